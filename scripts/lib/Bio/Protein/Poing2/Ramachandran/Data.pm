@@ -26,6 +26,9 @@ attribute is set, that directory is examined for files. Otherwise, first the
 directory mentioned in the environment variable C<$RAMA_DATA> is examined (if
 it is set), then C<$HOME/.poing2/rama/>. If none are set, die.
 
+If a binary table written by C<poing2-rama> exists alongside a data file (as
+C<boundary-*.data.bin>), the binary table is used instead.
+
 =cut
 
 has dir => (
@@ -76,6 +79,7 @@ sub _files_in_dir {
     );
     for(values %files){
         return undef if !(-e $_);
+        $_ .= '.bin' if -e "$_.bin";
     }
     return \%files;
 }
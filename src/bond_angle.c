@@ -1,11 +1,17 @@
 #include <stdlib.h>
 #include <math.h>
 #include <stdio.h>
+
+#ifdef HAVE_CONFIG_H
+#include <config.h>
+#endif
+
 #include "bond_angle.h"
 #include "vector.h"
+#include "lanes.h"
 
 struct bond_angle_spring * bond_angle_spring_alloc(
-        struct atom *a1, struct atom *a2, struct atom *a3,
+        size_t a1, size_t a2, size_t a3,
         double angle, double constant){
 
     struct bond_angle_spring *spring = malloc(sizeof(struct bond_angle_spring));
@@ -18,7 +24,7 @@ struct bond_angle_spring * bond_angle_spring_alloc(
 
 void bond_angle_spring_init(
         struct bond_angle_spring *s,
-        struct atom *a1, struct atom *a2, struct atom *a3,
+        size_t a1, size_t a2, size_t a3,
         double angle, double constant){
     s->a1 = a1;
     s->a2 = a2;
@@ -26,17 +32,18 @@ void bond_angle_spring_init(
     s->angle = angle;
     s->constant = constant;
     s->enabled = true;
+    s->cutoff = -1;
 }
 
 void bond_angle_spring_free(struct bond_angle_spring *s){
     free(s);
 }
 
-double bond_angle_angle(struct bond_angle_spring *s){
+double bond_angle_angle(struct bond_angle_spring *s, struct vector *pos){
     //Bond vectors (j is atom 2, the central atom)
     struct vector r_ij, r_kj;
-    vsub(&r_ij, &s->a1->position, &s->a2->position);
-    vsub(&r_kj, &s->a3->position, &s->a2->position);
+    vsub(&r_ij, &pos[s->a1], &pos[s->a2]);
+    vsub(&r_kj, &pos[s->a3], &pos[s->a2]);
 
     //Calculate modulus of bond vectors
     float r_ij_mod = vmag(&r_ij);
@@ -54,8 +61,8 @@ double bond_angle_angle(struct bond_angle_spring *s){
     return acos(cos_theta) * 180 / M_PI;
 }
 
-double bond_angle_energy(struct bond_angle_spring *s){
-    double angle = bond_angle_angle(s) / 180 * M_PI;
+double bond_angle_energy(struct bond_angle_spring *s, struct vector *pos){
+    double angle = bond_angle_angle(s, pos) / 180 * M_PI;
     double target = s->angle;
     return s->constant * (angle - target) * (angle - target);
 }
@@ -65,15 +72,16 @@ void bond_angle_force(
         struct vector *f1,
         struct vector *f2,
         struct vector *f3,
-        struct bond_angle_spring *s){
+        struct bond_angle_spring *s,
+        struct vector *pos){
 
     //Let's try a harmonic bond potential. See the GROMACS manual, section
     //4.2.5.
 
     //Bond vectors (j is atom 2, the central atom)
     struct vector r_ij, r_kj;
-    vsub(&r_ij, &s->a1->position, &s->a2->position);
-    vsub(&r_kj, &s->a3->position, &s->a2->position);
+    vsub(&r_ij, &pos[s->a1], &pos[s->a2]);
+    vsub(&r_kj, &pos[s->a3], &pos[s->a2]);
 
     //Calculate modulus of bond vectors
     float r_ij_mod = vmag(&r_ij);
@@ -125,6 +133,64 @@ void bond_angle_force(
     vmul_by(f2, -1);
 }
 
-bool bond_angle_synthesised(struct bond_angle_spring *b){
-    return b->a1->synthesised && b->a2->synthesised && b->a3->synthesised;
+/**
+ * Calculate the force due to bond angle s in each of LANES replicas at once.
+ * This gives the same result as bond_angle_force in each lane, with the same
+ * mixture of single and double precision. The bond vectors and forces are
+ * calculated on whole lanes; the angle itself is calculated one lane at a
+ * time.
+ */
+void bond_angle_force_lanes(
+        struct lane_vector *f1,
+        struct lane_vector *f2,
+        struct lane_vector *f3,
+        struct bond_angle_spring *s,
+        struct lane_vector *pos){
+
+    lane_t r_ij[N], r_kj[N];
+    for(size_t i=0; i < N; i++){
+        r_ij[i] = pos[s->a1].c[i] - pos[s->a2].c[i];
+        r_kj[i] = pos[s->a3].c[i] - pos[s->a2].c[i];
+    }
+    lane_t ij_sq = r_ij[0]*r_ij[0] + r_ij[1]*r_ij[1] + r_ij[2]*r_ij[2];
+    lane_t kj_sq = r_kj[0]*r_kj[0] + r_kj[1]*r_kj[1] + r_kj[2]*r_kj[2];
+    lane_t dot = r_ij[0]*r_kj[0] + r_ij[1]*r_kj[1] + r_ij[2]*r_kj[2];
+
+    //Scale factors for the bond vectors in each lane, rounded to single
+    //precision as in bond_angle_force. Straight angles have no force.
+    lane_t ijkj, ijij, kjkj, constant;
+    lane_mask_t bent;
+    double target = s->angle/180*M_PI;
+    for(size_t k=0; k < LANES; k++){
+        float r_ij_mod = sqrt(ij_sq[k]);
+        float r_kj_mod = sqrt(kj_sq[k]);
+        float cos_theta = dot[k] / (r_ij_mod * r_kj_mod);
+
+        //Same clamping as bond_angle_force
+        if(cos_theta < -1 || cos_theta > 1)
+            cos_theta = 1;
+        float theta = acos(cos_theta);
+
+        float c = -s->constant * (theta - target);
+        bent[k] = (1.0f - cos_theta*cos_theta == 0) ? 0 : -1;
+        if(bent[k])
+            c *= (-1.0f) / sqrt(1.0f - cos_theta*cos_theta);
+
+        constant[k] = c;
+        ijkj[k] = 1.0f / (r_ij_mod * r_kj_mod);
+        ijij[k] = cos_theta / (r_ij_mod * r_ij_mod);
+        kjkj[k] = cos_theta / (r_kj_mod * r_kj_mod);
+    }
+
+    for(size_t i=0; i < N; i++){
+        lane_t fi = (r_kj[i] * ijkj - r_ij[i] * ijij) * constant;
+        lane_t fk = (r_ij[i] * ijkj - r_kj[i] * kjkj) * constant;
+        f1->c[i] = LANE_SELECT(fi, bent);
+        f3->c[i] = LANE_SELECT(fk, bent);
+        f2->c[i] = LANE_SELECT((fi + fk) * -1, bent);
+    }
+}
+
+bool bond_angle_synthesised(struct bond_angle_spring *b, bool *synthesised){
+    return synthesised[b->a1] && synthesised[b->a2] && synthesised[b->a3];
 }
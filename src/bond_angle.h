@@ -5,33 +5,43 @@
 #include "residue.h"
 #include "vector.h"
 
+struct lane_vector;
+
 #define DEFAULT_BOND_ANGLE_CONST 0.1
 
 struct bond_angle_spring {
-    struct atom *a1, *a2, *a3;
-    double angle;
-    double constant;
-    double cutoff;
+    ///Atom indices
+    uint32_t a1, a2, a3;
+    float angle;
+    float constant;
+    float cutoff;
     bool enabled;
 };
 
 struct bond_angle_spring * bond_angle_spring_alloc(
-        struct atom *a1, struct atom *a2, struct atom *a3,
+        size_t a1, size_t a2, size_t a3,
         double angle, double constant);
 
 void bond_angle_spring_init(
         struct bond_angle_spring *s,
-        struct atom *a1, struct atom *a2, struct atom *a3,
+        size_t a1, size_t a2, size_t a3,
         double angle, double constant);
 void bond_angle_spring_free(struct bond_angle_spring *s);
 
-double bond_angle_angle(struct bond_angle_spring *s);
-double bond_angle_energy(struct bond_angle_spring *s);
+double bond_angle_angle(struct bond_angle_spring *s, struct vector *pos);
+double bond_angle_energy(struct bond_angle_spring *s, struct vector *pos);
 void bond_angle_force(
         struct vector *f1,
         struct vector *f2,
         struct vector *f3,
-        struct bond_angle_spring *s);
-bool bond_angle_synthesised(struct bond_angle_spring *b);
+        struct bond_angle_spring *s,
+        struct vector *pos);
+void bond_angle_force_lanes(
+        struct lane_vector *f1,
+        struct lane_vector *f2,
+        struct lane_vector *f3,
+        struct bond_angle_spring *s,
+        struct lane_vector *pos);
+bool bond_angle_synthesised(struct bond_angle_spring *b, bool *synthesised);
 
 #endif /* BOND_ANGLE_H_ */
@@ -0,0 +1,475 @@
+#include <stdlib.h>
+#include <stdio.h>
+#include <stdint.h>
+#include <string.h>
+#include <errno.h>
+#include <error.h>
+#include <fcntl.h>
+#include <unistd.h>
+
+#ifdef HAVE_CONFIG_H
+#include <config.h>
+#endif
+
+#include "checkpoint.h"
+#include "model.h"
+#include "record.h"
+#include "sterics.h"
+#include "rama.h"
+#include "rng.h"
+#include "vector.h"
+
+//Magic number and version at the start of a checkpoint
+#define CHECKPOINT_MAGIC "POING2CK"
+#define CHECKPOINT_VERSION 7
+//Written in native byte order, so that checkpoints from other machines are
+//caught
+#define CHECKPOINT_BYTE_ORDER 0x01020304
+
+/*
+ * The header describes the model that was being simulated, and is checked
+ * against the model being restarted. It is followed by a series of blocks,
+ * each preceded by its length, in the order written by checkpoint_save.
+ */
+struct checkpoint_header {
+    char magic[8];
+    uint32_t version;
+    uint32_t byte_order;
+    uint64_t natoms;
+    uint64_t nlinear;
+    uint64_t nconstraints;
+    uint64_t nrama;
+    double timestep;
+    uint64_t max_records;
+    uint64_t bandwidth;
+    uint64_t respa_steps;
+    uint32_t integrator;
+    uint8_t has_record;
+    uint8_t has_grid;
+    uint8_t has_chain;
+};
+
+//Current time and timestep, and size of the synthesised model
+struct checkpoint_state {
+    double time;
+    double timestep;
+    uint64_t num_atoms;
+    uint64_t num_residues;
+    int64_t stable_steps;
+};
+
+//Size of the neighbour lists of the steric grid
+struct checkpoint_neighbours {
+    uint64_t num_atoms;
+    uint64_t builds;
+    uint64_t len;
+};
+
+//Size of the water kick queue
+struct checkpoint_kicks {
+    uint64_t len;
+    uint64_t ndue;
+    double time;
+};
+
+static void fill_header(struct checkpoint_header *h, const struct model *m,
+        const struct model *state, const struct record *rec){
+    memset(h, 0, sizeof(*h));
+    memcpy(h->magic, CHECKPOINT_MAGIC, sizeof(h->magic));
+    h->version = CHECKPOINT_VERSION;
+    h->byte_order = CHECKPOINT_BYTE_ORDER;
+    h->natoms = m->num_atoms;
+    h->nlinear = m->num_linear_springs;
+    h->nconstraints = m->num_constraints;
+    h->nrama = m->num_rama_constraints;
+    h->timestep = m->timestep;
+    h->has_record = rec != NULL;
+    h->max_records = rec ? rec->max_records : 0;
+    h->has_grid = state->steric_grid != NULL;
+    h->has_chain = state->chain != NULL;
+    h->bandwidth = state->chain ? state->chain->bandwidth : 0;
+    h->respa_steps = m->respa_steps;
+    h->integrator = m->integrator;
+}
+
+//Append a block of size bytes to the checkpoint
+static int put(struct checkpointer *c, const void *data, size_t size){
+    uint64_t len = size;
+    if(c->len + sizeof(len) + size > c->size){
+        size_t new_size = c->size ? c->size : 4096;
+        while(new_size < c->len + sizeof(len) + size)
+            new_size *= 2;
+        char *buf = realloc(c->buf, new_size);
+        if(!buf)
+            return 1;
+        c->buf = buf;
+        c->size = new_size;
+    }
+    memcpy(c->buf + c->len, &len, sizeof(len));
+    c->len += sizeof(len);
+    if(size)
+        memcpy(c->buf + c->len, data, size);
+    c->len += size;
+    return 0;
+}
+
+//Checkpoint being read
+struct reader {
+    const char *buf;
+    size_t len;
+    size_t pos;
+    bool error;
+};
+
+//Read the next block, which must be size bytes long, into data
+static void get(struct reader *r, void *data, size_t size){
+    uint64_t len;
+    if(r->error || r->len - r->pos < sizeof(len)){
+        r->error = true;
+        return;
+    }
+    memcpy(&len, r->buf + r->pos, sizeof(len));
+    r->pos += sizeof(len);
+    if(len != size || r->len - r->pos < size){
+        r->error = true;
+        return;
+    }
+    if(size)
+        memcpy(data, r->buf + r->pos, size);
+    r->pos += size;
+}
+
+//Write len bytes of buf to file, by way of a temporary file
+static int write_file(const char *file, const char *buf, size_t len){
+    char tmp[strlen(file) + sizeof(".tmp")];
+    sprintf(tmp, "%s.tmp", file);
+    int fd = open(tmp, O_WRONLY | O_CREAT | O_TRUNC, 0666);
+    if(fd == -1){
+        error(0, errno, "Error opening %s", tmp);
+        return 1;
+    }
+    while(len){
+        ssize_t n = write(fd, buf, len);
+        if(n < 0 && errno == EINTR)
+            continue;
+        if(n < 0)
+            goto write_error;
+        buf += n;
+        len -= n;
+    }
+    if(fsync(fd))
+        goto write_error;
+    if(close(fd)){
+        fd = -1;
+        goto write_error;
+    }
+    if(rename(tmp, file)){
+        error(0, errno, "Error renaming %s to %s", tmp, file);
+        unlink(tmp);
+        return 1;
+    }
+    return 0;
+
+write_error:
+    error(0, errno, "Error writing %s", tmp);
+    if(fd != -1)
+        close(fd);
+    unlink(tmp);
+    return 1;
+}
+
+#ifdef HAVE_PTHREAD
+static void *write_thread(void *data){
+    struct checkpointer *c = data;
+    c->failed = write_file(c->file, c->buf, c->len);
+    return NULL;
+}
+#endif
+
+//Wait for the checkpoint being written, if there is one
+static void wait_for_write(struct checkpointer *c){
+#ifdef HAVE_PTHREAD
+    if(c->writing){
+        pthread_join(c->thread, NULL);
+        c->writing = false;
+    }
+#endif
+}
+
+void checkpoint_init(struct checkpointer *c, const char *file){
+    memset(c, 0, sizeof(*c));
+    c->file = file;
+}
+
+/**
+ * Save a checkpoint of state, the current state of a simulation of m. The
+ * positions recorded to decide which atoms to fix are saved from rec, unless
+ * it is NULL.
+ *
+ * The state is copied before this returns, and written in the background. If
+ * the previous checkpoint is still being written, this waits for it first.
+ *
+ * \return Non-zero if the previous checkpoint could not be written, or this
+ * one could not be started.
+ */
+int checkpoint_save(struct checkpointer *c, const struct model *m,
+        const struct model *state, const struct record *rec,
+        const struct checkpoint_counters *n){
+    wait_for_write(c);
+    int retval = c->failed;
+    c->failed = false;
+
+    size_t natoms = m->num_atoms;
+    struct checkpoint_header h;
+    fill_header(&h, m, state, rec);
+    struct checkpoint_state s = {
+        .time = state->time,
+        .timestep = state->timestep,
+        .num_atoms = state->num_atoms,
+        .num_residues = state->num_residues,
+        .stable_steps = state->stable_steps,
+    };
+    struct rng_position rng;
+    rng_save(state->rng, &rng);
+
+    c->len = 0;
+    int err = put(c, &h, sizeof(h))
+        || put(c, n, sizeof(*n))
+        || put(c, &s, sizeof(s))
+        || put(c, state->positions, sizeof(*state->positions) * natoms)
+        || put(c, state->velocities, sizeof(*state->velocities) * natoms)
+        || put(c, state->forces, sizeof(*state->forces) * natoms)
+        || put(c, state->slow_forces, sizeof(*state->slow_forces)
+                * (m->respa_steps > 1 ? natoms : 0))
+        || put(c, state->fixed, sizeof(*state->fixed) * natoms)
+        || put(c, state->synthesised, sizeof(*state->synthesised) * natoms)
+        || put(c, state->rama_constraints,
+                sizeof(*state->rama_constraints) * m->num_rama_constraints)
+        || put(c, &rng, sizeof(rng));
+
+    if(rec){
+        err = err
+            || put(c, rec->nrecords, sizeof(*rec->nrecords) * rec->natoms)
+            || put(c, rec->avg_jitter, sizeof(*rec->avg_jitter) * rec->natoms)
+            || put(c, rec->prev_vec, sizeof(*rec->prev_vec) * rec->natoms)
+            || put(c, rec->jitter_buf, sizeof(*rec->jitter_buf)
+                    * rec->natoms * rec->max_records)
+            || put(c, rec->buf_idx, sizeof(*rec->buf_idx) * rec->natoms);
+    }
+
+    //The neighbour lists are saved rather than rebuilt on restart, so that
+    //the forces are summed in the same order.
+    if(state->steric_grid){
+        const struct neighbour_list *l = &state->steric_grid->neighbours;
+        bool built = l->num_atoms != SIZE_MAX;
+        struct checkpoint_neighbours nl = {
+            .num_atoms = l->num_atoms,
+            .builds = l->builds,
+            .len = built ? l->start[l->num_atoms] : 0,
+        };
+        //Only start has an entry past the last atom
+        size_t nlists = built ? l->num_atoms : 0;
+        size_t nstart = built ? l->num_atoms + 1 : 0;
+        err = err
+            || put(c, &nl, sizeof(nl))
+            || put(c, l->start, sizeof(*l->start) * nstart)
+            || put(c, l->first_nonbonded, sizeof(*l->first_nonbonded) * nlists)
+            || put(c, l->first_far, sizeof(*l->first_far) * nlists)
+            || put(c, l->atoms, sizeof(*l->atoms) * nl.len)
+            || put(c, l->built_pos, sizeof(*l->built_pos) * natoms)
+            || put(c, l->built_fixed, sizeof(*l->built_fixed) * natoms);
+
+        const struct kick_queue *q = &state->steric_grid->kicks;
+        struct checkpoint_kicks k = {
+            .len = q->len,
+            .ndue = q->ndue,
+            .time = q->time,
+        };
+        err = err
+            || put(c, &k, sizeof(k))
+            || put(c, q->next, sizeof(*q->next) * q->len)
+            || put(c, q->heap, sizeof(*q->heap) * q->len)
+            || put(c, q->due, sizeof(*q->due) * q->ndue);
+    }
+
+    //The chain solver starts from the multipliers of the previous step
+    if(state->chain){
+        const struct constraint_chain *ch = state->chain;
+        size_t ncons = m->num_constraints;
+        err = err
+            || put(c, &ch->factorised, sizeof(ch->factorised))
+            || put(c, &ch->current, sizeof(ch->current))
+            || put(c, ch->band,
+                    sizeof(*ch->band) * (ncons * (ch->bandwidth + 1) + 1))
+            || put(c, ch->lambda, sizeof(*ch->lambda) * (ncons + 1))
+            || put(c, ch->state, sizeof(*ch->state) * (ncons + 1));
+    }
+
+    if(err){
+        fprintf(stderr, "Couldn't allocate memory for checkpoint\n");
+        return 1;
+    }
+
+#ifdef HAVE_PTHREAD
+    int thread_err = pthread_create(&c->thread, NULL, write_thread, c);
+    if(!thread_err){
+        c->writing = true;
+        return retval;
+    }
+    error(0, thread_err, "Couldn't start checkpoint thread");
+#endif
+    c->failed = write_file(c->file, c->buf, c->len);
+    return retval || c->failed;
+}
+
+/**
+ * Wait for the last checkpoint to be written, and free the checkpointer.
+ *
+ * \return Non-zero if the last checkpoint could not be written.
+ */
+int checkpoint_finish(struct checkpointer *c){
+    wait_for_write(c);
+    free(c->buf);
+    c->buf = NULL;
+    c->len = c->size = 0;
+    return c->failed;
+}
+
+/**
+ * Restore the state of a simulation of m from a checkpoint written by
+ * checkpoint_save. The state, along with rec if it is not NULL, must have
+ * been set up for the simulation as for a new run.
+ *
+ * \return Non-zero if the checkpoint couldn't be read or doesn't match m.
+ */
+int checkpoint_restore(const char *file, const struct model *m,
+        struct model *state, struct record *rec,
+        struct checkpoint_counters *n){
+    FILE *in = fopen(file, "rb");
+    if(!in){
+        error(0, errno, "Error opening %s", file);
+        return 1;
+    }
+    struct reader r = {NULL, 0, 0, false};
+    char *buf = NULL;
+    if(fseek(in, 0, SEEK_END) || (long)(r.len = ftell(in)) < 0
+            || fseek(in, 0, SEEK_SET)
+            || !(buf = malloc(r.len ? r.len : 1))
+            || fread(buf, 1, r.len, in) != r.len){
+        error(0, errno, "Error reading %s", file);
+        fclose(in);
+        free(buf);
+        return 1;
+    }
+    fclose(in);
+    r.buf = buf;
+
+    int retval = 1;
+    struct checkpoint_header h, expected;
+    fill_header(&expected, m, state, rec);
+    get(&r, &h, sizeof(h));
+    if(r.error || memcmp(h.magic, CHECKPOINT_MAGIC, sizeof(h.magic))){
+        fprintf(stderr, "%s is not a poing2 checkpoint\n", file);
+        goto out;
+    }
+    if(memcmp(&h, &expected, sizeof(h))){
+        fprintf(stderr, "Checkpoint %s was not written by this version of "
+                "poing2 for this model\n", file);
+        goto out;
+    }
+
+    size_t natoms = m->num_atoms;
+    struct checkpoint_state s;
+    struct rng_position rng;
+    get(&r, n, sizeof(*n));
+    get(&r, &s, sizeof(s));
+    get(&r, state->positions, sizeof(*state->positions) * natoms);
+    get(&r, state->velocities, sizeof(*state->velocities) * natoms);
+    get(&r, state->forces, sizeof(*state->forces) * natoms);
+    get(&r, state->slow_forces, sizeof(*state->slow_forces)
+            * (m->respa_steps > 1 ? natoms : 0));
+    get(&r, state->fixed, sizeof(*state->fixed) * natoms);
+    get(&r, state->synthesised, sizeof(*state->synthesised) * natoms);
+    get(&r, state->rama_constraints,
+            sizeof(*state->rama_constraints) * m->num_rama_constraints);
+    get(&r, &rng, sizeof(rng));
+    if(r.error)
+        goto corrupt;
+    state->time = s.time;
+    state->timestep = s.timestep;
+    state->num_atoms = s.num_atoms;
+    state->num_residues = s.num_residues;
+    state->stable_steps = s.stable_steps;
+    rng_restore(state->rng, &rng);
+
+    if(rec){
+        get(&r, rec->nrecords, sizeof(*rec->nrecords) * rec->natoms);
+        get(&r, rec->avg_jitter, sizeof(*rec->avg_jitter) * rec->natoms);
+        get(&r, rec->prev_vec, sizeof(*rec->prev_vec) * rec->natoms);
+        get(&r, rec->jitter_buf,
+                sizeof(*rec->jitter_buf) * rec->natoms * rec->max_records);
+        get(&r, rec->buf_idx, sizeof(*rec->buf_idx) * rec->natoms);
+    }
+
+    if(state->steric_grid){
+        struct neighbour_list *l = &state->steric_grid->neighbours;
+        struct checkpoint_neighbours nl;
+        get(&r, &nl, sizeof(nl));
+        bool built = nl.num_atoms != SIZE_MAX;
+        if(r.error || (built && nl.num_atoms > natoms))
+            goto corrupt;
+        if(nl.len > l->atoms_sz){
+            uint32_t *atoms = realloc(l->atoms, sizeof(*atoms) * nl.len);
+            if(!atoms){
+                fprintf(stderr, "Couldn't allocate neighbour lists\n");
+                goto out;
+            }
+            l->atoms = atoms;
+            l->atoms_sz = nl.len;
+        }
+        size_t nlists = built ? nl.num_atoms : 0;
+        size_t nstart = built ? nl.num_atoms + 1 : 0;
+        l->num_atoms = nl.num_atoms;
+        l->builds = nl.builds;
+        get(&r, l->start, sizeof(*l->start) * nstart);
+        get(&r, l->first_nonbonded, sizeof(*l->first_nonbonded) * nlists);
+        get(&r, l->first_far, sizeof(*l->first_far) * nlists);
+        get(&r, l->atoms, sizeof(*l->atoms) * nl.len);
+        get(&r, l->built_pos, sizeof(*l->built_pos) * natoms);
+        get(&r, l->built_fixed, sizeof(*l->built_fixed) * natoms);
+
+        struct kick_queue *q = &state->steric_grid->kicks;
+        struct checkpoint_kicks k;
+        get(&r, &k, sizeof(k));
+        if(r.error || k.len > natoms || k.ndue > natoms)
+            goto corrupt;
+        q->len = k.len;
+        q->ndue = k.ndue;
+        q->time = k.time;
+        get(&r, q->next, sizeof(*q->next) * q->len);
+        get(&r, q->heap, sizeof(*q->heap) * q->len);
+        get(&r, q->due, sizeof(*q->due) * q->ndue);
+    }
+
+    if(state->chain){
+        struct constraint_chain *ch = state->chain;
+        size_t ncons = m->num_constraints;
+        get(&r, &ch->factorised, sizeof(ch->factorised));
+        get(&r, &ch->current, sizeof(ch->current));
+        get(&r, ch->band,
+                sizeof(*ch->band) * (ncons * (ch->bandwidth + 1) + 1));
+        get(&r, ch->lambda, sizeof(*ch->lambda) * (ncons + 1));
+        get(&r, ch->state, sizeof(*ch->state) * (ncons + 1));
+    }
+
+    if(r.error || r.pos != r.len)
+        goto corrupt;
+    retval = 0;
+    goto out;
+
+corrupt:
+    fprintf(stderr, "Checkpoint %s is corrupt\n", file);
+out:
+    free(buf);
+    return retval;
+}
@@ -0,0 +1,56 @@
+#ifndef CHECKPOINT_H_
+#define CHECKPOINT_H_
+
+#include <stddef.h>
+#include <stdint.h>
+#include <stdbool.h>
+
+#ifdef HAVE_CONFIG_H
+#include <config.h>
+#endif
+
+#ifdef HAVE_PTHREAD
+#   include <pthread.h>
+#endif
+
+struct model;
+struct record;
+
+///Progress of a run through its steps, snapshots and checkpoints
+struct checkpoint_counters {
+    int64_t nsteps;
+    int32_t num_snapshots;
+    int32_t num_checkpoints;
+};
+
+/**
+ * Writes checkpoints of a running simulation to a file.
+ *
+ * The state is copied into buf by the simulation thread, and then written by
+ * a separate thread to a temporary file, which is renamed over the checkpoint
+ * once it has been synced. The previous checkpoint is kept until then, so a
+ * run that is killed while writing a checkpoint can still be restarted.
+ */
+struct checkpointer {
+    const char *file;
+    char *buf;
+    size_t len;
+    size_t size;
+    ///Set if the last checkpoint could not be written
+    bool failed;
+#ifdef HAVE_PTHREAD
+    pthread_t thread;
+    bool writing;
+#endif
+};
+
+void checkpoint_init(struct checkpointer *c, const char *file);
+int checkpoint_save(struct checkpointer *c, const struct model *m,
+        const struct model *state, const struct record *rec,
+        const struct checkpoint_counters *n);
+int checkpoint_finish(struct checkpointer *c);
+int checkpoint_restore(const char *file, const struct model *m,
+        struct model *state, struct record *rec,
+        struct checkpoint_counters *n);
+
+#endif /* CHECKPOINT_H_ */
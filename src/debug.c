@@ -78,13 +78,15 @@ void debug_linear(struct model *m, struct linear_spring *s){
 
     struct vector force_a, force_b;
     struct vector displacement;
-    linear_spring_force(&force_a, &force_b, s);
-    vsub(&displacement, &s->a->position, &s->b->position);
+    struct atom *a = &m->atoms[s->a];
+    struct atom *b = &m->atoms[s->b];
+    linear_spring_force(&force_a, &force_b, s, m->positions);
+    vsub(&displacement, &m->positions[s->a], &m->positions[s->b]);
 
     fprintf(m->debug->linear, DEBUG_LINEAR_FMT,
             m->time,
-            s->a->id, s->a->name,
-            s->b->id, s->b->name,
+            a->id, a->name,
+            b->id, b->name,
             (s->enabled ? "enabled" : "disabled"),
             s->distance, vmag(&displacement), 
             force_a.c[0], force_a.c[1], force_a.c[2],
@@ -101,15 +103,15 @@ void debug_torsion(struct model *m, struct torsion_spring *s){
             &spring_forces[1],
             &spring_forces[2],
             &spring_forces[3],
-            s);
+            s, m->positions);
     fprintf(m->debug->torsion, DEBUG_TORSION_FMT,
             m->time,
-            s->a1->id, s->a1->name,
-            s->a2->id, s->a2->name,
-            s->a3->id, s->a3->name,
-            s->a4->id, s->a4->name,
+            m->atoms[s->a1].id, m->atoms[s->a1].name,
+            m->atoms[s->a2].id, m->atoms[s->a2].name,
+            m->atoms[s->a3].id, m->atoms[s->a3].name,
+            m->atoms[s->a4].id, m->atoms[s->a4].name,
             (s->enabled ? "enabled" : "disabled"),
-            s->angle, torsion_spring_angle(s),
+            s->angle, torsion_spring_angle(s, m->positions),
             spring_forces[0].c[0],
             spring_forces[0].c[1],
             spring_forces[0].c[2],
@@ -133,14 +135,14 @@ void debug_angle(struct model *m, struct bond_angle_spring *s){
             &spring_forces[0],
             &spring_forces[1],
             &spring_forces[2],
-            s);
+            s, m->positions);
     fprintf(m->debug->angle, DEBUG_ANGLE_FMT,
             m->time,
-            s->a1->id, s->a1->name,
-            s->a2->id, s->a2->name,
-            s->a3->id, s->a3->name,
+            m->atoms[s->a1].id, m->atoms[s->a1].name,
+            m->atoms[s->a2].id, m->atoms[s->a2].name,
+            m->atoms[s->a3].id, m->atoms[s->a3].name,
             (s->enabled ? "enabled" : "disabled"),
-            s->angle, bond_angle_angle(s),
+            s->angle, bond_angle_angle(s, m->positions),
             spring_forces[0].c[0],
             spring_forces[0].c[1],
             spring_forces[0].c[2],
@@ -0,0 +1,479 @@
+#include <stdlib.h>
+#include <stdio.h>
+#include <stdint.h>
+#include <string.h>
+#include <errno.h>
+#include <error.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#ifdef HAVE_CONFIG_H
+#include <config.h>
+#endif
+
+#include "image.h"
+#include "model.h"
+#include "springreader.h"
+#include "residue.h"
+#include "linear_spring.h"
+#include "torsion_spring.h"
+#include "bond_angle.h"
+#include "rama.h"
+#include "vector.h"
+
+//Magic number and version at the start of a compiled model image
+#define IMAGE_MAGIC "POING2MD"
+#define IMAGE_VERSION 4
+//Written in native byte order, so that images from other machines are caught
+#define IMAGE_BYTE_ORDER 0x01020304
+//Alignment of each section within the image
+#define IMAGE_ALIGN 64
+
+enum image_section {
+    SEC_SETTINGS,
+    SEC_RESIDUES,
+    SEC_ATOMS,
+    SEC_POSITIONS,
+    SEC_LINEAR,
+    SEC_ANGLES,
+    SEC_TORSIONS,
+    SEC_RAMA,
+    SEC_CONSTRAINTS,
+    //Names of the Ramachandran data files, one nul-terminated string for each
+    //type. Types with no data have an empty name.
+    SEC_RAMA_FILES,
+    NUM_SECTIONS
+};
+
+/*
+ * Location of a section in the image. The size of each element is stored so
+ * that images written with a different structure layout are rejected.
+ */
+struct image_section_entry {
+    uint64_t offset;
+    uint64_t count;
+    uint64_t size;
+};
+
+struct image_header {
+    char magic[8];
+    uint32_t version;
+    uint32_t byte_order;
+    struct image_section_entry sections[NUM_SECTIONS];
+};
+
+//Simulation settings of the model
+struct image_settings {
+    double timestep;
+    double synth_time;
+    double drag_coefficient;
+    double max_synth_angle;
+    double until;
+    double record_time;
+    double max_jitter;
+    double verlet_skin;
+    double slow_spring_constant;
+    double min_timestep;
+    double max_timestep;
+    double max_displacement;
+    double max_kinetic_energy;
+    int32_t max_constraint_iterations;
+    int32_t fix_before;
+    int32_t constraint_solver;
+    int32_t integrator;
+    int32_t respa_steps;
+    uint32_t slow_terms;
+    uint8_t use_sterics;
+    uint8_t fix;
+    uint8_t threestate;
+    uint8_t use_water;
+    uint8_t shield_drag;
+    uint8_t do_synthesis;
+    uint8_t adaptive_timestep;
+};
+
+/**
+ * Check whether a file is a compiled model image. Returns false if the file
+ * cannot be read or is not a regular file.
+ */
+bool image_is_image(const char *file){
+    //Don't read from pipes, which would lose the start of the input
+    struct stat st;
+    if(stat(file, &st) || !S_ISREG(st.st_mode))
+        return false;
+    FILE *f = fopen(file, "rb");
+    if(!f)
+        return false;
+    char magic[sizeof(((struct image_header *)0)->magic)];
+    bool is_image = fread(magic, 1, sizeof(magic), f) == sizeof(magic)
+        && memcmp(magic, IMAGE_MAGIC, sizeof(magic)) == 0;
+    fclose(f);
+    return is_image;
+}
+
+/**
+ * Write a model as a binary image that can be read by image_read. The image
+ * holds the settings, residues, atoms, bonded terms and constraints of the
+ * model, along with the names of the Ramachandran data files that have been
+ * read. It should be written before the model is simulated.
+ *
+ * The image is written to a temporary file which is then renamed, so
+ * processes that have the old image mapped are not affected.
+ *
+ * \return Non-zero on error.
+ */
+int image_write(const char *file, const struct model *m){
+    struct image_settings settings;
+    memset(&settings, 0, sizeof(settings));
+    settings.timestep = m->timestep;
+    settings.synth_time = m->synth_time;
+    settings.drag_coefficient = m->drag_coefficient;
+    settings.max_synth_angle = m->max_synth_angle;
+    settings.until = m->until;
+    settings.record_time = m->record_time;
+    settings.max_jitter = m->max_jitter;
+    settings.verlet_skin = m->verlet_skin;
+    settings.fix_before = m->fix_before;
+    settings.constraint_solver = m->constraint_solver;
+    settings.integrator = m->integrator;
+    settings.slow_spring_constant = m->slow_spring_constant;
+    settings.respa_steps = m->respa_steps;
+    settings.slow_terms = m->slow_terms;
+    settings.adaptive_timestep = m->adaptive_timestep;
+    settings.min_timestep = m->min_timestep;
+    settings.max_timestep = m->max_timestep;
+    settings.max_displacement = m->max_displacement;
+    settings.max_constraint_iterations = m->max_constraint_iterations;
+    settings.max_kinetic_energy = m->max_kinetic_energy;
+    settings.use_sterics = m->use_sterics;
+    settings.fix = m->fix;
+    settings.threestate = m->threestate;
+    settings.use_water = m->use_water;
+    settings.shield_drag = m->shield_drag;
+    settings.do_synthesis = m->do_synthesis;
+
+    size_t rama_files_len = 0;
+    for(size_t i=0; i < UNKNOWN_RAMA; i++){
+        const char *name = rama_data_file(i);
+        rama_files_len += (name ? strlen(name) : 0) + 1;
+    }
+    char rama_files[rama_files_len];
+    char *name_end = rama_files;
+    for(size_t i=0; i < UNKNOWN_RAMA; i++){
+        const char *name = rama_data_file(i);
+        name_end = stpcpy(name_end, name ? name : "") + 1;
+    }
+
+    const void *data[NUM_SECTIONS] = {
+        [SEC_SETTINGS] = &settings,
+        [SEC_RESIDUES] = m->residues,
+        [SEC_ATOMS] = m->atoms,
+        [SEC_POSITIONS] = m->positions,
+        [SEC_LINEAR] = m->linear_springs,
+        [SEC_ANGLES] = m->bond_angles,
+        [SEC_TORSIONS] = m->torsion_springs,
+        [SEC_RAMA] = m->rama_constraints,
+        [SEC_CONSTRAINTS] = m->constraints,
+        [SEC_RAMA_FILES] = rama_files,
+    };
+    const size_t count[NUM_SECTIONS] = {
+        [SEC_SETTINGS] = 1,
+        [SEC_RESIDUES] = m->num_residues,
+        [SEC_ATOMS] = m->num_atoms,
+        [SEC_POSITIONS] = m->num_atoms,
+        [SEC_LINEAR] = m->num_linear_springs,
+        [SEC_ANGLES] = m->num_bond_angles,
+        [SEC_TORSIONS] = m->num_torsion_springs,
+        [SEC_RAMA] = m->num_rama_constraints,
+        [SEC_CONSTRAINTS] = m->num_constraints,
+        [SEC_RAMA_FILES] = rama_files_len,
+    };
+    const size_t size[NUM_SECTIONS] = {
+        [SEC_SETTINGS] = sizeof(settings),
+        [SEC_RESIDUES] = sizeof(*m->residues),
+        [SEC_ATOMS] = sizeof(*m->atoms),
+        [SEC_POSITIONS] = sizeof(*m->positions),
+        [SEC_LINEAR] = sizeof(*m->linear_springs),
+        [SEC_ANGLES] = sizeof(*m->bond_angles),
+        [SEC_TORSIONS] = sizeof(*m->torsion_springs),
+        [SEC_RAMA] = sizeof(*m->rama_constraints),
+        [SEC_CONSTRAINTS] = sizeof(*m->constraints),
+        [SEC_RAMA_FILES] = 1,
+    };
+
+    char tmp[strlen(file) + sizeof(".tmp")];
+    sprintf(tmp, "%s.tmp", file);
+    FILE *out = fopen(tmp, "wb");
+    if(!out){
+        error(0, errno, "Error opening %s", tmp);
+        return 1;
+    }
+
+    //Write a blank header to reserve space, then fill it in at the end
+    struct image_header h;
+    memset(&h, 0, sizeof(h));
+    if(fwrite(&h, sizeof(h), 1, out) != 1)
+        goto write_error;
+
+    static const char padding[IMAGE_ALIGN];
+    uint64_t offset = sizeof(h);
+    for(size_t i=0; i < NUM_SECTIONS; i++){
+        size_t pad = (IMAGE_ALIGN - offset % IMAGE_ALIGN) % IMAGE_ALIGN;
+        if(fwrite(padding, 1, pad, out) != pad)
+            goto write_error;
+        offset += pad;
+
+        h.sections[i].offset = offset;
+        h.sections[i].count = count[i];
+        h.sections[i].size = size[i];
+        if(count[i] && fwrite(data[i], size[i], count[i], out) != count[i])
+            goto write_error;
+        offset += size[i] * count[i];
+    }
+
+    memcpy(h.magic, IMAGE_MAGIC, sizeof(h.magic));
+    h.version = IMAGE_VERSION;
+    h.byte_order = IMAGE_BYTE_ORDER;
+    if(fseek(out, 0, SEEK_SET) || fwrite(&h, sizeof(h), 1, out) != 1)
+        goto write_error;
+
+    if(fclose(out) || rename(tmp, file)){
+        error(0, errno, "Error writing %s", file);
+        remove(tmp);
+        return 1;
+    }
+    return 0;
+
+write_error:
+    error(0, errno, "Error writing %s", tmp);
+    fclose(out);
+    remove(tmp);
+    return 1;
+}
+
+/*
+ * Get a pointer to a section of a mapped image, checking that the elements
+ * are the expected size and that the section lies within the image. Empty
+ * sections are returned as NULL.
+ *
+ * Returns non-zero if the section is invalid.
+ */
+static int image_section(void *map, size_t len, enum image_section sec,
+        size_t size, void **dst, size_t *count){
+    const struct image_header *h = map;
+    const struct image_section_entry *s = &h->sections[sec];
+    if(s->size != size || s->offset > len
+            || s->count > (len - s->offset) / size)
+        return 1;
+    *dst = s->count ? (char *)map + s->offset : NULL;
+    if(count)
+        *count = s->count;
+    return 0;
+}
+
+//Check that the torsion springs of a Ramachandran constraint reference atoms
+static bool rama_atoms_exist(const struct torsion_spring *s, size_t natoms){
+    return s->a1 < natoms && s->a2 < natoms
+        && s->a3 < natoms && s->a4 < natoms;
+}
+
+/*
+ * Check that the atoms of an image belong to residues and have positive
+ * masses, and that the Ramachandran constraints reference atoms that exist.
+ * The other bonded terms are checked by check_term_atoms, as for a
+ * specification.
+ *
+ * Returns non-zero if any of them are invalid.
+ */
+static int check_image_atoms(const struct model *m){
+    for(size_t i=0; i < m->num_atoms; i++){
+        const struct atom *a = &m->atoms[i];
+        if(a->residue_idx >= m->num_residues || !(a->mass > 0))
+            return 1;
+    }
+    for(size_t i=0; i < m->num_rama_constraints; i++){
+        const struct rama_constraint *r = &m->rama_constraints[i];
+        if((unsigned)r->type >= UNKNOWN_RAMA
+                || !rama_atoms_exist(&r->phi, m->num_atoms)
+                || !rama_atoms_exist(&r->psi, m->num_atoms))
+            return 1;
+    }
+    return check_term_atoms(m);
+}
+
+/**
+ * Read a model from an image written by image_write.
+ *
+ * The image is mapped privately into memory and the residues and bonded terms
+ * of the model point into the mapping, so they are only read from disk when
+ * they are used and may be sorted in place without changing the file. The
+ * atoms and their state are copied into arrays allocated by
+ * model_alloc_atoms. The Ramachandran data files named in the image are read
+ * again.
+ *
+ * \return A populated model or NULL on error.
+ */
+struct model *image_read(const char *file){
+    int fd = open(file, O_RDONLY);
+    if(fd == -1){
+        error(0, errno, "Error opening %s", file);
+        return NULL;
+    }
+    struct stat st;
+    if(fstat(fd, &st)){
+        error(0, errno, "Error reading %s", file);
+        close(fd);
+        return NULL;
+    }
+    size_t len = st.st_size;
+    if(len < sizeof(struct image_header)){
+        error(0, 0, "Model image %s is truncated", file);
+        close(fd);
+        return NULL;
+    }
+    void *map = mmap(NULL, len, PROT_READ | PROT_WRITE, MAP_PRIVATE, fd, 0);
+    close(fd);
+    if(map == MAP_FAILED){
+        error(0, errno, "Error mapping %s", file);
+        return NULL;
+    }
+
+    const struct image_header *h = map;
+    if(memcmp(h->magic, IMAGE_MAGIC, sizeof(h->magic)) != 0){
+        error(0, 0, "%s is not a model image", file);
+        munmap(map, len);
+        return NULL;
+    }
+    if(h->version != IMAGE_VERSION || h->byte_order != IMAGE_BYTE_ORDER){
+        error(0, 0, "Model image %s has an unsupported version "
+                "or byte order", file);
+        munmap(map, len);
+        return NULL;
+    }
+
+    struct model *m = model_alloc();
+    if(!m){
+        error(0, errno, "Error allocating model");
+        munmap(map, len);
+        return NULL;
+    }
+    m->image = map;
+    m->image_size = len;
+
+    struct image_settings *settings;
+    struct atom *atoms;
+    struct vector *positions;
+    char *rama_files;
+    size_t num_atoms, num_positions, rama_files_len;
+    if(image_section(map, len, SEC_SETTINGS, sizeof(*settings),
+                (void **)&settings, NULL)
+            || !settings
+            || image_section(map, len, SEC_RESIDUES, sizeof(*m->residues),
+                (void **)&m->residues, &m->num_residues)
+            || image_section(map, len, SEC_ATOMS, sizeof(*atoms),
+                (void **)&atoms, &num_atoms)
+            || image_section(map, len, SEC_POSITIONS, sizeof(*positions),
+                (void **)&positions, &num_positions)
+            || num_positions != num_atoms
+            || image_section(map, len, SEC_LINEAR,
+                sizeof(*m->linear_springs),
+                (void **)&m->linear_springs, &m->num_linear_springs)
+            || image_section(map, len, SEC_ANGLES, sizeof(*m->bond_angles),
+                (void **)&m->bond_angles, &m->num_bond_angles)
+            || image_section(map, len, SEC_TORSIONS,
+                sizeof(*m->torsion_springs),
+                (void **)&m->torsion_springs, &m->num_torsion_springs)
+            || image_section(map, len, SEC_RAMA,
+                sizeof(*m->rama_constraints),
+                (void **)&m->rama_constraints, &m->num_rama_constraints)
+            || image_section(map, len, SEC_CONSTRAINTS,
+                sizeof(*m->constraints),
+                (void **)&m->constraints, &m->num_constraints)
+            || image_section(map, len, SEC_RAMA_FILES, 1,
+                (void **)&rama_files, &rama_files_len)
+            || !rama_files || rama_files[rama_files_len - 1] != '\0'
+            || settings->constraint_solver < 0
+            || settings->constraint_solver >= UNKNOWN_SOLVER
+            || settings->integrator < 0
+            || settings->integrator >= UNKNOWN_INTEGRATOR
+            || settings->respa_steps < 1){
+        error(0, 0, "Model image %s is corrupt or was written by an "
+                "incompatible build", file);
+        goto error;
+    }
+
+    m->timestep = settings->timestep;
+    m->synth_time = settings->synth_time;
+    m->drag_coefficient = settings->drag_coefficient;
+    m->max_synth_angle = settings->max_synth_angle;
+    m->until = settings->until;
+    m->record_time = settings->record_time;
+    m->max_jitter = settings->max_jitter;
+    m->verlet_skin = settings->verlet_skin;
+    m->fix_before = settings->fix_before;
+    m->constraint_solver = settings->constraint_solver;
+    m->integrator = settings->integrator;
+    m->slow_spring_constant = settings->slow_spring_constant;
+    m->respa_steps = settings->respa_steps;
+    m->slow_terms = settings->slow_terms;
+    m->adaptive_timestep = settings->adaptive_timestep;
+    m->min_timestep = settings->min_timestep;
+    m->max_timestep = settings->max_timestep;
+    m->max_displacement = settings->max_displacement;
+    m->max_constraint_iterations = settings->max_constraint_iterations;
+    m->max_kinetic_energy = settings->max_kinetic_energy;
+    m->use_sterics = settings->use_sterics;
+    m->fix = settings->fix;
+    m->threestate = settings->threestate;
+    m->use_water = settings->use_water;
+    m->shield_drag = settings->shield_drag;
+    m->do_synthesis = settings->do_synthesis;
+
+    if(model_alloc_atoms(m, num_atoms)){
+        error(0, errno, "Error allocating atoms");
+        goto error;
+    }
+    if(num_atoms){
+        memcpy(m->atoms, atoms, sizeof(*atoms) * num_atoms);
+        memcpy(m->positions, positions, sizeof(*positions) * num_atoms);
+    }
+    if(check_image_atoms(m)){
+        error(0, 0, "Model image %s is corrupt", file);
+        goto error;
+    }
+    for(size_t i=0; i < num_atoms; i++){
+        m->inv_masses[i] = 1.0 / m->atoms[i].mass;
+        if(!m->do_synthesis)
+            m->synthesised[i] = true;
+    }
+
+    const char *name = rama_files;
+    for(size_t i=0; i < UNKNOWN_RAMA; i++){
+        if(name >= rama_files + rama_files_len){
+            error(0, 0, "Model image %s is corrupt", file);
+            goto error;
+        }
+        if(*name && rama_read_closest(name, i))
+            goto error;
+        name += strlen(name) + 1;
+    }
+    return m;
+
+error:
+    model_free(m);
+    return NULL;
+}
+
+/**
+ * Unmap the image that a model was read from. The residues and bonded terms
+ * of the model are no longer valid after this is called.
+ */
+void image_unmap(struct model *m){
+    if(!m->image)
+        return;
+    munmap(m->image, m->image_size);
+    m->image = NULL;
+    m->image_size = 0;
+}
@@ -0,0 +1,12 @@
+#ifndef IMAGE_H_
+#define IMAGE_H_
+
+#include <stdbool.h>
+#include "model.h"
+
+bool image_is_image(const char *file);
+int image_write(const char *file, const struct model *m);
+struct model *image_read(const char *file);
+void image_unmap(struct model *m);
+
+#endif /* IMAGE_H_ */
@@ -0,0 +1,66 @@
+#include <ctype.h>
+#include <string.h>
+#include "integrator.h"
+#include "leapfrog.h"
+#include "rattle.h"
+#include "rk4.h"
+#include "model.h"
+
+//Integrators that keep no state between steps need no setting up
+static void no_setup(struct model *m){
+    (void)m;
+}
+
+static const struct integrator rattle = {
+    "rattle", 1, no_setup, rattle_push, no_setup, rattle_push_lanes
+};
+
+static const struct integrator rattle_respa = {
+    "rattle-respa", 1, no_setup, rattle_respa_push, no_setup, NULL
+};
+
+static const struct integrator rattle_adaptive = {
+    "rattle-adaptive", 1, no_setup, rattle_adaptive_push, no_setup, NULL
+};
+
+static const struct integrator leapfrog = {
+    "leapfrog", 1, leapfrog_init, leapfrog_push, leapfrog_finish, NULL
+};
+
+static const struct integrator rk4 = {
+    "rk4", 4, no_setup, rk4_push, no_setup, NULL
+};
+
+/**
+ * Parse the name of an integrator. Returns UNKNOWN_INTEGRATOR if the name
+ * isn't recognised.
+ */
+enum integrator_type integrator_parse(const char *name){
+    char copy[strlen(name) + 1];
+    for(size_t i=0; i <= strlen(name); i++)
+        copy[i] = tolower(name[i]);
+
+    if(strcmp(copy, "rattle")   == 0) return RATTLE_INTEGRATOR;
+    if(strcmp(copy, "leapfrog") == 0) return LEAPFROG_INTEGRATOR;
+    if(strcmp(copy, "rk4")      == 0) return RK4_INTEGRATOR;
+    return UNKNOWN_INTEGRATOR;
+}
+
+/**
+ * Get the integrator selected for m. The RESPA and adaptive timestep variants
+ * of RATTLE are chosen by the respa_steps and adaptive_timestep settings.
+ */
+const struct integrator *integrator_get(const struct model *m){
+    switch(m->integrator){
+    case LEAPFROG_INTEGRATOR:
+        return &leapfrog;
+    case RK4_INTEGRATOR:
+        return &rk4;
+    default:
+        if(m->respa_steps > 1)
+            return &rattle_respa;
+        if(m->adaptive_timestep)
+            return &rattle_adaptive;
+        return &rattle;
+    }
+}
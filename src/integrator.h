@@ -0,0 +1,27 @@
+#ifndef INTEGRATOR_H_
+#define INTEGRATOR_H_
+
+#include "model.h"
+
+struct lanes;
+
+/**
+ * An integrator, which advances a model through time one step at a time.
+ * init is called before the first step of a simulation, but not when it is
+ * resumed from a checkpoint, and finish after the last step.
+ */
+struct integrator {
+    const char *name;
+    ///Number of times the forces are evaluated in each step
+    int force_evaluations;
+    void (*init)(struct model *m);
+    void (*push)(struct model *m);
+    void (*finish)(struct model *m);
+    ///Push a batch of replicas in lockstep, or NULL if that isn't supported
+    void (*push_lanes)(struct lanes *l);
+};
+
+enum integrator_type integrator_parse(const char *name);
+const struct integrator *integrator_get(const struct model *m);
+
+#endif /* INTEGRATOR_H_ */
@@ -0,0 +1,267 @@
+#include <config.h>
+#include <stdlib.h>
+#include <stdio.h>
+#include <stdbool.h>
+#include <string.h>
+#include <math.h>
+#include <getopt.h>
+#include "springreader.h"
+#include "image.h"
+#include "model.h"
+#include "integrator.h"
+#include "rattle.h"
+#include "sterics.h"
+#include "vector.h"
+#include "rng.h"
+#include "rama.h"
+#include "profile.h"
+
+static struct option opts[] = {
+    {"help",      no_argument,       0, 'h'},
+    {"synth",     required_argument, 0, 's'},
+    {"time",      required_argument, 0, 't'},
+    {"tolerance", required_argument, 0, 'e'},
+    {"min-step",  required_argument, 0, 'm'},
+    {"max-step",  required_argument, 0, 'M'},
+    {0, 0, 0, 0}
+};
+const char *opt_str = "hs:t:e:m:M:";
+
+const char *usage_str =
+"Usage: integrator_bench [OPTIONS] <SPEC>\n"
+"\n"
+"Compare the cost of the integrators per unit of simulated time, at the\n"
+"largest timestep at which each is stable. The model in SPEC is synthesised\n"
+"with RATTLE, then each integrator is run from the same state without water\n"
+"or drag, with timesteps doubling from the minimum. A timestep is stable if\n"
+"the total energy per atom stays within the tolerance of that of RATTLE with\n"
+"the minimum timestep, sampled once per unit of time. The trajectories\n"
+"diverge over longer runs, so the comparison is only meaningful for short\n"
+"times.\n"
+"Available options:\n"
+"  -h, --help         Display this help message.\n"
+"  -s, --synth=T      Synthesise the model for time T (default: until all\n"
+"                     atoms are synthesised).\n"
+"  -t, --time=T       Run each integrator for time T (default 20).\n"
+"  -e, --tolerance=E  Energy tolerance per atom (default 0.01).\n"
+"  -m, --min-step=DT  Smallest timestep (default 0.025).\n"
+"  -M, --max-step=DT  Largest timestep (default 1.6).\n"
+;
+
+double synth_time = -1;
+double run_time = 20;
+double tolerance = 0.01;
+double min_step = 0.025;
+double max_step = 1.6;
+
+void usage(const char *msg, int exitval){
+    FILE *out = (exitval < 2) ? stdout : stderr;
+    if(msg)
+        fprintf(out, "%s\n", msg);
+    fprintf(out, "%s", usage_str);
+    exit(exitval);
+}
+
+char *get_options(int argc, char **argv){
+    int c;
+    int option_index;
+    while((c = getopt_long(argc, argv, opt_str, opts, &option_index)) != -1){
+        switch(c){
+            case 'h':
+                usage(NULL, 1);
+                break;
+            case 's':
+                synth_time = atof(optarg);
+                break;
+            case 't':
+                run_time = atof(optarg);
+                break;
+            case 'e':
+                tolerance = atof(optarg);
+                break;
+            case 'm':
+                min_step = atof(optarg);
+                break;
+            case 'M':
+                max_step = atof(optarg);
+                break;
+            default:
+                usage(NULL, 2);
+        }
+    }
+    if(optind != argc - 1)
+        usage("A single specification must be given.", 2);
+    if(run_time < 1 || min_step <= 0 || max_step < min_step)
+        usage("The time and timesteps must be positive.", 2);
+    return argv[optind];
+}
+
+//State of the model after synthesis, from which each run starts
+struct start {
+    double time;
+    struct vector *positions;
+    struct vector *velocities;
+    struct rama_constraint *rama;
+};
+
+//Energy of the unfixed atoms of m
+static double total_energy(struct model *m){
+    double energy = model_energy(m);
+    for(size_t i=0; i < m->num_atoms; i++)
+        if(!m->fixed[i])
+            energy += vmag_sq(&m->velocities[i]) / (2 * m->inv_masses[i]);
+    return energy;
+}
+
+static void restore(struct model *m, const struct start *s){
+    size_t n = m->num_atoms;
+    m->time = s->time;
+    memcpy(m->positions, s->positions, sizeof(*m->positions) * n);
+    memcpy(m->velocities, s->velocities, sizeof(*m->velocities) * n);
+    memset(m->forces, 0, sizeof(*m->forces) * n);
+    memcpy(m->rama_constraints, s->rama,
+            sizeof(*m->rama_constraints) * m->num_rama_constraints);
+    if(m->chain){
+        m->chain->factorised = m->chain->current = false;
+        memset(m->chain->lambda, 0,
+                sizeof(*m->chain->lambda) * m->num_constraints);
+    }
+}
+
+/*
+ * Run the integrator from the start for run_time, recording the energy once
+ * per unit of time in energies. Returns the time taken in seconds, or a
+ * negative number if the simulation blew up.
+ */
+static double run(struct model *m, const struct integrator *integrator,
+        double timestep, const struct start *s, double *energies){
+    struct profile profiler;
+    size_t nsamples = (size_t)run_time;
+    restore(m, s);
+    m->timestep = timestep;
+
+    profile_start(&profiler);
+    integrator->init(m);
+    size_t k = 0;
+    while(k < nsamples){
+        integrator->push(m);
+        if(m->time - s->time >= k + 1){
+            energies[k++] = total_energy(m);
+            if(!isfinite(energies[k - 1]))
+                return -1;
+        }
+    }
+    integrator->finish(m);
+    return profile_duration(&profiler) * 1e-9;
+}
+
+int main(int argc, char **argv){
+    char *spec = get_options(argc, argv);
+    struct model *m = image_is_image(spec)
+        ? image_read(spec)
+        : springreader_parse_file(spec);
+    if(!m)
+        return 2;
+    if(model_build_bonds(m) || rattle_init_solver(m)
+            || model_build_active_set(m)){
+        fprintf(stderr, "Error setting up model\n");
+        return 1;
+    }
+    rng_seed(m->rng, 1);
+
+    struct steric_grid grid;
+    if(m->use_sterics || m->use_water || m->shield_drag){
+        if(steric_grid_init(&grid, m)){
+            fprintf(stderr, "Couldn't allocate steric grid.\n");
+            return 1;
+        }
+        m->steric_grid = &grid;
+    }
+
+    //Synthesise the model with RATTLE at the timestep of the specification
+    size_t total = m->num_atoms;
+    if(synth_time < 0)
+        synth_time = m->synth_time * total;
+    if(m->do_synthesis)
+        m->num_atoms = m->num_residues = 0;
+    while(m->time < synth_time){
+        int num_synthed = (int)(m->time / m->synth_time) + 1;
+        if(m->do_synthesis && num_synthed > m->num_atoms
+                && m->num_atoms < total){
+            size_t i = m->num_atoms++;
+            m->num_residues = m->atoms[i].residue_idx + 1;
+            model_synth_atom(m, i, DEFAULT_MAX_SYNTH_ANGLE);
+        }
+        rattle_push(m);
+    }
+
+    //The energy is only conserved without water and drag
+    m->use_water = false;
+    m->shield_drag = false;
+    m->drag_coefficient = 0;
+
+    struct start s;
+    size_t n = m->num_atoms;
+    size_t nsamples = (size_t)run_time;
+    s.time = m->time;
+    s.positions = malloc(sizeof(*s.positions) * n);
+    s.velocities = malloc(sizeof(*s.velocities) * n);
+    s.rama = malloc(sizeof(*s.rama) * (m->num_rama_constraints + 1));
+    double *reference = malloc(sizeof(*reference) * nsamples);
+    double *energies = malloc(sizeof(*energies) * nsamples);
+    if(!s.positions || !s.velocities || !s.rama || !reference || !energies){
+        fprintf(stderr, "Error allocating benchmark state\n");
+        return 1;
+    }
+    memcpy(s.positions, m->positions, sizeof(*s.positions) * n);
+    memcpy(s.velocities, m->velocities, sizeof(*s.velocities) * n);
+    memcpy(s.rama, m->rama_constraints,
+            sizeof(*s.rama) * m->num_rama_constraints);
+
+    const enum integrator_type types[] = {
+        RATTLE_INTEGRATOR, LEAPFROG_INTEGRATOR, RK4_INTEGRATOR};
+    m->integrator = RATTLE_INTEGRATOR;
+    if(run(m, integrator_get(m), min_step, &s, reference) < 0){
+        fprintf(stderr, "Reference run is unstable\n");
+        return 1;
+    }
+
+    printf("%zu atoms synthesised at time %g\n", n, s.time);
+    printf("%-10s %8s %12s %14s %14s\n", "integrator", "timestep",
+            "max dE/atom", "forces/time", "seconds/time");
+    for(size_t i=0; i < sizeof(types) / sizeof(*types); i++){
+        m->integrator = types[i];
+        const struct integrator *integrator = integrator_get(m);
+        double best_step = 0, best_cost = 0, best_error = 0;
+        for(double dt = min_step; dt <= max_step * (1 + 1e-9); dt *= 2){
+            double seconds = run(m, integrator, dt, &s, energies);
+            if(seconds < 0)
+                break;
+            double error = 0;
+            for(size_t k=0; k < nsamples; k++)
+                error = fmax(error, fabs(energies[k] - reference[k]) / n);
+            if(error > tolerance)
+                break;
+            best_step = dt;
+            best_cost = seconds / run_time;
+            best_error = error;
+        }
+        if(best_step == 0){
+            printf("%-10s %8s\n", integrator->name, "unstable");
+            continue;
+        }
+        printf("%-10s %8g %12.3g %14.1f %14.3g\n", integrator->name,
+                best_step, best_error,
+                integrator->force_evaluations / best_step, best_cost);
+    }
+
+    free(s.positions);
+    free(s.velocities);
+    free(s.rama);
+    free(reference);
+    free(energies);
+    if(m->steric_grid)
+        steric_grid_free(&grid);
+    model_free(m);
+    return 0;
+}
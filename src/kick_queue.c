@@ -0,0 +1,78 @@
+#include <stdlib.h>
+#include <stdbool.h>
+#include <math.h>
+#include "kick_queue.h"
+
+extern inline double kick_queue_peek(const struct kick_queue *q);
+
+/**
+ * Initialise an empty queue for up to natoms atoms.
+ *
+ * \return Non-zero if memory could not be allocated.
+ */
+int kick_queue_init(struct kick_queue *q, size_t natoms){
+    size_t n = natoms ? natoms : 1;
+    q->next = malloc(n * sizeof(*q->next));
+    q->heap = malloc(n * sizeof(*q->heap));
+    q->due = malloc(n * sizeof(*q->due));
+    q->len = 0;
+    q->ndue = 0;
+    q->time = NAN;
+    if(!q->next || !q->heap || !q->due){
+        kick_queue_free(q);
+        return 1;
+    }
+    return 0;
+}
+
+void kick_queue_free(struct kick_queue *q){
+    free(q->next);
+    free(q->heap);
+    free(q->due);
+    q->next = NULL;
+    q->heap = NULL;
+    q->due = NULL;
+}
+
+//Ties are broken by atom index, so that the order doesn't depend on the
+//history of the heap.
+static bool sooner(const struct kick_queue *q, size_t a, size_t b){
+    return q->next[a] < q->next[b] || (q->next[a] == q->next[b] && a < b);
+}
+
+/**
+ * Schedule the next kick of atom at time. The atom must either be the next one
+ * to be scheduled (atom len), or have just been popped.
+ */
+void kick_queue_push(struct kick_queue *q, size_t atom, double time){
+    q->next[atom] = time;
+    size_t i = q->len++;
+    while(i > 0){
+        size_t parent = (i - 1) / 2;
+        if(!sooner(q, atom, q->heap[parent]))
+            break;
+        q->heap[i] = q->heap[parent];
+        i = parent;
+    }
+    q->heap[i] = atom;
+}
+
+///Remove the atom with the soonest kick from the heap, and return it.
+size_t kick_queue_pop(struct kick_queue *q){
+    size_t top = q->heap[0];
+    size_t last = q->heap[--q->len];
+    size_t i = 0;
+    while(true){
+        size_t child = 2 * i + 1;
+        if(child >= q->len)
+            break;
+        if(child + 1 < q->len && sooner(q, q->heap[child + 1], q->heap[child]))
+            child++;
+        if(!sooner(q, q->heap[child], last))
+            break;
+        q->heap[i] = q->heap[child];
+        i = child;
+    }
+    q->heap[i] = last;
+    return top;
+}
@@ -0,0 +1,48 @@
+#ifndef KICK_QUEUE_H_
+#define KICK_QUEUE_H_
+
+#include <stddef.h>
+#include <math.h>
+#include "vector.h"
+
+///Kick delivered to an atom by the water model
+struct water_kick {
+    size_t atom;
+    struct vector direction;
+};
+
+/**
+ * Times of the next water kick of each atom.
+ *
+ * The atoms that have been scheduled are kept in a binary heap ordered by the
+ * time of their next kick, so that the kicks due in a step are found without
+ * visiting the other atoms. The kicks due in the step starting at time are
+ * kept in due, so that every force evaluation in that step applies the same
+ * kicks.
+ */
+struct kick_queue {
+    //Time of the next kick of each scheduled atom.
+    double *next;
+
+    //Heap of scheduled atoms, with the soonest kick first. Atoms 0 to len - 1
+    //are scheduled.
+    size_t *heap;
+    size_t len;
+
+    //Kicks due in the step starting at time.
+    struct water_kick *due;
+    size_t ndue;
+    double time;
+};
+
+int kick_queue_init(struct kick_queue *q, size_t natoms);
+void kick_queue_free(struct kick_queue *q);
+void kick_queue_push(struct kick_queue *q, size_t atom, double time);
+size_t kick_queue_pop(struct kick_queue *q);
+
+///Time of the soonest kick, which is infinite if no atoms are scheduled
+inline double kick_queue_peek(const struct kick_queue *q){
+    return q->len ? q->next[q->heap[0]] : INFINITY;
+}
+
+#endif /* KICK_QUEUE_H_ */
@@ -0,0 +1,73 @@
+#include <stdlib.h>
+#include <string.h>
+#include "lanes.h"
+#include "model.h"
+
+extern inline void lane_add_masked(struct lane_vector *dst,
+        const struct lane_vector *f, const lane_mask_t *mask);
+
+/**
+ * Set up lanes for the n replicas in models, each of which may have up to
+ * natoms atoms. The replicas must be copies of the same model.
+ *
+ * \return Non-zero if memory couldn't be allocated.
+ */
+int lanes_init(struct lanes *l, struct model **models, size_t n,
+        size_t natoms){
+    const size_t align = 64;
+    size_t size = natoms ? natoms : 1;
+
+    memset(l, 0, sizeof(*l));
+    l->n = n;
+    l->natoms = natoms;
+    for(size_t k=0; k < LANES; k++)
+        l->models[k] = models[k < n ? k : 0];
+
+    if(posix_memalign((void **)&l->positions, align,
+                sizeof(*l->positions) * size)
+            || posix_memalign((void **)&l->forces, align,
+                sizeof(*l->forces) * size)
+            || posix_memalign((void **)&l->movable, align,
+                sizeof(*l->movable) * size)){
+        lanes_free(l);
+        return 1;
+    }
+    return 0;
+}
+
+void lanes_free(struct lanes *l){
+    free(l->positions);
+    free(l->forces);
+    free(l->movable);
+    l->positions = l->forces = NULL;
+    l->movable = NULL;
+}
+
+/**
+ * Copy the positions and fixed atoms of each replica into the lanes, and zero
+ * the forces. Atoms never move in unused lanes.
+ */
+void lanes_gather(struct lanes *l){
+    size_t natoms = l->models[0]->num_atoms;
+    for(size_t k=0; k < LANES; k++){
+        const struct model *m = l->models[k];
+        for(size_t a=0; a < natoms; a++){
+            for(size_t i=0; i < N; i++){
+                l->positions[a].c[i][k] = m->positions[a].c[i];
+                l->forces[a].c[i][k] = 0;
+            }
+            l->movable[a][k] = (k < l->n && !m->fixed[a]) ? -1 : 0;
+        }
+    }
+}
+
+///Copy the forces in each lane back into the replicas.
+void lanes_scatter(struct lanes *l){
+    size_t natoms = l->models[0]->num_atoms;
+    for(size_t k=0; k < l->n; k++){
+        struct model *m = l->models[k];
+        for(size_t a=0; a < natoms; a++)
+            for(size_t i=0; i < N; i++)
+                m->forces[a].c[i] = l->forces[a].c[i][k];
+    }
+}
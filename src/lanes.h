@@ -0,0 +1,78 @@
+#ifndef LANES_H_
+#define LANES_H_
+
+#include <stddef.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include "vector.h"
+
+struct model;
+
+///Number of replicas simulated in lockstep: four doubles fill an AVX2 register
+#define LANES 4
+
+/**
+ * A double for each of LANES replicas. This uses the GCC vector extensions
+ * (also supported by clang), so arithmetic on lanes compiles to SIMD
+ * instructions, and lanes may be indexed like arrays.
+ */
+typedef double lane_t __attribute__((vector_size(LANES * sizeof(double))));
+
+/**
+ * A mask for each of LANES replicas. Comparing two lane_t values gives a mask
+ * with all bits set in the lanes where the comparison is true.
+ */
+typedef int64_t lane_mask_t
+    __attribute__((vector_size(LANES * sizeof(int64_t))));
+
+///A vector for each of LANES replicas, stored as one lane per component
+struct lane_vector {
+    lane_t c[N];
+};
+
+/*
+ * Keep the lanes of x for which mask is set, and set the others to zero. This
+ * is a macro because passing vectors by value changes the ABI depending on
+ * whether AVX is enabled.
+ */
+#define LANE_SELECT(x, mask) ((lane_t)((lane_mask_t)(x) & (mask)))
+
+/**
+ * Several replicas of the same model being simulated in lockstep. The
+ * replicas share their topology and are all synthesised at the same time, but
+ * each has its own positions, fixed atoms and random number generator.
+ *
+ * The positions of the replicas are gathered into lanes before the bonded
+ * forces are calculated, so that each spring is only looked up once for all
+ * of the replicas.
+ */
+struct lanes {
+    ///Number of replicas in use, no more than LANES
+    size_t n;
+    ///The replicas. Unused lanes are copies of the first replica.
+    struct model *models[LANES];
+    ///Number of atoms allocated
+    size_t natoms;
+
+    ///Positions of each atom in each replica
+    struct lane_vector *positions;
+    ///Bonded forces on each atom in each replica
+    struct lane_vector *forces;
+    ///Set for each replica in which the atom may move
+    lane_mask_t *movable;
+};
+
+int lanes_init(struct lanes *l, struct model **models, size_t n,
+        size_t natoms);
+void lanes_free(struct lanes *l);
+void lanes_gather(struct lanes *l);
+void lanes_scatter(struct lanes *l);
+
+///Add f to dst in each lane for which mask is set
+inline void lane_add_masked(struct lane_vector *dst,
+        const struct lane_vector *f, const lane_mask_t *mask){
+    for(size_t i=0; i < N; i++)
+        dst->c[i] += LANE_SELECT(f->c[i], *mask);
+}
+
+#endif /* LANES_H_ */
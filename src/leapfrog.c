@@ -1,51 +1,67 @@
 #include <stdlib.h>
 #include "leapfrog.h"
-#include "rk4.h"
+#include "rattle.h"
 #include "vector.h"
 #include "model.h"
 #include "residue.h"
 
+//Change the velocities of the unfixed atoms by the current forces over dt
+static void kick(struct model *model, double dt){
+    for(size_t i=0; i < model->num_atoms; i++){
+        if(model->fixed[i])
+            continue;
+        struct vector dv;
+        vmul(&dv, &model->forces[i], dt * model->inv_masses[i]);
+        vadd_to(&model->velocities[i], &dv);
+    }
+}
+
 //The leapfrog integrator requires the velocity to be a half-step out of phase
-//with the position (hence "leapfrog"). To initialise it, we use the RK4
-//integrator with a half timestep.
+//with the position (hence "leapfrog"). To initialise it, the velocities are
+//moved back half a step, so that the first push brings them forward to half
+//a step after the positions.
 void leapfrog_init(struct model *model){
-    double dt = model->timestep;
-
-    //Store original positions; we only want to increase the velocity
-    struct vector positions[model->num_atoms];
-
-    for(size_t i=0; i < model->num_atoms; i++)
-        vector_copy_to(&positions[i], &model->atoms[i].position);
-
     model_accumulate_forces(model);
-    model->timestep = dt / 2;
-    rk4_push(model);
-    model->timestep = dt;
+    kick(model, -model->timestep / 2);
+}
 
-    for(size_t i=0; i < model->num_atoms; i++)
-        vector_copy_to(&model->atoms[i].position, &positions[i]);
+//Bring the velocities back in phase with the positions, undoing
+//leapfrog_init.
+void leapfrog_finish(struct model *model){
+    model_accumulate_forces(model);
+    kick(model, model->timestep / 2);
 }
 
+/**
+ * Advance the model by one leapfrog step. The velocities, half a step behind
+ * the positions, are pushed a whole step using the forces at the current
+ * positions, and then the positions are moved with the new velocities. The
+ * new positions are corrected to satisfy the constraints, as in SHAKE, and
+ * the corrections are added to the velocities, so each velocity remains the
+ * distance moved in the step divided by the timestep.
+ */
 void leapfrog_push(struct model *model){
-    //Temp vectors for storing change in position and velocity.
-    //We use two separate vectors for clarity.
-    struct vector dr, dv;
-
     double dt = model->timestep;
-    model->time += dt;
+    size_t scratch_used = model->scratch.used;
+    struct vector *uncons = model_scratch(model,
+            sizeof(*uncons) * model->num_atoms);
 
     //Calculate forces
     model_accumulate_forces(model);
+    kick(model, dt);
 
-    //Increase position and velocity
+    //Move the atoms, then apply the constraints
     for(size_t i=0; i < model->num_atoms; i++){
-        if(model->atoms[i].fixed)
+        if(model->fixed[i]){
+            vector_copy_to(&uncons[i], &model->positions[i]);
+            vector_zero(&model->velocities[i]);
             continue;
-
-        vmul(&dr, &model->atoms[i].velocity, dt);
-        vadd_to(&model->atoms[i].position, &dr);
-
-        vmul(&dv, &model->atoms[i].force, dt / model->atoms[i].mass);
-        vadd_to(&model->atoms[i].velocity, &dv);
+        }
+        struct vector dr;
+        vmul(&dr, &model->velocities[i], dt);
+        vadd(&uncons[i], &model->positions[i], &dr);
     }
+    rattle_constrain_positions(model, uncons, NULL);
+    model->time += dt;
+    model->scratch.used = scratch_used;
 }
@@ -3,7 +3,7 @@
 
 struct model;
 void leapfrog_init(struct model *model);
+void leapfrog_finish(struct model *model);
 void leapfrog_push(struct model *model);
 
 #endif /* LEAPFROG_H_ */
-
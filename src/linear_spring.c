@@ -1,9 +1,15 @@
 #include <stdlib.h>
 #include <math.h>
+
+#ifdef HAVE_CONFIG_H
+#include <config.h>
+#endif
+
 #include "linear_spring.h"
+#include "lanes.h"
 
 struct linear_spring * linear_spring_alloc(double distance, double constant,
-        struct atom *a, struct atom *b){
+        size_t a, size_t b){
     struct linear_spring * s = malloc(sizeof(struct linear_spring));
     if(!s)
         return NULL;
@@ -14,7 +20,7 @@ struct linear_spring * linear_spring_alloc(double distance, double constant,
 
 void linear_spring_init(struct linear_spring *s,
         double distance, double constant,
-        struct atom *a, struct atom *b){
+        size_t a, size_t b){
     s->distance = distance;
     s->constant = constant;
     s->a = a;
@@ -23,7 +29,7 @@ void linear_spring_init(struct linear_spring *s,
     s->cutoff = -1;
 
     //Default to not disabling based on handedness
-    s->inner = s->outer = NULL;
+    s->inner = s->outer = NO_ATOM;
     s->right_handed = false;
 }
 
@@ -31,14 +37,19 @@ void linear_spring_free(struct linear_spring *s){
     free(s);
 }
 
-bool linear_spring_active(struct linear_spring *s){
+/**
+ * Returns true if the spring between the atoms at positions pos[s->a] and
+ * pos[s->b] should be applied.
+ */
+bool linear_spring_active(struct linear_spring *s,
+        struct vector *pos){
     struct vector displacement;
-    vsub(&displacement, &s->b->position, &s->a->position);
+    vsub(&displacement, &pos[s->b], &pos[s->a]);
     double distance = vmag(&displacement);
 
     if(!s->enabled)
         return false;
-    if(s->inner && s->outer){
+    if(s->inner != NO_ATOM && s->outer != NO_ATOM){
         /*
          * Here is the situation:
          *          o--------b
@@ -56,9 +67,9 @@ bool linear_spring_active(struct linear_spring *s){
         struct vector ai; //Between a and i (inner)
         struct vector oa; //Between o (outer) and a
         struct vector cross;
-        vsub(&ab, &s->b->position, &s->a->position);
-        vsub(&ai, &s->inner->position, &s->a->position);
-        vsub(&oa, &s->outer->position, &s->a->position);
+        vsub(&ab, &pos[s->b],     &pos[s->a]);
+        vsub(&ai, &pos[s->inner], &pos[s->a]);
+        vsub(&oa, &pos[s->outer], &pos[s->a]);
         vcross(&cross, &ab, &ai);
         double dot = vdot(&cross, &oa);
         bool rh = (dot > 0) ? true : false;
@@ -73,17 +84,18 @@ bool linear_spring_active(struct linear_spring *s){
 
 void linear_spring_force(
         struct vector *f1, struct vector *f2,
-        struct linear_spring *s){
+        struct linear_spring *s,
+        struct vector *pos){
 
     struct vector displacement;
     //Don't apply if outside the cutoffs
-    if(!linear_spring_active(s)){
+    if(!linear_spring_active(s, pos)){
         vector_zero(f1);
         vector_zero(f2);
         return;
     }
 
-    vsub(&displacement, &s->b->position, &s->a->position);
+    vsub(&displacement, &pos[s->b], &pos[s->a]);
 
     //Normalise displacement to get direction
     double distance = vmag(&displacement);
@@ -93,14 +105,62 @@ void linear_spring_force(
     vmul(f2, f1, -1);
 }
 
-double linear_spring_energy(struct linear_spring *s){
+/**
+ * Calculate the force due to spring s in each of LANES replicas at once. This
+ * gives the same result as linear_spring_force in each lane, but uses masks
+ * instead of branching on whether the spring is active.
+ */
+void linear_spring_force_lanes(
+        struct lane_vector *f1, struct lane_vector *f2,
+        struct linear_spring *s,
+        struct lane_vector *pos){
+
+    const struct lane_vector *a = &pos[s->a], *b = &pos[s->b];
+    lane_t ab[N];
+    for(size_t i=0; i < N; i++)
+        ab[i] = b->c[i] - a->c[i];
+
+    lane_t distance = ab[0]*ab[0] + ab[1]*ab[1] + ab[2]*ab[2];
+    for(size_t k=0; k < LANES; k++)
+        distance[k] = sqrt(distance[k]);
+    lane_t stretch = distance - s->distance;
+
+    lane_mask_t active = s->enabled ? ~(lane_mask_t){0} : (lane_mask_t){0};
+    if(s->cutoff >= 0)
+        active &= (stretch < s->cutoff) & (stretch > -s->cutoff);
+
+    //See linear_spring_active for the handedness check
+    if(s->inner != NO_ATOM && s->outer != NO_ATOM){
+        lane_t ai[N], oa[N];
+        for(size_t i=0; i < N; i++){
+            ai[i] = pos[s->inner].c[i] - a->c[i];
+            oa[i] = pos[s->outer].c[i] - a->c[i];
+        }
+        lane_t dot = (ab[1]*ai[2] - ab[2]*ai[1]) * oa[0]
+            + (ab[2]*ai[0] - ab[0]*ai[2]) * oa[1]
+            + (ab[0]*ai[1] - ab[1]*ai[0]) * oa[2];
+        lane_mask_t rh = dot > 0;
+        active &= s->right_handed ? rh : ~rh;
+    }
+
+    lane_t magnitude = stretch * s->constant;
+    for(size_t i=0; i < N; i++){
+        lane_t f = ab[i] / distance * magnitude;
+        f1->c[i] = LANE_SELECT(f, active);
+        f2->c[i] = LANE_SELECT(f * -1, active);
+    }
+}
+
+double linear_spring_energy(struct linear_spring *s,
+        struct vector *pos){
     struct vector displacement;
-    vsub(&displacement, &s->b->position, &s->a->position);
+    vsub(&displacement, &pos[s->b], &pos[s->a]);
     double distance = vmag(&displacement);
     double delta_r = distance - s->distance;
     return s->constant * delta_r*delta_r;
 }
 
-bool linear_spring_synthesised(struct linear_spring *s){
-    return s->a->synthesised && s->b->synthesised;
+bool linear_spring_synthesised(struct linear_spring *s,
+        bool *synthesised){
+    return synthesised[s->a] && synthesised[s->b];
 }
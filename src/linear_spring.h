@@ -5,41 +5,59 @@
 #include "residue.h"
 #include "vector.h"
 
+struct lane_vector;
+
 #define DEFAULT_SPRING_CONSTANT 0.01
 
 #define SC_BB_SPRING_CONSTANT 0.1
 
 #define BB_BB_SPRING_CONSTANT 0.05
 
+/**
+ * A harmonic spring between two atoms.
+ *
+ * There can be very many of these, so they are kept small: atoms are stored as
+ * 32-bit indices and the parameters in single precision. Forces are still
+ * calculated in double precision.
+ */
 struct linear_spring {
-    double distance;
-    double constant;
-    double cutoff;
+    ///Atom indices
+    uint32_t a, b;
+    ///Used for determining handedness. Set to NO_ATOM if unused.
+    uint32_t inner, outer;
+
+    float distance;
+    float constant;
+    float cutoff;
     bool enabled;
-    struct atom *a, *b;
-
-    ///Used for determining handedness
-    struct atom *inner, *outer;
     bool right_handed;
 };
 
 struct linear_spring * linear_spring_alloc(
         double distance, double constant,
-        struct atom *a, struct atom *b);
+        size_t a, size_t b);
 
 void linear_spring_init(
         struct linear_spring *s,
         double distance, double constant,
-        struct atom *a, struct atom *b);
+        size_t a, size_t b);
 
 void linear_spring_free(struct linear_spring *s);
 
-bool linear_spring_active(struct linear_spring *s);
+bool linear_spring_active(struct linear_spring *s,
+        struct vector *pos);
 
-double linear_spring_energy(struct linear_spring *s);
+double linear_spring_energy(struct linear_spring *s,
+        struct vector *pos);
 void linear_spring_force(
         struct vector *f1, struct vector *f2,
-        struct linear_spring *s);
-bool linear_spring_synthesised(struct linear_spring *s);
+        struct linear_spring *s,
+        struct vector *pos);
+void linear_spring_force_lanes(
+        struct lane_vector *f1, struct lane_vector *f2,
+        struct linear_spring *s,
+        struct lane_vector *pos);
+bool linear_spring_synthesised(struct linear_spring *s,
+        bool *synthesised);
 
 #endif //LINEAR_SPRING_H_
@@ -9,7 +9,9 @@
 #endif
 
 #include "model.h"
+#include "lanes.h"
 #include "vector.h"
+#include "rng.h"
 #include "sterics.h"
 #include "rama.h"
 #include "linear_spring.h"
@@ -17,25 +19,44 @@
 #include "rama.h"
 #include "torsion_spring.h"
 #include "debug.h"
+#include "rattle.h"
+#include "image.h"
+#include "pdb.h"
 
 #ifdef HAVE_CLOCK_GETTIME
 #include "profile.h"
 #endif
 
-static void add_torsion_force(struct torsion_spring *spring);
+#ifdef HAVE_OPENMP
+#include <omp.h>
+#endif
+
+static void add_torsion_force(struct model *m, struct vector *forces,
+        struct torsion_spring *spring);
 static double model_get_separation(
-        const struct model *restrict m,
-        const struct atom *restrict a,
-        const struct atom *restrict b,
-        struct atom **restrict place_near);
-
-static void apply_spring_force(struct model *m);
-static void apply_torsion_force(struct model *m);
-static void apply_rama_force(struct model *m);
-static void apply_angle_force(struct model *m);
+        const struct model *m,
+        size_t a, size_t b,
+        size_t *place_near);
+
+static struct vector *thread_force_buffers(struct model *m, int nthreads);
+static void reduce_forces(struct model *m, struct vector *buffers,
+        int nthreads);
+static void apply_spring_force(struct model *m, struct vector *forces,
+        enum force_level level);
+static void apply_torsion_force(struct model *m, struct vector *forces);
+static void apply_rama_force(struct model *m, struct vector *forces);
+static void apply_angle_force(struct model *m, struct vector *forces);
 static void apply_drag_force(struct model *m);
+static void accumulate_nonbonded_forces(struct model *m,
+        enum force_level level);
+static void add_torsion_force_lane(struct lanes *l, size_t k,
+        struct torsion_spring *s);
 static void profile(struct model *m, const char *msg);
+static size_t num_active(const struct model *m, const size_t *prefix,
+        size_t total);
 
+static int model_alloc_state(struct model *m, size_t natoms);
+static int model_alloc_scratch(struct model *m, size_t natoms);
 static void model_move_along_vector(struct model *m, double alpha,
         struct vector *r, struct vector *p);
 
@@ -49,6 +70,13 @@ struct model *model_alloc(){
     if(!m)
         return NULL;
 
+    //Start from the same seed as rand() does if it isn't seeded
+    m->rng = rng_alloc(1);
+    if(!m->rng){
+        free(m);
+        return NULL;
+    }
+
     m->num_linear_springs = 0;
     m->num_torsion_springs = 0;
     m->num_rama_constraints = 0;
@@ -58,19 +86,43 @@ struct model *model_alloc(){
     m->num_atoms = 0;
     m->residues = NULL;
     m->atoms = NULL;
+    m->positions = NULL;
+    m->velocities = NULL;
+    m->forces = NULL;
+    m->slow_forces = NULL;
+    m->inv_masses = NULL;
+    m->fixed = NULL;
+    m->synthesised = NULL;
     m->linear_springs = NULL;
     m->torsion_springs = NULL;
     m->bond_angles = NULL;
+    m->rama_constraints = NULL;
     m->constraints = NULL;
+    m->constraint_solver = SERIAL_SOLVER;
+    m->num_colours = 0;
+    m->colour_start = NULL;
+    m->chain = NULL;
     m->time = 0;
     m->until = 0;
     m->timestep = 0.1;
+    m->integrator = RATTLE_INTEGRATOR;
+    m->respa_steps = 1;
+    m->slow_terms = 0;
+    m->slow_spring_constant = 0;
+    m->adaptive_timestep = false;
+    m->min_timestep = DEFAULT_MIN_TIMESTEP;
+    m->max_timestep = DEFAULT_MAX_TIMESTEP;
+    m->max_displacement = DEFAULT_MAX_DISPLACEMENT;
+    m->max_constraint_iterations = DEFAULT_MAX_CONSTRAINT_ITERATIONS;
+    m->max_kinetic_energy = DEFAULT_MAX_KINETIC_ENERGY;
+    m->stable_steps = 0;
     m->synth_time = 100;
     m->drag_coefficient = -0.1;
     m->shield_drag = false;
     m->steric_grid = NULL;
     m->use_sterics = false;
     m->use_water = false;
+    m->verlet_skin = DEFAULT_VERLET_SKIN;
     m->max_synth_angle = DEFAULT_MAX_SYNTH_ANGLE;
     m->fix = false;
     m->threestate = false;
@@ -80,7 +132,15 @@ struct model *model_alloc(){
     m->record_time = m->timestep * 10;
     m->max_jitter = 0.01;
     m->profiler = NULL;
-    m->bond_map = NULL;
+    m->bond_start = NULL;
+    m->bonds = NULL;
+    m->active = NULL;
+    m->thread_forces = NULL;
+    m->thread_forces_sz = 0;
+    m->scratch.base = NULL;
+    m->scratch.size = m->scratch.used = 0;
+    m->image = NULL;
+    m->image_size = 0;
     return m;
 }
 
@@ -89,64 +149,506 @@ struct model *model_alloc(){
  */
 void model_free(struct model *m){
     free(m->atoms);
-    free(m->residues);
-    free(m->linear_springs);
-    free(m->torsion_springs);
-    free(m->bond_angles);
-    free(m->rama_constraints);
-    free(m->constraints);
+    free(m->positions);
+    free(m->velocities);
+    free(m->forces);
+    free(m->slow_forces);
+    free(m->inv_masses);
+    free(m->fixed);
+    free(m->synthesised);
+    if(m->image){
+        image_unmap(m);
+    }else{
+        free(m->residues);
+        free(m->linear_springs);
+        free(m->torsion_springs);
+        free(m->bond_angles);
+        free(m->rama_constraints);
+        free(m->constraints);
+    }
+    free(m->colour_start);
+    rattle_free_chain(m->chain);
+    free(m->bond_start);
+    free(m->bonds);
+    free(m->thread_forces);
+    free(m->scratch.base);
+    rng_free(m->rng);
+    if(m->active){
+        free(m->active->linear);
+        free(m->active->angle);
+        free(m->active->torsion);
+        free(m->active->rama);
+        free(m->active);
+    }
     free(m);
 }
 
+/**
+ * Allocate the atoms of a model along with the arrays holding the state of
+ * each atom. Positions, velocities and forces are zeroed, no atoms are fixed
+ * or synthesised and all masses are set to one. The scratch space used by
+ * the integrators is sized for natoms here, so that nothing needs to be
+ * allocated while the model is being simulated.
+ *
+ * \return Non-zero if memory could not be allocated.
+ */
+int model_alloc_atoms(struct model *m, size_t natoms){
+    m->num_atoms = natoms;
+    m->atoms = malloc(sizeof(*m->atoms) * (natoms ? natoms : 1));
+    if(!m->atoms || model_alloc_state(m, natoms)){
+        free(m->atoms);
+        m->atoms = NULL;
+        m->num_atoms = 0;
+        return 1;
+    }
+
+    for(size_t i=0; i < natoms; i++){
+        vector_zero(&m->positions[i]);
+        vector_zero(&m->velocities[i]);
+        vector_zero(&m->forces[i]);
+        m->inv_masses[i] = 1;
+        m->fixed[i] = false;
+        m->synthesised[i] = false;
+    }
+    return 0;
+}
+
+/*
+ * Allocate the arrays holding the state of each atom, and the scratch space.
+ * On failure, all of them are freed and set to NULL.
+ */
+static int model_alloc_state(struct model *m, size_t natoms){
+    //Align the state arrays to cache lines
+    const size_t align = 64;
+    size_t n = natoms ? natoms : 1;
+
+    m->positions = m->velocities = m->forces = m->slow_forces = NULL;
+    m->inv_masses = NULL;
+    m->fixed = m->synthesised = NULL;
+    if(posix_memalign((void **)&m->positions, align,
+                sizeof(*m->positions) * n)
+            || posix_memalign((void **)&m->velocities, align,
+                sizeof(*m->velocities) * n)
+            || posix_memalign((void **)&m->forces, align,
+                sizeof(*m->forces) * n)
+            || posix_memalign((void **)&m->slow_forces, align,
+                sizeof(*m->slow_forces) * n)
+            || posix_memalign((void **)&m->inv_masses, align,
+                sizeof(*m->inv_masses) * n)
+            || posix_memalign((void **)&m->fixed, align,
+                sizeof(*m->fixed) * n)
+            || posix_memalign((void **)&m->synthesised, align,
+                sizeof(*m->synthesised) * n)
+            || model_alloc_scratch(m, n))
+        goto alloc_err;
+    //The slow forces are applied before they are first calculated
+    memset(m->slow_forces, 0, sizeof(*m->slow_forces) * n);
+    return 0;
+
+alloc_err:
+    free(m->positions);
+    free(m->velocities);
+    free(m->forces);
+    free(m->slow_forces);
+    free(m->inv_masses);
+    free(m->fixed);
+    free(m->synthesised);
+    free(m->scratch.base);
+    m->scratch.base = NULL;
+    m->positions = m->velocities = m->forces = m->slow_forces = NULL;
+    m->inv_masses = NULL;
+    m->fixed = m->synthesised = NULL;
+    return 1;
+}
+
+/**
+ * Make a replica of a model, so that several simulations of the same model can
+ * be run at once. The replica shares the atoms, residues, springs and
+ * constraints of m, which are not changed by a simulation. It has its own copy
+ * of the state of each atom and of the Ramachandran constraints, which are
+ * updated as the model moves, as well as its own scratch space, constraint
+ * solver state and random number generator seeded with seed.
+ *
+ * The replica does not have a steric grid, debugging output or profiler, and
+ * must be freed with model_free_replica.
+ *
+ * \return The replica, or NULL if memory could not be allocated.
+ */
+struct model *model_replicate(const struct model *m, unsigned int seed){
+    struct model *r = malloc(sizeof(*r));
+    if(!r)
+        return NULL;
+    memcpy(r, m, sizeof(*r));
+    r->positions = r->velocities = r->forces = r->slow_forces = NULL;
+    r->inv_masses = NULL;
+    r->fixed = r->synthesised = NULL;
+    r->scratch.base = NULL;
+    r->rama_constraints = NULL;
+    r->chain = NULL;
+    r->steric_grid = NULL;
+    r->debug = NULL;
+    r->profiler = NULL;
+    r->thread_forces = NULL;
+    r->thread_forces_sz = 0;
+    r->image = NULL;
+    r->image_size = 0;
+
+    r->rng = rng_alloc(seed);
+    if(!r->rng || model_alloc_state(r, m->num_atoms))
+        goto alloc_err;
+
+    size_t n = m->num_atoms;
+    memcpy(r->positions, m->positions, sizeof(*r->positions) * n);
+    memcpy(r->velocities, m->velocities, sizeof(*r->velocities) * n);
+    memcpy(r->forces, m->forces, sizeof(*r->forces) * n);
+    memcpy(r->slow_forces, m->slow_forces, sizeof(*r->slow_forces) * n);
+    memcpy(r->inv_masses, m->inv_masses, sizeof(*r->inv_masses) * n);
+    memcpy(r->fixed, m->fixed, sizeof(*r->fixed) * n);
+    memcpy(r->synthesised, m->synthesised, sizeof(*r->synthesised) * n);
+
+    if(m->num_rama_constraints){
+        size_t sz = sizeof(*r->rama_constraints) * m->num_rama_constraints;
+        r->rama_constraints = malloc(sz);
+        if(!r->rama_constraints)
+            goto alloc_err;
+        memcpy(r->rama_constraints, m->rama_constraints, sz);
+    }
+    if(m->chain && rattle_copy_chain(r, m))
+        goto alloc_err;
+    return r;
+
+alloc_err:
+    model_free_replica(r);
+    return NULL;
+}
+
+/**
+ * Free a replica made by model_replicate, leaving the model that it was made
+ * from untouched.
+ */
+void model_free_replica(struct model *r){
+    free(r->positions);
+    free(r->velocities);
+    free(r->forces);
+    free(r->slow_forces);
+    free(r->inv_masses);
+    free(r->fixed);
+    free(r->synthesised);
+    free(r->rama_constraints);
+    rattle_free_chain(r->chain);
+    free(r->thread_forces);
+    free(r->scratch.base);
+    rng_free(r->rng);
+    free(r);
+}
+
+/*
+ * Allocate the scratch space. It must be large enough for the most that is
+ * taken at once: rk4_push holds four vectors per atom while projecting onto
+ * the constraints, which takes four flags per atom, and RATTLE takes one
+ * vector and four flags per atom. Each allocation may also waste up to SCRATCH_ALIGN
+ * bytes.
+ */
+static int model_alloc_scratch(struct model *m, size_t natoms){
+    size_t size = natoms * (SCRATCH_VECTORS * sizeof(struct vector)
+                + SCRATCH_FLAGS * sizeof(bool))
+        + SCRATCH_ALLOCS * SCRATCH_ALIGN;
+    free(m->scratch.base);
+    m->scratch.base = NULL;
+    m->scratch.size = m->scratch.used = 0;
+    if(posix_memalign((void **)&m->scratch.base, SCRATCH_ALIGN, size))
+        return 1;
+    m->scratch.size = size;
+    return 0;
+}
+
+/**
+ * Take size bytes from the scratch space of the model. The memory is aligned
+ * to SCRATCH_ALIGN bytes. To give it back, save m->scratch.used before taking
+ * anything and restore it afterwards.
+ *
+ * The scratch space is sized when the atoms are allocated, so running out is
+ * a bug; the program exits if it happens.
+ */
+void *model_scratch(struct model *m, size_t size){
+    size_t start = (m->scratch.used + SCRATCH_ALIGN - 1)
+        & ~(size_t)(SCRATCH_ALIGN - 1);
+    if(start + size > m->scratch.size){
+        fprintf(stderr, "Scratch space exhausted (%lu of %lu bytes used, "
+                "%lu requested)\n", m->scratch.used, m->scratch.size, size);
+        exit(1);
+    }
+    m->scratch.used = start + size;
+    return m->scratch.base + start;
+}
+
+/**
+ * Parse the name of a force term, as given in the slow_forces key of a
+ * specification. Returns FORCE_UNKNOWN if the name isn't recognised.
+ */
+enum force_term model_parse_force_term(const char *name){
+    if(strcmp(name, "linear")  == 0) return FORCE_LINEAR;
+    if(strcmp(name, "torsion") == 0) return FORCE_TORSION;
+    if(strcmp(name, "rama")    == 0) return FORCE_RAMA;
+    if(strcmp(name, "angle")   == 0) return FORCE_ANGLE;
+    if(strcmp(name, "steric")  == 0) return FORCE_STERIC;
+    if(strcmp(name, "water")   == 0) return FORCE_WATER;
+    if(strcmp(name, "drag")    == 0) return FORCE_DRAG;
+    return FORCE_UNKNOWN;
+}
+
+//Whether the given term is accumulated at the given level
+static bool evaluates(const struct model *m, enum force_level level,
+        enum force_term term){
+    switch(level){
+        case FAST_FORCES: return !(m->slow_terms & term);
+        case SLOW_FORCES: return m->slow_terms & term;
+        default:          return true;
+    }
+}
+
 void model_accumulate_forces(struct model *m){
+    model_accumulate_forces_level(m, ALL_FORCES);
+}
+
+/**
+ * Set the forces on the atoms of m to the sum of the terms at the given level.
+ * The levels are used by the RESPA integrator, which evaluates the slow terms
+ * less often than the fast ones.
+ */
+void model_accumulate_forces_level(struct model *m, enum force_level level){
     //Begin by zeroing out any existing forces
     for(size_t i=0; i < m->num_atoms; i++)
-        vector_zero(&m->atoms[i].force);
+        vector_zero(&m->forces[i]);
 
     #ifdef HAVE_CLOCK_GETTIME
     if(m->profiler)
         profile_start(m->profiler);
     #endif
 
-    apply_spring_force(m);
-    profile(m, "linear");
+    //Each thread accumulates the bonded forces into its own buffer, which are
+    //summed into the atoms afterwards. Debugging output is written from
+    //inside the force loops, so keep that serial.
+    int nthreads = 1;
+    #ifdef HAVE_OPENMP
+    if(!m->debug)
+        nthreads = omp_get_max_threads();
+    #endif
+    struct vector *buffers = NULL;
+    if(nthreads > 1)
+        buffers = thread_force_buffers(m, nthreads);
 
-    apply_torsion_force(m);
-    profile(m, "torsion");
+    #ifdef HAVE_OPENMP
+    #pragma omp parallel num_threads(nthreads) if(buffers)
+    #endif
+    {
+        struct vector *forces = NULL;
+        if(buffers){
+            #ifdef HAVE_OPENMP
+            forces = buffers + omp_get_thread_num() * m->num_atoms;
+            #endif
+            for(size_t i=0; i < m->num_atoms; i++)
+                vector_zero(&forces[i]);
+        }
 
-    apply_rama_force(m);
-    profile(m, "rama");
+        apply_spring_force(m, forces, level);
+        profile(m, "linear");
 
-    apply_angle_force(m);
-    profile(m, "angle");
+        if(evaluates(m, level, FORCE_TORSION)){
+            apply_torsion_force(m, forces);
+            profile(m, "torsion");
+        }
+
+        if(evaluates(m, level, FORCE_RAMA)){
+            apply_rama_force(m, forces);
+            profile(m, "rama");
+        }
 
-    apply_drag_force(m);
-    profile(m, "drag");
+        if(evaluates(m, level, FORCE_ANGLE)){
+            apply_angle_force(m, forces);
+            profile(m, "angle");
+        }
+    }
+
+    if(buffers){
+        reduce_forces(m, buffers, nthreads);
+        profile(m, "reduce");
+    }
+
+    accumulate_nonbonded_forces(m, level);
+}
+
+/*
+ * Add the drag force and the forces calculated from the steric grid to the
+ * atoms. These depend on the neighbours of each atom, so aren't calculated in
+ * lanes.
+ */
+void accumulate_nonbonded_forces(struct model *m, enum force_level level){
+    if(evaluates(m, level, FORCE_DRAG)){
+        apply_drag_force(m);
+        profile(m, "drag");
+    }
 
     //Steric, water and drag forces
     if(m->steric_grid){
-        steric_grid_update(m->steric_grid, m);
-        steric_grid_build_ilists(m->steric_grid, m);
+        if(steric_grid_update(m->steric_grid, m)){
+            fprintf(stderr, "Couldn't allocate neighbour lists.\n");
+            exit(1);
+        }
         profile(m, "steric grid update");
 
-        if(m->use_sterics){
+        if(m->use_sterics && evaluates(m, level, FORCE_STERIC)){
             steric_grid_forces(m->steric_grid, m);
             profile(m, "steric force");
-        }if(m->use_water){
+        }if(m->use_water && evaluates(m, level, FORCE_WATER)){
             water_force(m, m->steric_grid);
             profile(m, "water force");
-        }if(m->shield_drag){
+        }if(m->shield_drag && evaluates(m, level, FORCE_DRAG)){
             drag_force(m, m->steric_grid);
             profile(m, "shielded drag");
         }
     }
 }
 
-static void add_torsion_force(struct torsion_spring *s){
-    if(s->a1->synthesised
-            && s->a2->synthesised
-            && s->a3->synthesised
-            && s->a4->synthesised){
+/**
+ * Accumulate the forces on each replica in l, which must all have the same
+ * atoms synthesised. The bonded forces are calculated in lanes, so that each
+ * spring is looked up once for all of the replicas. Linear springs and bond
+ * angles are calculated for every lane at once; torsions are calculated one
+ * lane at a time, because the Ramachandran constraints differ between the
+ * replicas. The forces on each replica are the same as those from
+ * model_accumulate_forces with a single thread.
+ */
+void model_accumulate_forces_lanes(struct lanes *l){
+    struct model *m = l->models[0];
+    lanes_gather(l);
+
+    //Linear springs
+    size_t nlinear = num_active(m, m->active ? m->active->linear : NULL,
+            m->num_linear_springs);
+    for(size_t i=0; i < nlinear; i++){
+        struct linear_spring *s = &m->linear_springs[i];
+        if(!m->synthesised[s->a] || !m->synthesised[s->b])
+            continue;
+
+        struct lane_vector f1, f2;
+        linear_spring_force_lanes(&f1, &f2, s, l->positions);
+        lane_add_masked(&l->forces[s->a], &f1, &l->movable[s->a]);
+        lane_add_masked(&l->forces[s->b], &f2, &l->movable[s->b]);
+    }
+
+    //Torsion springs
+    size_t ntorsion = num_active(m, m->active ? m->active->torsion : NULL,
+            m->num_torsion_springs);
+    for(size_t i=0; i < ntorsion; i++){
+        struct torsion_spring *s = &m->torsion_springs[i];
+        if(!torsion_spring_synthesised(s, m->synthesised))
+            continue;
+
+        for(size_t k=0; k < l->n; k++){
+            const bool *fixed = l->models[k]->fixed;
+            if(!(fixed[s->a1] && fixed[s->a2] && fixed[s->a3] && fixed[s->a4]))
+                add_torsion_force_lane(l, k, s);
+        }
+    }
+
+    //Ramachandran constraints, each of which belongs to one replica
+    size_t nrama = num_active(m, m->active ? m->active->rama : NULL,
+            m->num_rama_constraints);
+    for(size_t i=0; i < nrama; i++){
+        if(!rama_is_synthesised(&m->rama_constraints[i], m->synthesised))
+            continue;
+
+        for(size_t k=0; k < l->n; k++){
+            struct rama_constraint *rama = &l->models[k]->rama_constraints[i];
+            rama_get_closest(rama, l->models[k]->positions);
+            if(rama->enabled){
+                add_torsion_force_lane(l, k, &rama->phi);
+                add_torsion_force_lane(l, k, &rama->psi);
+            }
+        }
+    }
+
+    //Bond angles
+    size_t nangles = num_active(m, m->active ? m->active->angle : NULL,
+            m->num_bond_angles);
+    for(size_t i=0; i < nangles; i++){
+        struct bond_angle_spring *s = &m->bond_angles[i];
+        if(!bond_angle_synthesised(s, m->synthesised))
+            continue;
+
+        struct lane_vector f[3];
+        bond_angle_force_lanes(&f[0], &f[1], &f[2], s, l->positions);
+        lane_add_masked(&l->forces[s->a1], &f[0], &l->movable[s->a1]);
+        lane_add_masked(&l->forces[s->a2], &f[1], &l->movable[s->a2]);
+        lane_add_masked(&l->forces[s->a3], &f[2], &l->movable[s->a3]);
+    }
+
+    lanes_scatter(l);
+    for(size_t k=0; k < l->n; k++)
+        accumulate_nonbonded_forces(l->models[k], ALL_FORCES);
+}
+
+//Add the force due to torsion spring s in replica k of l.
+static void add_torsion_force_lane(struct lanes *l, size_t k,
+        struct torsion_spring *s){
+    const struct model *m = l->models[k];
+    struct vector f[4];
+    torsion_spring_force_new(&f[0], &f[1], &f[2], &f[3], s, m->positions);
+
+    const uint32_t atoms[4] = {s->a1, s->a2, s->a3, s->a4};
+    for(size_t j=0; j < 4; j++){
+        if(m->fixed[atoms[j]])
+            continue;
+        for(size_t i=0; i < N; i++)
+            l->forces[atoms[j]].c[i][k] += f[j].c[i];
+    }
+}
+
+/*
+ * Get (allocating if necessary) one force buffer of num_atoms vectors for each
+ * thread. Returns NULL if the buffers can't be allocated, in which case we
+ * fall back to accumulating forces serially.
+ */
+static struct vector *thread_force_buffers(struct model *m, int nthreads){
+    size_t required = m->num_atoms * nthreads;
+    if(required > m->thread_forces_sz){
+        struct vector *buf = realloc(m->thread_forces,
+                sizeof(*buf) * required);
+        if(!buf)
+            return NULL;
+        m->thread_forces = buf;
+        m->thread_forces_sz = required;
+    }
+    return m->thread_forces;
+}
+
+//Sum the per-thread force buffers into the atoms
+static void reduce_forces(struct model *m, struct vector *buffers, int nthreads){
+    #ifdef HAVE_OPENMP
+    #pragma omp parallel for num_threads(nthreads) schedule(static)
+    #endif
+    for(size_t i=0; i < m->num_atoms; i++){
+        if(m->fixed[i])
+            continue;
+        for(int t=0; t < nthreads; t++)
+            vadd_to(&m->forces[i], &buffers[t * m->num_atoms + i]);
+    }
+}
+
+//Add the force f to atom a, or to the atom's entry in the per-thread buffer if
+//forces is not NULL.
+static inline void add_force(struct model *m, struct vector *forces,
+        size_t a, struct vector *f){
+    if(forces)
+        vadd_to(&forces[a], f);
+    else
+        vadd_to(&m->forces[a], f);
+}
+
+static void add_torsion_force(struct model *m, struct vector *forces,
+        struct torsion_spring *s){
+    if(torsion_spring_synthesised(s, m->synthesised)){
 
         struct vector spring_forces[4];
         torsion_spring_force_new(
@@ -154,68 +656,79 @@ static void add_torsion_force(struct torsion_spring *s){
                 &spring_forces[1],
                 &spring_forces[2],
                 &spring_forces[3],
-                s);
-
-        if(!s->a1->fixed)
-            vadd_to(&s->a1->force, &spring_forces[0]);
-        if(!s->a2->fixed)
-            vadd_to(&s->a2->force, &spring_forces[1]);
-        if(!s->a3->fixed)
-            vadd_to(&s->a3->force, &spring_forces[2]);
-        if(!s->a4->fixed)
-            vadd_to(&s->a4->force, &spring_forces[3]);
+                s, m->positions);
+
+        if(!m->fixed[s->a1])
+            add_force(m, forces, s->a1, &spring_forces[0]);
+        if(!m->fixed[s->a2])
+            add_force(m, forces, s->a2, &spring_forces[1]);
+        if(!m->fixed[s->a3])
+            add_force(m, forces, s->a3, &spring_forces[2]);
+        if(!m->fixed[s->a4])
+            add_force(m, forces, s->a4, &spring_forces[3]);
     }
 }
 
 
 
-const char *atom_fmt   = "ATOM  %5d  %-3s %-3s  %4d%1s   %8.3f%8.3f%8.3f\n";
-const char *conect_fmt = "CONECT% 5d% 5d\n";
-
+/**
+ * Write the synthesised atoms of m as a PDB model, numbered by incrementing
+ * *n. If conect is set, CONECT records are written for each active linear
+ * spring and constraint between synthesised atoms.
+ *
+ * \return The number of bytes written, or a negative number on error.
+ */
 int model_pdb(FILE *out, const struct model *m, bool conect, int *n){
-    int bytes_written = 0;
+    struct pdb_buffer b;
+    pdb_buffer_init(&b, out);
 
-    bytes_written += fprintf(out, "MODEL     %lu\n", ++(*n));
+    pdb_model(&b, ++(*n));
     for(size_t i=0; i < m->num_atoms; i++){
         struct atom *a    = &m->atoms[i];
         struct residue *r = &m->residues[a->residue_idx];
 
-        if(a->synthesised){
-            fprintf(out, atom_fmt, a->id, a->name,
-                    r->name,
-                    r->id,
-                    " ",
-                    a->position.c[0],
-                    a->position.c[1],
-                    a->position.c[2]);
-
-        }
+        if(m->synthesised[i])
+            pdb_atom(&b, a->id, a->name, r->name, r->id, &m->positions[i]);
     }
     if(conect){
-        for(size_t i=0; i < m->num_linear_springs; i++){
-            struct linear_spring s = m->linear_springs[i];
-            if(linear_spring_active(&s) && s.a->synthesised && s.b->synthesised){
-                int res = fprintf(out, conect_fmt, s.a->id, s.b->id);
-
-                if(res < 0)
-                    return res;
-                bytes_written += res;
-            }
+        size_t nlinear = num_active(m, m->active ? m->active->linear : NULL,
+                m->num_linear_springs);
+        for(size_t i=0; i < nlinear; i++){
+            struct linear_spring *s = &m->linear_springs[i];
+            if(linear_spring_synthesised(s, m->synthesised)
+                    && linear_spring_active(s, m->positions))
+                pdb_conect(&b, m->atoms[s->a].id, m->atoms[s->b].id);
         }
         for(size_t i=0; i < m->num_constraints; i++){
             struct constraint *s = &m->constraints[i];
-            struct atom *a = &m->atoms[s->a];
-            struct atom *b = &m->atoms[s->b];
-            if(a->synthesised && b->synthesised){
-                int res = fprintf(out, conect_fmt, a->id, b->id);
-                if(res < 0)
-                    return res;
-                bytes_written += res;
-            }
+            if(m->synthesised[s->a] && m->synthesised[s->b])
+                pdb_conect(&b, m->atoms[s->a].id, m->atoms[s->b].id);
         }
     }
-    bytes_written += fprintf(out, "ENDMDL\n");
-    return bytes_written;
+    pdb_puts(&b, "ENDMDL\n");
+    return pdb_flush(&b) ? -1 : (int)b.written;
+}
+
+/**
+ * Write CONECT records for every enabled linear spring and every constraint
+ * of m. This is written once, before the first model, rather than writing the
+ * active springs with each model.
+ *
+ * \return The number of bytes written, or a negative number on error.
+ */
+int model_pdb_conect(FILE *out, const struct model *m){
+    struct pdb_buffer b;
+    pdb_buffer_init(&b, out);
+    for(size_t i=0; i < m->num_linear_springs; i++){
+        struct linear_spring *s = &m->linear_springs[i];
+        if(s->enabled)
+            pdb_conect(&b, m->atoms[s->a].id, m->atoms[s->b].id);
+    }
+    for(size_t i=0; i < m->num_constraints; i++){
+        struct constraint *s = &m->constraints[i];
+        pdb_conect(&b, m->atoms[s->a].id, m->atoms[s->b].id);
+    }
+    return pdb_flush(&b) ? -1 : (int)b.written;
 }
 
 
@@ -242,64 +755,65 @@ int model_pdb(FILE *out, const struct model *m, bool conect, int *n){
 void model_synth_atom(const struct model *m, size_t idx, double max_angle){
     //We are going to be synthesising this atom:
     struct atom *a = &m->atoms[idx];
+    struct vector *pos = m->positions;
 
     //Try and get the previous two backbone atoms
-    struct atom *prev1 = NULL;
-    struct atom *prev2 = NULL;
+    size_t prev1 = NO_ATOM;
+    size_t prev2 = NO_ATOM;
 
-    for(int i=idx - 1; idx > 0 && i >= 0 && !prev2; i--){
+    for(int i=idx - 1; idx > 0 && i >= 0 && prev2 == NO_ATOM; i--){
         if(m->atoms[i].backbone){
-            if(prev1)
-                prev2 = &m->atoms[i];
+            if(prev1 != NO_ATOM)
+                prev2 = i;
             else
-                prev1 = &m->atoms[i];
+                prev1 = i;
         }
     }
 
-    a->synthesised = true;
-    if(!prev1 && !prev2){
+    m->synthesised[idx] = true;
+    if(prev1 == NO_ATOM && prev2 == NO_ATOM){
         //If this is the first atom, just plonk it down
-        vector_zero(&a->position);
-    }else if(prev1 && !prev2){
+        vector_zero(&pos[idx]);
+    }else if(prev1 != NO_ATOM && prev2 == NO_ATOM){
         //If this is the second atom, just plonk it down near the z-axis for a
         //backbone atom, or on the x-y plane for a non-backbone atom.
 
         //First, find the required distance between this and the previous atom
-        struct atom *place_near = prev1;
-        double separation = model_get_separation(m, a, prev1, &place_near);
+        size_t place_near = prev1;
+        double separation = model_get_separation(m, idx, prev1, &place_near);
 
         struct vector unit_offset;
         if(a->backbone){
             //Get a unit vector near the z-axis
-            vector_rand(&unit_offset, 0, max_angle / 180 * M_PI);
+            vector_rand(&unit_offset, 0, max_angle / 180 * M_PI, m->rng);
         }else{
             //Get a unit vector along the x-y axis
             vector_rand(&unit_offset,
                     (90 - max_angle) / 180 * M_PI,
-                    (90 + max_angle) / 180 * M_PI);
+                    (90 + max_angle) / 180 * M_PI, m->rng);
         }
 
         //Multiply by the distance
         vmul_by(&unit_offset, separation);
 
         //Add to the previous atom's coordinates
-        vadd_to(&unit_offset, &place_near->position);
+        vadd_to(&unit_offset, &pos[place_near]);
 
         //Copy into the new atom's coords
-        vector_copy_to(&a->position, &unit_offset);
+        vector_copy_to(&pos[idx], &unit_offset);
     }else{
 
         //We want to do the same as before, but then we want to rotate it such
         //that the vector between the previous two atoms is the new z-axis.
-        struct atom *place_near = prev1;
-        double separation = model_get_separation(m, a, prev1, &place_near);
+        size_t place_near = prev1;
+        double separation = model_get_separation(m, idx, prev1, &place_near);
         struct vector unit_offset;
         if(a->backbone){
-            vector_rand(&unit_offset, 0, max_angle / 180 * M_PI);
+            vector_rand(&unit_offset, 0, max_angle / 180 * M_PI, m->rng);
         }else{
             vector_rand(&unit_offset,
                     (90 - max_angle) / 180 * M_PI,
-                    (90 + max_angle) / 180 * M_PI);
+                    (90 + max_angle) / 180 * M_PI, m->rng);
         }
         vmul_by(&unit_offset, separation);
 
@@ -310,14 +824,14 @@ void model_synth_atom(const struct model *m, size_t idx, double max_angle){
         struct vector displacement;
         struct vector rot_axis;
         double angle;
-        vsub(&displacement, &prev1->position, &prev2->position);
+        vsub(&displacement, &pos[prev1], &pos[prev2]);
         vcross(&rot_axis, &displacement, &z);
         vdiv_by(&rot_axis, vmag(&rot_axis));
         angle = acos(vdot(&displacement, &z) / vmag(&displacement));
 
         struct vector vout;
         vrot_axis(&vout, &rot_axis, &unit_offset, -angle);
-        vadd(&a->position, &vout, &place_near->position);
+        vadd(&pos[idx], &vout, &pos[place_near]);
     }
 }
 
@@ -327,45 +841,61 @@ void model_synth_atom(const struct model *m, size_t idx, double max_angle){
 //
 //If no constraint is found, return the sum of the atom radii.
 double model_get_separation(
-        const struct model *restrict m,
-        const struct atom *restrict a,
-        const struct atom *restrict b,
-        struct atom **restrict place_near){
+        const struct model *m,
+        size_t a, size_t b,
+        size_t *place_near){
 
     for(size_t i=0; i < m->num_constraints; i++){
-        struct atom *c_a = &m->atoms[m->constraints[i].a];
-        struct atom *c_b = &m->atoms[m->constraints[i].b];
-        if(a == c_a && c_b->synthesised){
+        size_t c_a = m->constraints[i].a;
+        size_t c_b = m->constraints[i].b;
+        if(a == c_a && m->synthesised[c_b]){
             *place_near = c_b;
             return m->constraints[i].distance;
-        }else if(a == c_b && c_a->synthesised){
+        }else if(a == c_b && m->synthesised[c_a]){
             *place_near = c_a;
             return m->constraints[i].distance;
         }
     }
-    return a->radius + b->radius;
+    return m->atoms[a].radius + m->atoms[b].radius;
 }
 
-void apply_spring_force(struct model *m){
-    struct vector force1, force2;
+/*
+ * The bonded force routines may be called from inside a parallel region, in
+ * which case the loop iterations are shared between the threads and each
+ * thread accumulates into its own forces buffer. When forces is NULL they are
+ * added directly to the atoms.
+ */
+void apply_spring_force(struct model *m, struct vector *forces,
+        enum force_level level){
     struct linear_spring *linear_springs = m->linear_springs;
+    bool all_slow = m->slow_terms & FORCE_LINEAR;
+    size_t nsprings = num_active(m, m->active ? m->active->linear : NULL,
+            m->num_linear_springs);
 
     //Then go through all springs and accumulate forces on the residues
     #ifdef HAVE_OPENMP
-    #pragma omp parallel for shared(linear_springs)
+    #pragma omp for schedule(static)
     #endif
-    for(size_t i=0; i < m->num_linear_springs; i++){
+    for(size_t i=0; i < nsprings; i++){
         struct linear_spring *s = &linear_springs[i];
 
-        if(s->a->synthesised && s->b->synthesised){
-            if(!s->a->fixed || !s->b->fixed)
-                linear_spring_force(&force1, &force2, s);
+        //Weak springs may be evaluated once per RESPA step
+        if(level != ALL_FORCES){
+            bool slow = all_slow || s->constant <= m->slow_spring_constant;
+            if(slow != (level == SLOW_FORCES))
+                continue;
+        }
+
+        if(m->synthesised[s->a] && m->synthesised[s->b]){
+            struct vector force1, force2;
+            if(!m->fixed[s->a] || !m->fixed[s->b])
+                linear_spring_force(&force1, &force2, s, m->positions);
 
-            if(!s->a->fixed)
-                vadd_to(&s->a->force, &force1);
+            if(!m->fixed[s->a])
+                add_force(m, forces, s->a, &force1);
 
-            if(!s->b->fixed)
-                vadd_to(&s->b->force, &force2);
+            if(!m->fixed[s->b])
+                add_force(m, forces, s->b, &force2);
 
             //Print debug information
             if(m->debug)
@@ -374,71 +904,81 @@ void apply_spring_force(struct model *m){
     }
 }
 
-void apply_torsion_force(struct model *m){
+void apply_torsion_force(struct model *m, struct vector *forces){
     struct torsion_spring *torsion_springs = m->torsion_springs;
+    size_t nsprings = num_active(m, m->active ? m->active->torsion : NULL,
+            m->num_torsion_springs);
 
     //Torsion springs
     #ifdef HAVE_OPENMP
-    #pragma omp parallel for shared(torsion_springs)
+    #pragma omp for schedule(static)
     #endif
-    for(size_t i=0; i < m->num_torsion_springs; i++){
+    for(size_t i=0; i < nsprings; i++){
         struct torsion_spring *s = &torsion_springs[i];
 
-        if(s->a1->fixed && s->a2->fixed && s->a3->fixed && s->a4->fixed)
+        if(m->fixed[s->a1] && m->fixed[s->a2]
+                && m->fixed[s->a3] && m->fixed[s->a4])
             continue;
 
-        add_torsion_force(s);
+        add_torsion_force(m, forces, s);
 
         if(m->debug)
             debug_torsion(m, s);
     }
 }
 
-void apply_rama_force(struct model *m){
-    //Ramachandran constraints
-    for(size_t i=0; i < m->num_rama_constraints; i++){
+void apply_rama_force(struct model *m, struct vector *forces){
+    size_t nrama = num_active(m, m->active ? m->active->rama : NULL,
+            m->num_rama_constraints);
+
+    //Ramachandran constraints. Each constraint only updates its own torsion
+    //springs, so these can be shared between threads too.
+    #ifdef HAVE_OPENMP
+    #pragma omp for schedule(static)
+    #endif
+    for(size_t i=0; i < nrama; i++){
         struct rama_constraint *rama = &m->rama_constraints[i];
-        if(rama_is_synthesised(rama)){
-            rama_get_closest(rama);
+        if(rama_is_synthesised(rama, m->synthesised)){
+            rama_get_closest(rama, m->positions);
             if(rama->enabled){
-                add_torsion_force(rama->phi);
-                add_torsion_force(rama->psi);
+                add_torsion_force(m, forces, &rama->phi);
+                add_torsion_force(m, forces, &rama->psi);
             }
         }
     }
 
 }
 
-void apply_angle_force(struct model *m){
+void apply_angle_force(struct model *m, struct vector *forces){
     struct bond_angle_spring *bond_angles = m->bond_angles;
+    size_t nangles = num_active(m, m->active ? m->active->angle : NULL,
+            m->num_bond_angles);
 
     //Bond angle constraints
     #ifdef HAVE_OPENMP
-    #pragma omp parallel for shared(bond_angles)
+    #pragma omp for schedule(static)
     #endif
-    for(size_t i=0; i < m->num_bond_angles; i++){
+    for(size_t i=0; i < nangles; i++){
         struct bond_angle_spring *s = &bond_angles[i];
 
-        if(s->a1->fixed && s->a2->fixed && s->a3->fixed)
+        if(m->fixed[s->a1] && m->fixed[s->a2] && m->fixed[s->a3])
             continue;
 
-        if(s->a1->synthesised
-                && s->a2->synthesised
-                && s->a3->synthesised){
+        if(bond_angle_synthesised(s, m->synthesised)){
 
             struct vector spring_forces[3];
             bond_angle_force(
                     &spring_forces[0],
                     &spring_forces[1],
                     &spring_forces[2],
-                    s);
+                    s, m->positions);
 
-            if(!s->a1->fixed)
-                vadd_to(&s->a1->force, &spring_forces[0]);
-            if(!s->a2->fixed)
-                vadd_to(&s->a2->force, &spring_forces[1]);
-            if(!s->a3->fixed)
-                vadd_to(&s->a3->force, &spring_forces[2]);
+            if(!m->fixed[s->a1])
+                add_force(m, forces, s->a1, &spring_forces[0]);
+            if(!m->fixed[s->a2])
+                add_force(m, forces, s->a2, &spring_forces[1]);
+            if(!m->fixed[s->a3])
+                add_force(m, forces, s->a3, &spring_forces[2]);
 
             //Print debug information
             if(m->debug)
@@ -452,39 +992,46 @@ void apply_drag_force(struct model *m){
     //If we're not using the fancy drag force, apply the drag force now.
     if(!m->shield_drag){
         for(size_t i=0; i < m->num_atoms; i++){
-            vector_copy_to(&tmp, &m->atoms[i].velocity);
+            vector_copy_to(&tmp, &m->velocities[i]);
             vmul_by(&tmp, m->drag_coefficient);
-            vadd_to(&m->atoms[i].force, &tmp);
+            vadd_to(&m->forces[i], &tmp);
         }
     }
 }
 
 double model_energy(struct model *m){
     double energy = 0;
-
-    for(size_t i = 0; i < m->num_linear_springs; i++)
-        if(linear_spring_synthesised(&m->linear_springs[i]))
-            if(linear_spring_active(&m->linear_springs[i]))
-                energy += linear_spring_energy(&m->linear_springs[i]);
-
-    for(size_t i = 0; i < m->num_bond_angles; i++)
-        if(bond_angle_synthesised(&m->bond_angles[i]))
-            energy += bond_angle_energy(&m->bond_angles[i]);
-
-    for(size_t i = 0; i < m->num_torsion_springs; i++)
-        if(torsion_spring_synthesised(&m->torsion_springs[i]))
-            energy += torsion_spring_energy(&m->torsion_springs[i]);
+    struct active_set *act = m->active;
+    size_t nlinear  = num_active(m, act ? act->linear : NULL,
+            m->num_linear_springs);
+    size_t nangles  = num_active(m, act ? act->angle : NULL,
+            m->num_bond_angles);
+    size_t ntorsion = num_active(m, act ? act->torsion : NULL,
+            m->num_torsion_springs);
+
+    struct vector *pos = m->positions;
+    bool *synth = m->synthesised;
+
+    for(size_t i = 0; i < nlinear; i++)
+        if(linear_spring_synthesised(&m->linear_springs[i], synth))
+            if(linear_spring_active(&m->linear_springs[i], pos))
+                energy += linear_spring_energy(&m->linear_springs[i], pos);
+
+    for(size_t i = 0; i < nangles; i++)
+        if(bond_angle_synthesised(&m->bond_angles[i], synth))
+            energy += bond_angle_energy(&m->bond_angles[i], pos);
+
+    for(size_t i = 0; i < ntorsion; i++)
+        if(torsion_spring_synthesised(&m->torsion_springs[i], synth))
+            energy += torsion_spring_energy(&m->torsion_springs[i], pos);
 
     return energy;
 }
 
 double constraint_energy(struct constraint *c, struct model *m){
     //Model this as a quadratic potential with a high constant
-    struct atom *a = &m->atoms[c->a];
-    struct atom *b = &m->atoms[c->b];
-
     struct vector displacement;
-    vsub(&displacement, &a->position, &b->position);
+    vsub(&displacement, &m->positions[c->a], &m->positions[c->b]);
     double distance = vmag(&displacement);
 
     double k = 1;
@@ -494,11 +1041,8 @@ double constraint_energy(struct constraint *c, struct model *m){
 
 void constraint_force(struct constraint *c, struct model *m){
     //Model this as a quadratic potential with a high constant
-    struct atom *a = &m->atoms[c->a];
-    struct atom *b = &m->atoms[c->b];
-
     struct vector displacement;
-    vsub(&displacement, &a->position, &b->position);
+    vsub(&displacement, &m->positions[c->a], &m->positions[c->b]);
     double distance = vmag(&displacement);
 
     double k = 1;
@@ -508,14 +1052,12 @@ void constraint_force(struct constraint *c, struct model *m){
     vmul(&force_a, &displacement, -dr * k);
     vmul(&force_b, &force_a, -1);
 
-    vadd_to(&a->force, &force_a);
-    vadd_to(&b->force, &force_b);
+    vadd_to(&m->forces[c->a], &force_a);
+    vadd_to(&m->forces[c->b], &force_b);
 }
 
 bool constraint_is_synthesised(struct constraint *c, struct model *m){
-    struct atom *a = &m->atoms[c->a];
-    struct atom *b = &m->atoms[c->b];
-    return a->synthesised && b->synthesised;
+    return m->synthesised[c->a] && m->synthesised[c->b];
 }
 
 static int m_i = 0;
@@ -536,18 +1078,19 @@ void model_minim(struct model *m){
     //Total distance moved by all atoms
     double moved;
 
+    //Get the direction to move in. We are just going to use the negative
+    //gradient for a simple steepest descent algorithm.
+    size_t scratch_used = m->scratch.used;
+    struct vector *p = model_scratch(m, sizeof(*p) * m->num_atoms);
+    //We will also store the initial position.
+    struct vector *r = model_scratch(m, sizeof(*r) * m->num_atoms);
+
     int n = 0;
     do {
         //Just bail out if we try more than a hundred moves
         if(++n > 100)
             break;
 
-        //Get the direction to move in. We are just going to use the negative
-        //gradient for a simple steepest descent algorithm.
-        struct vector p[m->num_atoms];
-        //We will also store the initial position.
-        struct vector r[m->num_atoms];
-
         //Get the initial energy so we can compare it to the energy after any
         //proposed movements to see if the Wolfe conditions are satisfied. More
         //specifically, because we are using the backtracking line search, we check
@@ -572,8 +1115,8 @@ void model_minim(struct model *m){
         }
 
         for(size_t i=0; i < m->num_atoms; i++){
-            vector_copy_to(&p[i], &m->atoms[i].force);
-            vector_copy_to(&r[i], &m->atoms[i].position);
+            vector_copy_to(&p[i], &m->forces[i]);
+            vector_copy_to(&r[i], &m->positions[i]);
             double p_sq = vmag_sq(&p[i]);
             pdot += p_sq;
             total_move += sqrt(p_sq);
@@ -591,6 +1134,7 @@ void model_minim(struct model *m){
         }
         moved = total_move * step_size;
     }while(moved > precision);
+    m->scratch.used = scratch_used;
 }
 
 //Move the model along the direction vector p (with step size alpha), starting at position r.
@@ -599,42 +1143,264 @@ void model_move_along_vector(struct model *m, double alpha,
 
     for(size_t i=0; i < m->num_atoms; i++){
         struct vector dr;
-        vector_copy_to(&m->atoms[i].position, &r[i]);
+        vector_copy_to(&m->positions[i], &r[i]);
         vector_copy_to(&dr, &p[i]);
         vmul_by(&dr, alpha);
-        vadd_to(&m->atoms[i].position, &dr);
+        vadd_to(&m->positions[i], &dr);
     }
 }
 
-//Convenience function for profiling to avoid typing the ifdef out
+//Convenience function for profiling to avoid typing the ifdef out. This may be
+//called by every thread in a parallel region, but only the master thread
+//records the time.
 void profile(struct model *m, const char *msg){
     #ifdef HAVE_CLOCK_GETTIME
+    #ifdef HAVE_OPENMP
+    if(omp_get_thread_num() != 0)
+        return;
+    #endif
     if(m->profiler)
         profile_end(m->profiler, "%g\t%s\t%lld\n", m->time, msg);
     #endif
 }
 
-void model_build_bond_map(struct model *m){
-    //Build a proper 2d array (because we might have a reduced num_atoms to
-    //throw off any row/col calculations)
-    m->bond_map = malloc(sizeof(bool*) * m->num_atoms);
-    for(int i=0; i < m->num_atoms; i++){
-        m->bond_map[i] = malloc(sizeof(bool) * m->num_atoms);
-        for(int j=0; j < m->num_atoms; j++){
-            m->bond_map[i][j] = false;
-        }
+/**
+ * Build the list of atoms bonded to each atom from the constraints. Each row
+ * is sorted and any duplicate bonds are removed.
+ *
+ * \return Non-zero if memory could not be allocated.
+ */
+int model_build_bonds(struct model *m){
+    free(m->bond_start);
+    free(m->bonds);
+    m->bond_start = malloc(sizeof(*m->bond_start) * (m->num_atoms + 1));
+    m->bonds = malloc(sizeof(*m->bonds) * (2 * m->num_constraints + 1));
+    if(!m->bond_start || !m->bonds)
+        goto alloc_err;
+
+    //Count the bonds of each atom, then get the offset of the end of each row
+    for(size_t i=0; i <= m->num_atoms; i++)
+        m->bond_start[i] = 0;
+    for(size_t i=0; i < m->num_constraints; i++){
+        m->bond_start[m->constraints[i].a]++;
+        m->bond_start[m->constraints[i].b]++;
     }
+    for(size_t i=1; i <= m->num_atoms; i++)
+        m->bond_start[i] += m->bond_start[i - 1];
 
-    //Now add bonds for constraints
-    for(int i=0; i < m->num_constraints; i++){
-        struct constraint *c = m->constraints + i;
-        m->bond_map[c->a][c->b] = true;
-        m->bond_map[c->b][c->a] = true;
+    //Fill each row from the back, leaving bond_start[i] at the start of row i
+    for(size_t i=0; i < m->num_constraints; i++){
+        const struct constraint *c = &m->constraints[i];
+        m->bonds[--m->bond_start[c->a]] = c->b;
+        m->bonds[--m->bond_start[c->b]] = c->a;
     }
+
+    //Sort each row (they are only a few atoms long) and remove duplicates.
+    //Rows are moved towards the front as duplicates are removed.
+    size_t len = 0;
+    for(size_t i=0; i < m->num_atoms; i++){
+        size_t begin = m->bond_start[i], end = m->bond_start[i + 1];
+        for(size_t p=begin + 1; p < end; p++){
+            uint32_t b = m->bonds[p];
+            size_t q = p;
+            for(; q > begin && m->bonds[q - 1] > b; q--)
+                m->bonds[q] = m->bonds[q - 1];
+            m->bonds[q] = b;
+        }
+
+        m->bond_start[i] = len;
+        for(size_t p=begin; p < end; p++)
+            if(p == begin || m->bonds[p] != m->bonds[len - 1])
+                m->bonds[len++] = m->bonds[p];
+    }
+    m->bond_start[m->num_atoms] = len;
+    return 0;
+
+alloc_err:
+    free(m->bond_start);
+    free(m->bonds);
+    m->bond_start = NULL;
+    m->bonds = NULL;
+    return 1;
 }
 
-bool model_is_bonded(struct model *m, int i, int j){
-    if(!m->bond_map)
+bool model_is_bonded(const struct model *m, size_t i, size_t j){
+    if(!m->bond_start)
         return false;
-    return m->bond_map[i][j];
+    //Rows are sorted, so we can stop at the first atom not below j
+    for(size_t p=m->bond_start[i]; p < m->bond_start[i + 1]; p++)
+        if(m->bonds[p] >= j)
+            return m->bonds[p] == j;
+    return false;
+}
+
+
+//Number of terms of one kind that can be active in the model. If no active set
+//has been built we have to check every term.
+size_t num_active(const struct model *m, const size_t *prefix, size_t total){
+    if(!prefix)
+        return total;
+    return prefix[m->num_atoms];
+}
+
+static size_t max_idx(size_t a, size_t b){
+    return (a > b) ? a : b;
+}
+
+static size_t min_idx(size_t a, size_t b){
+    return (a < b) ? a : b;
+}
+
+//Indices of the highest and lowest atoms referenced by a torsion spring
+static size_t torsion_max_atom(const struct torsion_spring *s){
+    return max_idx(max_idx(s->a1, s->a2), max_idx(s->a3, s->a4));
+}
+
+static size_t torsion_min_atom(const struct torsion_spring *s){
+    return min_idx(min_idx(s->a1, s->a2), min_idx(s->a3, s->a4));
+}
+
+/*
+ * Stable counting sort of an array of terms by keys in the range [0, nkeys).
+ * The prefix array, which must have room for nkeys + 1 entries, is filled so
+ * that prefix[n] is the number of terms with a key less than n. If other is
+ * not NULL it is permuted along with the terms.
+ */
+static int counting_sort(void *terms, size_t nterms, size_t size,
+        const size_t *keys, size_t *other, size_t nkeys, size_t *prefix){
+
+    for(size_t i=0; i <= nkeys; i++)
+        prefix[i] = 0;
+    if(nterms == 0)
+        return 0;
+
+    char *sorted = malloc(nterms * size);
+    size_t *sorted_other = malloc(sizeof(*sorted_other) * nterms);
+    size_t *next = malloc(sizeof(*next) * nkeys);
+    if(!sorted || !sorted_other || !next){
+        free(sorted);
+        free(sorted_other);
+        free(next);
+        return 1;
+    }
+
+    for(size_t i=0; i < nterms; i++)
+        prefix[keys[i] + 1]++;
+    for(size_t i=1; i <= nkeys; i++)
+        prefix[i] += prefix[i-1];
+
+    for(size_t i=0; i < nkeys; i++)
+        next[i] = prefix[i];
+    for(size_t i=0; i < nterms; i++){
+        size_t j = next[keys[i]]++;
+        memcpy(sorted + j * size, (char*)terms + i * size, size);
+        if(other)
+            sorted_other[j] = other[i];
+    }
+    memcpy(terms, sorted, nterms * size);
+    if(other)
+        memcpy(other, sorted_other, nterms * sizeof(*other));
+
+    free(sorted);
+    free(sorted_other);
+    free(next);
+    return 0;
+}
+
+/*
+ * Sort terms by the highest atom index that they reference and then by the
+ * lowest, so that terms touching nearby atoms are next to each other in
+ * memory. On return, prefix[n] is the number of terms whose highest atom is
+ * less than n. The max_keys array is overwritten.
+ */
+static int sort_by_atoms(void *terms, size_t nterms, size_t size,
+        const size_t *min_keys, size_t *max_keys, size_t num_atoms,
+        size_t *prefix){
+    return counting_sort(terms, nterms, size,
+            min_keys, max_keys, num_atoms, prefix)
+        || counting_sort(terms, nterms, size,
+            max_keys, NULL, num_atoms, prefix);
+}
+
+/**
+ * Sort the linear springs, bond angles, torsion springs and Ramachandran
+ * constraints by the atom indices that they reference, and record how many of
+ * each are active for any number of synthesised atoms.
+ *
+ * Atoms are synthesised in order, so after this has been called the force and
+ * energy routines only visit the terms that refer to atoms that exist.
+ *
+ * \return Non-zero on allocation failure.
+ */
+int model_build_active_set(struct model *m){
+    size_t nterms = m->num_linear_springs;
+    if(m->num_bond_angles > nterms)      nterms = m->num_bond_angles;
+    if(m->num_torsion_springs > nterms)  nterms = m->num_torsion_springs;
+    if(m->num_rama_constraints > nterms) nterms = m->num_rama_constraints;
+
+    struct active_set *act = malloc(sizeof(*act));
+    size_t *lo = malloc(sizeof(*lo) * (nterms ? nterms : 1));
+    size_t *hi = malloc(sizeof(*hi) * (nterms ? nterms : 1));
+    if(!act || !lo || !hi)
+        goto alloc_err;
+
+    act->linear  = malloc(sizeof(*act->linear)  * (m->num_atoms + 1));
+    act->angle   = malloc(sizeof(*act->angle)   * (m->num_atoms + 1));
+    act->torsion = malloc(sizeof(*act->torsion) * (m->num_atoms + 1));
+    act->rama    = malloc(sizeof(*act->rama)    * (m->num_atoms + 1));
+    if(!act->linear || !act->angle || !act->torsion || !act->rama)
+        goto free_arrays;
+
+    for(size_t i=0; i < m->num_linear_springs; i++){
+        struct linear_spring *s = &m->linear_springs[i];
+        lo[i] = min_idx(s->a, s->b);
+        hi[i] = max_idx(s->a, s->b);
+    }
+    if(sort_by_atoms(m->linear_springs, m->num_linear_springs,
+                sizeof(*m->linear_springs), lo, hi, m->num_atoms, act->linear))
+        goto free_arrays;
+
+    for(size_t i=0; i < m->num_bond_angles; i++){
+        struct bond_angle_spring *s = &m->bond_angles[i];
+        lo[i] = min_idx(min_idx(s->a1, s->a2), s->a3);
+        hi[i] = max_idx(max_idx(s->a1, s->a2), s->a3);
+    }
+    if(sort_by_atoms(m->bond_angles, m->num_bond_angles,
+                sizeof(*m->bond_angles), lo, hi, m->num_atoms, act->angle))
+        goto free_arrays;
+
+    for(size_t i=0; i < m->num_torsion_springs; i++){
+        lo[i] = torsion_min_atom(&m->torsion_springs[i]);
+        hi[i] = torsion_max_atom(&m->torsion_springs[i]);
+    }
+    if(sort_by_atoms(m->torsion_springs, m->num_torsion_springs,
+                sizeof(*m->torsion_springs), lo, hi, m->num_atoms,
+                act->torsion))
+        goto free_arrays;
+
+    for(size_t i=0; i < m->num_rama_constraints; i++){
+        struct rama_constraint *r = &m->rama_constraints[i];
+        lo[i] = min_idx(torsion_min_atom(&r->phi), torsion_min_atom(&r->psi));
+        hi[i] = max_idx(torsion_max_atom(&r->phi), torsion_max_atom(&r->psi));
+    }
+    if(sort_by_atoms(m->rama_constraints, m->num_rama_constraints,
+                sizeof(*m->rama_constraints), lo, hi, m->num_atoms,
+                act->rama))
+        goto free_arrays;
+
+    free(lo);
+    free(hi);
+    m->active = act;
+    return 0;
+
+free_arrays:
+    free(act->linear);
+    free(act->angle);
+    free(act->torsion);
+    free(act->rama);
+alloc_err:
+    free(act);
+    free(lo);
+    free(hi);
+    return 1;
 }
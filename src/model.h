@@ -2,22 +2,139 @@
 #define MODEL_H_
 
 #include <stddef.h>
+#include <stdint.h>
 #include <stdbool.h>
 #include <stdio.h>
 
 struct residue;
 struct profile;
 struct model_debug;
+struct vector;
+struct rng;
+struct lanes;
 
 #define DEFAULT_MAX_SYNTH_ANGLE 10
 struct steric_grid;
 
 struct constraint {
     //Atom indices
-    size_t a, b;
+    uint32_t a, b;
     float distance;
 };
 
+/**
+ * Force terms, which can be evaluated once per step of the RESPA integrator
+ * rather than on every inner step.
+ */
+enum force_term {
+    FORCE_UNKNOWN = 0,
+    FORCE_LINEAR  = 1 << 0,
+    FORCE_TORSION = 1 << 1,
+    FORCE_RAMA    = 1 << 2,
+    FORCE_ANGLE   = 1 << 3,
+    FORCE_STERIC  = 1 << 4,
+    FORCE_WATER   = 1 << 5,
+    FORCE_DRAG    = 1 << 6
+};
+
+///Terms accumulated by model_accumulate_forces_level
+enum force_level {
+    ///Every term
+    ALL_FORCES,
+    ///Terms evaluated on every inner step of the RESPA integrator
+    FAST_FORCES,
+    ///Terms evaluated once per RESPA step
+    SLOW_FORCES
+};
+
+///Method used to satisfy the hard constraints
+enum constraint_solver {
+    ///Sweep over the constraints in order
+    SERIAL_SOLVER,
+    ///Sweep over colour classes of constraints that share no atoms
+    COLOURED_SOLVER,
+    ///Direct banded solve of the linearised constraints
+    CHAIN_SOLVER,
+    UNKNOWN_SOLVER
+};
+
+///Integrators that can be selected with the "integrator" key
+enum integrator_type {
+    ///Velocity Verlet with RATTLE constraints
+    RATTLE_INTEGRATOR,
+    ///Leapfrog with SHAKE constraints
+    LEAPFROG_INTEGRATOR,
+    ///Fourth-order Runge-Kutta, projected onto the constraints
+    RK4_INTEGRATOR,
+    UNKNOWN_INTEGRATOR
+};
+
+/**
+ * State of the chain constraint solver.
+ *
+ * The constraints are sorted so that constraints sharing an atom are at most
+ * bandwidth apart, which makes the coupling matrix between the constraints
+ * banded. Row k of the band holds entries (k, k) to (k, k - bandwidth). The
+ * matrix factorised for the velocities at the end of one step is reused for
+ * the positions at the start of the next.
+ */
+struct constraint_chain {
+    size_t bandwidth;
+    ///Lower band of the coupling matrix and then of its Cholesky factor
+    double *band;
+    ///Multiplier of each constraint from the last step, used as a warm start
+    double *lambda;
+    ///Right-hand side and solution of the banded system
+    double *rhs;
+    ///Whether each constraint was active, and which of its atoms were fixed,
+    //when the matrix was last factorised
+    uint8_t *state;
+    ///Whether band holds a valid factorisation
+    bool factorised;
+    /** Whether the factorisation was made at the current positions, which is
+     * only so between solving for the velocities and the next positions */
+    bool current;
+    ///Whether the fallback to the serial solver has been reported
+    bool warned;
+};
+
+/**
+ * Prefix counts of the bonded terms that can act on a partially-synthesised
+ * model.
+ *
+ * Terms are sorted by the highest atom index that they reference, so when the
+ * first n atoms have been synthesised only the first linear[n] linear springs,
+ * angle[n] bond angles, etc. can possibly apply. Each array has num_atoms + 1
+ * entries.
+ */
+struct active_set {
+    size_t *linear;
+    size_t *angle;
+    size_t *torsion;
+    size_t *rama;
+};
+
+///Number of vectors per atom in the scratch space
+#define SCRATCH_VECTORS 6
+///Number of flags per atom in the scratch space
+#define SCRATCH_FLAGS 4
+///Number of scratch allocations that may be held at once
+#define SCRATCH_ALLOCS 8
+///Alignment of each scratch allocation
+#define SCRATCH_ALIGN 64
+
+/**
+ * Scratch space for the per-atom temporaries of the integrators, minimiser
+ * and constraint solvers. Memory is taken from the start of base in order and
+ * given back by resetting used, so routines may nest as long as they give
+ * back everything they take.
+ */
+struct scratch {
+    char *base;
+    size_t size;
+    size_t used;
+};
+
 /**
  * Represents a model of a protein, with residues and springs.
  */
@@ -41,6 +158,26 @@ struct model {
     struct residue *residues;
     ///Atoms
     struct atom *atoms;
+
+    /* Per-atom state that is touched on every step is stored in separate
+     * arrays indexed by atom rather than in struct atom, so that the force and
+     * integration loops stream through contiguous memory. These are allocated
+     * along with the atoms by model_alloc_atoms. */
+
+    ///Atomic positions
+    struct vector *positions;
+    ///Atomic velocities
+    struct vector *velocities;
+    ///Force acting on each atom
+    struct vector *forces;
+    ///Slow forces, if the RESPA integrator is being used
+    struct vector *slow_forces;
+    ///Reciprocal of the mass of each atom
+    double *inv_masses;
+    ///Whether each atom is fixed in place
+    bool *fixed;
+    ///Whether each atom has been synthesised
+    bool *synthesised;
     ///Linear springs
     struct linear_spring *linear_springs;
     ///Torsion springs
@@ -51,6 +188,15 @@ struct model {
     struct rama_constraint *rama_constraints;
     ///Hard constraints
     struct constraint *constraints;
+    ///Solver used to satisfy the hard constraints
+    enum constraint_solver constraint_solver;
+    /** Number of colour classes of the constraints. Constraints
+     * colour_start[k] to colour_start[k+1] - 1 share no atoms. Only set for
+     * the coloured solver. */
+    size_t num_colours;
+    size_t *colour_start;
+    ///State of the chain solver, or NULL if it is not being used
+    struct constraint_chain *chain;
 
     ///Current time
     double time;
@@ -58,6 +204,28 @@ struct model {
     double until;
     ///Timestep
     double timestep;
+    ///Integrator used to advance the model
+    enum integrator_type integrator;
+    /** Number of inner steps of length timestep in each step of the RESPA
+     * integrator. If this is 1, every force is evaluated on every step. */
+    int respa_steps;
+    ///Terms evaluated once per RESPA step, from enum force_term
+    unsigned slow_terms;
+    ///Linear springs no stiffer than this are evaluated once per RESPA step
+    double slow_spring_constant;
+    /** Whether the timestep is adjusted by rattle_adaptive_push as the
+     * simulation runs, between min_timestep and max_timestep. */
+    bool adaptive_timestep;
+    double min_timestep;
+    double max_timestep;
+    ///The timestep is reduced if an atom moves further than this in a step
+    double max_displacement;
+    ///...or the constraint solver takes more than this many iterations
+    int max_constraint_iterations;
+    ///...or the mean kinetic energy of the moving atoms exceeds this
+    double max_kinetic_energy;
+    ///Number of steps since the adaptive timestep was last changed
+    int stable_steps;
     ///Time between residues being synthesised
     double synth_time;
     ///Drag coefficient
@@ -71,6 +239,8 @@ struct model {
     bool use_sterics;
     ///Enable / disable water effect
     bool use_water;
+    ///Skin distance added to the neighbour lists used by the steric grid
+    double verlet_skin;
 
     ///Maximum synthesis angle for new residues
     double max_synth_angle;
@@ -110,22 +280,55 @@ struct model {
     ///Optional profiler
     struct profile *profiler;
 
-    ///Map of bonds. To check if (i, j) are bonded, check the i,jth cell.
-    bool **bond_map;
+    /** Atoms joined by a constraint, in compressed sparse row form. The atoms
+     * bonded to atom i are bonds[bond_start[i]] to bonds[bond_start[i+1] - 1],
+     * in ascending order. If bond_start is NULL, no atoms are bonded. */
+    size_t *bond_start;
+    uint32_t *bonds;
+
+    ///Terms that are active for a given number of synthesised atoms. If this
+    //is NULL, every term is checked on every step.
+    struct active_set *active;
+
+    ///Per-thread force buffers used when accumulating forces in parallel.
+    struct vector *thread_forces;
+    ///Number of vectors allocated in thread_forces.
+    size_t thread_forces_sz;
+
+    ///Scratch space, sized for every atom in the model
+    struct scratch scratch;
+
+    ///Random number generator
+    struct rng *rng;
+
+    /** If the model was loaded from a compiled image, the mapping of that
+     * image. The residues and bonded terms point into the mapping rather than
+     * being allocated separately. */
+    void *image;
+    size_t image_size;
 };
 
 struct model *model_alloc();
 void model_free(struct model *m);
+int model_alloc_atoms(struct model *m, size_t natoms);
+struct model *model_replicate(const struct model *m, unsigned int seed);
+void model_free_replica(struct model *r);
+void *model_scratch(struct model *m, size_t size);
 
 void model_accumulate_forces(struct model *m);
+void model_accumulate_forces_level(struct model *m, enum force_level level);
+enum force_term model_parse_force_term(const char *name);
+void model_accumulate_forces_lanes(struct lanes *l);
 int model_pdb(FILE *out, const struct model *m, bool conect, int *n);
+int model_pdb_conect(FILE *out, const struct model *m);
 void model_synth(struct model *state, const struct model *m);
 
 void model_synth_atom(const struct model *m, size_t idx, double max_angle);
 double model_energy(struct model *m);
 void model_minim(struct model *m);
-void model_build_bond_map(struct model *m);
-bool model_is_bonded(struct model *m, int i, int j);
+int model_build_bonds(struct model *m);
+bool model_is_bonded(const struct model *m, size_t i, size_t j);
+int model_build_active_set(struct model *m);
 
 #endif /* MODEL_H_ */
 
@@ -0,0 +1,190 @@
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <math.h>
+
+#ifdef HAVE_CONFIG_H
+#include <config.h>
+#endif
+
+#include "pdb.h"
+#include "vector.h"
+
+const char *atom_fmt   = "ATOM  %5d  %-3s %-3s  %4d%1s   %8.3f%8.3f%8.3f\n";
+const char *conect_fmt = "CONECT% 5d% 5d\n";
+
+void pdb_buffer_init(struct pdb_buffer *b, FILE *out){
+    b->out = out;
+    b->len = 0;
+    b->written = 0;
+    b->error = false;
+}
+
+/**
+ * Write the contents of the buffer to the output file.
+ *
+ * \return Non-zero if this or any earlier write failed.
+ */
+int pdb_flush(struct pdb_buffer *b){
+    if(b->len && fwrite(b->data, 1, b->len, b->out) != b->len)
+        b->error = true;
+    b->written += b->len;
+    b->len = 0;
+    return b->error ? -1 : 0;
+}
+
+//Make sure there is space for a record in the buffer
+static char *reserve(struct pdb_buffer *b){
+    if(b->len + PDB_LINE_MAX > PDB_BUFFER_SIZE)
+        pdb_flush(b);
+    return b->data + b->len;
+}
+
+//Write s, padded with spaces on the right to width characters
+static char *put_str(char *p, const char *s, int width){
+    int len = 0;
+    while(*s){
+        *p++ = *s++;
+        len++;
+    }
+    for(; len < width; len++)
+        *p++ = ' ';
+    return p;
+}
+
+/*
+ * Write x, padded with spaces on the left to width characters. If space_sign
+ * is set, positive numbers are preceded by a space, as with the "% d"
+ * conversion.
+ */
+static char *put_int(char *p, long long x, int width, bool space_sign){
+    char digits[24];
+    int ndigits = 0;
+    unsigned long long u = x < 0
+        ? -(unsigned long long)x
+        : (unsigned long long)x;
+    do {
+        digits[ndigits++] = '0' + u % 10;
+        u /= 10;
+    } while(u);
+
+    int len = ndigits + (x < 0 || space_sign);
+    for(; len < width; len++)
+        *p++ = ' ';
+    if(x < 0)
+        *p++ = '-';
+    else if(space_sign)
+        *p++ = ' ';
+    while(ndigits)
+        *p++ = digits[--ndigits];
+    return p;
+}
+
+/*
+ * Write x as the "%8.3f" conversion would. Returns NULL if x is too large, or
+ * so close to halfway between two multiples of 0.001 that rounding x * 1000
+ * might not give the same result as printf.
+ */
+static char *put_fixed(char *p, double x){
+    double scaled = x * 1000;
+    if(!isless(fabs(scaled), 1e9))
+        return NULL;
+    double frac = scaled - floor(scaled);
+    if(fabs(frac - 0.5) < 1e-6)
+        return NULL;
+
+    long long q = llabs(llround(scaled));
+    char digits[16];
+    int ndigits = 0;
+    for(int i=0; i < 3; i++){
+        digits[ndigits++] = '0' + q % 10;
+        q /= 10;
+    }
+    digits[ndigits++] = '.';
+    do {
+        digits[ndigits++] = '0' + q % 10;
+        q /= 10;
+    } while(q);
+    //Small negative numbers are written as -0.000
+    if(signbit(x))
+        digits[ndigits++] = '-';
+
+    for(int len = ndigits; len < 8; len++)
+        *p++ = ' ';
+    while(ndigits)
+        *p++ = digits[--ndigits];
+    return p;
+}
+
+///Append a string to the buffer.
+void pdb_puts(struct pdb_buffer *b, const char *s){
+    size_t len = strlen(s);
+    while(len){
+        if(b->len == PDB_BUFFER_SIZE)
+            pdb_flush(b);
+        size_t n = PDB_BUFFER_SIZE - b->len;
+        n = len < n ? len : n;
+        memcpy(b->data + b->len, s, n);
+        b->len += n;
+        s += n;
+        len -= n;
+    }
+}
+
+///Append a MODEL record for model number n.
+void pdb_model(struct pdb_buffer *b, unsigned long n){
+    char *p = reserve(b);
+    p = put_str(p, "MODEL     ", 0);
+    p = put_int(p, n, 0, false);
+    *p++ = '\n';
+    b->len = p - b->data;
+}
+
+/**
+ * Append an ATOM record. This is the same as formatting with atom_fmt, but
+ * much faster.
+ */
+void pdb_atom(struct pdb_buffer *b, int id, const char *name,
+        const char *residue, int residue_id, const struct vector *pos){
+    char *start = reserve(b);
+    char *p = start;
+    if(strlen(name) + strlen(residue) < PDB_LINE_MAX / 2){
+        p = put_str(p, "ATOM  ", 0);
+        p = put_int(p, id, 5, false);
+        p = put_str(p, "  ", 0);
+        p = put_str(p, name, 3);
+        p = put_str(p, " ", 0);
+        p = put_str(p, residue, 3);
+        p = put_str(p, "  ", 0);
+        p = put_int(p, residue_id, 4, false);
+        p = put_str(p, "    ", 0);
+        for(size_t i=0; i < N && p; i++)
+            p = put_fixed(p, pos->c[i]);
+    }else{
+        p = NULL;
+    }
+
+    if(p){
+        *p++ = '\n';
+        b->len = p - b->data;
+    }else{
+        //Fall back to printf for anything unusual
+        pdb_flush(b);
+        int len = fprintf(b->out, atom_fmt, id, name, residue, residue_id, " ",
+                pos->c[0], pos->c[1], pos->c[2]);
+        if(len < 0)
+            b->error = true;
+        else
+            b->written += len;
+    }
+}
+
+///Append a CONECT record between atoms a1 and a2.
+void pdb_conect(struct pdb_buffer *b, int a1, int a2){
+    char *p = reserve(b);
+    p = put_str(p, "CONECT", 0);
+    p = put_int(p, a1, 5, true);
+    p = put_int(p, a2, 5, true);
+    *p++ = '\n';
+    b->len = p - b->data;
+}
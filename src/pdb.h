@@ -0,0 +1,43 @@
+#ifndef PDB_H_
+#define PDB_H_
+
+#include <stddef.h>
+#include <stdbool.h>
+#include <stdio.h>
+
+struct vector;
+
+///Size of the buffer in which PDB records are formatted
+#define PDB_BUFFER_SIZE 65536
+///Longest record formatted in the buffer
+#define PDB_LINE_MAX 128
+
+///Format of the ATOM records written to PDB files
+extern const char *atom_fmt;
+///Format of the CONECT records written to PDB files
+extern const char *conect_fmt;
+
+/**
+ * Records are formatted into a buffer, which is written to the output when it
+ * is full or flushed. The formatting is done by hand rather than by printf,
+ * but gives exactly the same output as atom_fmt and conect_fmt.
+ */
+struct pdb_buffer {
+    FILE *out;
+    ///Number of bytes in data
+    size_t len;
+    ///Number of bytes written to out
+    size_t written;
+    bool error;
+    char data[PDB_BUFFER_SIZE];
+};
+
+void pdb_buffer_init(struct pdb_buffer *b, FILE *out);
+void pdb_puts(struct pdb_buffer *b, const char *s);
+void pdb_model(struct pdb_buffer *b, unsigned long n);
+void pdb_atom(struct pdb_buffer *b, int id, const char *name,
+        const char *residue, int residue_id, const struct vector *pos);
+void pdb_conect(struct pdb_buffer *b, int a1, int a2);
+int pdb_flush(struct pdb_buffer *b);
+
+#endif /* PDB_H_ */
@@ -8,13 +8,24 @@
 #include <time.h>
 #include <unistd.h>
 #include "springreader.h"
+#include "image.h"
 #include "model.h"
 #include "rattle.h"
-#include "leapfrog.h"
+#include "rama.h"
+#include "integrator.h"
 #include "sterics.h"
 #include "linear_spring.h"
 #include "record.h"
 #include "debug.h"
+#include "rng.h"
+#include "lanes.h"
+#include "trajectory.h"
+#include "writer.h"
+#include "checkpoint.h"
+
+#ifdef HAVE_OPENMP
+#   include <omp.h>
+#endif
 
 #ifdef HAVE_CLOCK_GETTIME
 #   include "profile.h"
@@ -26,43 +37,110 @@
 
 enum state {FROZEN, NORMAL};
 
+#define DEFAULT_REPLICA_OUTPUT "replica_%d.pdb"
+#define DEFAULT_REPLICA_TRAJECTORY "replica_%d.p2t"
+#define DEFAULT_CHECKPOINT_INTERVAL 10000
+#define STR(x) #x
+#define XSTR(x) STR(x)
+#define LANES_STR XSTR(LANES)
+
 static void debug_file(FILE **f, const char *loc);
+static bool valid_pattern(const char *pattern);
+static int simulate(struct model *model, FILE *out, const unsigned int *seed);
+static int run_replicas(const struct model *model, unsigned int seed);
+static int run_batch(const struct model *model, unsigned int seed,
+        int first, int n);
+static int simulate_lanes(struct model **models, FILE **outs,
+        const unsigned int *seeds, size_t n);
 
 static struct option opts[] = { {"help",     no_argument,       0, 'h'},
     {"snapshot",   required_argument, 0, 's'},
     {"no-connect", no_argument,       0, 'c'},
+    {"conect-once", no_argument,      0, 'O'},
     {"seed",       required_argument, 0, 'r'},
     {"kinetic",    required_argument, 0, 'k'},
     {"debug-linear",  required_argument, 0, 'l'},
     {"debug-angle",   required_argument, 0, 'a'},
     {"debug-torsion", required_argument, 0, 't'},
+    {"compile",    no_argument,       0, 'C'},
+    {"output",     required_argument, 0, 'o'},
+    {"replicas",   required_argument, 0, 'R'},
+    {"threads",    required_argument, 0, 'T'},
+    {"lockstep",   no_argument,       0, 'L'},
+    {"trajectory", no_argument,       0, 'j'},
+    {"write-queue", required_argument, 0, 'Q'},
+    {"checkpoint", required_argument, 0, 'K'},
+    {"checkpoint-every", required_argument, 0, 'E'},
+    {"restart",    required_argument, 0, 'X'},
 #ifdef HAVE_CLOCK_GETTIME
     {"profile", required_argument, 0, 'p'},
 #endif
     {0, 0, 0, 0}
 };
-const char *opt_str = "hs:u:s:k:r:l:a:t:p:";
+const char *opt_str = "hs:u:s:k:r:l:a:t:p:o:R:T:";
 
 const char *usage_str =
 "Usage: poing [OPTIONS] <SPEC>\n"
 "\n"
 "Argument SPEC is mandatatory and must be a specification file for a "
-"simulation.\n"
+"simulation, or a model image written with --compile. The specification\n"
+"may be compressed with gzip, and is read from standard input if SPEC is -.\n"
 "Available options:\n"
 "  -h, --help         Display this help message.\n"
+"      --compile      Write SPEC as a model image and exit. Loading the image\n"
+"                     is much faster than parsing the specification.\n"
+"  -o, --output=F     Write snapshots to F rather than standard output. With\n"
+"                     --compile, write the model image to F rather than\n"
+"                     SPEC.p2m. With --replicas, F must contain one %d, which\n"
+"                     is replaced by the replica number (default\n"
+"                     " DEFAULT_REPLICA_OUTPUT ", or " DEFAULT_REPLICA_TRAJECTORY " with\n"
+"                     --trajectory).\n"
+"      --replicas=N   Simulate N replicas of the model at once, sharing the\n"
+"                     topology. Replica i uses seed S + i - 1.\n"
+"      --threads=T    Use T threads. Replicas are spread across the threads,\n"
+"                     each of which runs one replica at a time.\n"
+"      --lockstep     Step the replicas in batches of " LANES_STR ", calculating\n"
+"                     the bonded forces for each batch together.\n"
 "  -s, --snapshot=N   Write a PDB snapshot every N steps.\n"
+"      --trajectory   Write the snapshots as a compressed binary trajectory\n"
+"                     rather than PDB. Snapshots may be extracted from the\n"
+"                     trajectory with poing2-traj.\n"
+"      --write-queue=N Queue up to N snapshots to be written by a separate\n"
+"                     thread (default " XSTR(DEFAULT_WRITER_FRAMES) "). If N is 0, snapshots are\n"
+"                     written by the simulation thread.\n"
+"      --checkpoint=F Save the state of the simulation to F periodically, so\n"
+"                     that it can be resumed with --restart.\n"
+"      --checkpoint-every=N\n"
+"                     Save a checkpoint every N steps (default " XSTR(DEFAULT_CHECKPOINT_INTERVAL) ").\n"
+"      --restart=F    Resume the simulation of SPEC from checkpoint F. The\n"
+"                     remaining snapshots are exactly those of the original\n"
+"                     run.\n"
 "  -r, --seed=S       Use fixed random seed S.\n"
 "  -k, --kinetic=F    Write kinetic energies to file F.\n"
 "      --no-connect   Do not print CONECT records for each spring.\n"
+"      --conect-once  Print CONECT records for every spring once, before the\n"
+"                     first snapshot, rather than for the active springs in\n"
+"                     each snapshot.\n"
 #ifdef HAVE_CLOCK_GETTIME
 "  -p, --profile=F    Write profiling information to file F.\n"
 #endif
 ;
 int snapshot = -1;
 bool print_connect = true;
+bool conect_once = false;
 bool fixed_seed = false;
 unsigned int random_seed = 0;
 char *kinetic = NULL;
+bool compile = false;
+char *output = NULL;
+int replicas = 1;
+int nthreads = 0;
+bool lockstep = false;
+bool trajectory = false;
+int write_frames = DEFAULT_WRITER_FRAMES;
+char *checkpoint_file = NULL;
+int checkpoint_every = DEFAULT_CHECKPOINT_INTERVAL;
+char *restart_file = NULL;
 FILE *profile_file = NULL;
 
 bool do_debug = false;
@@ -90,6 +168,9 @@ char * get_options(int argc, char **argv){
             case 'c':
                 print_connect = false;
                 break;
+            case 'O':
+                conect_once = true;
+                break;
             case 'r':
                 fixed_seed = true;
                 random_seed = atoi(optarg);
@@ -97,6 +178,44 @@ char * get_options(int argc, char **argv){
             case 'k':
                 kinetic = optarg;
                 break;
+            case 'C':
+                compile = true;
+                break;
+            case 'o':
+                output = optarg;
+                break;
+            case 'R':
+                replicas = atoi(optarg);
+                if(replicas < 1)
+                    usage("Number of replicas must be positive.", 2);
+                break;
+            case 'L':
+                lockstep = true;
+                break;
+            case 'j':
+                trajectory = true;
+                break;
+            case 'Q':
+                write_frames = atoi(optarg);
+                if(write_frames < 0)
+                    usage("Write queue length must not be negative.", 2);
+                break;
+            case 'K':
+                checkpoint_file = optarg;
+                break;
+            case 'E':
+                checkpoint_every = atoi(optarg);
+                if(checkpoint_every < 1)
+                    usage("Checkpoint interval must be positive.", 2);
+                break;
+            case 'X':
+                restart_file = optarg;
+                break;
+            case 'T':
+                nthreads = atoi(optarg);
+                if(nthreads < 1)
+                    usage("Number of threads must be positive.", 2);
+                break;
             case 'l':
                 debug_file(&debug_opts.linear, optarg);
                 break;
@@ -117,9 +236,37 @@ char * get_options(int argc, char **argv){
     }
     if(optind >= argc)
         usage("No specification file supplied.", 2);
+    if(replicas > 1){
+        if(do_debug || profile_file)
+            usage("Debugging and profiling are not supported with replicas.", 2);
+        if(checkpoint_file || restart_file)
+            usage("Checkpoints are not supported with replicas.", 2);
+        if(output && !valid_pattern(output))
+            usage("Replica output must contain exactly one %d.", 2);
+    }else if(trajectory && !output && !compile && isatty(STDOUT_FILENO)){
+        usage("Refusing to write a binary trajectory to a terminal.", 2);
+    }
     return argv[optind];
 }
 
+/**
+ * Check that pattern is safe to use as a format string for a single int: it
+ * must contain exactly one %d and no other conversions except %%.
+ */
+bool valid_pattern(const char *pattern){
+    int nconv = 0;
+    for(const char *c = pattern; *c; c++){
+        if(*c != '%')
+            continue;
+        c++;
+        if(*c == 'd')
+            nconv++;
+        else if(*c != '%')
+            return false;
+    }
+    return nconv == 1;
+}
+
 void debug_file(FILE **f, const char *loc){
     do_debug = true;
     *f = fopen(loc, "w");
@@ -135,10 +282,30 @@ int main(int argc, char **argv){
 #endif
     /* Get options and whatnot */
     char * spec = get_options(argc, argv);
-    struct model *model = springreader_parse_file(spec);
+    struct model *model = image_is_image(spec)
+        ? image_read(spec)
+        : springreader_parse_file(spec);
     if(!model)
         return 2;
-    model_build_bond_map(model);
+
+    if(compile){
+        char image[strlen(spec) + sizeof(".p2m")];
+        sprintf(image, "%s.p2m", spec);
+        int retval = image_write(output ? output : image, model);
+        model_free(model);
+        rama_free_data();
+        return retval;
+    }
+    if(model_build_bonds(model)){
+        fprintf(stderr, "Error allocating bond list\n");
+        return 1;
+    }
+    if(rattle_init_solver(model))
+        return 1;
+    if(model_build_active_set(model)){
+        fprintf(stderr, "Error allocating active set\n");
+        return 1;
+    }
 
     //Set up debugging if any of the debug params was set
     if(do_debug){
@@ -147,13 +314,7 @@ int main(int argc, char **argv){
         debug_begin(model);
     }
 
-    if(!fixed_seed){
-        unsigned int seed = time(NULL) * getpid();
-        srand(seed);
-        printf("REMARK RANDOM SEED %u\n", seed);
-    }else{
-        srand(random_seed);
-    }
+    unsigned int seed = fixed_seed ? random_seed : time(NULL) * getpid();
 
     /* Open output file for kinetic energy if specified. */
     FILE *kinetic_out = NULL;
@@ -165,83 +326,392 @@ int main(int argc, char **argv){
         }
     }
 
+    int retval;
+    if(replicas > 1){
+        if(lockstep && !integrator_get(model)->push_lanes){
+            fprintf(stderr, "Only the RATTLE integrator with a fixed timestep "
+                    "can be used with --lockstep.\n");
+            exit(1);
+        }
+        retval = run_replicas(model, seed);
+    }else{
+        FILE *out = stdout;
+        if(output && !(out = fopen(output, "w"))){
+            perror("Couldn't open output file");
+            exit(1);
+        }
+        rng_seed(model->rng, seed);
 
-    /* Initialise steric grid if it is being used. */
-    struct steric_grid *steric_grid = NULL;
-    if(model->use_sterics || model->use_water || model->shield_drag){
-        steric_grid = malloc(sizeof(*steric_grid));
-        steric_grid_init(steric_grid, 100, 6.03, model->num_atoms);
-        model->steric_grid = steric_grid;
+        #ifdef HAVE_OPENMP
+        if(nthreads > 0)
+            omp_set_num_threads(nthreads);
+        #endif
+
+        #ifdef HAVE_CLOCK_GETTIME
+        //Start a profiler if required
+        struct profile profiler;
+        if(profile_file){
+            model->profiler = &profiler;
+            profile_init(model->profiler, profile_file);
+        }
+        #endif
+
+        retval = simulate(model, out,
+                fixed_seed || restart_file ? NULL : &seed);
+        if(output)
+            fclose(out);
     }
+    model_free(model);
+    return retval;
+}
+
+/*
+ * The state of a single simulation: the current state of the model, where its
+ * snapshots are written and the positions recorded to decide which atoms to
+ * fix.
+ */
+struct run {
+    struct model *model;
+    struct model state;
+    FILE *out;
+    ///Trajectory written to out if --trajectory was given
+    struct trajectory traj;
+    struct writer writer;
+    struct steric_grid *steric_grid;
+    struct record prev_positions;
+    int steps_per_record;
+    int num_snapshots;
+    ///Checkpoints written to checkpoint_file if it is set
+    struct checkpointer checkpoint;
+    int num_checkpoints;
+    ///Step from which the simulation starts, which is non-zero on restart
+    int first_step;
+};
+
+/*
+ * Prepare to simulate model, writing snapshots to out. The random seed is
+ * recorded at the start of the output unless seed is NULL.
+ *
+ * The current state of the simulation is a shallow copy of model, so the
+ * positions and other mutable state of model are updated in place.
+ */
+static int run_init(struct run *r, struct model *model, FILE *out,
+        const unsigned int *seed){
+    r->model = model;
+    r->out = out;
+    r->num_snapshots = 0;
+    r->num_checkpoints = 0;
+    r->first_step = 0;
+    checkpoint_init(&r->checkpoint, checkpoint_file);
 
-    #ifdef HAVE_CLOCK_GETTIME
-    //Start a profiler if required
-    struct profile profiler;
-    if(profile_file){
-        model->profiler = &profiler;
-        profile_init(model->profiler, profile_file);
+    if(trajectory){
+        if(trajectory_open(&r->traj, out, model, seed))
+            return 1;
+    }else{
+        if(seed)
+            fprintf(out, "REMARK RANDOM SEED %u\n", *seed);
+        if(print_connect && conect_once)
+            model_pdb_conect(out, model);
     }
-    #endif
+    if(writer_init(&r->writer, model, write_frames, out,
+                trajectory ? &r->traj : NULL, print_connect && !conect_once))
+        goto close_trajectory;
 
-        /* If we're doing a three-state synthesis then fix/unfix residues
-     * and enable/disable springs. */
-    enum state three_state = NORMAL;
+    /* Initialise steric grid if it is being used. */
+    r->steric_grid = NULL;
+    if(model->use_sterics || model->use_water || model->shield_drag){
+        r->steric_grid = malloc(sizeof(*r->steric_grid));
+        if(!r->steric_grid || steric_grid_init(r->steric_grid, model)){
+            fprintf(stderr, "Couldn't allocate steric grid.\n");
+            free(r->steric_grid);
+            writer_finish(&r->writer);
+            goto close_trajectory;
+        }
+        model->steric_grid = r->steric_grid;
+    }
 
     //Make a copy of our model to act as the current state
-    struct model state;
-    memcpy(&state, model, sizeof(state));
-
-    //Count the number of snapshots written
-    int num_snapshots = 0;
+    memcpy(&r->state, model, sizeof(r->state));
 
     //If we are simulating synthesis, the current state will start with no
     //atoms and no residues.
     if(model->do_synthesis){
-        state.num_atoms = 0;
-        state.num_residues = 0;
+        r->state.num_atoms = 0;
+        r->state.num_residues = 0;
     }
 
-    struct record prev_positions;
-    int steps_per_record;
     if(model->fix_before > 0){
         //Calculate how many records to store based on the number of atoms that
         //must be free, the synthesis time and the time between recording
         //positions.
         int nrecords = (model->fix_before * model->synth_time) / model->record_time;
-        steps_per_record = (int)(model->record_time / model->timestep);
-        record_init(&prev_positions, model, nrecords);
+        r->steps_per_record = (int)(model->record_time
+                / (model->timestep * model->respa_steps));
+        if(r->steps_per_record < 1)
+            r->steps_per_record = 1;
+        record_init(&r->prev_positions, model, nrecords);
     }
+    return 0;
 
-    for(int nsteps = 0; state.time < state.until; nsteps++){
-        //Calculate the number of synthesised atoms from the current time
-        int num_synthed = (int)(state.time / state.synth_time) + 1;
+close_trajectory:
+    if(trajectory)
+        trajectory_close(&r->traj);
+    return 1;
+}
 
-        //If we have too few atoms, synthesise the next one
-        if(model->do_synthesis && num_synthed > state.num_atoms && state.num_atoms < model->num_atoms){
-            size_t new_atom_idx = state.num_atoms;
-            state.num_atoms++;
-            state.num_residues = state.atoms[new_atom_idx].residue_idx + 1;
-            model_synth_atom(&state, new_atom_idx, DEFAULT_MAX_SYNTH_ANGLE);
-        }
+/*
+ * Restore the state of the run from a checkpoint, after it has been set up by
+ * run_init.
+ */
+static int run_restore(struct run *r, const char *file){
+    struct checkpoint_counters n;
+    if(checkpoint_restore(file, r->model, &r->state,
+                r->model->fix_before > 0 ? &r->prev_positions : NULL, &n))
+        return 1;
+    r->first_step = n.nsteps;
+    r->num_snapshots = n.num_snapshots;
+    r->num_checkpoints = n.num_checkpoints;
+    r->writer.num_written = n.num_snapshots;
+    return 0;
+}
+
+//Save a checkpoint at the start of step nsteps if one is due.
+static void run_checkpoint(struct run *r, int nsteps){
+    if(!checkpoint_file
+            || nsteps / checkpoint_every <= r->num_checkpoints)
+        return;
+    r->num_checkpoints++;
+    struct checkpoint_counters n = {
+        .nsteps = nsteps,
+        .num_snapshots = r->num_snapshots,
+        .num_checkpoints = r->num_checkpoints,
+    };
+    checkpoint_save(&r->checkpoint, r->model, &r->state,
+            r->model->fix_before > 0 ? &r->prev_positions : NULL, &n);
+}
 
-        //Write PDB file if required
-        if(snapshot > 0 && (int)(state.time / snapshot) > num_snapshots){
-            model_pdb(stdout, &state, print_connect, &num_snapshots);
+//Synthesise any new atoms and write a snapshot if one is due.
+static void run_begin_step(struct run *r){
+    struct model *model = r->model;
+    struct model *state = &r->state;
+
+    //Calculate the number of synthesised atoms from the current time
+    int num_synthed = (int)(state->time / state->synth_time) + 1;
+
+    //If we have too few atoms, synthesise the next one
+    if(model->do_synthesis && num_synthed > state->num_atoms && state->num_atoms < model->num_atoms){
+        size_t new_atom_idx = state->num_atoms;
+        state->num_atoms++;
+        state->num_residues = state->atoms[new_atom_idx].residue_idx + 1;
+        model_synth_atom(state, new_atom_idx, DEFAULT_MAX_SYNTH_ANGLE);
+    }
+
+    //Write PDB file or trajectory frame if required
+    if(snapshot > 0 && (int)(state->time / snapshot) > r->num_snapshots){
+        writer_push(&r->writer, state);
+        r->num_snapshots++;
+    }
+}
+
+/*
+ * Fix any atoms that have stopped moving after step nsteps, which started at
+ * time start. With an adaptive timestep, positions are recorded whenever the
+ * step passes a multiple of the record time rather than every
+ * steps_per_record steps.
+ */
+static void run_end_step(struct run *r, int nsteps, double start){
+    struct model *state = &r->state;
+    struct record *prev_positions = &r->prev_positions;
+    double record_time = r->model->record_time;
+    if(r->model->fix_before <= 0)
+        return;
+
+    bool due = state->adaptive_timestep
+        ? (int)(state->time / record_time) > (int)(start / record_time)
+        : nsteps % r->steps_per_record == 0;
+    if(due){
+        record_add(prev_positions, state);
+        for(size_t i=0; i < state->num_atoms; i++){
+            if(prev_positions->nrecords[i] == prev_positions->max_records)
+                if(prev_positions->avg_jitter[i] < r->model->max_jitter)
+                    state->fixed[i] = true;
         }
+    }
+}
+
+//Returns non-zero if the snapshots or last checkpoint could not be written.
+static int run_free(struct run *r){
+    int retval = writer_finish(&r->writer);
+    if(checkpoint_finish(&r->checkpoint))
+        retval = 1;
+    if(trajectory && trajectory_close(&r->traj))
+        retval = 1;
+    if(r->model->fix_before > 0)
+        record_free(&r->prev_positions);
+    //The state grows its own force buffers after being copied from the model
+    if(r->state.thread_forces != r->model->thread_forces)
+        free(r->state.thread_forces);
+    if(r->steric_grid){
+        steric_grid_free(r->steric_grid);
+        free(r->steric_grid);
+        r->model->steric_grid = NULL;
+    }
+    return retval;
+}
+
+/**
+ * Run the simulation described by model, writing snapshots to out. The random
+ * seed is recorded in the output unless seed is NULL.
+ *
+ * \return Non-zero on error.
+ */
+int simulate(struct model *model, FILE *out, const unsigned int *seed){
+    struct run run;
+    if(run_init(&run, model, out, seed))
+        return 1;
+    if(restart_file && run_restore(&run, restart_file)){
+        run_free(&run);
+        return 1;
+    }
 
-        //Push atoms
-        rattle_push(&state);
+    //A restored state is already in the middle of the integration
+    const struct integrator *integrator = integrator_get(&run.state);
+    if(!restart_file)
+        integrator->init(&run.state);
 
-        if(model->fix_before > 0 && nsteps % steps_per_record == 0){
-            record_add(&prev_positions, &state);
-            for(size_t i=0; i < state.num_atoms; i++){
-                if(prev_positions.nrecords[i] == prev_positions.max_records)
-                    if(prev_positions.avg_jitter[i] < model->max_jitter)
-                        state.atoms[i].fixed = true;
-            }
+    for(int nsteps = run.first_step; run.state.time < run.state.until; nsteps++){
+        double start = run.state.time;
+        run_checkpoint(&run, nsteps);
+        run_begin_step(&run);
+        integrator->push(&run.state);
+        run_end_step(&run, nsteps, start);
+    }
+    integrator->finish(&run.state);
+    return run_free(&run);
+}
+
+/**
+ * Simulate n replicas of the same model in lockstep, writing the snapshots of
+ * each replica to the corresponding entry of outs, preceded by its seed. There
+ * may be no more than LANES replicas.
+ *
+ * \return Non-zero on error.
+ */
+int simulate_lanes(struct model **models, FILE **outs,
+        const unsigned int *seeds, size_t n){
+    struct run runs[LANES];
+    struct model *states[LANES];
+    struct lanes lanes;
+    int retval = 1;
+
+    size_t ninit;
+    for(ninit = 0; ninit < n; ninit++){
+        if(run_init(&runs[ninit], models[ninit], outs[ninit], &seeds[ninit]))
+            goto free_runs;
+        states[ninit] = &runs[ninit].state;
+    }
+    if(lanes_init(&lanes, states, n, models[0]->num_atoms)){
+        fprintf(stderr, "Couldn't allocate lanes.\n");
+        goto free_runs;
+    }
+
+    //Every replica has the same time step, so they all finish together
+    const struct integrator *integrator = integrator_get(models[0]);
+    for(size_t k=0; k < n; k++)
+        integrator->init(states[k]);
+    for(int nsteps = 0; runs[0].state.time < runs[0].state.until; nsteps++){
+        double start = runs[0].state.time;
+        for(size_t k=0; k < n; k++)
+            run_begin_step(&runs[k]);
+        integrator->push_lanes(&lanes);
+        for(size_t k=0; k < n; k++)
+            run_end_step(&runs[k], nsteps, start);
+    }
+    for(size_t k=0; k < n; k++)
+        integrator->finish(states[k]);
+    lanes_free(&lanes);
+    retval = 0;
+
+free_runs:
+    for(size_t k=0; k < ninit; k++)
+        if(run_free(&runs[k]))
+            retval = 1;
+    return retval;
+}
+
+/**
+ * Simulate replicas copies of model, scheduled across nthreads threads. With
+ * --lockstep, the replicas are simulated in batches of LANES, otherwise one at
+ * a time.
+ *
+ * Replica i (counting from zero) is seeded with seed + i and writes its
+ * snapshots to the file named by formatting the output pattern with i + 1.
+ *
+ * \return Non-zero if any replica failed.
+ */
+int run_replicas(const struct model *model, unsigned int seed){
+    int width = lockstep ? LANES : 1;
+    int nbatches = (replicas + width - 1) / width;
+    int failed = 0;
+
+    #ifdef HAVE_OPENMP
+    #pragma omp parallel for schedule(dynamic, 1) reduction(|:failed) \
+        num_threads(nthreads > 0 ? nthreads : omp_get_max_threads())
+    #endif
+    for(int b=0; b < nbatches; b++){
+        #ifdef HAVE_OPENMP
+        //Each batch is simulated by a single thread.
+        omp_set_num_threads(1);
+        #endif
+
+        int first = b * width;
+        int n = (replicas - first < width) ? replicas - first : width;
+        failed |= run_batch(model, seed, first, n);
+    }
+    return failed;
+}
+
+/*
+ * Simulate the n replicas of model starting from replica first, in lockstep
+ * if there is more than one.
+ */
+int run_batch(const struct model *model, unsigned int seed, int first, int n){
+    const char *pattern = output ? output
+        : trajectory ? DEFAULT_REPLICA_TRAJECTORY : DEFAULT_REPLICA_OUTPUT;
+    struct model *models[LANES];
+    FILE *outs[LANES];
+    unsigned int seeds[LANES];
+    int retval = 1;
+
+    int nopen;
+    for(nopen = 0; nopen < n; nopen++){
+        int i = first + nopen;
+        char file[strlen(pattern) + 3 * sizeof(i)];
+        snprintf(file, sizeof(file), pattern, i + 1);
+        outs[nopen] = fopen(file, "w");
+        if(!outs[nopen]){
+            fprintf(stderr, "Couldn't open replica output file %s\n", file);
+            goto free_replicas;
         }
+
+        models[nopen] = model_replicate(model, seed + i);
+        if(!models[nopen]){
+            fprintf(stderr, "Couldn't allocate replica %d\n", i + 1);
+            fclose(outs[nopen]);
+            goto free_replicas;
+        }
+        seeds[nopen] = seed + i;
     }
 
-    model_free(model);
-    return 0;
+    if(n == 1)
+        retval = simulate(models[0], outs[0], &seeds[0]);
+    else
+        retval = simulate_lanes(models, outs, seeds, n);
+
+free_replicas:
+    for(int k=0; k < nopen; k++){
+        fclose(outs[k]);
+        model_free_replica(models[k]);
+    }
+    return retval;
 }
@@ -5,44 +5,125 @@
 #include <error.h>
 #include <string.h>
 #include <ctype.h>
+#include <stdint.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
 #include "rama.h"
 #include "residue.h"
 #include "model.h"
+#include "rng.h"
 
 #define NBINS (360*360)
 
+//Magic number and version at the start of a binary Ramachandran table
+#define RAMA_TABLE_MAGIC "POINGRAM"
+#define RAMA_TABLE_VERSION 1
+
+/*
+ * Coordinates of the closest allowed point for each bin, in degrees from 0 to
+ * 359. Bins inside an allowed region are set to -1.
+ */
 struct phi_psi {
-    double phi, psi;
+    int16_t phi, psi;
 };
 
-struct phi_psi *general     = NULL;
-struct phi_psi *alpha       = NULL;
-struct phi_psi *beta        = NULL;
-struct phi_psi *proline     = NULL;
-struct phi_psi *pre_proline = NULL;
-struct phi_psi *glycine     = NULL;
-struct phi_psi *alanine     = NULL;
-
-static struct phi_psi **rama_data(enum rama_constraint_type type){
-    switch(type){
-        case GENERAL:     return &general;
-        case ALPHA:       return &alpha;
-        case BETA:        return &beta;
-        case PROLINE:     return &proline;
-        case PRE_PROLINE: return &pre_proline;
-        case GLYCINE:     return &glycine;
-        case ALANINE:     return &alanine;
-        default:          return NULL;
-    }
+/*
+ * Header of a binary table. It is followed by NBINS struct phi_psi entries
+ * in native byte order. The bins field is also used to check that the table
+ * was written with the same byte order.
+ */
+struct rama_table_header {
+    char magic[8];
+    uint32_t version;
+    uint32_t bins;
+};
+
+struct rama_table {
+    const struct phi_psi *points;
+    //If the table was mapped from a binary file, this is the mapping.
+    //Otherwise points was allocated with malloc.
+    void *map;
+    size_t map_len;
+    //File the table was read from
+    char *file;
+};
+
+static struct rama_table tables[UNKNOWN_RAMA];
+
+static struct rama_table *rama_data(enum rama_constraint_type type){
+    if(type < 0 || type >= UNKNOWN_RAMA)
+        return NULL;
+    return &tables[type];
+}
+
+static void rama_unload(struct rama_table *t){
+    if(t->map)
+        munmap(t->map, t->map_len);
+    else
+        free((void *)t->points);
+    t->points = NULL;
+    t->map = NULL;
+    t->map_len = 0;
+    free(t->file);
+    t->file = NULL;
 }
 
 int rama_is_inited(enum rama_constraint_type type){
-    return (*(rama_data(type))) != NULL;
+    return rama_data(type) && rama_data(type)->points != NULL;
+}
+
+/**
+ * Get the name of the file from which the data for a type was read.
+ *
+ * \return The file name, or NULL if no data has been read for the type.
+ */
+const char *rama_data_file(enum rama_constraint_type type){
+    return rama_is_inited(type) ? rama_data(type)->file : NULL;
+}
+
+/*
+ * Map a binary table. The file must already be open as fd. Returns non-zero
+ * on error.
+ */
+static int rama_map_table(int fd, const char *file, struct rama_table *t){
+    struct stat st;
+    if(fstat(fd, &st)){
+        error(0, errno, "Error reading %s", file);
+        return 1;
+    }
+    size_t len = sizeof(struct rama_table_header)
+        + sizeof(struct phi_psi) * NBINS;
+    if((size_t)st.st_size != len){
+        error(0, 0, "Ramachandran table %s has the wrong size", file);
+        return 1;
+    }
+
+    void *map = mmap(NULL, len, PROT_READ, MAP_SHARED, fd, 0);
+    if(map == MAP_FAILED){
+        error(0, errno, "Error mapping %s", file);
+        return 1;
+    }
+    const struct rama_table_header *h = map;
+    if(h->version != RAMA_TABLE_VERSION || h->bins != 360){
+        error(0, 0, "Ramachandran table %s has an unsupported version "
+                "or byte order", file);
+        munmap(map, len);
+        return 1;
+    }
+    t->map = map;
+    t->map_len = len;
+    t->points = (const struct phi_psi *)(h + 1);
+    return 0;
 }
 
 /** Read a file containing several grid points. At each grid point, we have the
  * coordinates of the boundary of the nearest Ramachandran region.
  *
+ * The file may either be a text file with one line per grid point, or a
+ * binary table written by rama_write_table. Binary tables are mapped rather
+ * than read, so processes using the same table share its memory.
+ *
  * For the moment, we will just assume 1 degree bins.
  *
  * Upon error, this function returns a non-zero value.
@@ -52,6 +133,13 @@ int rama_is_inited(enum rama_constraint_type type){
 int rama_read_closest(const char *file, enum rama_constraint_type type){
     int retval = 0;
 
+    struct rama_table *table = rama_data(type);
+    if(!table){
+        error(0, 0, "Unknown Ramachandran type %d", (int)type);
+        return 1;
+    }
+    rama_unload(table);
+
     FILE *fin = fopen(file, "r");
     if(!fin){
         retval = 1;
@@ -59,23 +147,29 @@ int rama_read_closest(const char *file, enum rama_constraint_type type){
         goto open_error;
     }
 
-    struct phi_psi **points = rama_data(type);
-    if(!points){
-        retval = 1;
-        error(0, 0, "Unknown Ramachandran type %d", (int)type);
+    //Check for a binary table
+    char magic[sizeof(((struct rama_table_header *)0)->magic)];
+    if(fread(magic, 1, sizeof(magic), fin) == sizeof(magic)
+            && memcmp(magic, RAMA_TABLE_MAGIC, sizeof(magic)) == 0){
+        retval = rama_map_table(fileno(fin), file, table);
+        fclose(fin);
         goto open_error;
     }
-    *points = malloc(sizeof(struct phi_psi) * NBINS);
-    if(!(*points)){
+    rewind(fin);
+
+    struct phi_psi *points = malloc(sizeof(*points) * NBINS);
+    if(!points){
         retval = 1;
         error(errno, 0, "Error allocating memory");
+        fclose(fin);
         goto open_error;
     }
+    table->points = points;
 
     //Set angles to -1 for bins inside Ramachandran regions (i.e. not in data)
     for(size_t i=0; i < NBINS; i++){
-        (*points)[i].phi = -1;
-        (*points)[i].psi = -1;
+        points[i].phi = -1;
+        points[i].psi = -1;
     }
 
     int num_points = 0;
@@ -98,52 +192,117 @@ int rama_read_closest(const char *file, enum rama_constraint_type type){
                     nread, num_points);
             goto read_error;
         }
+        if(phi < 0 || phi >= 360 || psi < 0 || psi >= 360){
+            retval = 1;
+            error(0, 0, "Grid point out of range on line %d", num_points);
+            goto read_error;
+        }
         //We dont' remove the 180 degree offset when reading so that we can use
         //negative numbers as a flag to indicate missing values.
-        (*points)[phi * 360 + psi].phi = to_phi;
-        (*points)[phi * 360 + psi].psi = to_psi;
+        points[phi * 360 + psi].phi = to_phi;
+        points[phi * 360 + psi].psi = to_psi;
     }
 read_error:
     free(line);
     fclose(fin);
+    if(retval)
+        rama_unload(table);
 open_error:
+    if(!retval && !(table->file = strdup(file))){
+        error(0, errno, "Error allocating memory");
+        rama_unload(table);
+        retval = 1;
+    }
     return retval;
 }
 
+/**
+ * Write the table loaded for a type to a binary file that can be read by
+ * rama_read_closest. The table is written to a temporary file which is then
+ * renamed, so processes that have the old table mapped are not affected.
+ *
+ * \return Non-zero on error.
+ */
+int rama_write_table(const char *file, enum rama_constraint_type type){
+    if(!rama_is_inited(type)){
+        error(0, 0, "Ramachandran data not initialised!");
+        return 1;
+    }
+
+    char tmp[strlen(file) + sizeof(".tmp")];
+    sprintf(tmp, "%s.tmp", file);
+    FILE *out = fopen(tmp, "wb");
+    if(!out){
+        error(0, errno, "Error opening %s", tmp);
+        return 1;
+    }
+
+    struct rama_table_header h;
+    memset(&h, 0, sizeof(h));
+    memcpy(h.magic, RAMA_TABLE_MAGIC, sizeof(h.magic));
+    h.version = RAMA_TABLE_VERSION;
+    h.bins = 360;
+    if(fwrite(&h, sizeof(h), 1, out) != 1
+            || fwrite(rama_data(type)->points, sizeof(struct phi_psi), NBINS,
+                out) != NBINS){
+        error(0, errno, "Error writing %s", tmp);
+        fclose(out);
+        remove(tmp);
+        return 1;
+    }
+    if(fclose(out) || rename(tmp, file)){
+        error(0, errno, "Error writing %s", file);
+        remove(tmp);
+        return 1;
+    }
+    return 0;
+}
+
+/**
+ * Get the closest allowed point to the grid point (phi, psi), with both in
+ * the range 0--359. Returns false if the point is in an allowed region or no
+ * data is loaded for the type.
+ */
+bool rama_lookup(enum rama_constraint_type type, int phi, int psi,
+        int *to_phi, int *to_psi){
+    if(!rama_is_inited(type))
+        return false;
+    const struct phi_psi *p = &rama_data(type)->points[phi * 360 + psi];
+    if(p->phi < 0 || p->psi < 0)
+        return false;
+    *to_phi = p->phi;
+    *to_psi = p->psi;
+    return true;
+}
+
 /**
  * Find a random favoured point. This is probably pretty biased.
  */
-void rama_random_init(struct rama_constraint *rama){
-    float phi = ((float)random()) / RAND_MAX * 360;
-    float psi = ((float)random()) / RAND_MAX * 360;
+void rama_random_init(struct rama_constraint *rama, struct rng *rng){
+    float phi = ((float)rng_rand(rng)) / RAND_MAX * 360;
+    float psi = ((float)rng_rand(rng)) / RAND_MAX * 360;
 
     //Round to nearest grid point.
     int phi_grid = (int)(phi + 0.5) % 360;
     int psi_grid = (int)(psi + 0.5) % 360;
 
-    struct phi_psi **points = rama_data(rama->type);
-    struct phi_psi closest = (*points)[phi_grid * 360 + psi_grid];
+    const struct phi_psi *points = rama_data(rama->type)->points;
+    struct phi_psi closest = points[phi_grid * 360 + psi_grid];
     if(closest.psi == -1 || closest.psi == -1){
-        rama->phi->angle = phi;
-        rama->psi->angle = psi;
+        rama->phi.angle = phi;
+        rama->psi.angle = psi;
     }else{
-        rama->phi->angle = closest.phi;
-        rama->psi->angle = closest.psi;
+        rama->phi.angle = closest.phi;
+        rama->psi.angle = closest.psi;
     }
 }
 
 /**
  * Return true if all atoms in this constraint are synthesised.
  */
-int rama_is_synthesised(struct rama_constraint *rama){
-    return rama->phi->a1->synthesised &&
-        rama->phi->a2->synthesised &&
-        rama->phi->a3->synthesised &&
-        rama->phi->a4->synthesised &&
-        rama->psi->a1->synthesised &&
-        rama->psi->a2->synthesised &&
-        rama->psi->a3->synthesised &&
-        rama->psi->a4->synthesised;
+int rama_is_synthesised(struct rama_constraint *rama, bool *synthesised){
+    return torsion_spring_synthesised(&rama->phi, synthesised)
+        && torsion_spring_synthesised(&rama->psi, synthesised);
 }
 
 /**
@@ -169,30 +328,30 @@ enum rama_constraint_type rama_parse_type(const char *type){
 /**
  * Find the closest Ramachandran region to the given phi/psi angles.
  */
-int rama_get_closest(struct rama_constraint *rama){
+int rama_get_closest(struct rama_constraint *rama, struct vector *pos){
     int retval = 0;
 
-    double phi_f = torsion_spring_angle(rama->phi);
-    double psi_f = torsion_spring_angle(rama->psi);
+    double phi_f = torsion_spring_angle(&rama->phi, pos);
+    double psi_f = torsion_spring_angle(&rama->psi, pos);
 
     //Round to nearest grid point. Remember that the grid goes from 0--360, not
     //-180--180.
     int phi_grid = (int)(phi_f + 180 + 0.5) % 360;
     int psi_grid = (int)(psi_f + 180 + 0.5) % 360;
 
-    struct phi_psi **points = rama_data(rama->type);
-    if(!points){
+    struct rama_table *table = rama_data(rama->type);
+    if(!table){
         retval = 1;
         error(0, 0, "Unknown Ramachandran type %d", (int)rama->type);
         goto error;
     }
-    if(!(*points)){
+    if(!table->points){
         retval = 1;
         error(0, 0, "Ramachandran data not initialised!");
         goto error;
     }
 
-    struct phi_psi *closest = &((*points)[phi_grid * 360 + psi_grid]);
+    const struct phi_psi *closest = &table->points[phi_grid * 360 + psi_grid];
 
 
     if(closest->phi < 0 || closest->psi < 0){
@@ -201,8 +360,8 @@ int rama_get_closest(struct rama_constraint *rama){
     }else{
         //Update the torsion spring.  Remember that the data files are from
         //0-360, whereas we use -180 -- 180
-        rama->phi->angle = closest->phi - 180;
-        rama->psi->angle = closest->psi - 180;
+        rama->phi.angle = closest->phi - 180;
+        rama->psi.angle = closest->psi - 180;
         rama->enabled = true;
     }
 error:
@@ -223,43 +382,40 @@ void rama_init(struct rama_constraint *rama,
 
     //Find the atoms we want. Doing a linear search is slow, but this only has
     //to be done once for each residue at start up.
-    struct atom *phi_prev_C, *phi_N, *phi_CA, *phi_C;
-    phi_prev_C = phi_N = phi_CA = phi_C = NULL;
+    size_t phi_prev_C, phi_N, phi_CA, phi_C;
+    phi_prev_C = phi_N = phi_CA = phi_C = NO_ATOM;
 
-    struct atom *psi_N, *psi_CA, *psi_C, *psi_next_N;
-    psi_N = psi_CA = psi_C = psi_next_N = NULL;
+    size_t psi_N, psi_CA, psi_C, psi_next_N;
+    psi_N = psi_CA = psi_C = psi_next_N = NO_ATOM;
 
     for(size_t i=0; i < m->num_atoms; i++){
         struct atom *a = &m->atoms[i];
         if(a->residue_idx == residue_idx - 1){
             if(strcmp(a->name, "C"))
-                phi_prev_C = a;
+                phi_prev_C = i;
         }else if(a->residue_idx == residue_idx){
             if(strcmp(a->name, "N") == 0){
-                phi_N = a;
-                psi_N = a;
+                phi_N = i;
+                psi_N = i;
             }else if(strcmp(a->name, "CA") == 0){
-                phi_CA = a;
-                psi_CA = a;
+                phi_CA = i;
+                psi_CA = i;
             }else if(strcmp(a->name, "C") == 0){
-                phi_C = a;
-                psi_C = a;
+                phi_C = i;
+                psi_C = i;
             }
         }else if(a->residue_idx == residue_idx + 1){
             if(strcmp(a->name, "N") == 0)
-                psi_next_N = a;
+                psi_next_N = i;
         }
     }
-    rama->phi = torsion_spring_alloc(phi_prev_C, phi_N, phi_CA, phi_C, 0, constant);
-    rama->psi = torsion_spring_alloc(psi_N, psi_CA, psi_C, psi_next_N, 0, constant);
+    torsion_spring_init(&rama->phi,
+            phi_prev_C, phi_N, phi_CA, phi_C, 0, constant);
+    torsion_spring_init(&rama->psi,
+            psi_N, psi_CA, psi_C, psi_next_N, 0, constant);
 }
 
 void rama_free_data(){
-    free(general);
-    free(alpha);
-    free(beta);
-    free(proline);
-    free(pre_proline);
-    free(glycine);
-    free(alanine);
+    for(size_t i=0; i < UNKNOWN_RAMA; i++)
+        rama_unload(&tables[i]);
 }
@@ -8,6 +8,7 @@
 #define DEFAULT_RAMA_CONST 0.5
 
 struct model;
+struct rng;
 
 enum rama_constraint_type {
     GENERAL,
@@ -21,14 +22,18 @@ enum rama_constraint_type {
 };
 
 struct rama_constraint {
-    struct torsion_spring *phi, *psi;
+    struct torsion_spring phi, psi;
     enum rama_constraint_type type;
     bool enabled;
 };
 
 int rama_is_inited(enum rama_constraint_type type);
+const char *rama_data_file(enum rama_constraint_type type);
 int rama_read_closest(const char *file, enum rama_constraint_type type);
-int rama_get_closest(struct rama_constraint *rama);
+int rama_write_table(const char *file, enum rama_constraint_type type);
+bool rama_lookup(enum rama_constraint_type type, int phi, int psi,
+        int *to_phi, int *to_psi);
+int rama_get_closest(struct rama_constraint *rama, struct vector *pos);
 void rama_free_data();
 enum rama_constraint_type rama_parse_type(const char *type);
 void rama_init(struct rama_constraint *rama,
@@ -36,7 +41,7 @@ void rama_init(struct rama_constraint *rama,
         size_t residue_idx,
         const char *type,
         float constant);
-void rama_random_init(struct rama_constraint *rama);
-int rama_is_synthesised(struct rama_constraint *rama);
+void rama_random_init(struct rama_constraint *rama, struct rng *rng);
+int rama_is_synthesised(struct rama_constraint *rama, bool *synthesised);
 
 #endif //RAMA_H_
@@ -0,0 +1,66 @@
+#include <config.h>
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <getopt.h>
+#include "rama.h"
+
+static struct option opts[] = {
+    {"help",   no_argument,       0, 'h'},
+    {"output", required_argument, 0, 'o'},
+    {0, 0, 0, 0}
+};
+const char *opt_str = "ho:";
+
+const char *usage_str =
+"Usage: poing2-rama [OPTIONS] <FILE>...\n"
+"\n"
+"Convert text Ramachandran boundary files into binary tables, which poing2\n"
+"maps into memory instead of parsing. Each FILE is written to FILE.bin.\n"
+"Available options:\n"
+"  -h, --help         Display this help message.\n"
+"  -o, --output=F     Write to F instead. Only one FILE may be given.\n"
+;
+
+void usage(const char *msg, int exitval){
+    FILE *out = (exitval < 2) ? stdout : stderr;
+    if(msg)
+        fprintf(out, "%s\n", msg);
+    fprintf(out, "%s", usage_str);
+    exit(exitval);
+}
+
+int main(int argc, char **argv){
+    const char *output = NULL;
+    int c;
+    int option_index;
+    while((c = getopt_long(argc, argv, opt_str, opts, &option_index)) != -1){
+        switch(c){
+            case 'h':
+                usage(NULL, 1);
+                break;
+            case 'o':
+                output = optarg;
+                break;
+            default:
+                usage(NULL, 2);
+        }
+    }
+    if(optind >= argc)
+        usage("No input files supplied.", 2);
+    if(output && argc - optind > 1)
+        usage("Only one input file may be given with --output.", 2);
+
+    int retval = 0;
+    for(int i=optind; i < argc; i++){
+        char out[strlen(argv[i]) + sizeof(".bin")];
+        sprintf(out, "%s.bin", argv[i]);
+
+        //Any type will do; the table is only held long enough to write it.
+        if(rama_read_closest(argv[i], GENERAL)
+                || rama_write_table(output ? output : out, GENERAL))
+            retval = 1;
+    }
+    rama_free_data();
+    return retval;
+}
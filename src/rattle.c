@@ -2,14 +2,28 @@
 #include "model.h"
 #include "residue.h"
 #include "rattle.h"
+#include "lanes.h"
 #include <math.h>
 #include <signal.h>
+#include <stdlib.h>
+#include <string.h>
+#include <ctype.h>
+
+#ifdef HAVE_CONFIG_H
+#include <config.h>
+#endif
 
 static size_t maxit = 100;
 static double tolerance = 1e-4;
 
 static int ni = 0;
 
+//Greatest number of colours the coloured solver can use
+#define MAX_COLOURS 64
+
+static struct constraint_chain *chain_alloc(size_t n, size_t bandwidth);
+static size_t push_positions(struct model *m, double *max_disp_sq);
+
 void rattle_push(struct model *m){
     rattle_unconstrained_push(m);
     model_accumulate_forces(m);
@@ -17,116 +31,873 @@ void rattle_push(struct model *m){
     m->time += m->timestep;
 }
 
+//Change the velocities of the unfixed atoms by the impulse of forces over dt
+static void respa_kick(struct model *m, struct vector *forces,
+        double dt){
+    for(size_t a=0; a < m->num_atoms; a++){
+        if(m->fixed[a])
+            continue;
+        struct vector dv;
+        vmul(&dv, &forces[a], dt * m->inv_masses[a]);
+        vadd_to(&m->velocities[a], &dv);
+    }
+}
+
+/**
+ * Advance m by one step of the r-RESPA multiple time step integrator, which is
+ * respa_steps RATTLE steps of length timestep using only the fast forces. The
+ * slow forces are applied as half kicks at the start and end of the step, and
+ * are only calculated once, at the end; m->slow_forces holds them until the
+ * start of the next step.
+ */
+void rattle_respa_push(struct model *m){
+    int k = m->respa_steps;
+    double dt = m->timestep;
+    double outer = dt * k;
+    double start = m->time;
+
+    respa_kick(m, m->slow_forces, outer / 2);
+    for(int j=0; j < k; j++){
+        rattle_unconstrained_push(m);
+        model_accumulate_forces_level(m, FAST_FORCES);
+
+        if(j == k - 1){
+            //The slow forces are calculated as though for a single step from
+            //the start of this one, so that the water kicks for the whole
+            //step are applied at once.
+            struct vector *fast = m->forces;
+            double time = m->time;
+            m->forces = m->slow_forces;
+            m->time = start;
+            m->timestep = outer;
+            model_accumulate_forces_level(m, SLOW_FORCES);
+            m->slow_forces = m->forces;
+            m->forces = fast;
+            m->time = time;
+            m->timestep = dt;
+
+            //The velocity constraints are applied after both kicks
+            respa_kick(m, m->slow_forces, outer / 2);
+        }
+        rattle_move(m);
+        m->time += dt;
+    }
+}
+
+//Mean kinetic energy of the moving atoms of m
+static double mean_kinetic_energy(const struct model *m){
+    double energy = 0;
+    size_t n = 0;
+    for(size_t a=0; a < m->num_atoms; a++){
+        if(m->fixed[a])
+            continue;
+        energy += vmag_sq(&m->velocities[a]) / (2 * m->inv_masses[a]);
+        n++;
+    }
+    return n ? energy / n : 0;
+}
+
+/**
+ * Advance m by one RATTLE step, then choose the timestep of the next step.
+ *
+ * The step is never repeated. If the constraint solver needed more than
+ * max_constraint_iterations iterations, an atom moved further than
+ * max_displacement, or the mean kinetic energy is above max_kinetic_energy,
+ * the timestep is halved. Once the step has stayed well inside those bounds
+ * for ADAPTIVE_GROW_STEPS steps, it is increased by ADAPTIVE_GROW_FACTOR.
+ */
+void rattle_adaptive_push(struct model *m){
+    double max_disp_sq;
+    size_t nit = push_positions(m, &max_disp_sq);
+    model_accumulate_forces(m);
+    rattle_move(m);
+    m->time += m->timestep;
+
+    double max_disp = m->max_displacement;
+    double energy = mean_kinetic_energy(m);
+    if(nit > (size_t)m->max_constraint_iterations
+            || max_disp_sq > max_disp * max_disp
+            || energy > m->max_kinetic_energy){
+        m->timestep /= 2;
+        if(m->timestep < m->min_timestep)
+            m->timestep = m->min_timestep;
+        m->stable_steps = 0;
+        return;
+    }
+
+    //Grow only if the larger step is expected to stay within the bounds
+    double grown = max_disp / ADAPTIVE_GROW_FACTOR;
+    if(max_disp_sq > grown * grown
+            || nit > (size_t)m->max_constraint_iterations / 2
+            || energy > m->max_kinetic_energy / 2){
+        m->stable_steps = 0;
+        return;
+    }
+    if(++m->stable_steps < ADAPTIVE_GROW_STEPS)
+        return;
+    m->timestep *= ADAPTIVE_GROW_FACTOR;
+    if(m->timestep > m->max_timestep)
+        m->timestep = m->max_timestep;
+    m->stable_steps = 0;
+}
+
+/**
+ * Advance each replica in l by one step. The replicas are pushed in lockstep,
+ * so that their bonded forces can be calculated together.
+ */
+void rattle_push_lanes(struct lanes *l){
+    for(size_t k=0; k < l->n; k++)
+        rattle_unconstrained_push(l->models[k]);
+    model_accumulate_forces_lanes(l);
+    for(size_t k=0; k < l->n; k++){
+        rattle_move(l->models[k]);
+        l->models[k]->time += l->models[k]->timestep;
+    }
+}
+
+/**
+ * Parse the name of a constraint solver. Returns UNKNOWN_SOLVER if the name
+ * isn't recognised.
+ */
+enum constraint_solver rattle_parse_solver(const char *name){
+    char copy[strlen(name) + 1];
+    for(size_t i=0; i <= strlen(name); i++)
+        copy[i] = tolower(name[i]);
+
+    if(strcmp(copy, "serial")   == 0) return SERIAL_SOLVER;
+    if(strcmp(copy, "coloured") == 0) return COLOURED_SOLVER;
+    if(strcmp(copy, "colored")  == 0) return COLOURED_SOLVER;
+    if(strcmp(copy, "chain")    == 0) return CHAIN_SOLVER;
+    return UNKNOWN_SOLVER;
+}
+
+/**
+ * Sort the constraints into colour classes for the coloured solver, so that
+ * no two constraints of the same colour share an atom. Constraints are
+ * coloured greedily in their original order, which keeps the order within
+ * each colour.
+ *
+ * \return Non-zero if memory couldn't be allocated or an atom has too many
+ * constraints to colour.
+ */
+int rattle_colour_constraints(struct model *m){
+    int retval = 1;
+    uint64_t *used = calloc(m->num_atoms ? m->num_atoms : 1, sizeof(*used));
+    uint8_t *colour = malloc(sizeof(*colour) * (m->num_constraints + 1));
+    struct constraint *sorted = malloc(
+            sizeof(*sorted) * (m->num_constraints + 1));
+    size_t *colour_start = calloc(MAX_COLOURS + 1, sizeof(*colour_start));
+    if(!used || !colour || !sorted || !colour_start){
+        fprintf(stderr, "Error allocating constraint colours\n");
+        goto free_all;
+    }
+
+    //Give each constraint the lowest colour not used by either of its atoms
+    size_t num_colours = 0;
+    for(size_t i=0; i < m->num_constraints; i++){
+        const struct constraint *c = &m->constraints[i];
+        uint64_t taken = used[c->a] | used[c->b];
+        if(taken == UINT64_MAX){
+            fprintf(stderr, "Too many constraints on atom %u or %u "
+                    "to colour\n", c->a, c->b);
+            goto free_all;
+        }
+
+        size_t k = 0;
+        while(taken & (UINT64_C(1) << k))
+            k++;
+        used[c->a] |= UINT64_C(1) << k;
+        used[c->b] |= UINT64_C(1) << k;
+        colour[i] = k;
+        if(k + 1 > num_colours)
+            num_colours = k + 1;
+    }
+
+    //Stable counting sort of the constraints by colour
+    for(size_t i=0; i < m->num_constraints; i++)
+        colour_start[colour[i] + 1]++;
+    for(size_t k=1; k <= num_colours; k++)
+        colour_start[k] += colour_start[k - 1];
+    for(size_t i=0; i < m->num_constraints; i++)
+        sorted[colour_start[colour[i]]++] = m->constraints[i];
+    for(size_t k=num_colours; k > 0; k--)
+        colour_start[k] = colour_start[k - 1];
+    colour_start[0] = 0;
+
+    memcpy(m->constraints, sorted, sizeof(*sorted) * m->num_constraints);
+    free(m->colour_start);
+    m->colour_start = colour_start;
+    m->num_colours = num_colours;
+    colour_start = NULL;
+    retval = 0;
+
+free_all:
+    free(used);
+    free(colour);
+    free(sorted);
+    free(colour_start);
+    return retval;
+}
+
+/**
+ * Prepare the constraints for the solver selected in the model.
+ *
+ * \return Non-zero on error.
+ */
+int rattle_init_solver(struct model *m){
+    switch(m->constraint_solver){
+    case COLOURED_SOLVER:
+        return rattle_colour_constraints(m);
+    case CHAIN_SOLVER:
+        return rattle_chain_constraints(m);
+    default:
+        return 0;
+    }
+}
+
+static int constraint_cmp(const void *a, const void *b){
+    const struct constraint *c1 = a, *c2 = b;
+    uint32_t lo1 = c1->a < c1->b ? c1->a : c1->b;
+    uint32_t lo2 = c2->a < c2->b ? c2->a : c2->b;
+    uint32_t hi1 = c1->a < c1->b ? c1->b : c1->a;
+    uint32_t hi2 = c2->a < c2->b ? c2->b : c2->a;
+    if(lo1 != lo2)
+        return lo1 < lo2 ? -1 : 1;
+    if(hi1 != hi2)
+        return hi1 < hi2 ? -1 : 1;
+    return 0;
+}
+
+/**
+ * Sort the constraints by their lowest atom and set up the chain solver. For
+ * a chain, constraints sharing an atom end up close together, so the matrix
+ * coupling the constraints is banded.
+ *
+ * \return Non-zero if memory couldn't be allocated.
+ */
+int rattle_chain_constraints(struct model *m){
+    size_t n = m->num_constraints;
+    qsort(m->constraints, n, sizeof(*m->constraints), constraint_cmp);
+
+    //Each constraint is coupled to the earlier constraints sharing its atoms,
+    //so the bandwidth is the furthest back that one of its atoms was first
+    //used.
+    size_t num_atoms = 0;
+    for(size_t k=0; k < n; k++){
+        if(m->constraints[k].a >= num_atoms) num_atoms = m->constraints[k].a + 1;
+        if(m->constraints[k].b >= num_atoms) num_atoms = m->constraints[k].b + 1;
+    }
+    size_t *first = malloc(sizeof(*first) * (num_atoms + 1));
+    if(!first)
+        goto alloc_err;
+
+    size_t bandwidth = 0;
+    for(size_t i=0; i < num_atoms; i++)
+        first[i] = SIZE_MAX;
+    for(size_t k=0; k < n; k++){
+        uint32_t atoms[2] = {m->constraints[k].a, m->constraints[k].b};
+        for(size_t j=0; j < 2; j++){
+            if(first[atoms[j]] == SIZE_MAX)
+                first[atoms[j]] = k;
+            if(k - first[atoms[j]] > bandwidth)
+                bandwidth = k - first[atoms[j]];
+        }
+    }
+    free(first);
+
+    struct constraint_chain *chain = chain_alloc(n, bandwidth);
+    if(!chain)
+        goto alloc_err;
+    rattle_free_chain(m->chain);
+    m->chain = chain;
+    return 0;
+
+alloc_err:
+    fprintf(stderr, "Error allocating chain constraint solver\n");
+    return 1;
+}
+
+/**
+ * Give a replica r of the model m its own state for the chain solver, with
+ * the constraints already sorted by rattle_chain_constraints on m.
+ *
+ * \return Non-zero if memory could not be allocated.
+ */
+int rattle_copy_chain(struct model *r, const struct model *m){
+    r->chain = chain_alloc(m->num_constraints, m->chain->bandwidth);
+    return r->chain == NULL;
+}
+
+//Allocate the state of the chain solver for n constraints
+static struct constraint_chain *chain_alloc(size_t n, size_t bandwidth){
+    struct constraint_chain *chain = calloc(1, sizeof(*chain));
+    if(!chain)
+        return NULL;
+    chain->bandwidth = bandwidth;
+    chain->band = malloc(sizeof(*chain->band) * (n * (bandwidth + 1) + 1));
+    chain->lambda = calloc(n + 1, sizeof(*chain->lambda));
+    chain->rhs = malloc(sizeof(*chain->rhs) * (n + 1));
+    chain->state = calloc(n + 1, sizeof(*chain->state));
+    if(!chain->band || !chain->lambda || !chain->rhs || !chain->state){
+        rattle_free_chain(chain);
+        return NULL;
+    }
+    return chain;
+}
+
+/**
+ * Free the state of the chain solver.
+ */
+void rattle_free_chain(struct constraint_chain *chain){
+    if(!chain)
+        return;
+    free(chain->band);
+    free(chain->lambda);
+    free(chain->rhs);
+    free(chain->state);
+    free(chain);
+}
+
+/*
+ * Move the unconstrained positions (and the velocities) of the atoms of
+ * constraint i towards satisfying the constraint. Returns true if the
+ * constraint was not already satisfied.
+ */
+static inline bool correct_position(struct model *m, struct vector *uncons,
+        size_t i){
+
+    struct vector *pos = m->positions;
+    struct vector *vel = m->velocities;
+    double *inv_mass = m->inv_masses;
+    size_t a = m->constraints[i].a;
+    size_t b = m->constraints[i].b;
+
+    //Get displacement vector between unconsrained positions
+    struct vector p;
+    vsub(&p, &uncons[a], &uncons[b]);
+
+    //Do we need to apply this constaint?
+    float dist = m->constraints[i].distance;
+    float diffsq = dist * dist - vmag_sq(&p);
+    if(fabs(diffsq) <= tolerance * 2)
+        return false;
+
+    //Get displacement vector between unmoved atoms
+    struct vector r;
+    vsub(&r, &pos[a], &pos[b]);
+
+    //XXX: The original Allen and Tildsey code has a bail out here
+    //if a certain tolerance is not met.
+
+    //Get correction factor g_ab
+    float reduced_mass = inv_mass[a] + inv_mass[b];
+    float gab = diffsq / (2.0 * reduced_mass * vdot(&r, &p));
+
+    //Get correction term
+    struct vector delta;
+    vmul(&delta, &r, gab);
+
+    //Update unconstrained positions
+    for(size_t j=0; j<N; j++){
+        if(!m->fixed[a]){
+            uncons[a].c[j] += inv_mass[a] * delta.c[j];
+            vel[a].c[j] += inv_mass[a] * delta.c[j] / m->timestep;
+        }
+        if(!m->fixed[b]){
+            uncons[b].c[j] -= inv_mass[b] * delta.c[j];
+            vel[b].c[j] -= inv_mass[b] * delta.c[j] / m->timestep;
+        }
+    }
+    return true;
+}
+
+/*
+ * Remove the component of the relative velocity of the atoms of constraint i
+ * along the constraint. Returns true if the correction was large enough to
+ * apply.
+ */
+static inline bool correct_velocity(struct model *m, size_t i){
+    struct vector *pos = m->positions;
+    struct vector *vel = m->velocities;
+    double *inv_mass = m->inv_masses;
+    size_t a = m->constraints[i].a;
+    size_t b = m->constraints[i].b;
+
+    //Constraint distance squared
+    float dsq = m->constraints[i].distance * m->constraints[i].distance;
+
+    //Get velocity and position delta
+    struct vector v_ab, r_ab;
+    vsub(&v_ab, &vel[a], &vel[b]);
+    vsub(&r_ab, &pos[a], &pos[b]);
+
+    //Dot product
+    float rv = vdot(&v_ab, &r_ab);
+
+    //Reciprocal masses
+    float rma = inv_mass[a];
+    float rmb = inv_mass[b];
+
+    //Correction term
+    float gab = -rv / ((rma + rmb) * dsq);
+
+    if(fabs(gab) <= tolerance)
+        return false;
+
+    //Get position correction
+    struct vector r_delta;
+    vmul(&r_delta, &r_ab, gab);
+
+    //Update velocity vectors
+    struct vector delta_v;
+    vmul(&delta_v, &r_delta, rma);
+    if(!m->fixed[a])
+        vadd_to(&vel[a], &delta_v);
+    vmul(&delta_v, &r_delta, -rmb);
+    if(!m->fixed[b])
+        vadd_to(&vel[b], &delta_v);
+    return true;
+}
+
+/*
+ * Satisfy the constraints by sweeping over each colour class in turn. The
+ * constraints within a class share no atoms, so they are independent and can
+ * be applied in parallel. Constraints are skipped if neither of their atoms
+ * was moved in the previous sweep. Returns the number of sweeps, or maxit + 1
+ * if the constraints did not converge.
+ */
+static size_t solve_coloured(struct model *m, struct vector *uncons){
+    size_t scratch_used = m->scratch.used;
+    bool *moved = model_scratch(m, sizeof(*moved) * m->num_atoms);
+    bool *moving = model_scratch(m, sizeof(*moving) * m->num_atoms);
+    for(size_t i=0; i < m->num_atoms; i++){
+        moved[i] = !m->fixed[i];
+        moving[i] = false;
+    }
+
+    size_t nit;
+    for(nit=0; nit < maxit; nit++){
+        size_t corrected = 0;
+        for(size_t k=0; k < m->num_colours; k++){
+            #ifdef HAVE_OPENMP
+            #pragma omp parallel for schedule(static) reduction(+:corrected)
+            #endif
+            for(size_t i=m->colour_start[k]; i < m->colour_start[k+1]; i++){
+                size_t a = m->constraints[i].a;
+                size_t b = m->constraints[i].b;
+                if(a >= m->num_atoms || b >= m->num_atoms)
+                    continue;
+                if(!m->synthesised[a] || !m->synthesised[b])
+                    continue;
+                if(!moved[a] && !moved[b])
+                    continue;
+
+                bool applied = uncons
+                    ? correct_position(m, uncons, i)
+                    : correct_velocity(m, i);
+                if(applied){
+                    moving[a] = moving[b] = true;
+                    corrected++;
+                }
+            }
+        }
+        if(!corrected)
+            break;
+
+        for(size_t i=0; i < m->num_atoms; i++){
+            moved[i] = moving[i];
+            moving[i] = false;
+        }
+    }
+    m->scratch.used = scratch_used;
+    return nit + 1;
+}
+
+//Flags in constraint_chain.state
+#define CHAIN_ACTIVE  1
+#define CHAIN_FIXED_A 2
+#define CHAIN_FIXED_B 4
+
+/*
+ * Get the state of constraint k. It is active if both atoms have been
+ * synthesised and at least one can move.
+ */
+static inline uint8_t chain_state(const struct model *m, size_t k){
+    size_t a = m->constraints[k].a;
+    size_t b = m->constraints[k].b;
+    if(a >= m->num_atoms || b >= m->num_atoms
+            || !m->synthesised[a] || !m->synthesised[b]
+            || (m->fixed[a] && m->fixed[b]))
+        return 0;
+    return CHAIN_ACTIVE
+        | (m->fixed[a] ? CHAIN_FIXED_A : 0)
+        | (m->fixed[b] ? CHAIN_FIXED_B : 0);
+}
+
+//Inverse mass of an atom, or zero if it is fixed
+static inline double chain_inv_mass(const struct model *m, size_t a){
+    return m->fixed[a] ? 0 : m->inv_masses[a];
+}
+
+/*
+ * Build and factorise the matrix K coupling the constraints, where K(k, l)
+ * is the change in r_k . p_k when the multiplier of constraint l changes by
+ * one. Inactive constraints get an identity row so they can be solved along
+ * with the rest. The state of each constraint must already be set in
+ * m->chain->state. K is factorised as L D L^T, with the unit lower triangle of L
+ * stored below the diagonal of the band and 1 / D on the diagonal, so that
+ * solving needs no divisions. Returns false if the matrix isn't positive
+ * definite, which happens if the constraints are redundant.
+ */
+static bool chain_factorise(struct model *m){
+    struct constraint_chain *chain = m->chain;
+    size_t w = chain->bandwidth;
+    struct vector *pos = m->positions;
+
+    for(size_t k=0; k < m->num_constraints; k++){
+        double *row = &chain->band[k * (w + 1)];
+        for(size_t j=0; j <= w; j++)
+            row[j] = 0;
+        if(!(chain->state[k] & CHAIN_ACTIVE)){
+            row[0] = 1;
+            continue;
+        }
+
+        size_t a = m->constraints[k].a;
+        size_t b = m->constraints[k].b;
+        struct vector r_k;
+        vsub(&r_k, &pos[a], &pos[b]);
+        size_t lo = k > w ? k - w : 0;
+        for(size_t l=lo; l <= k; l++){
+            if(!(chain->state[l] & CHAIN_ACTIVE))
+                continue;
+            size_t c = m->constraints[l].a;
+            size_t d = m->constraints[l].b;
+            double s = chain_inv_mass(m, c) * ((c == a) - (c == b))
+                     - chain_inv_mass(m, d) * ((d == a) - (d == b));
+            if(s == 0)
+                continue;
+            struct vector r_l;
+            vsub(&r_l, &pos[c], &pos[d]);
+            row[k - l] = s * vdot(&r_k, &r_l);
+        }
+    }
+
+    //Banded LDL^T factorisation, in place. ld[j] holds L(k, j) * D(j).
+    double ld[w + 1];
+    for(size_t k=0; k < m->num_constraints; k++){
+        double *row_k = &chain->band[k * (w + 1)];
+        size_t lo = k > w ? k - w : 0;
+        double diag = row_k[0];
+        for(size_t j=lo; j < k; j++){
+            const double *row_j = &chain->band[j * (w + 1)];
+            double sum = row_k[k - j];
+            for(size_t i=lo; i < j; i++)
+                sum -= ld[k - i] * row_j[j - i];
+            ld[k - j] = sum;
+            row_k[k - j] = sum * row_j[0];
+            diag -= sum * row_k[k - j];
+        }
+        if(diag <= 0)
+            return false;
+        row_k[0] = 1 / diag;
+    }
+    return true;
+}
+
+//Solve the factorised system in place in chain->rhs
+static void chain_solve(struct model *m){
+    struct constraint_chain *chain = m->chain;
+    size_t w = chain->bandwidth;
+    size_t n = m->num_constraints;
+    double *x = chain->rhs;
+
+    for(size_t k=0; k < n; k++){
+        const double *row = &chain->band[k * (w + 1)];
+        size_t lo = k > w ? k - w : 0;
+        for(size_t j=lo; j < k; j++)
+            x[k] -= row[k - j] * x[j];
+    }
+    for(size_t k=0; k < n; k++)
+        x[k] *= chain->band[k * (w + 1)];
+    for(size_t k=n; k-- > 0;){
+        size_t hi = k + w < n - 1 ? k + w : n - 1;
+        for(size_t i=k+1; i <= hi; i++)
+            x[k] -= chain->band[i * (w + 1) + (i - k)] * x[i];
+    }
+}
+
+/*
+ * Move atoms along each active constraint by the multipliers in x. If uncons
+ * is NULL, only the velocities are updated.
+ */
+static void chain_apply(struct model *m, struct vector *uncons,
+        const double *x){
+    struct vector *pos = m->positions;
+    struct vector *vel = m->velocities;
+    double inv_dt = 1 / m->timestep;
+    for(size_t k=0; k < m->num_constraints; k++){
+        if(!(m->chain->state[k] & CHAIN_ACTIVE) || x[k] == 0)
+            continue;
+        size_t a = m->constraints[k].a;
+        size_t b = m->constraints[k].b;
+        struct vector delta;
+        vsub(&delta, &pos[a], &pos[b]);
+        vmul(&delta, &delta, x[k]);
+        for(size_t j=0; j < N; j++){
+            double da = chain_inv_mass(m, a) * delta.c[j];
+            double db = chain_inv_mass(m, b) * delta.c[j];
+            if(uncons){
+                uncons[a].c[j] += da;
+                uncons[b].c[j] -= db;
+                vel[a].c[j] += da * inv_dt;
+                vel[b].c[j] -= db * inv_dt;
+            }else{
+                vel[a].c[j] += da;
+                vel[b].c[j] -= db;
+            }
+        }
+    }
+}
+
+/*
+ * Make sure the factorised matrix is usable. The matrix is refactorised if
+ * refactor is set or the set of active or fixed atoms has changed. Returns
+ * false if the matrix could not be factorised.
+ */
+static bool chain_prepare(struct model *m, bool refactor){
+    struct constraint_chain *chain = m->chain;
+    refactor = refactor || !chain->factorised;
+    for(size_t k=0; k < m->num_constraints; k++){
+        uint8_t state = chain_state(m, k);
+        if(state != chain->state[k]){
+            chain->state[k] = state;
+            refactor = true;
+        }
+    }
+    if(!refactor)
+        return true;
+
+    chain->factorised = chain_factorise(m);
+    if(!chain->factorised){
+        if(!chain->warned)
+            fprintf(stderr, "Warning: Constraints are redundant. "
+                    "Falling back to the serial solver.\n");
+        chain->warned = true;
+    }
+    return chain->factorised;
+}
+
+/*
+ * Satisfy the position constraints with a direct banded solve. The matrix
+ * factorised at the end of the last step is linearised about the current
+ * positions, but the constraints are not linear so a few solves are needed to
+ * reach the tolerance. If the velocities were not solved for at the end of
+ * the last step, as with the leapfrog integrator, the matrix is refactorised
+ * first. The multipliers from the last step are applied first.
+ * Returns the number of passes over the constraints, maxit + 1 if the
+ * constraints did not converge, or 0 if the matrix could not be factorised.
+ */
+static size_t solve_chain_positions(struct model *m, struct vector *uncons){
+    struct constraint_chain *chain = m->chain;
+    bool current = chain->current;
+    chain->current = false;
+    if(!chain_prepare(m, !current))
+        return 0;
+
+    //Warm start
+    for(size_t k=0; k < m->num_constraints; k++)
+        if(!(chain->state[k] & CHAIN_ACTIVE))
+            chain->lambda[k] = 0;
+    chain_apply(m, uncons, chain->lambda);
+
+    for(size_t nit=0; nit < maxit; nit++){
+        bool done = true;
+        for(size_t k=0; k < m->num_constraints; k++){
+            chain->rhs[k] = 0;
+            if(!(chain->state[k] & CHAIN_ACTIVE))
+                continue;
+            struct vector p;
+            vsub(&p, &uncons[m->constraints[k].a], &uncons[m->constraints[k].b]);
+            double dist = m->constraints[k].distance;
+            double diffsq = dist * dist - vmag_sq(&p);
+            if(fabs(diffsq) > tolerance * 2)
+                done = false;
+            chain->rhs[k] = diffsq / 2;
+        }
+        if(done)
+            return nit + 1;
+
+        chain_solve(m);
+        chain_apply(m, uncons, chain->rhs);
+        for(size_t k=0; k < m->num_constraints; k++)
+            chain->lambda[k] += chain->rhs[k];
+    }
+    return maxit + 1;
+}
+
+/*
+ * Remove the velocity along the constraints. The velocity constraints are
+ * linear, so a single solve at the current positions satisfies them. The
+ * factorisation is kept for the position solve of the next step. Returns
+ * false if the matrix could not be factorised.
+ */
+static bool solve_chain_velocities(struct model *m){
+    struct constraint_chain *chain = m->chain;
+    struct vector *pos = m->positions;
+    struct vector *vel = m->velocities;
+    if(!chain_prepare(m, true))
+        return false;
+    chain->current = true;
+
+    for(size_t k=0; k < m->num_constraints; k++){
+        chain->rhs[k] = 0;
+        if(!(chain->state[k] & CHAIN_ACTIVE))
+            continue;
+        size_t a = m->constraints[k].a;
+        size_t b = m->constraints[k].b;
+        struct vector r_ab, v_ab;
+        vsub(&r_ab, &pos[a], &pos[b]);
+        vsub(&v_ab, &vel[a], &vel[b]);
+        chain->rhs[k] = -vdot(&r_ab, &v_ab);
+    }
+    chain_solve(m);
+    chain_apply(m, NULL, chain->rhs);
+    return true;
+}
+
 void rattle_unconstrained_push(struct model *m){
+    push_positions(m, NULL);
+}
+
+/*
+ * Do the first half of a RATTLE step, moving the atoms to their constrained
+ * positions. Returns the number of iterations taken by the constraint solver,
+ * which is more than maxit if it did not converge. If max_disp_sq is not NULL,
+ * it is set to the greatest squared distance moved by an atom.
+ */
+static size_t push_positions(struct model *m, double *max_disp_sq){
     ni++;
-    bool moving[m->num_atoms];
-    bool moved[m->num_atoms];
+    size_t scratch_used = m->scratch.used;
+    struct vector *pos = m->positions;
+    struct vector *vel = m->velocities;
+    double *inv_mass = m->inv_masses;
 
     //We will need to store the unconstrained position of each atom after the
     //initial push.
-    struct vector uncons[m->num_atoms];
+    struct vector *uncons = model_scratch(m, sizeof(*uncons) * m->num_atoms);
 
     //Do the initial verlet push, storing the positions in "ucons"
     for(size_t a=0; a < m->num_atoms; a++){
-        if(m->atoms[a].fixed){
-            vector_copy_to(&uncons[a], &m->atoms[a].position);
-            vector_zero(&m->atoms[a].velocity);
+        if(m->fixed[a]){
+            vector_copy_to(&uncons[a], &pos[a]);
+            vector_zero(&vel[a]);
             continue;
         }
 
         //Get acceleration
         struct vector accel;
-        vdiv(&accel, &m->atoms[a].force, m->atoms[a].mass);
-
-        moving[a] = false;
-        moved[a] = true;
+        vmul(&accel, &m->forces[a], inv_mass[a]);
 
         //Get unconstrained position by a velocity Verlet push
         for(size_t i=0; i < N; i++){
-            uncons[a].c[i] = m->atoms[a].position.c[i]
-                + m->timestep * m->atoms[a].velocity.c[i]
+            uncons[a].c[i] = pos[a].c[i]
+                + m->timestep * vel[a].c[i]
                 + m->timestep * m->timestep / 2 * accel.c[i];
             //Also push the velocity a half step
-            m->atoms[a].velocity.c[i] =
-                m->atoms[a].velocity.c[i] + m->timestep / 2 * accel.c[i];
+            vel[a].c[i] = vel[a].c[i] + m->timestep / 2 * accel.c[i];
         }
     }
 
+    size_t nit = rattle_constrain_positions(m, uncons, max_disp_sq);
+    m->scratch.used = scratch_used;
+    return nit;
+}
+
+/**
+ * Move the unfixed atoms of m from their current positions to uncons,
+ * corrected to satisfy the constraints with the selected solver. Each
+ * correction is also added to the velocity of the atom, divided by the
+ * timestep. The corrections are made along the constraints at the current
+ * positions, which must satisfy them.
+ *
+ * \return The number of iterations taken by the solver, which is more than the
+ * maximum if it did not converge. If max_disp_sq is not NULL, it is set to the
+ * greatest squared distance moved by an atom.
+ */
+size_t rattle_constrain_positions(struct model *m, struct vector *uncons,
+        double *max_disp_sq){
+    size_t scratch_used = m->scratch.used;
+    bool *moving = model_scratch(m, sizeof(*moving) * m->num_atoms);
+    bool *moved = model_scratch(m, sizeof(*moved) * m->num_atoms);
+    struct vector *pos = m->positions;
+    for(size_t a=0; a < m->num_atoms; a++){
+        moving[a] = false;
+        moved[a] = !m->fixed[a];
+    }
 
     //Begin iterating to solve the constraints
     bool done = false;
-    for(size_t nit = 0; !done && nit < maxit; nit++){
-        for(size_t i=0; i < m->num_constraints; i++){
-            //Set to false if anything is moved.
-            done = true;
-
-            struct atom *a = &m->atoms[m->constraints[i].a];
-            struct atom *b = &m->atoms[m->constraints[i].b];
-            if(!a->synthesised || !b->synthesised)
-                continue;
-            if(!moved[m->constraints[i].a] && !moved[m->constraints[i].b])
-                continue;
-
-            //Get displacement vector between unconsrained positions
-            struct vector p;
-            vsub(&p, &uncons[m->constraints[i].a], &uncons[m->constraints[i].b]);
-
-            //Do we need to apply this constaint?
-            float dist = m->constraints[i].distance;
-            float diffsq = dist * dist - vmag_sq(&p);
-            if(fabs(diffsq) > tolerance * 2){
-                //This is not our last iteration
-                done = false;
-
-                //Get displacement vector between unmoved atoms
-                struct vector r;
-                vsub(&r, &a->position, &b->position);
-
-                //XXX: The original Allen and Tildsey code has a bail out here
-                //if a certain tolerance is not met.
-
-                //Get correction factor g_ab
-                float reduced_mass = 1.0 / a->mass + 1.0 / b->mass;
-                float gab = diffsq / (2.0 * reduced_mass * vdot(&r, &p));
-
-                //Get correction term
-                struct vector delta;
-                vmul(&delta, &r, gab);
-
-                //Update unconstrained positions
-                for(size_t j=0; j<N; j++){
-                    if(!m->atoms[m->constraints[i].a].fixed){
-                        uncons[m->constraints[i].a].c[j] += 1.0 / a->mass * delta.c[j];
-                        a->velocity.c[j] += 1.0 / a->mass * delta.c[j] / m->timestep;
-                    }
-                    if(!m->atoms[m->constraints[i].b].fixed){
-                        uncons[m->constraints[i].b].c[j] -= 1.0 / b->mass * delta.c[j];
-                        b->velocity.c[j] -= 1.0 / b->mass * delta.c[j] / m->timestep;
-                    }
-                }
+    size_t nit = 0;
+    if(m->constraint_solver == CHAIN_SOLVER
+            && (nit = solve_chain_positions(m, uncons))){
+        done = nit <= maxit;
+    }else if(m->constraint_solver == COLOURED_SOLVER){
+        nit = solve_coloured(m, uncons);
+        done = nit <= maxit;
+    }else{
+        for(nit = 0; !done && nit < maxit; nit++){
+            for(size_t i=0; i < m->num_constraints; i++){
+                //Set to false if anything is moved.
+                done = true;
+
+                size_t a = m->constraints[i].a;
+                size_t b = m->constraints[i].b;
+                if(!m->synthesised[a] || !m->synthesised[b])
+                    continue;
+                if(!moved[a] && !moved[b])
+                    continue;
+
+                if(correct_position(m, uncons, i))
+                    //This is not our last iteration
+                    done = false;
+            }
+            for(size_t i=0; i < m->num_atoms; i++){
+                moved[i] = moving[i];
+                moving[i] = false;
             }
-        }
-        for(size_t i=0; i < m->num_atoms; i++){
-            moved[i] = moving[i];
-            moving[i] = false;
         }
     }
-    if(!done)
+    if(!done){
         fprintf(stderr, "Warning: Maximum iterations exceeded at line %d of file %s\n", __LINE__, __FILE__);
+        nit = maxit + 1;
+    }
 
     //Copy the new positions to the atoms
+    double max_sq = 0;
     for(size_t i=0; i < m->num_atoms; i++){
-        if(!m->atoms[i].fixed)
-            vector_copy_to(&m->atoms[i].position, &uncons[i]);
+        if(m->fixed[i])
+            continue;
+        if(max_disp_sq){
+            struct vector d;
+            vsub(&d, &uncons[i], &pos[i]);
+            if(vmag_sq(&d) > max_sq)
+                max_sq = vmag_sq(&d);
+        }
+        vector_copy_to(&pos[i], &uncons[i]);
     }
+    if(max_disp_sq)
+        *max_disp_sq = max_sq;
+    m->scratch.used = scratch_used;
+    return nit;
 }
 
 size_t ncalled = 0;
 
 //Call this after calculating new forces
 void rattle_move(struct model *m){ ncalled++;
-    bool moving[m->num_atoms];
-    bool moved[m->num_atoms];
+    struct vector *vel = m->velocities;
+    double *inv_mass = m->inv_masses;
 
     if(getenv("DEBUG"))
         if(ncalled == 235001)
@@ -134,75 +905,62 @@ void rattle_move(struct model *m){ ncalled++;
 
     //Do the second verlet push
     for(size_t a=0; a < m->num_atoms; a++){
-        if(m->atoms[a].fixed)
+        if(m->fixed[a])
             continue;
 
         //Update velocity using acceleration
         for(size_t i=0; i < N; i++){
-            m->atoms[a].velocity.c[i] =
-                m->atoms[a].velocity.c[i]
-                + (m->timestep / 2) * m->atoms[a].force.c[i] / m->atoms[a].mass;
+            vel[a].c[i] = vel[a].c[i]
+                + (m->timestep / 2) * m->forces[a].c[i] * inv_mass[a];
         }
+    }
+    rattle_constrain_velocities(m);
+}
 
+/**
+ * Remove the components of the velocities of m along the constraints, with
+ * the selected solver.
+ */
+void rattle_constrain_velocities(struct model *m){
+    size_t scratch_used = m->scratch.used;
+    bool *moving = model_scratch(m, sizeof(*moving) * m->num_atoms);
+    bool *moved = model_scratch(m, sizeof(*moved) * m->num_atoms);
+    for(size_t a=0; a < m->num_atoms; a++){
         moving[a] = false;
-        moved[a] = true;
+        moved[a] = !m->fixed[a];
     }
 
     //Begin iterating to converge on velocity
     bool done = false;
-    for(size_t nit = 0; nit < maxit && !done; nit++){
+    if(m->constraint_solver == CHAIN_SOLVER && solve_chain_velocities(m)){
         done = true;
-        for(size_t i=0; i < m->num_constraints; i++){
-            struct atom *a = &m->atoms[m->constraints[i].a];
-            struct atom *b = &m->atoms[m->constraints[i].b];
-            if(!a->synthesised || !b->synthesised)
-                continue;
-            if(!moved[m->constraints[i].a] && !moved[m->constraints[i].b])
-                continue;
-
-            //Constraint distance squared
-            float dsq = m->constraints[i].distance * m->constraints[i].distance;
-
-            //Get velocity and position delta
-            struct vector v_ab, r_ab;
-            vsub(&v_ab, &a->velocity, &b->velocity);
-            vsub(&r_ab, &a->position, &b->position);
-
-            //Dot product
-            float rv = vdot(&v_ab, &r_ab);
-
-            //Reciprocal masses
-            float rma = 1.0 / a->mass;
-            float rmb = 1.0 / b->mass;
-
-            //Correction term
-            float gab = -rv / ((rma + rmb) * dsq);
-
-            if(fabs(gab) > tolerance){
-                //Get position correction
-                struct vector r_delta;
-                vmul(&r_delta, &r_ab, gab);
-
-                //Update velocity vectors
-                struct vector delta_v;
-                vmul(&delta_v, &r_delta, rma);
-                if(!a->fixed)
-                    vadd_to(&a->velocity, &delta_v);
-                vmul(&delta_v, &r_delta, -rmb);
-                if(!b->fixed)
-                    vadd_to(&b->velocity, &delta_v);
-
-                done = false;
-                moving[m->constraints[i].a] = true;
-                moving[m->constraints[i].b] = true;
+    }else if(m->constraint_solver == COLOURED_SOLVER){
+        done = solve_coloured(m, NULL) <= maxit;
+    }else{
+        for(size_t nit = 0; nit < maxit && !done; nit++){
+            done = true;
+            for(size_t i=0; i < m->num_constraints; i++){
+                size_t a = m->constraints[i].a;
+                size_t b = m->constraints[i].b;
+                if(!m->synthesised[a] || !m->synthesised[b])
+                    continue;
+                if(!moved[a] && !moved[b])
+                    continue;
+
+                if(correct_velocity(m, i)){
+                    done = false;
+                    moving[a] = true;
+                    moving[b] = true;
+                }
             }
-        }
 
-        for(size_t i=0; i < m->num_atoms; i++){
-            moved[i] = moving[i];
-            moving[i] = false;
+            for(size_t i=0; i < m->num_atoms; i++){
+                moved[i] = moving[i];
+                moving[i] = false;
+            }
         }
     }
     if(!done)
         fprintf(stderr, "Warning: Maximum iterations exceeded at line %d of file %s\n", __LINE__, __FILE__);
+    m->scratch.used = scratch_used;
 }
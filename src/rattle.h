@@ -1,8 +1,33 @@
 #ifndef RATTLE_H_
 
+#include "model.h"
+
+//Bounds of the adaptive timestep controller
+#define DEFAULT_MIN_TIMESTEP 0.01
+#define DEFAULT_MAX_TIMESTEP 0.4
+#define DEFAULT_MAX_DISPLACEMENT 0.1
+#define DEFAULT_MAX_CONSTRAINT_ITERATIONS 20
+#define DEFAULT_MAX_KINETIC_ENERGY 1
+//Number of steps within the bounds before the adaptive timestep is increased
+#define ADAPTIVE_GROW_STEPS 20
+#define ADAPTIVE_GROW_FACTOR 1.25
+
 struct model;
+struct lanes;
 void rattle_push(struct model *m);
+void rattle_adaptive_push(struct model *m);
+void rattle_respa_push(struct model *m);
+void rattle_push_lanes(struct lanes *l);
 void rattle_unconstrained_push(struct model *m);
 void rattle_move(struct model *m);
+size_t rattle_constrain_positions(struct model *m, struct vector *uncons,
+        double *max_disp_sq);
+void rattle_constrain_velocities(struct model *m);
+enum constraint_solver rattle_parse_solver(const char *name);
+int rattle_colour_constraints(struct model *m);
+int rattle_chain_constraints(struct model *m);
+int rattle_init_solver(struct model *m);
+int rattle_copy_chain(struct model *r, const struct model *m);
+void rattle_free_chain(struct constraint_chain *chain);
 
 #endif /* RATTLE_H_ */
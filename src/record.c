@@ -33,18 +33,18 @@ void record_free(struct record *r){
 
 void record_add(struct record *r, struct model *m){
     for(size_t i=0; i < m->num_atoms; i++){
-        if(m->atoms[i].fixed)
+        if(m->fixed[i])
             continue;
 
         if(r->nrecords[i] == 0){
             //If we don't have a reference point, just set that.
-            vector_copy_to(&r->prev_vec[i], &m->atoms[i].position);
+            vector_copy_to(&r->prev_vec[i], &m->positions[i]);
             r->nrecords[i]++;
         }else{
             //Calculate jitter and copy current position to previous vector
             struct vector displ;
-            vsub(&displ, &m->atoms[i].position, &r->prev_vec[i]);
-            vector_copy_to(&r->prev_vec[i], &m->atoms[i].position);
+            vsub(&displ, &m->positions[i], &r->prev_vec[i]);
+            vector_copy_to(&r->prev_vec[i], &m->positions[i]);
             double jitter = vmag(&displ);
 
             //Calculate the sum of the previous jitters from the current avg.
@@ -26,16 +26,13 @@ void residue_free(struct residue *r){
 
 void atom_init(struct atom *a, int id, const char *name){
     a->id = id;
-    a->synthesised = false;
     a->name[0] = '\0';
     strncat(a->name, name, MAX_ATOM_NAME_SZ-1);
     a->radius = 0;
-    a->fixed = false;
-    vector_zero(&a->position);
-    vector_zero(&a->velocity);
-    vector_zero(&a->force);
+    a->mass = 0;
     a->hydrophobicity = 0.0;
     a->residue_idx = 0;
+    a->backbone = false;
 }
 
 void atom_set_atom_description(struct atom *a,
@@ -2,6 +2,7 @@
 #define RESIDUE_H_
 
 #include <stddef.h>
+#include <stdint.h>
 #include <stdbool.h>
 #include "vector.h"
 #include "model.h"
@@ -43,15 +44,19 @@ struct AA_name {
     const char *threeletter;
 };
 
+///Index used to mark an atom that has not been set
+#define NO_ATOM UINT32_MAX
+
+/**
+ * Descriptive information about an atom. The per-atom data used on every step
+ * (position, velocity, force, etc.) is stored in arrays in struct model.
+ */
 struct atom {
     ///1-indexed ID
     int id;
-    bool synthesised;
     char name[MAX_ATOM_NAME_SZ];
-    struct vector position, velocity, force;
     double radius;
     double mass;
-    bool fixed;
     double hydrophobicity;
     size_t residue_idx;
     bool backbone;
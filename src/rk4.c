@@ -1,71 +1,97 @@
 #include <stdlib.h>
 #include "rk4.h"
+#include "rattle.h"
 #include "vector.h"
 #include "model.h"
 #include "residue.h"
 
+#ifdef HAVE_CONFIG_H
+#include <config.h>
+#endif
+
+/**
+ * Advance the model by one step of the classical fourth-order Runge-Kutta
+ * method. The forces are evaluated four times, at the start, twice at the
+ * midpoint and at the end of the step, with the velocities of each stage so
+ * that the drag is included. The time is not changed until the end of the
+ * step, so water kicks are scheduled once for the whole step.
+ *
+ * Fixed atoms are not moved. Runge-Kutta knows nothing of the constraints, so
+ * the positions at the end of the step are projected onto the constraints
+ * from those at the start, and the velocities onto the constraints at the
+ * new positions, as in RATTLE.
+ */
 void rk4_push(struct model *model){
+    //Position of each stage relative to the step, and the weight of each
+    static const double stage[4] = {0, 0.5, 0.5, 1};
+    static const double weight[4] = {1.0 / 6, 2.0 / 6, 2.0 / 6, 1.0 / 6};
     double dt = model->timestep;
-    model->time += dt;
 
-    struct vector orig_pos[model->num_atoms];
-    struct vector k1[model->num_atoms];
-    struct vector k2[model->num_atoms];
-    struct vector k3[model->num_atoms];
-    struct vector k4[model->num_atoms];
+    size_t scratch_used = model->scratch.used;
+    size_t size = sizeof(struct vector) * model->num_atoms;
+    struct vector *orig_pos = model_scratch(model, size);
+    struct vector *orig_vel = model_scratch(model, size);
+    struct vector *sum_pos = model_scratch(model, size);
+    struct vector *sum_vel = model_scratch(model, size);
 
-    struct atom *atoms = model->atoms;
+    struct vector *pos = model->positions;
+    struct vector *vel = model->velocities;
+    struct vector *frc = model->forces;
+    double *inv_mass = model->inv_masses;
 
-    model_accumulate_forces(model);
-    #pragma omp parallel for shared(atoms, orig_pos, k1, k2, k3, k4)
     for(size_t i=0; i < model->num_atoms; i++){
-        vector_copy_to(&orig_pos[i], &atoms[i].position);
-        vector_copy_to(&k1[i], &atoms[i].force);
-        vdiv_by(&k1[i], atoms[i].mass);
-
-        vector_copy_to(&atoms[i].position, &k1[i]);
-        vmul_by(&atoms[i].position, dt/2);
-        vadd_to(&atoms[i].position, &orig_pos[i]);
+        if(model->fixed[i])
+            vector_zero(&vel[i]);
+        vector_copy_to(&orig_pos[i], &pos[i]);
+        vector_copy_to(&orig_vel[i], &vel[i]);
+        vector_zero(&sum_pos[i]);
+        vector_zero(&sum_vel[i]);
     }
 
-    model_accumulate_forces(model);
-    #pragma omp parallel for shared(atoms, orig_pos, k1, k2, k3, k4)
-    for(size_t i=0; i < model->num_atoms; i++){
-        vector_copy_to(&k2[i], &atoms[i].force);
-        vdiv_by(&k2[i], atoms[i].mass);
+    for(size_t k=0; k < 4; k++){
+        model_accumulate_forces(model);
+        double next = k < 3 ? stage[k + 1] * dt : 0;
 
-        vector_copy_to(&atoms[i].position, &k2[i]);
-        vmul_by(&atoms[i].position, dt/2);
-        vadd_to(&atoms[i].position, &orig_pos[i]);
-    }
+        #ifdef HAVE_OPENMP
+        #pragma omp parallel for
+        #endif
+        for(size_t i=0; i < model->num_atoms; i++){
+            if(model->fixed[i])
+                continue;
 
-    model_accumulate_forces(model);
-    #pragma omp parallel for shared(atoms, orig_pos, k1, k2, k3, k4)
-    for(size_t i=0; i < model->num_atoms; i++){
-        vector_copy_to(&k3[i], &atoms[i].force);
-        vdiv_by(&k3[i], atoms[i].mass);
+            //The derivatives of this stage are its velocity and acceleration
+            struct vector accel, d;
+            vmul(&accel, &frc[i], inv_mass[i]);
+            vmul(&d, &vel[i], weight[k]);
+            vadd_to(&sum_pos[i], &d);
+            vmul(&d, &accel, weight[k]);
+            vadd_to(&sum_vel[i], &d);
 
-        vector_copy_to(&atoms[i].position, &k3[i]);
-        vmul_by(&atoms[i].position, dt);
-        vadd_to(&atoms[i].position, &orig_pos[i]);
+            //Move to the start of the next stage
+            if(k < 3){
+                vmul(&d, &vel[i], next);
+                vadd(&pos[i], &orig_pos[i], &d);
+                vmul(&d, &accel, next);
+                vadd(&vel[i], &orig_vel[i], &d);
+            }
+        }
     }
 
-    model_accumulate_forces(model);
-    #pragma omp parallel for shared(atoms, orig_pos, k1, k2, k3, k4)
+    //The projection needs the positions from the start of the step, which
+    //satisfy the constraints.
     for(size_t i=0; i < model->num_atoms; i++){
-        vector_copy_to(&k4[i], &atoms[i].force);
-        vdiv_by(&k4[i], atoms[i].mass);
-
-        vmul_by(&k1[i], 1*dt/6);
-        vmul_by(&k2[i], 2*dt/6);
-        vmul_by(&k3[i], 2*dt/6);
-        vmul_by(&k4[i], 1*dt/6);
-        vadd_to(&atoms[i].velocity, &k1[i]);
-        vadd_to(&atoms[i].velocity, &k2[i]);
-        vadd_to(&atoms[i].velocity, &k3[i]);
-        vadd_to(&atoms[i].velocity, &k4[i]);
-
-        vmul(&atoms[i].position, &atoms[i].velocity, dt);
-        vadd_to(&atoms[i].position, &orig_pos[i]);
+        vector_copy_to(&pos[i], &orig_pos[i]);
+        if(model->fixed[i]){
+            vector_copy_to(&sum_pos[i], &orig_pos[i]);
+            continue;
+        }
+        vmul_by(&sum_pos[i], dt);
+        vadd_to(&sum_pos[i], &orig_pos[i]);
+        vmul_by(&sum_vel[i], dt);
+        vadd(&vel[i], &orig_vel[i], &sum_vel[i]);
     }
+    rattle_constrain_positions(model, sum_pos, NULL);
+    rattle_constrain_velocities(model);
+    model->time += dt;
+    model->scratch.used = scratch_used;
 }
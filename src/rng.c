@@ -0,0 +1,55 @@
+#include <stdlib.h>
+#include <string.h>
+#include "rng.h"
+
+extern inline int rng_rand(struct rng *r);
+extern inline void philox4x32(const uint32_t ctr[4], const uint32_t key[2],
+        uint32_t out[4]);
+extern inline void rng_counter(const struct rng *r, uint64_t step,
+        uint32_t idx, uint32_t out[4]);
+extern inline double rng_uniform(uint32_t x);
+
+/**
+ * Allocate a random number generator with the given seed.
+ *
+ * \return The generator, or NULL if out of memory.
+ */
+struct rng *rng_alloc(unsigned int seed){
+    struct rng *r = malloc(sizeof(*r));
+    if(r)
+        rng_seed(r, seed);
+    return r;
+}
+
+///Reset a generator to the start of the sequence for seed
+void rng_seed(struct rng *r, unsigned int seed){
+    //The state must be cleared before initstate_r is called
+    memset(r, 0, sizeof(*r));
+    initstate_r(seed, r->state, sizeof(r->state), &r->data);
+    r->key[0] = seed;
+    r->key[1] = 0;
+    r->step = 0;
+}
+
+void rng_free(struct rng *r){
+    free(r);
+}
+
+///Save the position of a generator in its sequence.
+void rng_save(const struct rng *r, struct rng_position *p){
+    memcpy(p->state, r->state, sizeof(p->state));
+    p->front = r->data.fptr - r->data.state;
+    p->rear = r->data.rptr - r->data.state;
+    memcpy(p->key, r->key, sizeof(p->key));
+    p->step = r->step;
+}
+
+///Return a generator to a position saved by rng_save.
+void rng_restore(struct rng *r, const struct rng_position *p){
+    rng_seed(r, 0);
+    memcpy(r->state, p->state, sizeof(r->state));
+    r->data.fptr = r->data.state + p->front;
+    r->data.rptr = r->data.state + p->rear;
+    memcpy(r->key, p->key, sizeof(r->key));
+    r->step = p->step;
+}
@@ -0,0 +1,96 @@
+#ifndef RNG_H_
+#define RNG_H_
+
+#include <stdlib.h>
+#include <stdint.h>
+
+/** Size of the generator state. This is the size used by rand(), so that a
+ * generator gives the same sequence as rand() after srand() with the same
+ * seed. */
+#define RNG_STATE_SZ 128
+
+/**
+ * Random number generator. Each model has its own, so that several models can
+ * be simulated at once, each with their own seed.
+ *
+ * Besides the sequential generator, which is used for synthesis, there is a
+ * counter-based generator (Philox4x32-10) for numbers drawn for every atom on
+ * every step. A block of numbers depends only on the seed, the step and the
+ * atom, so the atoms can be handled in any order, by any number of threads.
+ */
+struct rng {
+    struct random_data data;
+    char state[RNG_STATE_SZ];
+    ///Key of the counter-based generator, derived from the seed
+    uint32_t key[2];
+    ///Next step for which counter-based numbers will be drawn
+    uint64_t step;
+};
+
+/**
+ * Position of a generator in its sequence. The generator itself holds
+ * pointers into its state, so this is what is saved in a checkpoint.
+ */
+struct rng_position {
+    char state[RNG_STATE_SZ];
+    int32_t front, rear;
+    uint32_t key[2];
+    uint64_t step;
+};
+
+struct rng *rng_alloc(unsigned int seed);
+void rng_seed(struct rng *r, unsigned int seed);
+void rng_free(struct rng *r);
+void rng_save(const struct rng *r, struct rng_position *p);
+void rng_restore(struct rng *r, const struct rng_position *p);
+
+///Get a random number between 0 and RAND_MAX
+inline int rng_rand(struct rng *r){
+    int32_t x;
+    random_r(&r->data, &x);
+    return x;
+}
+
+#define PHILOX_M0 0xD2511F53u
+#define PHILOX_M1 0xCD9E8D57u
+#define PHILOX_W0 0x9E3779B9u
+#define PHILOX_W1 0xBB67AE85u
+#define PHILOX_ROUNDS 10
+
+/**
+ * Philox4x32-10: encrypt the counter ctr with key, giving four independent
+ * random 32-bit numbers in out.
+ */
+inline void philox4x32(const uint32_t ctr[4], const uint32_t key[2],
+        uint32_t out[4]){
+    uint32_t c0 = ctr[0], c1 = ctr[1], c2 = ctr[2], c3 = ctr[3];
+    uint32_t k0 = key[0], k1 = key[1];
+    for(int i=0; i < PHILOX_ROUNDS; i++){
+        uint64_t p0 = (uint64_t)PHILOX_M0 * c0;
+        uint64_t p1 = (uint64_t)PHILOX_M1 * c2;
+        c0 = (uint32_t)(p1 >> 32) ^ c1 ^ k0;
+        c1 = (uint32_t)p1;
+        c2 = (uint32_t)(p0 >> 32) ^ c3 ^ k1;
+        c3 = (uint32_t)p0;
+        k0 += PHILOX_W0;
+        k1 += PHILOX_W1;
+    }
+    out[0] = c0;
+    out[1] = c1;
+    out[2] = c2;
+    out[3] = c3;
+}
+
+///Get the block of four random numbers for atom idx on the given step
+inline void rng_counter(const struct rng *r, uint64_t step, uint32_t idx,
+        uint32_t out[4]){
+    uint32_t ctr[4] = {idx, 0, (uint32_t)step, (uint32_t)(step >> 32)};
+    philox4x32(ctr, r->key, out);
+}
+
+///Convert a random 32-bit number to a double in [0, 1)
+inline double rng_uniform(uint32_t x){
+    return x * (1.0 / 4294967296.0);
+}
+
+#endif /* RNG_H_ */
@@ -1,8 +1,20 @@
 #include <stdlib.h>
 #include <stdio.h>
+#include <stdarg.h>
+#include <stdint.h>
 #include <errno.h>
 #include <string.h>
+#include <strings.h>
 #include <ctype.h>
+#include <unistd.h>
+
+#ifdef HAVE_CONFIG_H
+#include <config.h>
+#endif
+
+#ifdef HAVE_ZLIB
+#include <zlib.h>
+#endif
 
 #include "springreader.h"
 #include "residue.h"
@@ -10,6 +22,8 @@
 #include "torsion_spring.h"
 #include "bond_angle.h"
 #include "rama.h"
+#include "rattle.h"
+#include "integrator.h"
 
 #include "cJSON/cJSON.h"
 
@@ -26,43 +40,233 @@
     goto label; \
 } while(0)
 
+//Size of the blocks in which a specification file is read
+#define STREAM_BLOCK_SZ 65536
+//Maximum length of the keys read by the streaming parser
+#define MAX_KEY_SZ 64
+
+//Growable buffer of text
+struct text_buffer {
+    char *text;
+    size_t len;
+    size_t size;
+};
+
+/*
+ * JSON text read by the streaming parser. The text is read into block in
+ * pieces by read_block, so a large specification never has to be held in
+ * memory all at once. If read_block is NULL, buf holds all of the text.
+ */
+struct json_stream {
+    ssize_t (*read_block)(void *src, char *block, size_t len);
+    void *src;
+    char *block;
+    const char *buf;
+    size_t pos, len;
+    //Line number, for error messages
+    int line;
+    //Set when an error has been reported
+    bool failed;
+    //If not NULL, text that is read is also appended to this buffer
+    struct text_buffer *capture;
+};
+
+/*
+ * Bonded terms, which make up the bulk of a large specification and are read
+ * straight into the model by the streaming parser.
+ */
+enum term_kind {
+    LINEAR_TERM,
+    ANGLE_TERM,
+    TORSION_TERM,
+    CONSTRAINT_TERM,
+    UNKNOWN_TERM
+};
+
+static const struct term_info {
+    //Top-level key of the array of terms
+    const char *section;
+    //Name of a single term in error messages
+    const char *name;
+    //Key holding the equilibrium distance or angle
+    const char *value_key;
+    size_t natoms;
+} term_info[UNKNOWN_TERM] = {
+    [LINEAR_TERM]     = {"linear",      "spring",     "distance", 2},
+    [ANGLE_TERM]      = {"angle",       "angle",      "angle",    3},
+    [TORSION_TERM]    = {"torsion",     "torsion",    "angle",    4},
+    [CONSTRAINT_TERM] = {"constraints", "constraint", "distance", 2},
+};
+
+/*
+ * Fields of a single bonded term. Atom indices are converted to start from 0,
+ * but are not checked against the number of atoms because the terms may be
+ * read before the atoms.
+ */
+struct term {
+    uint32_t atoms[4];
+    size_t natoms;
+    double value, constant, cutoff;
+    bool has_atoms, has_value, has_constant, has_cutoff;
+    bool has_hand;
+    uint32_t inner, outer;
+    bool right_handed;
+};
+
 static void print_cjson_error(const char *json_str);
 static void set_double_if_set(cJSON *root, const char *key, double *dst);
 static void set_int_if_set(cJSON *root, const char *key, int *dst);
 static void set_bool_if_set(cJSON *root, const char *key, bool *dst);
 static void set_string_if_set(cJSON *root, const char *key, char **dst);
 
+static struct model *parse_stream(struct json_stream *s);
 static int read_residues(cJSON *root, struct model *m);
 static int read_atoms(cJSON *root, struct model *m);
-static int read_springs(cJSON *root, struct model *m);
-static int read_angles(cJSON *root, struct model *m);
-static int read_torsions(cJSON *root, struct model *m);
+static int read_terms(struct json_stream *s, struct model *m,
+        enum term_kind kind);
+static int read_term(struct json_stream *s, enum term_kind kind, size_t idx,
+        struct term *t);
+static int read_handedness(struct json_stream *s, size_t idx, struct term *t);
+static int read_atom_index(struct json_stream *s, const char *name,
+        size_t idx, uint32_t *dst);
 static int read_rama(cJSON *root, struct model *m);
-static int read_constraints(cJSON *root, struct model *m);
 static int read_atom_definitions(cJSON *root);
 
 static int check_mandatory_keys(cJSON *root, const char **keys, size_t nkeys,
     const char *fmt);
 
+static ssize_t read_block(void *src, char *block, size_t len);
+static void js_init(struct json_stream *s,
+        ssize_t (*read_block)(void *, char *, size_t),
+        void *src, char *block);
+static void js_error(struct json_stream *s, const char *fmt, ...);
+static int js_skip_ws(struct json_stream *s);
+static bool js_accept(struct json_stream *s, char c);
+static int js_expect(struct json_stream *s, char c);
+static int js_string(struct json_stream *s, char *dst, size_t size);
+static int js_number(struct json_stream *s, double *dst);
+static int js_skip_value(struct json_stream *s);
+static int js_next_key(struct json_stream *s, char *key, size_t size,
+        bool *first);
+static int js_next_item(struct json_stream *s, bool *first);
+static int text_push(struct text_buffer *t, char c);
+
 /**
  * Parse  a configuration string into a model.
  *
  * \return A populated model or NULL on error.
  */
 struct model * springreader_parse_str(const char *str){
+    struct json_stream s;
+    js_init(&s, NULL, NULL, NULL);
+    s.buf = str;
+    s.len = strlen(str);
+    return parse_stream(&s);
+}
+
+/**
+ * Parse a configuration file into a model. The file is read in blocks as it
+ * is parsed rather than all at once, so it may be a pipe. If file is "-", the
+ * configuration is read from standard input. If poing2 was built with zlib,
+ * files compressed with gzip are decompressed as they are read.
+ *
+ * \return A populated model or NULL on error.
+ */
+struct model * springreader_parse_file(const char *file){
     struct model *m = NULL;
-    char *copy = strdup(str);
-    if(!copy)
-        goto_err(error, "Error allocating copy of json string\n");
+    char *block = malloc(STREAM_BLOCK_SZ);
+    if(!block)
+        goto_perror(bail, "Error allocating input buffer");
+
+    bool from_stdin = strcmp(file, "-") == 0;
+#ifdef HAVE_ZLIB
+    gzFile in = from_stdin
+        ? gzdopen(dup(STDIN_FILENO), "rb")
+        : gzopen(file, "rb");
+#else
+    FILE *in = from_stdin ? stdin : fopen(file, "r");
+#endif
+    if(!in)
+        goto_perror(free_block, "Error reading input file");
+
+    struct json_stream s;
+    js_init(&s, read_block, in, block);
+    m = parse_stream(&s);
+
+#ifdef HAVE_ZLIB
+    gzclose(in);
+#else
+    if(!from_stdin)
+        fclose(in);
+#endif
+free_block:
+    free(block);
+bail:
+    return m;
+}
+
+/*
+ * Parse a configuration from a stream of JSON text. The bonded terms are read
+ * directly into the model as they are parsed. Everything else is small, so
+ * the text of each of the other top-level values is parsed with cJSON and
+ * added to a root object, which is then read as a whole.
+ */
+struct model *parse_stream(struct json_stream *s){
+    struct text_buffer text = {NULL, 0, 0};
+    cJSON *root = NULL;
 
-    m = model_alloc();
+    struct model *m = model_alloc();
     if(!m)
         goto_err(error, "Error allocating model\n");
-
-    //Read the JSON object
-    cJSON *root = cJSON_Parse(str);
+    root = cJSON_CreateObject();
     if(!root)
-        goto_cjson_error(free_copy, str, "Error parsing JSON root\n");
+        goto_err(error, "Error allocating JSON root\n");
+
+#ifndef HAVE_ZLIB
+    //Check for the gzip magic number, because no JSON starts with it
+    if(js_skip_ws(s) == 0x1f)
+        goto_err(error, "Compressed configuration files are not supported "
+                "without zlib\n");
+#endif
+
+    char key[MAX_KEY_SZ];
+    bool first = true;
+    int more;
+    while((more = js_next_key(s, key, sizeof(key), &first)) == 1){
+        enum term_kind kind = 0;
+        while(kind < UNKNOWN_TERM
+                && strcasecmp(key, term_info[kind].section) != 0)
+            kind++;
+        if(kind != UNKNOWN_TERM){
+            if(read_terms(s, m, kind))
+                goto error;
+            continue;
+        }
+
+        //Keep a copy of the text of any other value and parse it with cJSON
+        text.len = 0;
+        js_skip_ws(s);
+        s->capture = &text;
+        int fail = js_skip_value(s);
+        s->capture = NULL;
+        if(fail || text_push(&text, '\0'))
+            goto error;
+
+        cJSON *item = cJSON_Parse(text.text);
+        if(!item)
+            goto_cjson_error(error, text.text,
+                    "Error parsing value of key '%s'\n", key);
+        cJSON_AddItemToObject(root, key, item);
+    }
+    if(more < 0)
+        goto error;
+    if(js_skip_ws(s) != EOF)
+        js_error(s, "Unexpected text after JSON root");
+    if(s->failed)
+        goto error;
+    free(text.text);
+    text.text = NULL;
+
     //Set config values
     set_double_if_set(root, "timestep", &m->timestep);
     set_double_if_set(root, "synth_time", &m->synth_time);
@@ -71,6 +275,16 @@ struct model * springreader_parse_str(const char *str){
     set_double_if_set(root, "until", &m->until);
     set_double_if_set(root, "record_time", &m->record_time);
     set_double_if_set(root, "max_jitter", &m->max_jitter);
+    set_double_if_set(root, "verlet_skin", &m->verlet_skin);
+    set_double_if_set(root, "slow_spring_constant", &m->slow_spring_constant);
+    set_int_if_set(root, "respa_steps", &m->respa_steps);
+    set_bool_if_set(root, "adaptive_timestep", &m->adaptive_timestep);
+    set_double_if_set(root, "min_timestep", &m->min_timestep);
+    set_double_if_set(root, "max_timestep", &m->max_timestep);
+    set_double_if_set(root, "max_displacement", &m->max_displacement);
+    set_int_if_set(root, "max_constraint_iterations",
+            &m->max_constraint_iterations);
+    set_double_if_set(root, "max_kinetic_energy", &m->max_kinetic_energy);
     set_bool_if_set(root, "use_sterics", &m->use_sterics);
     set_bool_if_set(root, "fix", &m->fix);
     set_bool_if_set(root, "threestate", &m->threestate);
@@ -79,22 +293,75 @@ struct model * springreader_parse_str(const char *str){
     set_bool_if_set(root, "do_synthesis", &m->do_synthesis);
     set_int_if_set(root, "fix_before", &m->fix_before);
 
-    if(read_atom_definitions(root)) goto free_copy;
-    if(read_residues(root, m))    goto free_copy;
-    if(read_atoms(root, m))       goto free_copy;
-    if(read_springs(root, m))     goto free_copy;
-    if(read_angles(root, m))      goto free_copy;
-    if(read_torsions(root, m))    goto free_copy;
-    if(read_rama(root, m))        goto free_copy;
-    if(read_constraints(root, m)) goto free_copy;
+    cJSON *solver = cJSON_GetObjectItem(root, "constraint_solver");
+    if(solver){
+        if(!solver->valuestring)
+            goto_err(error, "The 'constraint_solver' key must be a string\n");
+        m->constraint_solver = rattle_parse_solver(solver->valuestring);
+        if(m->constraint_solver == UNKNOWN_SOLVER)
+            goto_err(error, "Unknown constraint solver '%s'\n",
+                    solver->valuestring);
+    }
+
+    cJSON *integrator = cJSON_GetObjectItem(root, "integrator");
+    if(integrator){
+        if(!integrator->valuestring)
+            goto_err(error, "The 'integrator' key must be a string\n");
+        m->integrator = integrator_parse(integrator->valuestring);
+        if(m->integrator == UNKNOWN_INTEGRATOR)
+            goto_err(error, "Unknown integrator '%s'\n",
+                    integrator->valuestring);
+    }
+
+    if(m->respa_steps < 1)
+        goto_err(error, "The 'respa_steps' key must be at least 1\n");
+    cJSON *slow = cJSON_GetObjectItem(root, "slow_forces");
+    if(slow){
+        if(slow->type != cJSON_Array)
+            goto_err(error, "The 'slow_forces' key must be an array\n");
+        for(cJSON *term = slow->child; term; term = term->next){
+            enum force_term t = term->valuestring
+                ? model_parse_force_term(term->valuestring) : FORCE_UNKNOWN;
+            if(t == FORCE_UNKNOWN)
+                goto_err(error, "Unknown force term in 'slow_forces'\n");
+            m->slow_terms |= t;
+        }
+    }
 
-    free(copy);
+    if(m->adaptive_timestep){
+        if(m->min_timestep <= 0 || m->min_timestep > m->timestep
+                || m->max_timestep < m->timestep)
+            goto_err(error, "The timestep must be between 'min_timestep' and "
+                    "'max_timestep', which must be positive\n");
+        if(m->respa_steps > 1)
+            goto_err(error, "The 'adaptive_timestep' key can't be used with "
+                    "'respa_steps'\n");
+    }
+    if(m->integrator != RATTLE_INTEGRATOR
+            && (m->respa_steps > 1 || m->adaptive_timestep))
+        goto_err(error, "The 'respa_steps' and 'adaptive_timestep' keys can "
+                "only be used with the RATTLE integrator\n");
+
+    if(read_atom_definitions(root)) goto error;
+    if(read_residues(root, m))    goto error;
+    if(read_atoms(root, m))       goto error;
+    if(check_term_atoms(m))       goto error;
+    if(read_rama(root, m))        goto error;
+
+    cJSON_Delete(root);
     return m;
 
-free_copy:
-    free(copy);
 error:
-    free(m);
+    free(text.text);
+    if(root)
+        cJSON_Delete(root);
+    if(m){
+        free(m->linear_springs);
+        free(m->bond_angles);
+        free(m->torsion_springs);
+        free(m->constraints);
+        free(m);
+    }
     return NULL;
 }
 
@@ -136,9 +403,7 @@ int read_atoms(cJSON *root, struct model *m){
 
     //Malloc the atoms array
     int natoms = cJSON_GetArraySize(atoms);
-    m->num_atoms = natoms;
-    m->atoms = malloc(sizeof(*m->atoms) * natoms);
-    if(!m->atoms)
+    if(model_alloc_atoms(m, natoms))
         goto_perror(error, "Error allocating atoms array\n");
 
     //Get all the atoms
@@ -168,17 +433,20 @@ int read_atoms(cJSON *root, struct model *m){
             goto_err(free_atoms, "Residue index %d out of range at atom %lu\n",
                     residue->valueint, i+1);
 
-        struct atom *a = &m->atoms[id->valueint-1];
+        size_t idx = id->valueint - 1;
+        struct atom *a = &m->atoms[idx];
         atom_init(a, id->valueint, name->valuestring);
         a->residue_idx = residue->valueint - 1;
         atom_set_atom_description(a, desc);
+        m->inv_masses[idx] = 1.0 / a->mass;
         if(!m->do_synthesis)
-            a->synthesised = true;
+            m->synthesised[idx] = true;
 
         if(position){
-            a->position.c[0] = cJSON_GetArrayItem(position, 0)->valuedouble;
-            a->position.c[1] = cJSON_GetArrayItem(position, 1)->valuedouble;
-            a->position.c[2] = cJSON_GetArrayItem(position, 2)->valuedouble;
+            struct vector *pos = &m->positions[idx];
+            pos->c[0] = cJSON_GetArrayItem(position, 0)->valuedouble;
+            pos->c[1] = cJSON_GetArrayItem(position, 1)->valuedouble;
+            pos->c[2] = cJSON_GetArrayItem(position, 2)->valuedouble;
         }
 
     }
@@ -186,269 +454,322 @@ int read_atoms(cJSON *root, struct model *m){
 
 free_atoms:
     free(m->atoms);
+    free(m->positions);
+    free(m->velocities);
+    free(m->forces);
+    free(m->inv_masses);
+    free(m->fixed);
+    free(m->synthesised);
 error:
     return -1;
 }
 
-int read_constraints(cJSON *root, struct model *m){
-    cJSON *constraints = cJSON_GetObjectItem(root, "constraints");
-
-    //It's valid to have no springs, so this isn't an error
-    if(!constraints)
-        return 0;
-
-    //Find the number of springs we have and malloc an array
-    int nsprings = cJSON_GetArraySize(constraints);
-    m->num_constraints = nsprings;
-    m->constraints = malloc(sizeof(*m->constraints) * nsprings);
-    if(!m->constraints)
-        goto_perror(alloc_err, "Error allocating constraints array\n");
-
-    const char *mandatory[2] = {"atoms", "distance"};
-    size_t i=0;
-    for(cJSON *spring = constraints->child; spring; spring = spring->next, i++){
-        int fail = check_mandatory_keys(spring, mandatory, 2,
-                "Constraint no. %d missing key '%s'\n");
-        if(fail)
-            goto free_springs;
-
-        cJSON *atoms    = cJSON_GetObjectItem(spring, "atoms");
-        cJSON *distance = cJSON_GetObjectItem(spring, "distance");
-
-        if(atoms->type != cJSON_Array)
-            goto_err(free_springs,
-                    "Key 'atoms' must be an array in spring %lu\n", i+1);
-        if(cJSON_GetArraySize(atoms) != 2)
-            goto_err(free_springs,
-                    "Key 'atoms' must contain 2 atoms in spring %lu\n", i+1);
+/*
+ * Read an array of bonded terms from the stream into the model. The array of
+ * terms is grown as they are read and trimmed to size at the end.
+ */
+int read_terms(struct json_stream *s, struct model *m, enum term_kind kind){
+    const struct term_info *info = &term_info[kind];
+    size_t elem_sz = 0;
+    bool seen = false;
+    switch(kind){
+    case LINEAR_TERM:
+        elem_sz = sizeof(*m->linear_springs);
+        seen = m->linear_springs != NULL;
+        break;
+    case ANGLE_TERM:
+        elem_sz = sizeof(*m->bond_angles);
+        seen = m->bond_angles != NULL;
+        break;
+    case TORSION_TERM:
+        elem_sz = sizeof(*m->torsion_springs);
+        seen = m->torsion_springs != NULL;
+        break;
+    case CONSTRAINT_TERM:
+        elem_sz = sizeof(*m->constraints);
+        seen = m->constraints != NULL;
+        break;
+    default:
+        break;
+    }
+    if(seen){
+        js_error(s, "Key '%s' given more than once", info->section);
+        return 1;
+    }
 
-        for(cJSON *a = atoms->child; a; a = a->next){
-            if(a->valueint - 1 < 0 || a->valueint - 1 >= m->num_atoms)
-                goto_err(free_springs,
-                        "Atom %d does not exist in spring %lu\n",
-                        a->valueint, i + 1);
+    char *terms = NULL;
+    size_t n = 0, capacity = 0;
+    bool first = true;
+    int more;
+    while((more = js_next_item(s, &first)) == 1){
+        struct term t;
+        if(read_term(s, kind, n + 1, &t))
+            goto error;
+
+        if(n == capacity){
+            size_t new_capacity = capacity ? capacity + capacity / 2 : 1024;
+            char *grown = realloc(terms, new_capacity * elem_sz);
+            if(!grown)
+                goto_perror(error, "Error allocating bonded terms");
+            terms = grown;
+            capacity = new_capacity;
         }
 
-        int a1 = cJSON_GetArrayItem(atoms, 0)->valueint - 1;
-        int a2 = cJSON_GetArrayItem(atoms, 1)->valueint - 1;
+        void *dst = terms + n * elem_sz;
+        switch(kind){
+        case LINEAR_TERM: {
+            struct linear_spring *spring = dst;
+            linear_spring_init(spring, t.value,
+                    t.has_constant ? t.constant : DEFAULT_SPRING_CONSTANT,
+                    t.atoms[0], t.atoms[1]);
+            if(t.has_cutoff)
+                spring->cutoff = t.cutoff;
+            if(t.has_hand){
+                spring->inner = t.inner;
+                spring->outer = t.outer;
+                spring->right_handed = t.right_handed;
+            }
+            break;
+        }
+        case ANGLE_TERM: {
+            struct bond_angle_spring *angle = dst;
+            bond_angle_spring_init(angle, t.atoms[0], t.atoms[1], t.atoms[2],
+                    t.value,
+                    t.has_constant ? t.constant : DEFAULT_BOND_ANGLE_CONST);
+            if(t.has_cutoff)
+                angle->cutoff = t.cutoff;
+            break;
+        }
+        case TORSION_TERM: {
+            struct torsion_spring *torsion = dst;
+            torsion_spring_init(torsion,
+                    t.atoms[0], t.atoms[1], t.atoms[2], t.atoms[3],
+                    t.value,
+                    t.has_constant ? t.constant : DEFAULT_TORSION_CONST);
+            if(t.has_cutoff)
+                torsion->cutoff = t.cutoff;
+            break;
+        }
+        case CONSTRAINT_TERM: {
+            struct constraint *c = dst;
+            c->a = t.atoms[0];
+            c->b = t.atoms[1];
+            c->distance = t.value;
+            break;
+        }
+        default:
+            break;
+        }
+        n++;
+    }
+    if(more < 0)
+        goto error;
+
+    //Give back the unused space
+    if(n == 0){
+        free(terms);
+        terms = NULL;
+    }else if(n < capacity){
+        char *trimmed = realloc(terms, n * elem_sz);
+        if(trimmed)
+            terms = trimmed;
+    }
 
-        struct constraint *s = &m->constraints[i];
-        s->a = a1;
-        s->b = a2;
-        s->distance = distance->valuedouble;
+    switch(kind){
+    case LINEAR_TERM:
+        m->linear_springs = (struct linear_spring *)terms;
+        m->num_linear_springs = n;
+        break;
+    case ANGLE_TERM:
+        m->bond_angles = (struct bond_angle_spring *)terms;
+        m->num_bond_angles = n;
+        break;
+    case TORSION_TERM:
+        m->torsion_springs = (struct torsion_spring *)terms;
+        m->num_torsion_springs = n;
+        break;
+    case CONSTRAINT_TERM:
+        m->constraints = (struct constraint *)terms;
+        m->num_constraints = n;
+        break;
+    default:
+        break;
     }
     return 0;
 
-free_springs:
-    free(m->constraints);
-alloc_err:
+error:
+    free(terms);
     return 1;
 }
 
-int read_springs(cJSON *root, struct model *m){
-    cJSON *springs = cJSON_GetObjectItem(root, "linear");
-
-    //It's valid to have no springs, so this isn't an error
-    if(!springs)
-        return 0;
-
-    //Find the number of springs we have and malloc an array
-    int nsprings = cJSON_GetArraySize(springs);
-    m->num_linear_springs = nsprings;
-    m->linear_springs = malloc(sizeof(*m->linear_springs) * nsprings);
-    if(!m->linear_springs)
-        goto_perror(alloc_err, "Error allocating springs array\n");
-
-    const char *mandatory[2] = {"atoms", "distance"};
-    size_t i=0;
-    for(cJSON *spring = springs->child; spring; spring = spring->next, i++){
-        int fail = check_mandatory_keys(spring, mandatory, 2,
-                "Spring no. %d missing key '%s'\n");
-        if(fail)
-            goto free_springs;
-
-        cJSON *atoms    = cJSON_GetObjectItem(spring, "atoms");
-        cJSON *distance = cJSON_GetObjectItem(spring, "distance");
-        cJSON *constant = cJSON_GetObjectItem(spring, "constant");
-        cJSON *cutoff   = cJSON_GetObjectItem(spring, "cutoff");
-        cJSON *hand     = cJSON_GetObjectItem(spring, "handedness");
-
-        if(atoms->type != cJSON_Array)
-            goto_err(free_springs,
-                    "Key 'atoms' must be an array in spring %lu\n", i+1);
-        if(cJSON_GetArraySize(atoms) != 2)
-            goto_err(free_springs,
-                    "Key 'atoms' must contain 2 atoms in spring %lu\n", i+1);
-
-        for(cJSON *a = atoms->child; a; a = a->next){
-            if(a->valueint - 1 < 0 || a->valueint - 1 >= m->num_atoms)
-                goto_err(free_springs,
-                        "Atom %d does not exist in spring %lu\n",
-                        a->valueint, i + 1);
+//Read a single bonded term. The index idx is only used in error messages.
+int read_term(struct json_stream *s, enum term_kind kind, size_t idx,
+        struct term *t){
+    const struct term_info *info = &term_info[kind];
+    memset(t, 0, sizeof(*t));
+
+    char key[MAX_KEY_SZ];
+    bool first = true;
+    int more;
+    while((more = js_next_key(s, key, sizeof(key), &first)) == 1){
+        int fail = 0;
+        if(strcasecmp(key, "atoms") == 0){
+            t->has_atoms = true;
+            bool first_atom = true;
+            int more_atoms;
+            while((more_atoms = js_next_item(s, &first_atom)) == 1){
+                if(t->natoms == info->natoms){
+                    js_error(s, "Key 'atoms' must contain %lu atoms in %s %lu",
+                            info->natoms, info->name, idx);
+                    return 1;
+                }
+                if(read_atom_index(s, info->name, idx,
+                            &t->atoms[t->natoms++]))
+                    return 1;
+            }
+            fail = more_atoms < 0;
+        }else if(strcasecmp(key, info->value_key) == 0){
+            t->has_value = true;
+            fail = js_number(s, &t->value);
+        }else if(strcasecmp(key, "constant") == 0){
+            t->has_constant = true;
+            fail = js_number(s, &t->constant);
+        }else if(strcasecmp(key, "cutoff") == 0){
+            t->has_cutoff = true;
+            fail = js_number(s, &t->cutoff);
+        }else if(kind == LINEAR_TERM && strcasecmp(key, "handedness") == 0){
+            fail = read_handedness(s, idx, t);
+        }else{
+            fail = js_skip_value(s);
         }
+        if(fail)
+            return 1;
+    }
+    if(more < 0)
+        return 1;
 
-        int a1 = cJSON_GetArrayItem(atoms, 0)->valueint - 1;
-        int a2 = cJSON_GetArrayItem(atoms, 1)->valueint - 1;
-        double constant_f = (constant)
-            ? constant->valuedouble
-            : DEFAULT_SPRING_CONSTANT;
-
-
-        struct linear_spring *s = &m->linear_springs[i];
-        linear_spring_init(s, distance->valuedouble, constant_f,
-                &m->atoms[a1], &m->atoms[a2]);
-        if(cutoff)
-            s->cutoff = cutoff->valuedouble;
-
-        if(hand){
-            const char *mand_hand[3] = {"inner", "outer", "handedness"};
-            fail = check_mandatory_keys(hand, mand_hand, 3,
-                    "Spring no. %d missing key '%s'\n");
-            if(fail)
-                goto free_springs;
-
-            cJSON *inner = cJSON_GetObjectItem(hand, "inner");
-            cJSON *outer = cJSON_GetObjectItem(hand, "outer");
-            cJSON *handedness = cJSON_GetObjectItem(hand, "handedness");
-
-            //Check atoms exist. Tedious error checking.
-            if(inner->valueint - 1 < 0 || inner->valueint - 1 >= m->num_atoms)
-                goto_err(free_springs,
-                        "Inner atom %d does not exist in spring %lu\n",
-                        inner->valueint, i + 1);
-            if(outer->valueint - 1 < 0 || outer->valueint - 1 >= m->num_atoms)
-                goto_err(free_springs,
-                        "Outer atom %d does not exist in spring %lu\n",
-                        outer->valueint, i + 1);
-            if(strcmp(handedness->valuestring, "RIGHT") != 0
-                    && strcmp(handedness->valuestring, "LEFT") != 0)
-                goto_err(free_springs,
-                        "Handedness of spring %lu is not 'LEFT' or 'RIGHT'\n",
-                        i + 1);
-
-            s->inner = &m->atoms[inner->valueint - 1];
-            s->outer = &m->atoms[outer->valueint - 1];
-            s->right_handed = (strcmp(handedness->valuestring, "RIGHT") == 0);
-        }
+    if(!t->has_atoms){
+        js_error(s, "Missing key 'atoms' in %s %lu", info->name, idx);
+        return 1;
+    }
+    if(!t->has_value){
+        js_error(s, "Missing key '%s' in %s %lu",
+                info->value_key, info->name, idx);
+        return 1;
+    }
+    if(t->natoms != info->natoms){
+        js_error(s, "Key 'atoms' must contain %lu atoms in %s %lu",
+                info->natoms, info->name, idx);
+        return 1;
     }
     return 0;
-
-free_springs:
-    free(m->linear_springs);
-alloc_err:
-    return 1;
 }
 
-int read_angles(cJSON *root, struct model *m){
-    cJSON *springs = cJSON_GetObjectItem(root, "angle");
-
-    //It's valid to have no springs, so this isn't an error
-    if(!springs)
-        return 0;
-
-    //Find the number of springs we have and malloc an array
-    int nsprings = cJSON_GetArraySize(springs);
-    m->num_bond_angles = nsprings;
-    m->bond_angles = malloc(sizeof(*m->bond_angles) * nsprings);
-    if(!m->bond_angles)
-        goto_perror(alloc_err, "Error allocating bond angles array\n");
-
-    const char *mandatory[2] = {"atoms", "angle"};
-    size_t i=0;
-    for(cJSON *spring = springs->child; spring; spring = spring->next, i++){
-        int fail = check_mandatory_keys(spring, mandatory, 2,
-                "Angle no. %d missing key '%s'\n");
+//Read the handedness of a linear spring
+int read_handedness(struct json_stream *s, size_t idx, struct term *t){
+    bool has_inner = false, has_outer = false, has_hand = false;
+    char key[MAX_KEY_SZ];
+    bool first = true;
+    int more;
+    while((more = js_next_key(s, key, sizeof(key), &first)) == 1){
+        int fail = 0;
+        if(strcasecmp(key, "inner") == 0){
+            has_inner = true;
+            fail = read_atom_index(s, "spring", idx, &t->inner);
+        }else if(strcasecmp(key, "outer") == 0){
+            has_outer = true;
+            fail = read_atom_index(s, "spring", idx, &t->outer);
+        }else if(strcasecmp(key, "handedness") == 0){
+            char hand[MAX_KEY_SZ];
+            has_hand = true;
+            fail = js_string(s, hand, sizeof(hand));
+            if(!fail && strcmp(hand, "RIGHT") != 0
+                    && strcmp(hand, "LEFT") != 0){
+                js_error(s, "Handedness of spring %lu is not 'LEFT' or 'RIGHT'",
+                        idx);
+                fail = 1;
+            }
+            if(!fail)
+                t->right_handed = strcmp(hand, "RIGHT") == 0;
+        }else{
+            fail = js_skip_value(s);
+        }
         if(fail)
-            goto free_springs;
-
-        cJSON *atoms    = cJSON_GetObjectItem(spring, "atoms");
-        cJSON *angle    = cJSON_GetObjectItem(spring, "angle");
-        cJSON *constant = cJSON_GetObjectItem(spring, "constant");
-        cJSON *cutoff   = cJSON_GetObjectItem(spring, "cutoff");
-
-        if(atoms->type != cJSON_Array)
-            goto_err(free_springs,
-                    "Key 'atoms' must be an array in angle %lu\n", i+1);
-        if(cJSON_GetArraySize(atoms) != 3)
-            goto_err(free_springs,
-                    "Key 'atoms' must contain 3 atoms in angle %lu\n", i+1);
-
-        int a1 = cJSON_GetArrayItem(atoms, 0)->valueint - 1;
-        int a2 = cJSON_GetArrayItem(atoms, 1)->valueint - 1;
-        int a3 = cJSON_GetArrayItem(atoms, 2)->valueint - 1;
-        double constant_f = (constant)
-            ? constant->valuedouble
-            : DEFAULT_BOND_ANGLE_CONST;
+            return 1;
+    }
+    if(more < 0)
+        return 1;
 
-        struct bond_angle_spring *s = &m->bond_angles[i];
-        bond_angle_spring_init(s, &m->atoms[a1], &m->atoms[a2], &m->atoms[a3],
-                angle->valuedouble, constant_f);
-        if(cutoff)
-            s->cutoff = cutoff->valuedouble;
+    if(!has_inner || !has_outer || !has_hand){
+        js_error(s, "Missing key '%s' in handedness of spring %lu",
+                !has_inner ? "inner" : !has_outer ? "outer" : "handedness",
+                idx);
+        return 1;
     }
+    t->has_hand = true;
     return 0;
-
-free_springs:
-    free(m->bond_angles);
-alloc_err:
-    return 1;
 }
 
-int read_torsions(cJSON *root, struct model *m){
-    cJSON *springs = cJSON_GetObjectItem(root, "torsion");
-
-    //It's valid to have no springs, so this isn't an error
-    if(!springs)
-        return 0;
-
-    //Find the number of springs we have and malloc an array
-    int nsprings = cJSON_GetArraySize(springs);
-    m->num_torsion_springs = nsprings;
-    m->torsion_springs = malloc(sizeof(*m->torsion_springs) * nsprings);
-    if(!m->torsion_springs)
-        goto_perror(alloc_err, "Error allocating torsion springs array\n");
-
-    const char *mandatory[2] = {"atoms", "angle"};
-    size_t i=0;
-    for(cJSON *spring = springs->child; spring; spring = spring->next, i++){
-        int fail = check_mandatory_keys(spring, mandatory, 2,
-                "Torsion constraint no. %d missing key '%s'\n");
-        if(fail)
-            goto free_springs;
-
-        cJSON *atoms    = cJSON_GetObjectItem(spring, "atoms");
-        cJSON *angle    = cJSON_GetObjectItem(spring, "angle");
-        cJSON *constant = cJSON_GetObjectItem(spring, "constant");
-        cJSON *cutoff   = cJSON_GetObjectItem(spring, "cutoff");
-
-        if(atoms->type != cJSON_Array)
-            goto_err(free_springs,
-                    "Key 'atoms' must be an array in angle %lu\n", i+1);
-        if(cJSON_GetArraySize(atoms) != 4)
-            goto_err(free_springs,
-                    "Key 'atoms' must contain 4 atoms in angle %lu\n", i+1);
+//Read a 1-based atom ID and store it as an index starting from 0
+int read_atom_index(struct json_stream *s, const char *name, size_t idx,
+        uint32_t *dst){
+    double id;
+    if(js_number(s, &id))
+        return 1;
+    if(id < 1 || id > UINT32_MAX){
+        js_error(s, "Atom %g does not exist in %s %lu", id, name, idx);
+        return 1;
+    }
+    *dst = (uint32_t)id - 1;
+    return 0;
+}
 
-        int a1 = cJSON_GetArrayItem(atoms, 0)->valueint - 1;
-        int a2 = cJSON_GetArrayItem(atoms, 1)->valueint - 1;
-        int a3 = cJSON_GetArrayItem(atoms, 2)->valueint - 1;
-        int a4 = cJSON_GetArrayItem(atoms, 3)->valueint - 1;
-        double constant_f = (constant)
-            ? constant->valuedouble
-            : DEFAULT_TORSION_CONST;
+//Check that an atom exists, printing an error if it doesn't
+static bool atom_exists(const struct model *m, uint32_t atom,
+        const char *name, size_t idx){
+    if(atom < m->num_atoms)
+        return true;
+    fprintf(stderr, "Atom %lu does not exist in %s %lu\n",
+            (unsigned long)atom + 1, name, idx + 1);
+    return false;
+}
 
-        struct torsion_spring *s = &m->torsion_springs[i];
-        torsion_spring_init(s,
-                &m->atoms[a1], &m->atoms[a2], &m->atoms[a3], &m->atoms[a4],
-                angle->valuedouble, constant_f);
-        if(cutoff)
-            s->cutoff = cutoff->valuedouble;
+/*
+ * Check that the atoms referenced by the bonded terms exist. This is done
+ * once everything has been read, because the terms may come before the atoms.
+ */
+int check_term_atoms(const struct model *m){
+    for(size_t i=0; i < m->num_linear_springs; i++){
+        const struct linear_spring *s = &m->linear_springs[i];
+        if(!atom_exists(m, s->a, "spring", i)
+                || !atom_exists(m, s->b, "spring", i))
+            return 1;
+        if(s->inner != NO_ATOM && (!atom_exists(m, s->inner, "spring", i)
+                    || !atom_exists(m, s->outer, "spring", i)))
+            return 1;
+    }
+    for(size_t i=0; i < m->num_bond_angles; i++){
+        const struct bond_angle_spring *s = &m->bond_angles[i];
+        if(!atom_exists(m, s->a1, "angle", i)
+                || !atom_exists(m, s->a2, "angle", i)
+                || !atom_exists(m, s->a3, "angle", i))
+            return 1;
+    }
+    for(size_t i=0; i < m->num_torsion_springs; i++){
+        const struct torsion_spring *s = &m->torsion_springs[i];
+        if(!atom_exists(m, s->a1, "torsion", i)
+                || !atom_exists(m, s->a2, "torsion", i)
+                || !atom_exists(m, s->a3, "torsion", i)
+                || !atom_exists(m, s->a4, "torsion", i))
+            return 1;
+    }
+    for(size_t i=0; i < m->num_constraints; i++){
+        const struct constraint *c = &m->constraints[i];
+        if(!atom_exists(m, c->a, "constraint", i)
+                || !atom_exists(m, c->b, "constraint", i))
+            return 1;
     }
     return 0;
-
-free_springs:
-    free(m->torsion_springs);
-alloc_err:
-    return 1;
 }
 
 int read_rama(cJSON *root, struct model *m){
@@ -464,6 +785,20 @@ int read_rama(cJSON *root, struct model *m){
     if(fail)
         goto alloc_err;
 
+    //Find the types used by the constraints, so that we only load those
+    cJSON *springs = cJSON_GetObjectItem(rama, "constraints");
+    const char *used[UNKNOWN_RAMA] = {NULL};
+    for(cJSON *spring = springs->child; spring; spring = spring->next){
+        cJSON *type = cJSON_GetObjectItem(spring, "type");
+        if(!type || !type->valuestring)
+            continue;
+        enum rama_constraint_type t = rama_parse_type(type->valuestring);
+        if(t == UNKNOWN_RAMA)
+            goto_err(alloc_err, "Unknown Ramachandran type '%s'\n",
+                    type->valuestring);
+        used[t] = type->valuestring;
+    }
+
     //Read file data
     cJSON *data = cJSON_GetObjectItem(rama, "data");
     if(!data)
@@ -474,12 +809,17 @@ int read_rama(cJSON *root, struct model *m){
         type = rama_parse_type(d->string);
         if(type == UNKNOWN_RAMA)
             goto_err(alloc_err, "Unknown Ramachandran type '%s'\n", d->string);
+        if(!used[type])
+            continue;
         if(rama_read_closest(d->valuestring, type))
             goto alloc_err;
     }
+    for(size_t i=0; i < UNKNOWN_RAMA; i++)
+        if(used[i] && !rama_is_inited(i))
+            goto_err(alloc_err, "No Ramachandran data given for type '%s'\n",
+                    used[i]);
 
     //Find the number of springs we have and malloc an array
-    cJSON *springs = cJSON_GetObjectItem(rama, "constraints");
     int nsprings = cJSON_GetArraySize(springs);
     m->num_rama_constraints = nsprings;
     m->rama_constraints = malloc(sizeof(*m->rama_constraints) * nsprings);
@@ -581,51 +921,6 @@ void print_cjson_error(const char *json_str){
     fprintf(stderr, "Error parsing line %d: %.*s\n", line, strlen, error);
 }
 
-struct model * springreader_parse_file(const char *file){
-    FILE *f = fopen(file, "r");
-    if(!f)
-        goto_perror(bail, "Error reading input file");
-
-    //Seek to end of file to get file size
-    int rv;
-    rv = fseek(f, 0, SEEK_END);
-    if(rv == -1)
-        goto_perror(close_file, "Error seeking to end of input file");
-
-    long file_sz = ftell(f);
-    if(file_sz == -1)
-        goto_perror(close_file, "Error getting file size (file too large?)");
-
-    rv = fseek(f, 0, SEEK_SET);
-    if(rv == -1)
-        goto_perror(close_file, "Error seeking back to start of input file.");
-
-    //Malloc buffer and read file
-    char *buf = malloc(file_sz + 1);
-    if(!buf)
-        goto_perror(close_file, "Error allocating memory to store config file.");
-
-    int nread = fread(buf, 1, file_sz, f);
-    if(ferror(f) || nread != file_sz)
-        goto_perror(free_buffer, "Error reading from config file");
-    //Set terminating nul byte
-    buf[nread] = '\0';
-
-    //Close file
-    fclose(f);
-
-    struct model *model = springreader_parse_str(buf);
-    free(buf);
-    return model;
-
-free_buffer:
-    free(buf);
-close_file:
-    fclose(f);
-bail:
-    return NULL;
-}
-
 int read_atom_definitions(cJSON *root){
     cJSON *atom_descriptions = cJSON_GetObjectItem(root, "atom_descriptions");
     //If not set, we'll just use the default definitions
@@ -662,3 +957,307 @@ error:
     return 1;
 }
 
+#ifdef HAVE_ZLIB
+//Read the next block of a (possibly compressed) file
+ssize_t read_block(void *src, char *block, size_t len){
+    int nread = gzread(src, block, len);
+    if(nread < 0){
+        int errnum;
+        fprintf(stderr, "Error reading input file: %s\n",
+                gzerror(src, &errnum));
+    }
+    return nread;
+}
+#else
+//Read the next block of a file
+ssize_t read_block(void *src, char *block, size_t len){
+    size_t nread = fread(block, 1, len, src);
+    if(ferror((FILE *)src)){
+        perror("Error reading input file");
+        return -1;
+    }
+    return nread;
+}
+#endif
+
+/*
+ * Set up a stream reading from src with the function read_block, which should
+ * fill block with up to STREAM_BLOCK_SZ bytes and return the number read, 0
+ * at the end of the input or -1 on error.
+ */
+void js_init(struct json_stream *s,
+        ssize_t (*read_block)(void *, char *, size_t),
+        void *src, char *block){
+    s->read_block = read_block;
+    s->src = src;
+    s->block = block;
+    s->buf = block;
+    s->pos = s->len = 0;
+    s->line = 1;
+    s->failed = false;
+    s->capture = NULL;
+}
+
+//Print an error with the current line number, unless one has been printed
+void js_error(struct json_stream *s, const char *fmt, ...){
+    if(!s->failed){
+        va_list args;
+        va_start(args, fmt);
+        fprintf(stderr, "Error parsing line %d: ", s->line);
+        vfprintf(stderr, fmt, args);
+        fprintf(stderr, "\n");
+        va_end(args);
+    }
+    s->failed = true;
+}
+
+//Read the next block into the buffer. Returns non-zero if there is no more.
+static int js_fill(struct json_stream *s){
+    if(!s->read_block || s->failed)
+        return 1;
+    ssize_t nread = s->read_block(s->src, s->block, STREAM_BLOCK_SZ);
+    if(nread <= 0){
+        //Errors have already been printed by read_block
+        if(nread < 0)
+            s->failed = true;
+        s->read_block = NULL;
+        return 1;
+    }
+    s->buf = s->block;
+    s->pos = 0;
+    s->len = nread;
+    return 0;
+}
+
+//Get the next character without consuming it, or EOF
+static inline int js_peek(struct json_stream *s){
+    if(s->pos == s->len && js_fill(s))
+        return EOF;
+    return (unsigned char)s->buf[s->pos];
+}
+
+//Consume the next character
+static inline int js_getc(struct json_stream *s){
+    int c = js_peek(s);
+    if(c == EOF)
+        return EOF;
+    s->pos++;
+    if(c == '\n')
+        s->line++;
+    if(s->capture && text_push(s->capture, c))
+        s->failed = true;
+    return c;
+}
+
+//Skip whitespace and return the next character
+int js_skip_ws(struct json_stream *s){
+    int c;
+    while((c = js_peek(s)) != EOF && isspace(c))
+        js_getc(s);
+    return c;
+}
+
+//Consume the next non-whitespace character if it is c
+bool js_accept(struct json_stream *s, char c){
+    if(js_skip_ws(s) != c)
+        return false;
+    js_getc(s);
+    return true;
+}
+
+//Consume the next non-whitespace character, which must be c
+int js_expect(struct json_stream *s, char c){
+    if(js_accept(s, c))
+        return 0;
+    int found = js_peek(s);
+    if(found == EOF)
+        js_error(s, "Expected '%c' but reached the end of the input", c);
+    else
+        js_error(s, "Expected '%c' but found '%c'", c, found);
+    return 1;
+}
+
+/*
+ * Read a string into dst, which can hold size characters including the nul
+ * byte. If dst is NULL, the string is skipped.
+ */
+int js_string(struct json_stream *s, char *dst, size_t size){
+    if(js_skip_ws(s) != '"'){
+        js_error(s, "Expected a string");
+        return 1;
+    }
+    js_getc(s);
+
+    size_t len = 0;
+    int c;
+    while((c = js_getc(s)) != '"'){
+        if(c == EOF){
+            js_error(s, "Unterminated string");
+            return 1;
+        }
+        if(c == '\\'){
+            c = js_getc(s);
+            switch(c){
+            case '"': case '\\': case '/':
+                break;
+            case 'b': c = '\b'; break;
+            case 'f': c = '\f'; break;
+            case 'n': c = '\n'; break;
+            case 'r': c = '\r'; break;
+            case 't': c = '\t'; break;
+            case 'u': {
+                //Only ASCII is meaningful in a configuration file
+                unsigned int code = 0;
+                for(int i=0; i < 4; i++){
+                    int h = js_getc(s);
+                    if(!isxdigit(h)){
+                        js_error(s, "Invalid unicode escape in string");
+                        return 1;
+                    }
+                    code = code * 16 + (isdigit(h) ? h - '0' : tolower(h) - 'a' + 10);
+                }
+                c = code < 0x80 ? (int)code : '?';
+                break;
+            }
+            default:
+                js_error(s, "Invalid escape in string");
+                return 1;
+            }
+        }
+        if(dst){
+            if(len + 1 >= size){
+                js_error(s, "String too long");
+                return 1;
+            }
+            dst[len++] = c;
+        }
+    }
+    if(dst)
+        dst[len] = '\0';
+    return 0;
+}
+
+//Read a number
+int js_number(struct json_stream *s, double *dst){
+    char num[64];
+    size_t len = 0;
+    int c = js_skip_ws(s);
+    while(c != EOF && (isdigit(c) || c == '-' || c == '+' || c == '.'
+                || c == 'e' || c == 'E')){
+        if(len + 1 == sizeof(num)){
+            js_error(s, "Number too long");
+            return 1;
+        }
+        num[len++] = js_getc(s);
+        c = js_peek(s);
+    }
+    num[len] = '\0';
+
+    char *end;
+    *dst = strtod(num, &end);
+    if(len == 0 || *end != '\0'){
+        js_error(s, "Expected a number");
+        return 1;
+    }
+    return 0;
+}
+
+//Skip over any value
+int js_skip_value(struct json_stream *s){
+    int c = js_skip_ws(s);
+    if(c == '"'){
+        return js_string(s, NULL, 0);
+    }else if(c == '{'){
+        bool first = true;
+        int more;
+        while((more = js_next_key(s, NULL, 0, &first)) == 1)
+            if(js_skip_value(s))
+                return 1;
+        return more < 0;
+    }else if(c == '['){
+        bool first = true;
+        int more;
+        while((more = js_next_item(s, &first)) == 1)
+            if(js_skip_value(s))
+                return 1;
+        return more < 0;
+    }else if(isalpha(c)){
+        char word[6];
+        size_t len = 0;
+        while(isalpha(js_peek(s)) && len + 1 < sizeof(word))
+            word[len++] = js_getc(s);
+        word[len] = '\0';
+        if(strcmp(word, "true") && strcmp(word, "false")
+                && strcmp(word, "null")){
+            js_error(s, "Unknown value '%s'", word);
+            return 1;
+        }
+        return 0;
+    }
+    double num;
+    return js_number(s, &num);
+}
+
+/*
+ * Read the next key of an object into key, which can hold size characters.
+ * If key is NULL, the key is skipped. On the first call, *first must be true
+ * and the opening brace is read.
+ *
+ * Returns 1 if a key was read, 0 at the end of the object or -1 on error.
+ */
+int js_next_key(struct json_stream *s, char *key, size_t size, bool *first){
+    if(*first){
+        *first = false;
+        if(js_expect(s, '{'))
+            return -1;
+        if(js_accept(s, '}'))
+            return 0;
+    }else{
+        if(js_accept(s, '}'))
+            return 0;
+        if(js_expect(s, ','))
+            return -1;
+    }
+    if(js_string(s, key, size) || js_expect(s, ':'))
+        return -1;
+    return 1;
+}
+
+/*
+ * Move to the next item of an array. On the first call, *first must be true
+ * and the opening bracket is read.
+ *
+ * Returns 1 if there is another item, 0 at the end of the array or -1 on
+ * error.
+ */
+int js_next_item(struct json_stream *s, bool *first){
+    if(*first){
+        *first = false;
+        if(js_expect(s, '['))
+            return -1;
+        if(js_accept(s, ']'))
+            return 0;
+    }else{
+        if(js_accept(s, ']'))
+            return 0;
+        if(js_expect(s, ','))
+            return -1;
+    }
+    return 1;
+}
+
+//Append a character to a text buffer
+int text_push(struct text_buffer *t, char c){
+    if(t->len == t->size){
+        size_t size = t->size ? t->size * 2 : 4096;
+        char *text = realloc(t->text, size);
+        if(!text){
+            perror("Error allocating text buffer");
+            return 1;
+        }
+        t->text = text;
+        t->size = size;
+    }
+    t->text[t->len++] = c;
+    return 0;
+}
@@ -5,5 +5,6 @@
 
 struct model * springreader_parse_str(const char *str);
 struct model * springreader_parse_file(const char *file);
+int check_term_atoms(const struct model *m);
 
 #endif /* SPRINGREADER_H_ */
@@ -4,227 +4,534 @@
 #include <float.h>
 #include "sterics.h"
 
-#define cube(x)   ((x) * (x) * (x))
-#define square(x) ((x) * (x))
-
-static inline size_t coords(struct steric_grid *grid, size_t x, size_t y, size_t z);
-static struct vector buf = {.c = {GRID_BUFFER, GRID_BUFFER, GRID_BUFFER}};
-
-void steric_grid_init(struct steric_grid *grid, size_t size_in_cells, double cell_size, size_t num_atoms){
-    grid->size_in_cells = size_in_cells;
-    grid->cell_size = cell_size;
-
-    //We need this many cells:
-    size_t ncells = cube(size_in_cells);
+#ifdef HAVE_CONFIG_H
+#include <config.h>
+#endif
 
-    //Initialise linked list buffer
-    grid->list_buf = malloc(num_atoms * sizeof(*grid->list_buf));
-    grid->list_buf_idx = 0;
+#define square(x) ((x) * (x))
 
-    grid->interaction_list = malloc(num_atoms * sizeof(*grid->interaction_list));
-    grid->cells = malloc(ncells * sizeof(*grid->cells));
-    //Initialise everything to have zero atoms
-    for(size_t i=0; i < ncells; i++)
-        grid->cells[i] = NULL;
-    for(size_t i=0; i < num_atoms; i++)
-        grid->interaction_list[i] = 0;
+//Use at least this many hash buckets for each atom, so that few cells share a
+//bucket.
+#define BUCKETS_PER_ATOM 2
+#define MIN_BUCKETS 64
+
+//Ratio of the cell size to the largest steric radius.
+#define CELL_SIZE_FACTOR 2.0
+
+/**
+ * Initialise a steric grid for the atoms in a model. The cell size is chosen
+ * from the largest steric radius of any atom, and the number of hash buckets
+ * from the number of atoms.
+ *
+ * \return Non-zero if memory could not be allocated.
+ */
+int steric_grid_init(struct steric_grid *grid, const struct model *m){
+    double max_radius = 0;
+    for(size_t i=0; i < m->num_atoms; i++)
+        if(m->atoms[i].radius > max_radius)
+            max_radius = m->atoms[i].radius;
+
+    //Searches only visit the cells overlapping the interaction range of each
+    //atom, so the cell size trades the number of buckets visited against the
+    //number of atoms checked. Cells as large as the longest steric contact
+    //distance were the fastest for building the neighbour lists.
+    grid->max_radius = max_radius;
+    grid->cell_size = CELL_SIZE_FACTOR * max_radius;
+    if(grid->cell_size <= 0)
+        grid->cell_size = 1;
+
+    grid->num_buckets = MIN_BUCKETS;
+    while(grid->num_buckets < BUCKETS_PER_ATOM * m->num_atoms)
+        grid->num_buckets *= 2;
+    grid->visit_stamp = 0;
+
+    struct neighbour_list *l = &grid->neighbours;
+    l->skin = m->verlet_skin;
+    l->num_atoms = SIZE_MAX;
+    l->atoms = NULL;
+    l->atoms_sz = 0;
+    l->builds = 0;
+
+    size_t n = m->num_atoms ? m->num_atoms : 1;
+    grid->bucket_start = malloc(
+            (grid->num_buckets + 1) * sizeof(*grid->bucket_start));
+    grid->visited = calloc(grid->num_buckets, sizeof(*grid->visited));
+    grid->cell_atoms = malloc(n * sizeof(*grid->cell_atoms));
+    grid->cell_pos = malloc(n * sizeof(*grid->cell_pos));
+    grid->cell_radius = malloc(n * sizeof(*grid->cell_radius));
+    grid->atom_bucket = malloc(n * sizeof(*grid->atom_bucket));
+    l->start = malloc((n + 1) * sizeof(*l->start));
+    l->first_nonbonded = malloc(n * sizeof(*l->first_nonbonded));
+    l->first_far = malloc(n * sizeof(*l->first_far));
+    l->built_pos = malloc(n * sizeof(*l->built_pos));
+    l->built_fixed = malloc(n * sizeof(*l->built_fixed));
+    int kicks_err = kick_queue_init(&grid->kicks, m->num_atoms);
+    if(kicks_err || !grid->bucket_start || !grid->visited || !grid->cell_atoms
+            || !grid->cell_pos || !grid->cell_radius || !grid->atom_bucket
+            || !l->start || !l->first_nonbonded
+            || !l->first_far || !l->built_pos || !l->built_fixed){
+        steric_grid_free(grid);
+        return 1;
+    }
+    return 0;
 }
 
-//Small utility function to convert 3d coordinates into the block array format.
-static inline size_t coords(struct steric_grid *grid, size_t x, size_t y, size_t z){
-    return x + y * grid->size_in_cells + z * square(grid->size_in_cells);
+void steric_grid_free(struct steric_grid *grid){
+    free(grid->bucket_start);
+    free(grid->visited);
+    free(grid->cell_atoms);
+    free(grid->cell_pos);
+    free(grid->cell_radius);
+    free(grid->atom_bucket);
+    kick_queue_free(&grid->kicks);
+    free(grid->neighbours.start);
+    free(grid->neighbours.first_nonbonded);
+    free(grid->neighbours.first_far);
+    free(grid->neighbours.atoms);
+    free(grid->neighbours.built_pos);
+    free(grid->neighbours.built_fixed);
+    grid->bucket_start = NULL;
+    grid->visited = NULL;
+    grid->cell_atoms = NULL;
+    grid->cell_pos = NULL;
+    grid->cell_radius = NULL;
+    grid->atom_bucket = NULL;
+    grid->neighbours.start = NULL;
+    grid->neighbours.first_nonbonded = NULL;
+    grid->neighbours.first_far = NULL;
+    grid->neighbours.atoms = NULL;
+    grid->neighbours.built_pos = NULL;
+    grid->neighbours.built_fixed = NULL;
+    grid->neighbours.atoms_sz = 0;
 }
 
-//Function to convert coordinates in Angstroms to grid cell coords
-static inline void ang2cell(struct steric_grid *grid, struct vector *v, size_t *x, size_t *y, size_t *z){
-    *x = (size_t)((v->c[0] - grid->origin.c[0]) / grid->cell_size);
-    *y = (size_t)((v->c[1] - grid->origin.c[1]) / grid->cell_size);
-    *z = (size_t)((v->c[2] - grid->origin.c[2]) / grid->cell_size);
+//Index of the cell containing coordinate x along one axis. Cells are aligned
+//to the origin, so this is floor(x / cell_size), but truncating and fixing up
+//negative numbers is much cheaper than calling floor.
+static inline int64_t axis_cell(const struct steric_grid *g, double x){
+    double c = x / g->cell_size;
+    int64_t i = (int64_t)c;
+    return (c < i) ? i - 1 : i;
 }
 
-//Min and max functions
-static inline int min(double a, double b){
-    return (a < b) ? a : b;
-}
-static inline int man(double a, double b){
-    return (a > b) ? a : b;
+//Hash bucket of the cell with the given coordinates.
+static inline size_t cell_bucket(const struct steric_grid *g,
+        int64_t x, int64_t y, int64_t z){
+    uint64_t h = (uint64_t)x * 73856093u
+        ^ (uint64_t)y * 19349663u
+        ^ (uint64_t)z * 83492791u;
+    //Mix the high bits into the low bits, which are used for the bucket.
+    h ^= h >> 31;
+    h *= UINT64_C(0xbf58476d1ce4e5b9);
+    h ^= h >> 29;
+    return h & (g->num_buckets - 1);
 }
 
-//Find the origin of the grid by locating the lowest dimension of each atom
-void steric_grid_find_origin(struct steric_grid *g, struct model *m){
-    vector_fill(&g->origin, DBL_MAX, DBL_MAX, DBL_MAX);
-    for(size_t i=0; i < m->num_atoms; i++)
-        vmin_elems(&g->origin, &m->atoms[i].position);
-    vsub_to(&g->origin, &buf);
+//Sort the atoms into buckets.
+static void sort_atoms(struct steric_grid *g, struct model *m){
+    //Counting sort of the atoms by bucket. Count the atoms in each bucket,
+    //then get the offset of the end of each bucket.
+    for(size_t b=0; b <= g->num_buckets; b++)
+        g->bucket_start[b] = 0;
+    for(size_t i=0; i < m->num_atoms; i++){
+        struct vector *v = &m->positions[i];
+        g->atom_bucket[i] = cell_bucket(g,
+                axis_cell(g, v->c[0]),
+                axis_cell(g, v->c[1]),
+                axis_cell(g, v->c[2]));
+        g->bucket_start[g->atom_bucket[i]]++;
+    }
+    for(size_t b=1; b < g->num_buckets; b++)
+        g->bucket_start[b] += g->bucket_start[b - 1];
+    g->bucket_start[g->num_buckets] = m->num_atoms;
+
+    //Place atoms in reverse order at the end of their bucket, so that each
+    //bucket ends up in ascending order of atom index and bucket_start[b] is
+    //moved back to the start of bucket b.
+    for(size_t i=m->num_atoms; i-- > 0;){
+        size_t p = --g->bucket_start[g->atom_bucket[i]];
+        g->cell_atoms[p] = i;
+        vector_copy_to(&g->cell_pos[p], &m->positions[i]);
+        g->cell_radius[p] = m->atoms[i].radius;
+    }
 }
 
-//Add atom to cell i (in block coords)
-void add_atom(struct steric_grid *grid, size_t cell_index, size_t atom_idx){
-    //Get a linked list object from the buffer
-    struct atom_list *list = grid->list_buf + (grid->list_buf_idx++);
-
-    list->next = grid->cells[cell_index];
-    list->atom_idx = atom_idx;
-    grid->cells[cell_index] = list;
+//Distance from x to the interval [lo, lo + size] (zero if x is inside it).
+static inline double interval_dist(double x, double lo, double size){
+    if(x < lo)
+        return lo - x;
+    if(x > lo + size)
+        return x - lo - size;
+    return 0;
 }
 
-//Set the interaction list for the atom at atom_index (in the model) to the
-//list of atoms in the cell at cell_index
-static void update_ilist(struct steric_grid *grid, size_t atom_index, size_t cell_index){
-    grid->interaction_list[atom_index] = cell_index;
+//Number of ranges that stencil() may return for a sphere of radius range.
+static inline size_t stencil_size(const struct steric_grid *g, double range){
+    size_t width = (size_t)(2 * range / g->cell_size) + 2;
+    size_t cells = width * width * width;
+    return (cells < g->num_buckets) ? cells : g->num_buckets;
 }
 
-void free_linked_list(struct atom_list *list){
-    while(list){
-        struct atom_list *next = list->next;
-        free(list);
-        list = next;
+/*
+ * Get the ranges of cell_atoms covering every bucket containing a cell that
+ * overlaps the sphere of radius range around centre. Each bucket is only
+ * returned once, even if several of the cells hash to it. The ranges array
+ * must have room for stencil_size(g, range) ranges. Returns the number of
+ * ranges.
+ *
+ * This marks buckets as visited in the grid, so it isn't thread safe.
+ */
+static size_t stencil(struct steric_grid *g, const struct vector *centre,
+        double range, size_t (*ranges)[2]){
+    int64_t lo[N], hi[N];
+    for(size_t j=0; j < N; j++){
+        lo[j] = axis_cell(g, centre->c[j] - range);
+        hi[j] = axis_cell(g, centre->c[j] + range);
     }
-}
 
-void steric_grid_update(struct steric_grid *g, struct model *m){
-    size_t x, y, z;
-    size_t cell_index;
+    size_t stamp = ++g->visit_stamp;
+    size_t n = 0;
+    for(int64_t z=lo[2]; z <= hi[2]; z++){
+        double dz = interval_dist(centre->c[2], z * g->cell_size, g->cell_size);
+        for(int64_t y=lo[1]; y <= hi[1]; y++){
+            double dy = interval_dist(centre->c[1],
+                    y * g->cell_size, g->cell_size);
+            double chord_sq = range * range - dy * dy - dz * dz;
+            if(chord_sq < 0)
+                continue;
 
-    //Reset buffer
-    g->list_buf_idx = 0;
+            double chord = sqrt(chord_sq);
+            int64_t x_hi = axis_cell(g, centre->c[0] + chord);
+            for(int64_t x=axis_cell(g, centre->c[0] - chord); x <= x_hi; x++){
+                size_t b = cell_bucket(g, x, y, z);
+                if(g->visited[b] == stamp)
+                    continue;
+                g->visited[b] = stamp;
 
-    //Reset each cell
-    for(size_t i=0; i < m->num_atoms; i++){
-        size_t cell_idx = g->interaction_list[i];
-        g->cells[cell_idx] = NULL;
+                ranges[n][0] = g->bucket_start[b];
+                ranges[n][1] = g->bucket_start[b + 1];
+                if(ranges[n][0] != ranges[n][1])
+                    n++;
+            }
+        }
     }
+    return n;
+}
 
-    //Find origin
-    steric_grid_find_origin(g, m);
+//Check whether any atom has moved far enough, or any atom has been added or
+//released, for the neighbour lists to be out of date.
+static bool lists_expired(const struct neighbour_list *l, const struct model *m){
+    if(l->num_atoms != m->num_atoms)
+        return true;
 
-    //Add atoms to cells
+    double max_sq = square(l->skin / 2);
     for(size_t i=0; i < m->num_atoms; i++){
-        //Angstroms to cell coordinates
-        ang2cell(g, &m->atoms[i].position, &x, &y, &z);
-        //To block coordinates
-        cell_index = coords(g, x, y, z);
-        //Add atom to linked list
-        add_atom(g, cell_index, i);
+        if(l->built_fixed[i] && !m->fixed[i])
+            return true;
+
+        struct vector moved;
+        vsub(&moved, &m->positions[i], &l->built_pos[i]);
+        if(vdot(&moved, &moved) > max_sq)
+            return true;
     }
+    return false;
+}
+
+//Make sure there is room for at least n neighbours in the list.
+static int reserve_neighbours(struct neighbour_list *l, size_t n){
+    if(n <= l->atoms_sz)
+        return 0;
+
+    size_t sz = l->atoms_sz ? l->atoms_sz : 1024;
+    while(sz < n)
+        sz *= 2;
+    uint32_t *atoms = realloc(l->atoms, sz * sizeof(*atoms));
+    if(!atoms)
+        return 1;
+    l->atoms = atoms;
+    l->atoms_sz = sz;
+    return 0;
 }
 
-void steric_grid_build_ilists(struct steric_grid *g, struct model *m){
-    size_t x, y, z;
-    size_t cell_index;
+/*
+ * Build the neighbour lists of every atom from the cells. The bonded, near and
+ * far neighbours of each atom are collected separately and then appended to
+ * the list in that order. Returns non-zero if memory could not be allocated.
+ */
+static int build_lists(struct steric_grid *g, struct model *m){
+    struct neighbour_list *l = &g->neighbours;
+    double water = m->use_water ? WATER_RADIUS : 0;
+    double far_cut = m->shield_drag ? DRAG_SHIELDING_DISTANCE + l->skin : 0;
+
+    //Bonded neighbours are stored from the front of other and far neighbours
+    //from the back, since there can't be more than num_atoms of either.
+    uint32_t *near = malloc(m->num_atoms * sizeof(*near));
+    uint32_t *other = malloc(m->num_atoms * sizeof(*other));
+    //Atoms bonded to the current atom
+    bool *bonded = calloc(m->num_atoms, sizeof(*bonded));
+    if(m->num_atoms && (!near || !other || !bonded))
+        goto alloc_err;
+
+    size_t len = 0;
+    for(size_t i=0; i < m->num_atoms; i++){
+        struct vector *pos = &m->positions[i];
+        double radius = m->atoms[i].radius;
+        double range = radius + g->max_radius + water + l->skin;
+        if(far_cut > range)
+            range = far_cut;
+
+        size_t ranges[stencil_size(g, range)][2];
+        size_t nranges = stencil(g, pos, range, ranges);
+        size_t nnear = 0, nbonded = 0, nfar = 0;
+
+        //Bonded atoms are taken straight from the bond list, and marked so
+        //that they are skipped when searching the buckets. Bonds to atoms
+        //that haven't been added yet are ignored.
+        if(m->bond_start){
+            for(size_t p=m->bond_start[i]; p < m->bond_start[i + 1]; p++){
+                size_t j = m->bonds[p];
+                if(j >= m->num_atoms)
+                    continue;
+                bonded[j] = true;
+                if(!(m->fixed[i] && m->fixed[j]))
+                    other[nbonded++] = j;
+            }
+        }
+
+        for(size_t k=0; k < nranges; k++){
+            for(size_t p=ranges[k][0]; p < ranges[k][1]; p++){
+                size_t j = g->cell_atoms[p];
+                if(i == j || bonded[j] || (m->fixed[i] && m->fixed[j]))
+                    continue;
+
+                struct vector displacement;
+                vsub(&displacement, &g->cell_pos[p], pos);
+                double dist_sq = vdot(&displacement, &displacement);
+                double near_cut = radius + g->cell_radius[p] + water + l->skin;
+                bool is_near = dist_sq < square(near_cut);
+                if(!is_near && dist_sq >= square(far_cut))
+                    continue;
+
+                if(is_near)
+                    near[nnear++] = j;
+                else
+                    other[m->num_atoms - ++nfar] = j;
+            }
+        }
+        if(m->bond_start)
+            for(size_t p=m->bond_start[i]; p < m->bond_start[i + 1]; p++)
+                if(m->bonds[p] < m->num_atoms)
+                    bonded[m->bonds[p]] = false;
+
+        if(reserve_neighbours(l, len + nbonded + nnear + nfar))
+            goto alloc_err;
+        l->start[i] = len;
+        for(size_t k=0; k < nbonded; k++)
+            l->atoms[len++] = other[k];
+        l->first_nonbonded[i] = len;
+        for(size_t k=0; k < nnear; k++)
+            l->atoms[len++] = near[k];
+        l->first_far[i] = len;
+        for(size_t k=0; k < nfar; k++)
+            l->atoms[len++] = other[m->num_atoms - 1 - k];
+    }
+    l->start[m->num_atoms] = len;
 
     for(size_t i=0; i < m->num_atoms; i++){
-        //Angstroms to cell coordinates
-        ang2cell(g, &m->atoms[i].position, &x, &y, &z);
-        //To block coordinates
-        cell_index = coords(g, x, y, z);
-        //Add atom to linked list
-        update_ilist(g, i, cell_index);
+        vector_copy_to(&l->built_pos[i], &m->positions[i]);
+        l->built_fixed[i] = m->fixed[i];
     }
+    l->num_atoms = m->num_atoms;
+    l->builds++;
+
+    free(near);
+    free(other);
+    free(bonded);
+    return 0;
+
+alloc_err:
+    free(near);
+    free(other);
+    free(bonded);
+    l->num_atoms = SIZE_MAX;
+    return 1;
 }
 
-struct atom_list *steric_grid_interaction_list(struct steric_grid *g, size_t atom_index){
-    return g->cells[g->interaction_list[atom_index]];
+/**
+ * Update the neighbour lists if any atom has moved by more than half of the
+ * skin distance since they were last built, or if atoms have been added or
+ * released. This must be called whenever the atoms move.
+ *
+ * \return Non-zero if memory could not be allocated.
+ */
+int steric_grid_update(struct steric_grid *g, struct model *m){
+    if(!lists_expired(&g->neighbours, m))
+        return 0;
+
+    sort_atoms(g, m);
+    return build_lists(g, m);
 }
 
 void steric_grid_forces(struct steric_grid *g, struct model *m){
-    struct vector displacement;
-    struct atom_list *l = NULL;
-    for(size_t i=0; i < m->num_atoms; i++){
-        struct atom *a = m->atoms + i;
+    struct neighbour_list *l = &g->neighbours;
 
-        for(l = g->cells[g->interaction_list[i]]; l; l = l->next){
-            struct atom *b = m->atoms + l->atom_idx;
-            if(a == b)
+    //Forces are only applied to atom a, so each thread can work on a
+    //different set of atoms without any locking.
+    #ifdef HAVE_OPENMP
+    #pragma omp parallel for schedule(dynamic, 64)
+    #endif
+    for(size_t i=0; i < m->num_atoms; i++){
+        struct vector *pos = &m->positions[i];
+        double radius = m->atoms[i].radius;
+
+        //Bonded atoms don't interact sterically, and atoms beyond
+        //first_far are only in the list for the drag force.
+        for(size_t p=l->first_nonbonded[i]; p < l->first_far[i]; p++){
+            size_t j = l->atoms[p];
+            struct vector displacement;
+            vsub(&displacement, &m->positions[j], pos);
+
+            //Compare squared distances so that we only need a square root
+            //for the few atoms that are actually touching.
+            double dist_sq = vdot(&displacement, &displacement);
+            double contact = radius + m->atoms[j].radius;
+            if(dist_sq >= contact * contact)
                 continue;
 
-            vsub(&displacement, &b->position, &a->position);
-            double dist = vmag(&displacement);
-            if(!model_is_bonded(m, i, l->atom_idx) && dist < a-> radius + b->radius){
-                //Find the distance by which the constraints are violated
-                double excess = a->radius + b->radius - dist;
-                //Convert to unit vector pointing in direction of force
-                vdiv_by(&displacement, vmag(&displacement));
-                //Apply constants
-                vmul_by(&displacement, -STERIC_FORCE_CONSTANT * excess);
-                //Apply to atom a
-                vadd_to(&a->force, &displacement);
-            }
+            //Find the distance by which the constraints are violated
+            double dist = sqrt(dist_sq);
+            double excess = contact - dist;
+            //Convert to unit vector pointing in direction of force
+            vdiv_by(&displacement, dist);
+            //Apply constants
+            vmul_by(&displacement, -STERIC_FORCE_CONSTANT * excess);
+            //Apply to atom a
+            vadd_to(&m->forces[i], &displacement);
         }
     }
 }
 
 #define POLAR_KICK_PROB 0.0001
 #define KICK_PROB 0.0003
-#define WATER_RADIUS 1.4
-#define DRAG_SHIELDING_DISTANCE 10.14
 #define COS_DRAG_BLOCK_ANGLE 0.80901699437494745
 #define KICK_VELOCITY 0.08
 
-void water_force(struct model *m, struct steric_grid *g){
-    for(size_t i=0; i < m->num_atoms; i++){
-        struct atom *a = &m->atoms[i];
-        if(a->fixed)
-            continue;
+//Time until the next kick of atom i, given the random number u
+static double kick_interval(const struct model *m, size_t i, uint32_t u){
+    const struct atom *a = &m->atoms[i];
+    double sf_area = 4*M_PI*a->radius*a->radius;
+    double rate = sf_area * (POLAR_KICK_PROB + (a->hydrophobicity
+                * (KICK_PROB - POLAR_KICK_PROB)));
+    if(rate <= 0)
+        return INFINITY;
+    return -log1p(-rng_uniform(u)) / rate;
+}
 
-        double sf_area = 4*M_PI*a->radius*a->radius;
+/*
+ * Find the kicks due in the step starting at m->time. Each atom is kicked at
+ * the rate given by its surface area and hydrophobicity, so the time until
+ * its next kick is drawn from the exponential distribution. Atoms are kicked
+ * at most once per step.
+ *
+ * The random numbers for atom i on a step are drawn from the counter-based
+ * generator, keyed by the step and the atom, so they don't depend on the
+ * order in which the atoms are scheduled.
+ */
+static void schedule_kicks(struct model *m, struct kick_queue *q){
+    uint64_t step = m->rng->step++;
+    double end = m->time + m->timestep;
+    uint32_t x[4];
+
+    //Schedule the atoms synthesised since the last step
+    for(size_t i=q->len; i < m->num_atoms; i++){
+        rng_counter(m->rng, step, i, x);
+        kick_queue_push(q, i, m->time + kick_interval(m, i, x[3]));
+    }
 
-        double kick_prob = sf_area * (POLAR_KICK_PROB + (a->hydrophobicity
-                    * (KICK_PROB - POLAR_KICK_PROB)));
+    q->ndue = 0;
+    while(kick_queue_peek(q) < end){
+        size_t i = kick_queue_pop(q);
+        rng_counter(m->rng, step, i, x);
+        double next = q->next[i] + kick_interval(m, i, x[2]);
+        kick_queue_push(q, i, next > end ? next : end);
+        if(m->fixed[i])
+            continue;
 
-        bool do_kick = kick_prob * RAND_MAX * m->timestep < rand();
+        struct water_kick *k = &q->due[q->ndue++];
+        k->atom = i;
+        vector_rand_from(&k->direction, 0, M_PI,
+                rng_uniform(x[0]), rng_uniform(x[1]));
+    }
+    q->time = m->time;
+}
+
+void water_force(struct model *m, struct steric_grid *g){
+    struct neighbour_list *l = &g->neighbours;
+    struct kick_queue *q = &g->kicks;
+
+    //Integrators that evaluate the forces several times in a step get the
+    //same kicks each time.
+    if(q->time != m->time)
+        schedule_kicks(m, q);
+
+    #ifdef HAVE_OPENMP
+    #pragma omp parallel for schedule(dynamic, 64)
+    #endif
+    for(size_t k=0; k < q->ndue; k++){
+        size_t i = q->due[k].atom;
+        struct atom *a = &m->atoms[i];
 
         struct vector kick, kick_point;
-        vector_rand(&kick, 0, M_PI);
+        vector_copy_to(&kick, &q->due[k].direction);
 
         vector_copy_to(&kick_point, &kick);
         vmul_by(&kick_point, a->radius);
-        vadd_to(&kick_point, &a->position);
+        vadd_to(&kick_point, &m->positions[i]);
 
         struct vector displacement;
-        if(do_kick){
-            bool good = true;
-            struct atom_list *l;
-            for(l = g->cells[g->interaction_list[i]]; l; l = l->next){
-                struct atom *b = m->atoms + l->atom_idx;
-                if(a == b)
-                    continue;
-
-                vsub(&displacement, &kick_point, &b->position);
-                if(vmag(&displacement) < b->radius + WATER_RADIUS){
-                    good = false;
-                    break;
-                }
+        bool good = true;
+        for(size_t p=l->start[i]; p < l->first_far[i]; p++){
+            size_t j = l->atoms[p];
+            vsub(&displacement, &kick_point, &m->positions[j]);
+            if(vmag(&displacement) < m->atoms[j].radius + WATER_RADIUS){
+                good = false;
+                break;
             }
+        }
 
-            if(good){
-                vmul_by(&kick, KICK_VELOCITY);
-                vadd_to(&a->force, &kick);
-            }
+        if(good){
+            vmul_by(&kick, KICK_VELOCITY);
+            vadd_to(&m->forces[i], &kick);
         }
     }
 }
 
 void drag_force(struct model *m, struct steric_grid *g){
+    struct neighbour_list *l = &g->neighbours;
+
+    #ifdef HAVE_OPENMP
+    #pragma omp parallel for schedule(dynamic, 64)
+    #endif
     for(size_t i=0; i < m->num_atoms; i++){
-        struct atom *a = &m->atoms[i];
-        if(a->fixed)
+        if(m->fixed[i])
             continue;
 
+        struct vector *vel = &m->velocities[i];
         struct vector displ, drag;
-        bool apply = true;
-        struct atom_list *l;
-        for(l = g->cells[g->interaction_list[i]]; l; l = l->next){
-            struct atom *b = m->atoms + l->atom_idx;
-            if(a == b)
-                continue;
+        double speed = vmag(vel);
+        if(speed == 0)
+            continue;
 
-            vsub(&displ, &b->position, &a->position);
+        //Any atom within the shielding distance may block the drag.
+        bool apply = true;
+        for(size_t p=l->start[i]; p < l->start[i + 1]; p++){
+            size_t j = l->atoms[p];
+            vsub(&displ, &m->positions[j], &m->positions[i]);
             double dist = vmag(&displ);
 
             if(dist < DRAG_SHIELDING_DISTANCE){
-                double dot = vdot(&displ, &a->velocity);
-                if(dot / (dist * vmag(&a->velocity)) > COS_DRAG_BLOCK_ANGLE){
+                double dot = vdot(&displ, vel);
+                if(dot / (dist * speed) > COS_DRAG_BLOCK_ANGLE){
                     apply = false;
                     break;
                 }
@@ -232,9 +539,9 @@ void drag_force(struct model *m, struct steric_grid *g){
         }
 
         if(apply){
-            vector_copy_to(&drag, &a->velocity);
+            vector_copy_to(&drag, vel);
             vmul_by(&drag, m->drag_coefficient);
-            vadd_to(&a->force, &drag);
+            vadd_to(&m->forces[i], &drag);
         }
     }
 }
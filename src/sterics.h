@@ -1,46 +1,105 @@
 #ifndef STERICS_H_
 #define STERICS_H_
 
-#define GRID_BUFFER 0.01
 #define MAX_STERIC_DISTANCE 5.0
 #define STERIC_FORCE_CONSTANT 1.025
+#define WATER_RADIUS 1.4
+#define DRAG_SHIELDING_DISTANCE 10.14
+#define DEFAULT_VERLET_SKIN 2.0
 
+#include <stdint.h>
 #include "residue.h"
 #include "model.h"
 #include "vector.h"
+#include "kick_queue.h"
 
-struct atom_list {
-    size_t atom_idx;
-    struct atom_list *next;
+/**
+ * Verlet neighbour lists shared by the steric, water and drag forces.
+ *
+ * The neighbours of atom i are atoms[start[i]] to atoms[start[i + 1] - 1].
+ * They are stored in three groups: first the atoms bonded to i, which only
+ * the water and drag forces need; then, from first_nonbonded[i], other atoms
+ * within steric (or water) range; then, from first_far[i], atoms only within
+ * the drag shielding distance. Each range is extended by the skin distance, so
+ * that the lists stay valid until some atom has moved by half of the skin.
+ * Pairs of atoms that are both fixed are left out.
+ */
+struct neighbour_list {
+    //Extra distance (in Angstroms) added to each interaction range.
+    double skin;
+
+    //Number of atoms when the lists were built.
+    size_t num_atoms;
+
+    //Offsets into atoms for each atom. There are num_atoms + 1 entries.
+    size_t *start;
+    size_t *first_nonbonded;
+    size_t *first_far;
+
+    //Neighbour indices, and the number of entries allocated.
+    uint32_t *atoms;
+    size_t atoms_sz;
+
+    //Positions and fixed state of each atom when the lists were built.
+    struct vector *built_pos;
+    bool *built_fixed;
+
+    //Number of times the lists have been built.
+    size_t builds;
 };
 
+/**
+ * Spatial hash used to find the atoms near each atom.
+ *
+ * Space is divided into cubic cells aligned to the origin, and each cell is
+ * hashed into one of num_buckets buckets. Only the buckets are stored, so the
+ * memory used depends on the number of atoms rather than how far apart they
+ * are. Several cells may share a bucket, so atoms found in a bucket must still
+ * be checked for distance.
+ *
+ * When the neighbour lists are rebuilt the atoms are counting-sorted by bucket
+ * into cell_atoms, so that the atoms in bucket b are
+ * cell_atoms[bucket_start[b]] to cell_atoms[bucket_start[b + 1] - 1].
+ */
 struct steric_grid {
-    //Size (in cells) in each direction.
-    size_t size_in_cells;
-
-    //Calculated dynamically on each update step.
-    struct vector origin;
+    //Largest steric radius of any atom.
+    double max_radius;
 
-    //Size (in Angstroms) of each cell.
+    //Size (in Angstroms) of each cell, chosen from the largest steric radius.
     double cell_size;
 
-    //We store a list of atoms in each cell.
-    struct atom_list **cells;
+    //Number of hash buckets. This is a power of two.
+    size_t num_buckets;
+
+    //Offset of each bucket in cell_atoms. There are num_buckets + 1 entries.
+    size_t *bucket_start;
+
+    //Atom indices, sorted by bucket.
+    size_t *cell_atoms;
+
+    //Positions and steric radii of the atoms in cell_atoms, in the same
+    //order, so that searching a bucket reads contiguous memory.
+    struct vector *cell_pos;
+    double *cell_radius;
+
+    //Bucket that each atom is in.
+    size_t *atom_bucket;
+
+    //Stamp of the last search that visited each bucket, so that buckets
+    //shared by several cells are only searched once.
+    size_t *visited;
+    size_t visit_stamp;
 
-    //Store an explicit interaction list for each atom. Do this by storing the
-    //index of the cell the atom is in.
-    size_t *interaction_list;
+    //Neighbour lists built from the buckets.
+    struct neighbour_list neighbours;
 
-    //Pool of atom lists to avoid repeated malloc/free cycles
-    struct atom_list *list_buf;
-    size_t list_buf_idx;
+    //Next water kick of each atom.
+    struct kick_queue kicks;
 };
 
-void steric_grid_init(struct steric_grid *grid, size_t size_in_cells, double cell_size, size_t num_atoms);
-void steric_grid_find_origin(struct steric_grid *g, struct model *m);
-void steric_grid_update(struct steric_grid *g, struct model *m);
-struct atom_list *steric_grid_interaction_list(struct steric_grid *g, size_t atom_index);
-void steric_grid_build_ilists(struct steric_grid *g, struct model *m);
+int steric_grid_init(struct steric_grid *grid, const struct model *m);
+void steric_grid_free(struct steric_grid *grid);
+int steric_grid_update(struct steric_grid *g, struct model *m);
 void steric_grid_forces(struct steric_grid *g, struct model *m);
 
 void water_force(struct model *m, struct steric_grid *grid);
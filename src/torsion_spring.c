@@ -4,11 +4,11 @@
 #include "torsion_spring.h"
 
 static void torsion_spring_force_single(struct vector *dst, struct
-        torsion_spring *s, enum torsion_unit on);
+        torsion_spring *s, struct vector *pos, enum torsion_unit on);
 
 struct torsion_spring * torsion_spring_alloc(
-        struct atom *a1, struct atom *a2,
-        struct atom *a3, struct atom *a4,
+        size_t a1, size_t a2,
+        size_t a3, size_t a4,
         double angle, double constant){
 
     struct torsion_spring *s = malloc(sizeof(struct torsion_spring));
@@ -19,8 +19,8 @@ struct torsion_spring * torsion_spring_alloc(
 }
 
 void torsion_spring_init(struct torsion_spring *s,
-        struct atom *a1, struct atom *a2,
-        struct atom *a3, struct atom *a4,
+        size_t a1, size_t a2,
+        size_t a3, size_t a4,
         double angle, double constant){
     s->a1 = a1;
     s->a2 = a2;
@@ -36,13 +36,13 @@ void torsion_spring_free(struct torsion_spring *s){
     free(s);
 }
 
-double torsion_spring_angle(struct torsion_spring *s){
+double torsion_spring_angle(struct torsion_spring *s, struct vector *pos){
 
     //Bond vectors
     struct vector b1, b2, b3;
-    vsub(&b1, &s->a2->position, &s->a1->position);
-    vsub(&b2, &s->a3->position, &s->a2->position);
-    vsub(&b3, &s->a4->position, &s->a3->position);
+    vsub(&b1, &pos[s->a2], &pos[s->a1]);
+    vsub(&b2, &pos[s->a3], &pos[s->a2]);
+    vsub(&b3, &pos[s->a4], &pos[s->a3]);
 
     struct vector cross_b1_b2, cross_b2_b3;
     vcross(&cross_b1_b2, &b1, &b2);
@@ -60,12 +60,14 @@ double torsion_spring_angle(struct torsion_spring *s){
     return atan2(y, x) * 180 / M_PI;
 }
 
-void torsion_spring_axis(struct vector *dst, struct torsion_spring *s){
-    vsub(dst, &s->a3->position, &s->a2->position);
+void torsion_spring_axis(struct vector *dst, struct torsion_spring *s,
+        struct vector *pos){
+    vsub(dst, &pos[s->a3], &pos[s->a2]);
 }
 
-void torsion_spring_torque(struct vector *dst, struct torsion_spring *s){
-    double delta_angle = (torsion_spring_angle(s) - s->angle);
+void torsion_spring_torque(struct vector *dst, struct torsion_spring *s,
+        struct vector *pos){
+    double delta_angle = (torsion_spring_angle(s, pos) - s->angle);
     if(delta_angle < -180)
         delta_angle += 360;
     else if(delta_angle > 180)
@@ -74,7 +76,7 @@ void torsion_spring_torque(struct vector *dst, struct torsion_spring *s){
 
     //Normalised axis
     struct vector axis;
-    torsion_spring_axis(&axis, s);
+    torsion_spring_axis(&axis, s, pos);
     vdiv_by(&axis, vmag(&axis));
 
     //Magnitude of torque
@@ -89,28 +91,29 @@ void torsion_spring_force(
         struct vector *f2,
         struct vector *f3,
         struct vector *f4,
-        struct torsion_spring *s){
+        struct torsion_spring *s,
+        struct vector *pos){
     vector_zero(f2);
     vector_zero(f3);
-    torsion_spring_force_single(f1, s, R1);
-    torsion_spring_force_single(f4, s, R4);
+    torsion_spring_force_single(f1, s, pos, R1);
+    torsion_spring_force_single(f4, s, pos, R4);
 }
 
 void torsion_spring_force_single(struct vector *dst, struct torsion_spring *s,
-        enum torsion_unit on){
+        struct vector *pos, enum torsion_unit on){
 
-    double angle = torsion_spring_angle(s);
+    double angle = torsion_spring_angle(s, pos);
     if(!s->enabled || (s->cutoff > 0 && fabs(angle - s->angle) > s->cutoff)){
         vector_zero(dst);
         return;
     }
 
     struct vector torque, arm;
-    torsion_spring_torque(&torque, s);
+    torsion_spring_torque(&torque, s, pos);
     if(on == R1)
-        vsub(&arm, &s->a1->position, &s->a2->position);
+        vsub(&arm, &pos[s->a1], &pos[s->a2]);
     else
-        vsub(&arm, &s->a4->position, &s->a3->position);
+        vsub(&arm, &pos[s->a4], &pos[s->a3]);
 
     /*
      * We want to project the arm to a vector perpendicular to the axis,
@@ -133,7 +136,7 @@ void torsion_spring_force_single(struct vector *dst, struct torsion_spring *s,
      */
 
     struct vector axis;
-    torsion_spring_axis(&axis, s);
+    torsion_spring_axis(&axis, s, pos);
     double axis_mag = vmag(&axis);
     double proj_mag = vdot(&arm, &axis);
 
@@ -191,15 +194,16 @@ void torsion_spring_force_new(
         struct vector *f2,
         struct vector *f3,
         struct vector *f4,
-        struct torsion_spring *s){
+        struct torsion_spring *s,
+        struct vector *pos){
 
     struct vector tmp;
 
     //Bond vectors according to naming in Blondel & Karplus
     struct vector F, G, H;
-    vsub(&F, &s->a1->position, &s->a2->position);
-    vsub(&G, &s->a2->position, &s->a3->position);
-    vsub(&H, &s->a4->position, &s->a3->position);
+    vsub(&F, &pos[s->a1], &pos[s->a2]);
+    vsub(&G, &pos[s->a2], &pos[s->a3]);
+    vsub(&H, &pos[s->a4], &pos[s->a3]);
 
     //Abort if either of the two angles are nearly 180 degrees
     double FG_angle = fabs(
@@ -224,7 +228,7 @@ void torsion_spring_force_new(
     //-sin(phi-phi0).
     //double angle = acos(vdot(&A, &B) / (vmag(&A) * vmag(&B)));
     vcross(&tmp, &B, &A);
-    double angle = torsion_spring_angle(s);
+    double angle = torsion_spring_angle(s, pos);
     double force = -sin((angle - s->angle) / 180 * M_PI);
 
     //d \phi / d r_i (i.e. for first atom)
@@ -273,13 +277,13 @@ void torsion_spring_force_new(
     vmul_by(f4, s->constant);
 }
 
-double torsion_spring_energy(struct torsion_spring *s){
-    double angle = torsion_spring_angle(s) / 180 * M_PI;
+double torsion_spring_energy(struct torsion_spring *s, struct vector *pos){
+    double angle = torsion_spring_angle(s, pos) / 180 * M_PI;
     double target = s->angle / 180 * M_PI;
     return -s->constant * cos(angle - target);
 }
 
-bool torsion_spring_synthesised(struct torsion_spring *s){
-    return s->a1->synthesised && s->a2->synthesised
-        && s->a3->synthesised && s->a4->synthesised;
+bool torsion_spring_synthesised(struct torsion_spring *s, bool *synthesised){
+    return synthesised[s->a1] && synthesised[s->a2]
+        && synthesised[s->a3] && synthesised[s->a4];
 }
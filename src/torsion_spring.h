@@ -9,42 +9,47 @@
 enum torsion_unit {R1, R4};
 
 struct torsion_spring {
-    struct atom *a1, *a2, *a3, *a4;
-    double angle;
-    double constant;
-    double cutoff;
+    ///Atom indices
+    uint32_t a1, a2, a3, a4;
+    float angle;
+    float constant;
+    float cutoff;
     bool enabled;
 };
 
 struct torsion_spring * torsion_spring_alloc(
-        struct atom *a1, struct atom *a2,
-        struct atom *a3, struct atom *a4,
+        size_t a1, size_t a2,
+        size_t a3, size_t a4,
         double angle, double constant);
 
 void torsion_spring_init(
         struct torsion_spring *s,
-        struct atom *a1, struct atom *a2,
-        struct atom *a3, struct atom *a4,
+        size_t a1, size_t a2,
+        size_t a3, size_t a4,
         double angle, double constant);
 void torsion_spring_free(struct torsion_spring *s);
-void torsion_spring_axis(struct vector *dst, struct torsion_spring *s);
-void torsion_spring_torque(struct vector *dst, struct torsion_spring *s);
-double torsion_spring_angle(struct torsion_spring *s);
+void torsion_spring_axis(struct vector *dst, struct torsion_spring *s,
+        struct vector *pos);
+void torsion_spring_torque(struct vector *dst, struct torsion_spring *s,
+        struct vector *pos);
+double torsion_spring_angle(struct torsion_spring *s, struct vector *pos);
 
 void torsion_spring_force(
         struct vector *f1,
         struct vector *f2,
         struct vector *f3,
         struct vector *f4,
-        struct torsion_spring *s);
+        struct torsion_spring *s,
+        struct vector *pos);
 void torsion_spring_force_new(
         struct vector *f1,
         struct vector *f2,
         struct vector *f3,
         struct vector *f4,
-        struct torsion_spring *s);
-double torsion_spring_energy(struct torsion_spring *s);
-bool torsion_spring_synthesised(struct torsion_spring *s);
+        struct torsion_spring *s,
+        struct vector *pos);
+double torsion_spring_energy(struct torsion_spring *s, struct vector *pos);
+bool torsion_spring_synthesised(struct torsion_spring *s, bool *synthesised);
 
 #endif /* TORSION_SPRING_H_ */
 
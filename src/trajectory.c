@@ -0,0 +1,441 @@
+#include <stdlib.h>
+#include <stdio.h>
+#include <stdint.h>
+#include <string.h>
+#include <errno.h>
+#include <error.h>
+#include <math.h>
+#include <sys/types.h>
+
+#ifdef HAVE_CONFIG_H
+#include <config.h>
+#endif
+
+#include "trajectory.h"
+#include "model.h"
+#include "residue.h"
+#include "vector.h"
+#include "pdb.h"
+
+//Magic numbers at the start of the trajectory, each frame and the trailer
+#define TRAJECTORY_MAGIC "POING2TR"
+#define TRAJECTORY_INDEX_MAGIC "POING2IX"
+#define TRAJECTORY_FRAME_MAGIC 0x4d415246
+#define TRAJECTORY_VERSION 1
+//Written in native byte order, so that trajectories from other machines are
+//caught
+#define TRAJECTORY_BYTE_ORDER 0x01020304
+//Maximum length of a 64-bit variable-length integer
+#define MAX_VARINT 10
+
+/*
+ * A trajectory consists of a header, the name and residue of each atom, the
+ * frames, the offset of each frame and finally a trailer giving the location
+ * of the offsets. A trajectory that was not closed has no offsets or trailer,
+ * but the frames can still be read in order.
+ */
+struct trajectory_header {
+    char magic[8];
+    uint32_t version;
+    uint32_t byte_order;
+    uint64_t natoms;
+    double precision;
+    uint32_t seed;
+    uint32_t has_seed;
+};
+
+/*
+ * Each frame is followed by a bitmap of the synthesised atoms and the encoded
+ * coordinates of those atoms; size is the length of both.
+ */
+struct trajectory_frame {
+    uint32_t magic;
+    uint32_t nsynth;
+    uint64_t size;
+    double time;
+};
+
+struct trajectory_trailer {
+    uint64_t index_offset;
+    uint64_t nframes;
+    char magic[8];
+};
+
+static size_t frame_size(size_t natoms){
+    return (natoms + 7) / 8 + natoms * N * MAX_VARINT;
+}
+
+//Write x to buf as a zigzag-encoded variable-length integer
+static uint8_t *put_varint(uint8_t *buf, int64_t x){
+    uint64_t z = ((uint64_t)x << 1) ^ (uint64_t)(x >> 63);
+    while(z >= 0x80){
+        *buf++ = (uint8_t)(z | 0x80);
+        z >>= 7;
+    }
+    *buf++ = (uint8_t)z;
+    return buf;
+}
+
+//Read a varint from buf, which ends at end. Returns NULL if it is truncated.
+static const uint8_t *get_varint(const uint8_t *buf, const uint8_t *end,
+        int64_t *x){
+    uint64_t z = 0;
+    for(int shift=0; buf < end && shift < 64; shift += 7){
+        uint8_t b = *buf++;
+        z |= (uint64_t)(b & 0x7f) << shift;
+        if(!(b & 0x80)){
+            *x = (int64_t)(z >> 1) ^ -(int64_t)(z & 1);
+            return buf;
+        }
+    }
+    return NULL;
+}
+
+static int write_bytes(struct trajectory *t, const void *data, size_t size){
+    if(fwrite(data, 1, size, t->out) != size)
+        return 1;
+    t->offset += size;
+    return 0;
+}
+
+/**
+ * Start writing a trajectory of model m to out. The header records the name
+ * and residue of each atom, and the random seed if seed is not NULL.
+ *
+ * \return Non-zero on error.
+ */
+int trajectory_open(struct trajectory *t, FILE *out, const struct model *m,
+        const unsigned int *seed){
+    memset(t, 0, sizeof(*t));
+    t->out = out;
+    t->natoms = m->num_atoms;
+    t->buf = malloc(frame_size(t->natoms));
+    if(!t->buf){
+        fprintf(stderr, "Couldn't allocate trajectory buffer\n");
+        return 1;
+    }
+
+    struct trajectory_header h;
+    memset(&h, 0, sizeof(h));
+    memcpy(h.magic, TRAJECTORY_MAGIC, sizeof(h.magic));
+    h.version = TRAJECTORY_VERSION;
+    h.byte_order = TRAJECTORY_BYTE_ORDER;
+    h.natoms = t->natoms;
+    h.precision = TRAJECTORY_PRECISION;
+    h.seed = seed ? *seed : 0;
+    h.has_seed = seed != NULL;
+    if(write_bytes(t, &h, sizeof(h)))
+        goto write_error;
+
+    for(size_t i=0; i < t->natoms; i++){
+        const struct atom *a = &m->atoms[i];
+        const struct residue *r = &m->residues[a->residue_idx];
+        struct trajectory_atom ta;
+        memset(&ta, 0, sizeof(ta));
+        ta.id = a->id;
+        ta.residue_id = r->id;
+        strncpy(ta.name, a->name, sizeof(ta.name) - 1);
+        strncpy(ta.residue, r->name, sizeof(ta.residue) - 1);
+        if(write_bytes(t, &ta, sizeof(ta)))
+            goto write_error;
+    }
+    return 0;
+
+write_error:
+    error(0, errno, "Error writing trajectory");
+    free(t->buf);
+    t->buf = NULL;
+    return 1;
+}
+
+/**
+ * Append the positions of the synthesised atoms of m to the trajectory.
+ *
+ * \return Non-zero on error.
+ */
+int trajectory_write(struct trajectory *t, const struct model *m){
+    if(t->nframes == t->max_frames){
+        size_t max_frames = t->max_frames ? t->max_frames * 2 : 64;
+        uint64_t *index = realloc(t->index, sizeof(*index) * max_frames);
+        if(!index){
+            fprintf(stderr, "Couldn't allocate trajectory index\n");
+            return 1;
+        }
+        t->index = index;
+        t->max_frames = max_frames;
+    }
+
+    //Atoms that have not been synthesised yet are left out
+    size_t bitmap_size = (t->natoms + 7) / 8;
+    uint8_t *bitmap = t->buf;
+    uint8_t *p = t->buf + bitmap_size;
+    memset(bitmap, 0, bitmap_size);
+
+    int64_t prev[N] = {0};
+    uint32_t nsynth = 0;
+    for(size_t i=0; i < m->num_atoms; i++){
+        if(!m->synthesised[i])
+            continue;
+        bitmap[i / 8] |= 1 << (i % 8);
+        nsynth++;
+
+        //Neighbouring atoms are close, so the differences are small
+        for(size_t j=0; j < N; j++){
+            int64_t q = llround(m->positions[i].c[j] * TRAJECTORY_PRECISION);
+            p = put_varint(p, q - prev[j]);
+            prev[j] = q;
+        }
+    }
+
+    struct trajectory_frame f;
+    memset(&f, 0, sizeof(f));
+    f.magic = TRAJECTORY_FRAME_MAGIC;
+    f.nsynth = nsynth;
+    f.size = p - t->buf;
+    f.time = m->time;
+
+    uint64_t offset = t->offset;
+    if(write_bytes(t, &f, sizeof(f)) || write_bytes(t, t->buf, f.size)){
+        error(0, errno, "Error writing trajectory");
+        return 1;
+    }
+    t->index[t->nframes++] = offset;
+    return 0;
+}
+
+/**
+ * Write the index of the frames, and free the trajectory. The output file is
+ * flushed but not closed.
+ *
+ * \return Non-zero if the index or any earlier frames could not be written.
+ */
+int trajectory_close(struct trajectory *t){
+    struct trajectory_trailer trailer;
+    memset(&trailer, 0, sizeof(trailer));
+    trailer.index_offset = t->offset;
+    trailer.nframes = t->nframes;
+    memcpy(trailer.magic, TRAJECTORY_INDEX_MAGIC, sizeof(trailer.magic));
+
+    int retval = 0;
+    if((t->nframes
+                && write_bytes(t, t->index, sizeof(*t->index) * t->nframes))
+            || write_bytes(t, &trailer, sizeof(trailer))
+            || fflush(t->out) || ferror(t->out)){
+        error(0, errno, "Error writing trajectory");
+        retval = 1;
+    }
+    free(t->index);
+    free(t->buf);
+    t->index = NULL;
+    t->buf = NULL;
+    return retval;
+}
+
+/*
+ * Build the index of a trajectory that was not closed by reading each frame
+ * header in turn, starting from offset. Reading stops at the first incomplete
+ * frame.
+ */
+static int scan_frames(struct trajectory_reader *r, uint64_t offset,
+        uint64_t file_size){
+    size_t max_frames = 0;
+    struct trajectory_frame f;
+    while(offset + sizeof(f) <= file_size){
+        if(fseeko(r->in, offset, SEEK_SET)
+                || fread(&f, sizeof(f), 1, r->in) != 1
+                || f.magic != TRAJECTORY_FRAME_MAGIC
+                || f.size > frame_size(r->natoms)
+                || offset + sizeof(f) + f.size > file_size)
+            break;
+
+        if(r->nframes == max_frames){
+            max_frames = max_frames ? max_frames * 2 : 64;
+            uint64_t *index = realloc(r->index, sizeof(*index) * max_frames);
+            if(!index){
+                fprintf(stderr, "Couldn't allocate trajectory index\n");
+                return 1;
+            }
+            r->index = index;
+        }
+        r->index[r->nframes++] = offset;
+        offset += sizeof(f) + f.size;
+    }
+    return 0;
+}
+
+/**
+ * Open a trajectory written by trajectory_write. The index of the frames is
+ * read from the end of the file, so that any frame can be read directly. If
+ * the trajectory was not closed, the frames are scanned instead.
+ *
+ * \return Non-zero on error.
+ */
+int trajectory_read_open(struct trajectory_reader *r, const char *file){
+    memset(r, 0, sizeof(*r));
+    r->in = fopen(file, "rb");
+    if(!r->in){
+        error(0, errno, "Error opening %s", file);
+        return 1;
+    }
+
+    struct trajectory_header h;
+    if(fread(&h, sizeof(h), 1, r->in) != 1
+            || memcmp(h.magic, TRAJECTORY_MAGIC, sizeof(h.magic)) != 0){
+        fprintf(stderr, "%s is not a poing2 trajectory\n", file);
+        goto error;
+    }
+    if(h.version != TRAJECTORY_VERSION
+            || h.byte_order != TRAJECTORY_BYTE_ORDER){
+        fprintf(stderr, "%s was written by an incompatible version of poing2\n",
+                file);
+        goto error;
+    }
+    r->natoms = h.natoms;
+    r->precision = h.precision;
+    r->seed = h.seed;
+    r->has_seed = h.has_seed;
+
+    r->atoms = malloc(sizeof(*r->atoms) * (r->natoms ? r->natoms : 1));
+    r->buf = malloc(frame_size(r->natoms));
+    if(!r->atoms || !r->buf){
+        fprintf(stderr, "Couldn't allocate memory for trajectory %s\n", file);
+        goto error;
+    }
+    if(fread(r->atoms, sizeof(*r->atoms), r->natoms, r->in) != r->natoms)
+        goto read_error;
+    uint64_t frames_start = sizeof(h) + sizeof(*r->atoms) * r->natoms;
+
+    struct trajectory_trailer trailer;
+    if(fseeko(r->in, 0, SEEK_END))
+        goto read_error;
+    uint64_t file_size = ftello(r->in);
+
+    bool indexed = file_size >= frames_start + sizeof(trailer)
+        && !fseeko(r->in, file_size - sizeof(trailer), SEEK_SET)
+        && fread(&trailer, sizeof(trailer), 1, r->in) == 1
+        && !memcmp(trailer.magic, TRAJECTORY_INDEX_MAGIC, sizeof(trailer.magic))
+        && trailer.index_offset >= frames_start
+        && trailer.index_offset + trailer.nframes * sizeof(*r->index)
+            + sizeof(trailer) == file_size;
+
+    if(indexed){
+        r->nframes = trailer.nframes;
+        r->index = malloc(sizeof(*r->index) * (r->nframes ? r->nframes : 1));
+        if(!r->index){
+            fprintf(stderr, "Couldn't allocate trajectory index\n");
+            goto error;
+        }
+        if(fseeko(r->in, trailer.index_offset, SEEK_SET)
+                || fread(r->index, sizeof(*r->index), r->nframes, r->in)
+                    != r->nframes)
+            goto read_error;
+    }else if(scan_frames(r, frames_start, file_size)){
+        goto error;
+    }
+    return 0;
+
+read_error:
+    error(0, errno, "Error reading %s", file);
+error:
+    trajectory_read_close(r);
+    return 1;
+}
+
+/**
+ * Read frame number frame (counting from zero) of a trajectory. The position
+ * of each synthesised atom is written to positions, which must have space for
+ * every atom, and whether the atom was synthesised to synthesised. The time of
+ * the frame is written to time if it is not NULL.
+ *
+ * \return Non-zero on error.
+ */
+int trajectory_read_frame(struct trajectory_reader *r, size_t frame,
+        struct vector *positions, bool *synthesised, double *time){
+    if(frame >= r->nframes){
+        fprintf(stderr, "Trajectory has no frame %zu\n", frame + 1);
+        return 1;
+    }
+
+    struct trajectory_frame f;
+    if(fseeko(r->in, r->index[frame], SEEK_SET)
+            || fread(&f, sizeof(f), 1, r->in) != 1
+            || f.magic != TRAJECTORY_FRAME_MAGIC
+            || f.size > frame_size(r->natoms)
+            || fread(r->buf, 1, f.size, r->in) != f.size){
+        fprintf(stderr, "Error reading trajectory frame %zu\n", frame + 1);
+        return 1;
+    }
+
+    size_t bitmap_size = (r->natoms + 7) / 8;
+    const uint8_t *bitmap = r->buf;
+    const uint8_t *p = r->buf + bitmap_size;
+    const uint8_t *end = r->buf + f.size;
+
+    int64_t q[N] = {0};
+    for(size_t i=0; i < r->natoms; i++){
+        synthesised[i] = bitmap[i / 8] & (1 << (i % 8));
+        if(!synthesised[i])
+            continue;
+        for(size_t j=0; j < N; j++){
+            int64_t delta;
+            if(!(p = get_varint(p, end, &delta))){
+                fprintf(stderr, "Trajectory frame %zu is corrupt\n", frame + 1);
+                return 1;
+            }
+            q[j] += delta;
+            positions[i].c[j] = q[j] / r->precision;
+        }
+    }
+    if(time)
+        *time = f.time;
+    return 0;
+}
+
+/**
+ * Write frame number frame (counting from zero) of a trajectory as a PDB
+ * model. The model is numbered from one, as poing2 numbers its snapshots.
+ *
+ * \return Non-zero on error.
+ */
+int trajectory_frame_pdb(FILE *out, struct trajectory_reader *r, size_t frame){
+    struct vector *positions = malloc(sizeof(*positions) * (r->natoms + 1));
+    bool *synthesised = malloc(sizeof(*synthesised) * (r->natoms + 1));
+    int retval = 1;
+    if(!positions || !synthesised){
+        fprintf(stderr, "Couldn't allocate memory for trajectory frame\n");
+        goto free_frame;
+    }
+    if(trajectory_read_frame(r, frame, positions, synthesised, NULL))
+        goto free_frame;
+
+    struct pdb_buffer *b = malloc(sizeof(*b));
+    if(!b){
+        fprintf(stderr, "Couldn't allocate memory for trajectory frame\n");
+        goto free_frame;
+    }
+    pdb_buffer_init(b, out);
+    pdb_model(b, frame + 1);
+    for(size_t i=0; i < r->natoms; i++){
+        const struct trajectory_atom *a = &r->atoms[i];
+        if(synthesised[i])
+            pdb_atom(b, a->id, a->name, a->residue, a->residue_id,
+                    &positions[i]);
+    }
+    pdb_puts(b, "ENDMDL\n");
+    retval = pdb_flush(b) ? 1 : 0;
+    free(b);
+
+free_frame:
+    free(positions);
+    free(synthesised);
+    return retval;
+}
+
+void trajectory_read_close(struct trajectory_reader *r){
+    if(r->in)
+        fclose(r->in);
+    free(r->atoms);
+    free(r->index);
+    free(r->buf);
+    memset(r, 0, sizeof(*r));
+}
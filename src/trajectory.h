@@ -0,0 +1,70 @@
+#ifndef TRAJECTORY_H_
+#define TRAJECTORY_H_
+
+#include <stddef.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include <stdio.h>
+
+struct model;
+struct vector;
+
+///Coordinates are stored in units of 1/TRAJECTORY_PRECISION Angstroms
+#define TRAJECTORY_PRECISION 1000
+
+///Name and residue of an atom, as written to the trajectory header
+struct trajectory_atom {
+    int32_t id;
+    int32_t residue_id;
+    char name[8];
+    char residue[8];
+};
+
+/**
+ * A binary trajectory being written. Each frame holds the positions of the
+ * synthesised atoms, quantised to TRAJECTORY_PRECISION and stored as
+ * variable-length differences from the previous atom. Frames are written as
+ * they are added, so the output may be a pipe; an index of the frames is
+ * written when the trajectory is closed.
+ */
+struct trajectory {
+    FILE *out;
+    size_t natoms;
+    ///Bytes written so far
+    uint64_t offset;
+
+    ///Offset of each frame
+    uint64_t *index;
+    size_t nframes;
+    size_t max_frames;
+
+    ///Buffer in which each frame is encoded
+    uint8_t *buf;
+};
+
+///A binary trajectory opened for reading
+struct trajectory_reader {
+    FILE *in;
+    size_t natoms;
+    double precision;
+    unsigned int seed;
+    bool has_seed;
+    struct trajectory_atom *atoms;
+
+    uint64_t *index;
+    size_t nframes;
+    uint8_t *buf;
+};
+
+int trajectory_open(struct trajectory *t, FILE *out, const struct model *m,
+        const unsigned int *seed);
+int trajectory_write(struct trajectory *t, const struct model *m);
+int trajectory_close(struct trajectory *t);
+
+int trajectory_read_open(struct trajectory_reader *r, const char *file);
+int trajectory_read_frame(struct trajectory_reader *r, size_t frame,
+        struct vector *positions, bool *synthesised, double *time);
+int trajectory_frame_pdb(FILE *out, struct trajectory_reader *r, size_t frame);
+void trajectory_read_close(struct trajectory_reader *r);
+
+#endif /* TRAJECTORY_H_ */
@@ -0,0 +1,96 @@
+#include <config.h>
+#include <stdlib.h>
+#include <stdio.h>
+#include <stdbool.h>
+#include <getopt.h>
+#include "trajectory.h"
+
+static struct option opts[] = {
+    {"help",   no_argument,       0, 'h'},
+    {"frame",  required_argument, 0, 'f'},
+    {"all",    no_argument,       0, 'a'},
+    {"info",   no_argument,       0, 'i'},
+    {0, 0, 0, 0}
+};
+const char *opt_str = "hf:ai";
+
+const char *usage_str =
+"Usage: poing2-traj [OPTIONS] <TRAJECTORY>\n"
+"\n"
+"Extract snapshots from a binary trajectory written by poing2 --trajectory,\n"
+"and write them to standard output in PDB format. By default, the final\n"
+"snapshot is written.\n"
+"Available options:\n"
+"  -h, --help         Display this help message.\n"
+"  -f, --frame=N      Write snapshot N, counting from 1. Negative values of N\n"
+"                     count back from the final snapshot.\n"
+"  -a, --all          Write every snapshot.\n"
+"  -i, --info         Print the number of atoms and snapshots.\n"
+;
+
+void usage(const char *msg, int exitval){
+    FILE *out = (exitval < 2) ? stdout : stderr;
+    if(msg)
+        fprintf(out, "%s\n", msg);
+    fprintf(out, "%s", usage_str);
+    exit(exitval);
+}
+
+int main(int argc, char **argv){
+    long frame = -1;
+    bool all = false;
+    bool info = false;
+    int c;
+    int option_index;
+    while((c = getopt_long(argc, argv, opt_str, opts, &option_index)) != -1){
+        switch(c){
+            case 'h':
+                usage(NULL, 1);
+                break;
+            case 'f':
+                frame = atol(optarg);
+                if(frame == 0)
+                    usage("Snapshots are numbered from 1.", 2);
+                break;
+            case 'a':
+                all = true;
+                break;
+            case 'i':
+                info = true;
+                break;
+            default:
+                usage(NULL, 2);
+        }
+    }
+    if(optind != argc - 1)
+        usage("A single trajectory file must be given.", 2);
+
+    struct trajectory_reader r;
+    if(trajectory_read_open(&r, argv[optind]))
+        return 1;
+
+    int retval = 0;
+    if(info){
+        printf("Atoms: %zu\nSnapshots: %zu\n", r.natoms, r.nframes);
+        goto close;
+    }
+
+    if(r.has_seed)
+        printf("REMARK RANDOM SEED %u\n", r.seed);
+    if(all){
+        for(size_t i=0; i < r.nframes && !retval; i++)
+            retval = trajectory_frame_pdb(stdout, &r, i);
+    }else{
+        long idx = frame > 0 ? frame - 1 : (long)r.nframes + frame;
+        if(idx < 0 || idx >= (long)r.nframes){
+            fprintf(stderr, "Trajectory has %zu snapshots.\n", r.nframes);
+            retval = 1;
+        }else{
+            retval = trajectory_frame_pdb(stdout, &r, idx);
+        }
+    }
+
+close:
+    trajectory_read_close(&r);
+    return retval;
+}
@@ -3,6 +3,7 @@
 
 #include <math.h>
 #include <stdlib.h>
+#include "rng.h"
 
 #define N 3
 typedef double real;
@@ -98,18 +99,14 @@ inline double vmag(struct vector *v1){
 
 
 /**
- * Find a random vector within a given azimuthal angle.
- *
- * This produces a random vector with an azimuthal angle between min_phi and
- * max_phi.
+ * Find the vector within a given azimuthal angle given by the uniform random
+ * numbers i and j, which are between 0 and 1.
  */
-
-inline void vector_rand(struct vector *dst, double min_phi, double max_phi){
+inline void vector_rand_from(struct vector *dst, double min_phi,
+        double max_phi, double i, double j){
     double cos_max_phi = cos(max_phi);
     double cos_min_phi = cos(min_phi);
 
-    double i = (double)rand() / RAND_MAX;
-    double j = (double)rand() / RAND_MAX;
     double z   = cos_min_phi - i * (cos_min_phi - cos_max_phi);
     double phi = j * M_PI * 2;
 
@@ -118,6 +115,20 @@ inline void vector_rand(struct vector *dst, double min_phi, double max_phi){
     dst->c[2] = z;
 }
 
+/**
+ * Find a random vector within a given azimuthal angle.
+ *
+ * This produces a random vector with an azimuthal angle between min_phi and
+ * max_phi.
+ */
+
+inline void vector_rand(struct vector *dst, double min_phi, double max_phi,
+        struct rng *rng){
+    double i = (double)rng_rand(rng) / RAND_MAX;
+    double j = (double)rng_rand(rng) / RAND_MAX;
+    vector_rand_from(dst, min_phi, max_phi, i, j);
+}
+
 inline void vector_spherical_coords(struct vector *dst, struct vector *v){
     dst->c[0] = vmag(v);
     dst->c[1] = atan2(v->c[1], v->c[0]);
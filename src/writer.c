@@ -0,0 +1,168 @@
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <errno.h>
+#include <error.h>
+
+#ifdef HAVE_CONFIG_H
+#include <config.h>
+#endif
+
+#include "writer.h"
+#include "model.h"
+#include "trajectory.h"
+#include "vector.h"
+
+//Write a single snapshot to the output
+static void write_snapshot(struct writer *w, const struct model *state){
+    if(w->traj){
+        if(trajectory_write(w->traj, state))
+            w->failed = true;
+        w->num_written++;
+    }else if(model_pdb(w->out, state, w->conect, &w->num_written) < 0){
+        w->failed = true;
+    }
+}
+
+static void free_frames(struct writer *w){
+    for(size_t i=0; i < w->nframes && w->frames; i++){
+        free(w->frames[i].positions);
+        free(w->frames[i].synthesised);
+    }
+    free(w->frames);
+    w->frames = NULL;
+}
+
+#ifdef HAVE_PTHREAD
+//Write frames from the tail of the ring until the last one
+static void *writer_thread(void *data){
+    struct writer *w = data;
+    while(true){
+        while(sem_wait(&w->filled) && errno == EINTR)
+            ;
+        size_t tail = __atomic_load_n(&w->tail, __ATOMIC_RELAXED);
+        struct writer_frame *f = &w->frames[tail];
+        if(f->last)
+            break;
+        write_snapshot(w, &f->state);
+        __atomic_store_n(&w->tail, (tail + 1) % w->nframes, __ATOMIC_RELEASE);
+        sem_post(&w->empty);
+    }
+    return NULL;
+}
+#endif
+
+/**
+ * Set up a writer for snapshots of model m, which are written to the
+ * trajectory traj if it is not NULL, or as PDB models to out. If conect is
+ * set, CONECT records are written with each PDB model.
+ *
+ * Up to nframes snapshots are queued to be written by a separate thread. If
+ * nframes is zero, or threads are not available, snapshots are written as
+ * soon as they are pushed.
+ *
+ * \return Non-zero on error.
+ */
+int writer_init(struct writer *w, const struct model *m, size_t nframes,
+        FILE *out, struct trajectory *traj, bool conect){
+    memset(w, 0, sizeof(*w));
+    w->out = out;
+    w->traj = traj;
+    w->conect = conect;
+#ifdef HAVE_PTHREAD
+    //One frame is needed to tell the thread to stop
+    w->nframes = nframes ? nframes + 1 : 0;
+#endif
+    if(!w->nframes)
+        return 0;
+
+    w->frames = calloc(w->nframes, sizeof(*w->frames));
+    if(!w->frames)
+        goto alloc_error;
+    w->natoms = m->num_atoms;
+    size_t natoms = m->num_atoms ? m->num_atoms : 1;
+    for(size_t i=0; i < w->nframes; i++){
+        struct writer_frame *f = &w->frames[i];
+        f->positions = malloc(sizeof(*f->positions) * natoms);
+        f->synthesised = malloc(sizeof(*f->synthesised) * natoms);
+        if(!f->positions || !f->synthesised)
+            goto alloc_error;
+    }
+
+#ifdef HAVE_PTHREAD
+    sem_init(&w->filled, 0, 0);
+    sem_init(&w->empty, 0, w->nframes - 1);
+    int err = pthread_create(&w->thread, NULL, writer_thread, w);
+    if(err){
+        error(0, err, "Couldn't start writer thread");
+        sem_destroy(&w->filled);
+        sem_destroy(&w->empty);
+        free_frames(w);
+        return 1;
+    }
+#endif
+    return 0;
+
+alloc_error:
+    fprintf(stderr, "Couldn't allocate snapshot buffers\n");
+    free_frames(w);
+    return 1;
+}
+
+/**
+ * Write a snapshot of state. If snapshots are written by a separate thread,
+ * the positions and synthesised atoms of state are copied into the ring, and
+ * this only waits if the ring is full.
+ */
+void writer_push(struct writer *w, const struct model *state){
+    if(!w->nframes){
+        write_snapshot(w, state);
+        return;
+    }
+#ifdef HAVE_PTHREAD
+    while(sem_wait(&w->empty) && errno == EINTR)
+        ;
+    size_t head = __atomic_load_n(&w->head, __ATOMIC_RELAXED);
+    struct writer_frame *f = &w->frames[head];
+
+    //Springs may refer to atoms beyond those in the state, which must still
+    //be marked as not synthesised.
+    memcpy(&f->state, state, sizeof(f->state));
+    memcpy(f->positions, state->positions, sizeof(*f->positions) * w->natoms);
+    memcpy(f->synthesised, state->synthesised,
+            sizeof(*f->synthesised) * w->natoms);
+    f->state.positions = f->positions;
+    f->state.synthesised = f->synthesised;
+    f->last = false;
+
+    __atomic_store_n(&w->head, (head + 1) % w->nframes, __ATOMIC_RELEASE);
+    sem_post(&w->filled);
+#endif
+}
+
+/**
+ * Wait for any queued snapshots to be written, and free the writer.
+ *
+ * \return Non-zero if any snapshot could not be written.
+ */
+int writer_finish(struct writer *w){
+#ifdef HAVE_PTHREAD
+    if(w->nframes){
+        //The empty semaphore leaves one frame spare for this
+        size_t head = __atomic_load_n(&w->head, __ATOMIC_RELAXED);
+        w->frames[head].last = true;
+        __atomic_store_n(&w->head, (head + 1) % w->nframes, __ATOMIC_RELEASE);
+        sem_post(&w->filled);
+
+        pthread_join(w->thread, NULL);
+        sem_destroy(&w->filled);
+        sem_destroy(&w->empty);
+        free_frames(w);
+    }
+#endif
+    if(!w->traj && fflush(w->out))
+        w->failed = true;
+    if(w->failed)
+        fprintf(stderr, "Error writing snapshots\n");
+    return w->failed;
+}
@@ -0,0 +1,73 @@
+#ifndef WRITER_H_
+#define WRITER_H_
+
+#include <stddef.h>
+#include <stdbool.h>
+#include <stdio.h>
+
+#ifdef HAVE_CONFIG_H
+#include <config.h>
+#endif
+
+#ifdef HAVE_PTHREAD
+#   include <pthread.h>
+#   include <semaphore.h>
+#endif
+
+#include "model.h"
+
+struct trajectory;
+
+///Default number of snapshots that may be waiting to be written
+#define DEFAULT_WRITER_FRAMES 4
+
+///A snapshot waiting to be written
+struct writer_frame {
+    ///Shallow copy of the state, with its own positions and synthesised atoms
+    struct model state;
+    struct vector *positions;
+    bool *synthesised;
+    ///Set to tell the writer thread to stop
+    bool last;
+};
+
+/**
+ * Writes snapshots, either as PDB models or to a trajectory.
+ *
+ * If frames were requested and threads are available, the snapshots are
+ * written by a separate thread so that the simulation does not wait for the
+ * output. The positions are copied into a ring of preallocated frames, which
+ * is a single-producer, single-consumer queue: the simulation thread only
+ * moves the head and the writer thread only moves the tail. The semaphores
+ * count the filled and empty frames, and are only used to sleep when the
+ * ring is empty or full.
+ */
+struct writer {
+    FILE *out;
+    ///Trajectory to which snapshots are written instead of PDB, or NULL
+    struct trajectory *traj;
+    bool conect;
+    ///Number of models written so far
+    int num_written;
+    ///Set if any snapshot could not be written
+    bool failed;
+
+    ///Number of atoms in the model, which are copied into each frame
+    size_t natoms;
+    ///Number of frames in the ring, or 0 to write snapshots immediately
+    size_t nframes;
+    struct writer_frame *frames;
+    ///Index of the next frame to fill, and the next frame to write
+    size_t head, tail;
+#ifdef HAVE_PTHREAD
+    sem_t filled, empty;
+    pthread_t thread;
+#endif
+};
+
+int writer_init(struct writer *w, const struct model *m, size_t nframes,
+        FILE *out, struct trajectory *traj, bool conect);
+void writer_push(struct writer *w, const struct model *state);
+int writer_finish(struct writer *w);
+
+#endif /* WRITER_H_ */
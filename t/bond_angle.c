@@ -4,6 +4,7 @@
 #include "../src/bond_angle.h"
 #include "../src/residue.h"
 #include "../src/vector.h"
+#include "../src/lanes.h"
 #include "tap.h"
 
 void is_vector(struct vector *v1, struct vector *v2, 
@@ -12,11 +13,42 @@ void is_vector(struct vector *v1, struct vector *v2,
         fis(v1->c[i], v2->c[i], epsilon, "%s: element %d", text, i);
 }
 
+//Each lane of the lane force should match the scalar force, including in lanes
+//where the angle is straight.
+void test_lanes(struct bond_angle_spring *s){
+    struct vector pos[LANES][3];
+    for(size_t k=0; k < LANES; k++){
+        vector_fill(&pos[k][0], 0, 1, 0.2 * k);
+        vector_fill(&pos[k][1], 0, 0, 0);
+        vector_fill(&pos[k][2], 1 + k, 0.5 * k, 0);
+    }
+    //Straight
+    vector_fill(&pos[1][0], -1, 0, 0);
+    vector_fill(&pos[1][2], 2, 0, 0);
+
+    struct lane_vector lane_pos[3], f[3];
+    for(size_t a=0; a < 3; a++)
+        for(size_t i=0; i < N; i++)
+            for(size_t k=0; k < LANES; k++)
+                lane_pos[a].c[i][k] = pos[k][a].c[i];
+    bond_angle_force_lanes(&f[0], &f[1], &f[2], s, lane_pos);
+
+    for(size_t k=0; k < LANES; k++){
+        struct vector scalar[3];
+        bond_angle_force(&scalar[0], &scalar[1], &scalar[2], s, pos[k]);
+        double max_diff = 0;
+        for(size_t a=0; a < 3; a++)
+            for(size_t i=0; i < N; i++)
+                max_diff = fmax(max_diff, fabs(f[a].c[i][k] - scalar[a].c[i]));
+        ok(max_diff < 1e-10, "Lane %d matches scalar force", k);
+    }
+}
+
 int main(){
-    plan(9);
+    plan(9 + LANES);
     struct bond_angle_spring *s;
 
-    struct atom a1, a2, a3;
+    struct vector pos[3];
 
     /*
      * a1
@@ -24,11 +56,11 @@ int main(){
      * |
      * a2----a3
      */
-    vector_fill(&a1.position,  0, 1, 0);
-    vector_fill(&a2.position,  0, 0, 0);
-    vector_fill(&a3.position,  1, 0, 0);
+    vector_fill(&pos[0],  0, 1, 0);
+    vector_fill(&pos[1],  0, 0, 0);
+    vector_fill(&pos[2],  1, 0, 0);
 
-    s = bond_angle_spring_alloc(&a1, &a2, &a3, 45, 1.0);
+    s = bond_angle_spring_alloc(0, 1, 2, 45, 1.0);
 
     //Try the new force method
     struct vector f1, f2, f3;
@@ -36,7 +68,7 @@ int main(){
     vector_zero(&f2);
     vector_zero(&f3);
 
-    bond_angle_force(&f1, &f2, &f3, s);
+    bond_angle_force(&f1, &f2, &f3, s, pos);
     cmp_ok(f1.c[0], ">=", 0, "a1 moving right");
     cmp_ok(f1.c[1], "<=", 0, "a1 moving down");
     fis(f1.c[2], 0, 1e-3, "a1 approximately stationary in z");
@@ -49,5 +81,6 @@ int main(){
     cmp_ok(f3.c[1], ">=", 0, "a3 moving up");
     fis(f3.c[2], 0, 1e-3, "a3 approximately stationary in z");
 
+    test_lanes(s);
     done_testing();
 }
@@ -0,0 +1,135 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include "../src/springreader.h"
+#include "../src/checkpoint.h"
+#include "../src/model.h"
+#include "../src/rng.h"
+#include "../src/rattle.h"
+#include "../src/sterics.h"
+#include "../src/vector.h"
+#include "tap.h"
+
+const char *json =
+"{\n"
+"    \"sequence\": \"AG\",\n"
+"    \"do_synthesis\": false,\n"
+"    \"atoms\": [\n"
+"        {\"id\": 1, \"name\": \"CA\",  \"residue\": 1,"
+"         \"position\": [1, 2, 3]},\n"
+"        {\"id\": 2, \"name\": \"ALA\", \"residue\": 1,"
+"         \"position\": [2, 2, 3]},\n"
+"        {\"id\": 3, \"name\": \"CA\",  \"residue\": 2,"
+"         \"position\": [4, 5, 6]}\n"
+"    ],\n"
+"    \"linear\": [\n"
+"        {\"atoms\": [1, 3], \"distance\": 3.8, \"constant\": 0.2}\n"
+"    ]\n"
+"}\n";
+
+const char *other_json =
+"{\n"
+"    \"sequence\": \"A\",\n"
+"    \"do_synthesis\": false,\n"
+"    \"atoms\": [\n"
+"        {\"id\": 1, \"name\": \"CA\",  \"residue\": 1,"
+"         \"position\": [1, 2, 3]}\n"
+"    ]\n"
+"}\n";
+
+void test_state(const char *file){
+    struct model *m = springreader_parse_str(json);
+    struct model *other = springreader_parse_str(other_json);
+    if(!m || !other)
+        BAIL_OUT("Couldn't parse model");
+
+    m->time = 12.5;
+    vector_fill(&m->velocities[2], 0.25, -1, 0.5);
+    rng_rand(m->rng);
+
+    struct checkpointer c;
+    checkpoint_init(&c, file);
+    struct checkpoint_counters saved = {
+        .nsteps = 125, .num_snapshots = 3, .num_checkpoints = 1};
+    ok(!checkpoint_save(&c, m, m, NULL, &saved), "Saved checkpoint");
+    ok(!checkpoint_finish(&c), "Checkpoint written");
+    int next = rng_rand(m->rng);
+
+    //Carry on, then go back to the checkpoint
+    m->time = 20;
+    vector_fill(&m->positions[0], 0, 0, 0);
+    vector_fill(&m->velocities[2], 0, 0, 0);
+    rng_rand(m->rng);
+
+    struct checkpoint_counters n;
+    ok(!checkpoint_restore(file, m, m, NULL, &n), "Restored checkpoint");
+    ok(n.nsteps == 125 && n.num_snapshots == 3 && n.num_checkpoints == 1,
+            "Counters restored");
+    fis(m->time, 12.5, 1e-10, "Time restored");
+    ok(m->positions[0].c[0] == 1 && m->velocities[2].c[1] == -1,
+            "Positions and velocities restored");
+    cmp_ok(rng_rand(m->rng), "==", next, "Random numbers continue");
+
+    ok(checkpoint_restore(file, other, other, NULL, &n),
+            "Checkpoint of another model rejected");
+
+    model_free(other);
+    model_free(m);
+}
+
+//The neighbour lists are saved once they have been built by a step
+void test_sterics(const char *file){
+    struct model *m = springreader_parse_str(json);
+    if(!m)
+        BAIL_OUT("Couldn't parse model");
+    m->use_sterics = true;
+    struct steric_grid grid;
+    if(model_build_bonds(m) || rattle_init_solver(m)
+            || model_build_active_set(m) || steric_grid_init(&grid, m))
+        BAIL_OUT("Couldn't set up model");
+    m->steric_grid = &grid;
+    rattle_push(m);
+
+    struct neighbour_list *l = &grid.neighbours;
+    size_t natoms = m->num_atoms;
+    ok(l->num_atoms == natoms, "Neighbour lists built");
+    size_t len = l->start[natoms];
+    size_t first_nonbonded = l->first_nonbonded[natoms - 1];
+    size_t first_far = l->first_far[natoms - 1];
+    size_t builds = l->builds;
+
+    struct checkpointer c;
+    checkpoint_init(&c, file);
+    struct checkpoint_counters saved = {.nsteps = 1};
+    ok(!checkpoint_save(&c, m, m, NULL, &saved)
+            && !checkpoint_finish(&c), "Saved checkpoint with sterics");
+
+    l->start[natoms] = l->first_nonbonded[natoms - 1] = 0;
+    l->first_far[natoms - 1] = 0;
+    l->builds = 0;
+    struct checkpoint_counters n;
+    ok(!checkpoint_restore(file, m, m, NULL, &n),
+            "Restored checkpoint with sterics");
+    ok(l->num_atoms == natoms && l->builds == builds && l->start[natoms] == len
+            && l->first_nonbonded[natoms - 1] == first_nonbonded
+            && l->first_far[natoms - 1] == first_far,
+            "Neighbour lists restored");
+
+    steric_grid_free(&grid);
+    m->steric_grid = NULL;
+    model_free(m);
+}
+
+int main(){
+    plan(12);
+    char file[] = "checkpointXXXXXX";
+    int fd = mkstemp(file);
+    close(fd);
+
+    test_state(file);
+    test_sterics(file);
+
+    unlink(file);
+    done_testing();
+}
@@ -0,0 +1,152 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include "../src/springreader.h"
+#include "../src/image.h"
+#include "../src/model.h"
+#include "../src/residue.h"
+#include "../src/linear_spring.h"
+#include "../src/torsion_spring.h"
+#include "../src/bond_angle.h"
+#include "../src/rama.h"
+#include "tap.h"
+
+const char *json =
+"{\n"
+"    \"sequence\": \"AG\",\n"
+"    \"timestep\": 0.05,\n"
+"    \"until\": 200,\n"
+"    \"use_sterics\": true,\n"
+"    \"do_synthesis\": false,\n"
+"    \"fix_before\": 3,\n"
+"    \"constraint_solver\": \"coloured\",\n"
+"    \"respa_steps\": 3,\n"
+"    \"slow_forces\": [\"drag\"],\n"
+"    \"max_displacement\": 0.2,\n"
+"    \"max_constraint_iterations\": 8,\n"
+"    \"atoms\": [\n"
+"        {\"id\": 1, \"name\": \"CA\",  \"residue\": 1,"
+"         \"position\": [1, 2, 3]},\n"
+"        {\"id\": 2, \"name\": \"ALA\", \"residue\": 1},\n"
+"        {\"id\": 3, \"name\": \"CA\",  \"residue\": 2,"
+"         \"position\": [4, 5, 6]}\n"
+"    ],\n"
+"    \"linear\": [\n"
+"        {\"atoms\": [1, 3], \"distance\": 3.8, \"constant\": 0.2}\n"
+"    ],\n"
+"    \"angle\": [\n"
+"        {\"atoms\": [2, 1, 3], \"angle\": 90, \"constant\": 0.1}\n"
+"    ],\n"
+"    \"constraints\": [\n"
+"        {\"atoms\": [1, 2], \"distance\": 1.5}\n"
+"    ],\n"
+"    \"ramachandran\": {\n"
+"        \"data\": {\n"
+"            \"general\": \"data/boundary-general-nosec.data\"\n"
+"        },\n"
+"        \"constraints\": []\n"
+"    }\n"
+"}\n";
+
+void test_round_trip(const char *file){
+    struct model *orig = springreader_parse_str(json);
+    if(!orig)
+        BAIL_OUT("Couldn't parse model");
+    //Load a table that the model doesn't use, so that we can check it is
+    //loaded again from the image.
+    ok(!rama_read_closest("data/boundary-alpha.data", ALPHA),
+            "Read extra Ramachandran data");
+    ok(!image_write(file, orig), "Wrote model image");
+    model_free(orig);
+    rama_free_data();
+
+    ok(image_is_image(file), "Recognised model image");
+    struct model *m = image_read(file);
+    ok(m != NULL, "Read model image");
+    if(!m)
+        BAIL_OUT("Couldn't read model image");
+    ok(m->image != NULL, "Model refers to mapped image");
+
+    fis(m->timestep, 0.05, 1e-10, "Timestep");
+    fis(m->until, 200, 1e-10, "Run time");
+    ok(m->use_sterics, "Sterics enabled");
+    ok(!m->do_synthesis, "Synthesis disabled");
+    cmp_ok(m->fix_before, "==", 3, "Fix before");
+    ok(m->constraint_solver == COLOURED_SOLVER, "Constraint solver");
+    ok(m->respa_steps == 3 && m->slow_terms == FORCE_DRAG, "RESPA settings");
+    ok(!m->adaptive_timestep && m->max_displacement == 0.2
+            && m->max_constraint_iterations == 8, "Adaptive timestep settings");
+
+    cmp_ok(m->num_residues, "==", 2, "Two residues");
+    is(m->residues[1].name, "GLY", "Residue 2 is GLY");
+    cmp_ok(m->num_atoms, "==", 3, "Three atoms");
+    is(m->atoms[1].name, "ALA", "Atom 2 is ALA");
+    fis(m->positions[2].c[1], 5, 1e-10, "Atom position");
+    fis(m->inv_masses[1], 1.0 / m->atoms[1].mass, 1e-10, "Inverse mass");
+    ok(m->synthesised[0] && m->synthesised[2], "Atoms synthesised");
+
+    cmp_ok(m->num_linear_springs, "==", 1, "One linear spring");
+    ok(m->linear_springs[0].a == 0 && m->linear_springs[0].b == 2,
+            "Linear spring atoms");
+    cmp_ok(m->num_bond_angles, "==", 1, "One bond angle");
+    ok(m->bond_angles[0].a1 == 1, "Bond angle atoms");
+    cmp_ok(m->num_torsion_springs, "==", 0, "No torsion springs");
+    ok(m->torsion_springs == NULL, "Empty section is NULL");
+    cmp_ok(m->num_constraints, "==", 1, "One constraint");
+    fis(m->constraints[0].distance, 1.5, 1e-6, "Constraint distance");
+
+    ok(rama_is_inited(ALPHA), "Ramachandran data read again");
+    ok(!rama_is_inited(GENERAL), "Unused Ramachandran data not read");
+
+    model_free(m);
+    rama_free_data();
+}
+
+//Write the model with one field broken and check the image is refused
+void test_corrupt(const char *file){
+    struct model *m = springreader_parse_str(json);
+    if(!m)
+        BAIL_OUT("Couldn't parse model");
+
+    m->linear_springs[0].b = 3;
+    image_write(file, m);
+    ok(image_read(file) == NULL, "Refused spring with missing atom");
+    m->linear_springs[0].b = 2;
+
+    m->atoms[1].residue_idx = 2;
+    image_write(file, m);
+    ok(image_read(file) == NULL, "Refused atom with missing residue");
+    m->atoms[1].residue_idx = 0;
+
+    double mass = m->atoms[1].mass;
+    m->atoms[1].mass = 0;
+    image_write(file, m);
+    ok(image_read(file) == NULL, "Refused atom without mass");
+    m->atoms[1].mass = mass;
+
+    model_free(m);
+    rama_free_data();
+}
+
+void test_truncated(const char *file){
+    FILE *f = fopen(file, "r+");
+    fseek(f, 0, SEEK_END);
+    long len = ftell(f);
+    fclose(f);
+    truncate(file, len / 2);
+    ok(image_read(file) == NULL, "Refused truncated image");
+    ok(!image_is_image("data/boundary-alpha.data"), "Text is not an image");
+}
+
+int main(int argc, char **argv){
+    plan(35);
+    char file[] = "imageXXXXXX";
+    int fd = mkstemp(file);
+    close(fd);
+    test_round_trip(file);
+    test_corrupt(file);
+    test_truncated(file);
+    unlink(file);
+    done_testing();
+}
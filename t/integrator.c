@@ -0,0 +1,149 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdbool.h>
+#include <string.h>
+#include <math.h>
+#include "../src/model.h"
+#include "../src/vector.h"
+#include "../src/integrator.h"
+#include "../src/rattle.h"
+#include "../src/linear_spring.h"
+#include "tap.h"
+
+//Chain 0-1-2-3 with unit bonds, a weak spring between its ends, and random
+//velocities
+static const size_t natoms = 4;
+
+static struct model *sprung_chain(enum integrator_type integrator){
+    struct model *m = model_alloc();
+    model_alloc_atoms(m, natoms);
+    m->timestep = 0.1;
+    m->drag_coefficient = 0;
+    m->integrator = integrator;
+    srand(3);
+    for(size_t i=0; i < natoms; i++){
+        m->synthesised[i] = true;
+        vector_fill(&m->positions[i], i, 0, 0);
+        vector_fill(&m->velocities[i],
+                (double)rand() / RAND_MAX - 0.5,
+                (double)rand() / RAND_MAX - 0.5,
+                (double)rand() / RAND_MAX - 0.5);
+    }
+
+    m->num_constraints = natoms - 1;
+    m->constraints = malloc(sizeof(*m->constraints) * m->num_constraints);
+    for(size_t i=0; i < m->num_constraints; i++){
+        m->constraints[i].a = i;
+        m->constraints[i].b = i + 1;
+        m->constraints[i].distance = 1;
+    }
+    m->num_linear_springs = 1;
+    m->linear_springs = malloc(sizeof(*m->linear_springs));
+    linear_spring_init(&m->linear_springs[0], 2, 0.1, 0, natoms - 1);
+    return m;
+}
+
+static double constraint_error(struct model *m){
+    double max_err = 0;
+    for(size_t i=0; i < m->num_constraints; i++){
+        struct constraint *c = &m->constraints[i];
+        struct vector r;
+        vsub(&r, &m->positions[c->a], &m->positions[c->b]);
+        max_err = fmax(max_err, fabs(vmag(&r) - c->distance));
+    }
+    return max_err;
+}
+
+static double energy(struct model *m){
+    double e = model_energy(m);
+    for(size_t i=0; i < m->num_atoms; i++)
+        e += vmag_sq(&m->velocities[i]) / (2 * m->inv_masses[i]);
+    return e;
+}
+
+void test_select(){
+    ok(integrator_parse("rattle") == RATTLE_INTEGRATOR, "Parsed rattle");
+    ok(integrator_parse("Leapfrog") == LEAPFROG_INTEGRATOR, "Parsed leapfrog");
+    ok(integrator_parse("rk4") == RK4_INTEGRATOR, "Parsed rk4");
+    ok(integrator_parse("euler") == UNKNOWN_INTEGRATOR, "Unknown integrator");
+
+    struct model *m = model_alloc();
+    is(integrator_get(m)->name, "rattle", "RATTLE by default");
+    ok(integrator_get(m)->push_lanes != NULL, "RATTLE can be run in lockstep");
+    m->respa_steps = 2;
+    is(integrator_get(m)->name, "rattle-respa", "RESPA variant of RATTLE");
+    m->respa_steps = 1;
+    m->adaptive_timestep = true;
+    is(integrator_get(m)->name, "rattle-adaptive",
+            "Adaptive variant of RATTLE");
+    m->integrator = RK4_INTEGRATOR;
+    is(integrator_get(m)->name, "rk4", "Selected RK4");
+    cmp_ok(integrator_get(m)->force_evaluations, "==", 4,
+            "RK4 evaluates the forces four times");
+    model_free(m);
+}
+
+//A sprung chain with its first atom fixed, using the chain solver
+static struct model *fixed_chain(enum integrator_type type){
+    struct model *m = sprung_chain(type);
+    m->constraint_solver = CHAIN_SOLVER;
+    rattle_init_solver(m);
+    m->fixed[0] = true;
+    vector_zero(&m->velocities[0]);
+    return m;
+}
+
+/*
+ * Run the integrator for 100 steps alongside RATTLE, and check that it keeps
+ * to the constraints, leaves fixed atoms alone and follows the energy of
+ * RATTLE. The energy is not conserved exactly by any of them, as the linear
+ * springs are not quite harmonic.
+ */
+void check_integrator(enum integrator_type type, const char *name){
+    struct model *m = fixed_chain(type);
+    struct model *ref = fixed_chain(RATTLE_INTEGRATOR);
+    const struct integrator *integrator = integrator_get(m);
+    integrator->init(m);
+    double max_de = 0;
+    for(int i=0; i < 100; i++){
+        integrator->push(m);
+        rattle_push(ref);
+        //The first step removes the velocities along the constraints
+        if(i > 0)
+            max_de = fmax(max_de, fabs(energy(m) - energy(ref)));
+    }
+    integrator->finish(m);
+
+    fis(m->time, 10, 1e-10, "%s: time advanced by each step", name);
+    ok(constraint_error(m) < 1e-3, "%s: constraints satisfied (error %g)",
+            name, constraint_error(m));
+    ok(m->positions[0].c[0] == 0 && vmag(&m->velocities[0]) == 0,
+            "%s: fixed atom not moved", name);
+    ok(max_de < 0.02 * energy(ref), "%s: energy follows RATTLE (within %g)",
+            name, max_de);
+    model_free(m);
+    model_free(ref);
+}
+
+void test_leapfrog_phase(){
+    struct model *m = sprung_chain(LEAPFROG_INTEGRATOR);
+    m->num_constraints = 0;
+    struct vector v;
+    vector_copy_to(&v, &m->velocities[3]);
+    const struct integrator *integrator = integrator_get(m);
+    integrator->init(m);
+    ok(m->velocities[3].c[0] != v.c[0], "Leapfrog velocities out of phase");
+    integrator->finish(m);
+    fis(m->velocities[3].c[0], v.c[0], 1e-12,
+            "Leapfrog velocities back in phase");
+    model_free(m);
+}
+
+int main(int argc, char **argv){
+    plan(20);
+    test_select();
+    check_integrator(LEAPFROG_INTEGRATOR, "Leapfrog");
+    check_integrator(RK4_INTEGRATOR, "RK4");
+    test_leapfrog_phase();
+    done_testing();
+}
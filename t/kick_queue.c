@@ -0,0 +1,47 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <math.h>
+#include <stdbool.h>
+#include "../src/kick_queue.h"
+#include "tap.h"
+
+#define NATOMS 100
+
+int main(){
+    plan(5);
+    struct kick_queue q;
+    if(kick_queue_init(&q, NATOMS))
+        BAIL_OUT("Couldn't allocate queue");
+
+    ok(isinf(kick_queue_peek(&q)), "Empty queue has no kicks");
+
+    srand(1);
+    for(size_t i=0; i < NATOMS; i++)
+        kick_queue_push(&q, i, i % 7 == 0 ? 5.0 : (double)rand() / RAND_MAX);
+    cmp_ok(q.len, "==", NATOMS, "All atoms scheduled");
+
+    //Reschedule the soonest atoms, as the water model does
+    for(int i=0; i < 10; i++){
+        size_t atom = kick_queue_pop(&q);
+        kick_queue_push(&q, atom, q.next[atom] + 2);
+    }
+
+    bool sorted = true;
+    double prev = -INFINITY;
+    size_t prev_atom = 0;
+    for(size_t i=0; i < NATOMS; i++){
+        double time = kick_queue_peek(&q);
+        size_t atom = kick_queue_pop(&q);
+        if(time != q.next[atom] || time < prev
+                || (time == prev && atom < prev_atom))
+            sorted = false;
+        prev = time;
+        prev_atom = atom;
+    }
+    ok(sorted, "Atoms popped in order of kick time, then index");
+    cmp_ok(q.len, "==", 0, "Queue emptied");
+    fis(prev, 5, 1e-10, "Latest kick popped last");
+
+    kick_queue_free(&q);
+    done_testing();
+}
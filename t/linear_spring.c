@@ -15,30 +15,25 @@ void is_vector(struct vector *v1, struct vector *v2,
 int main(){
     plan(30);
     struct linear_spring *s;
-    struct atom a;
-    struct atom b;
-    atom_init(&a, 1, "CA");
-    atom_init(&b, 1, "CA");
-    atom_set_atom_description(&a, atom_description_lookup("CA", 2));
-    atom_set_atom_description(&b, atom_description_lookup("CA", 2));
+    struct vector pos[2];
 
-    vector_fill(&a.position, -0.5, 0, 0);
-    vector_fill(&b.position, +0.5, 0, 0);
-    s = linear_spring_alloc(1, 1.0, &a, &b);
+    vector_fill(&pos[0], -0.5, 0, 0);
+    vector_fill(&pos[1], +0.5, 0, 0);
+    s = linear_spring_alloc(1, 1.0, 0, 1);
 
     struct vector result;
     struct vector force1, force2;
 
     //At equilibrium
     vector_fill(&result, 0, 0, 0);
-    linear_spring_force(&force1, &force2, s);
+    linear_spring_force(&force1, &force2, s, pos);
     is_vector(&force1, &result, 1e-10, "Force = 0 on A");
     is_vector(&force2, &result, 1e-10, "Force = 0 on B");
 
     //Pushing outwards
     s->distance = 2.0;
     vector_fill(&result, -1, 0, 0);
-    linear_spring_force(&force1, &force2, s);
+    linear_spring_force(&force1, &force2, s, pos);
     is_vector(&force1, &result, 1e-10, "Force = (-1, 0, 0) on A");
 
     vector_fill(&result, +1, 0, 0);
@@ -47,7 +42,7 @@ int main(){
     //Pulling inwards
     s->distance = 0.5;
     vector_fill(&result, +0.5, 0, 0);
-    linear_spring_force(&force1, &force2, s);
+    linear_spring_force(&force1, &force2, s, pos);
     is_vector(&force1, &result, 1e-10, "Force = (+0.5, 0, 0) on A");
 
     vector_fill(&result, -0.5, 0, 0);
@@ -57,7 +52,7 @@ int main(){
     s->constant = 2.0;
     s->distance = 2.0;
     vector_fill(&result, -2, 0, 0);
-    linear_spring_force(&force1, &force2, s);
+    linear_spring_force(&force1, &force2, s, pos);
     is_vector(&force1, &result, 1e-10, "Force = (-2, 0, 0) on A");
 
     vector_fill(&result, +2, 0, 0);
@@ -67,15 +62,15 @@ int main(){
     s->constant = 1.0;
     s->cutoff   = 0.5;
     s->distance = 1.0;
-    vector_fill(&a.position, -1, 0, 0);
-    vector_fill(&b.position, +1, 0, 0);
+    vector_fill(&pos[0], -1, 0, 0);
+    vector_fill(&pos[1], +1, 0, 0);
     vector_fill(&result, 0, 0, 0);
-    linear_spring_force(&force1, &force2, s);
+    linear_spring_force(&force1, &force2, s, pos);
     is_vector(&force1, &result, 1e-10, "Force = 0 past cutoff");
 
     s->cutoff = 2.5;
     vector_fill(&result, 1, 0, 0);
-    linear_spring_force(&force1, &force2, s);
+    linear_spring_force(&force1, &force2, s, pos);
     is_vector(&force1, &result, 1e-10, "Force applied within cutoff");
 
     done_testing();
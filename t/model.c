@@ -4,21 +4,308 @@
 #include "../src/model.h"
 #include "../src/residue.h"
 #include "../src/vector.h"
+#include "../src/linear_spring.h"
+#include "../src/bond_angle.h"
+#include "../src/torsion_spring.h"
+#include "../src/rk4.h"
+#include "../src/rama.h"
+#include "../src/rng.h"
+#include "../src/lanes.h"
 #include "tap.h"
 
+#ifdef HAVE_CONFIG_H
+#include <config.h>
+#endif
+
+#ifdef HAVE_OPENMP
+#include <omp.h>
+#endif
+
+void test_active_set(){
+    struct model *m = model_alloc();
+    model_alloc_atoms(m, 6);
+    for(size_t i=0; i < 6; i++)
+        atom_init(&m->atoms[i], i+1, "CA");
+
+    struct linear_spring springs[4];
+    linear_spring_init(&springs[0], 1, 1, 5, 0);
+    linear_spring_init(&springs[1], 2, 1, 0, 1);
+    linear_spring_init(&springs[2], 3, 1, 3, 2);
+    linear_spring_init(&springs[3], 4, 1, 1, 3);
+
+    struct bond_angle_spring angles[2];
+    bond_angle_spring_init(&angles[0], 2, 3, 4, 90, 0);
+    bond_angle_spring_init(&angles[1], 0, 1, 2, 90, 0);
+
+    m->num_linear_springs = 4;
+    m->linear_springs = springs;
+    m->num_bond_angles = 2;
+    m->bond_angles = angles;
+
+    ok(!model_build_active_set(m), "Built active set");
+    fis(springs[0].distance, 2, 1e-10, "Spring (1, 2) sorted first");
+    fis(springs[1].distance, 4, 1e-10, "Spring (2, 4) sorted second");
+    fis(springs[2].distance, 3, 1e-10, "Equal highest atom sorted by lowest");
+    fis(springs[3].distance, 1, 1e-10, "Spring (6, 1) sorted last");
+    ok(angles[0].a1 == 0, "Angle (1, 2, 3) sorted first");
+
+    cmp_ok(m->active->linear[0], "==", 0, "No springs with no atoms");
+    cmp_ok(m->active->linear[2], "==", 1, "One spring with two atoms");
+    cmp_ok(m->active->linear[4], "==", 3, "Three springs with four atoms");
+    cmp_ok(m->active->linear[6], "==", 4, "All springs with six atoms");
+    cmp_ok(m->active->angle[4], "==", 1, "One angle with four atoms");
+    cmp_ok(m->active->angle[5], "==", 2, "Two angles with five atoms");
+
+    //Only count the springs between synthesised atoms
+    for(size_t i=0; i < 6; i++){
+        m->synthesised[i] = true;
+        vector_fill(&m->positions[i], i, 0, 0);
+    }
+    m->num_atoms = 4;
+    double energy = model_energy(m);
+    fis(energy, (1-2)*(1-2) + (1-3)*(1-3) + (2-4)*(2-4), 1e-10,
+            "Energy only includes active springs");
+}
+
+
+//Accumulate the forces in parallel and check that they match the serial forces
+void test_bonds(){
+    struct model *m = model_alloc();
+    model_alloc_atoms(m, 5);
+
+    //A chain 0-1-2-3 with the bond 1-2 given twice, plus 3-1. Atom 4 is free.
+    uint32_t pairs[][2] = {{0, 1}, {2, 1}, {1, 2}, {2, 3}, {3, 1}};
+    m->num_constraints = sizeof(pairs) / sizeof(*pairs);
+    m->constraints = malloc(sizeof(*m->constraints) * m->num_constraints);
+    for(size_t i=0; i < m->num_constraints; i++){
+        m->constraints[i].a = pairs[i][0];
+        m->constraints[i].b = pairs[i][1];
+        m->constraints[i].distance = 1;
+    }
+
+    ok(!model_build_bonds(m), "Built bond list");
+    ok(model_is_bonded(m, 0, 1) && model_is_bonded(m, 1, 0), "Bonds symmetric");
+    ok(model_is_bonded(m, 1, 3) && model_is_bonded(m, 3, 1), "Out of order bond");
+    ok(!model_is_bonded(m, 0, 2) && !model_is_bonded(m, 4, 0), "Not bonded");
+    cmp_ok(m->bond_start[2] - m->bond_start[1], "==", 3,
+            "Duplicate bond removed");
+    ok(m->bonds[m->bond_start[1]] == 0
+            && m->bonds[m->bond_start[1] + 1] == 2
+            && m->bonds[m->bond_start[1] + 2] == 3, "Row sorted");
+    model_free(m);
+}
+
+void test_parallel_forces(){
+    const size_t natoms = 40;
+    const size_t nsprings = 200;
+    struct linear_spring springs[nsprings];
+    struct bond_angle_spring angles[natoms - 2];
+    struct torsion_spring torsions[natoms - 3];
+    struct vector serial[natoms];
+
+    struct model *m = model_alloc();
+    model_alloc_atoms(m, natoms);
+
+    srand(1);
+    for(size_t i=0; i < natoms; i++){
+        atom_init(&m->atoms[i], i+1, "CA");
+        atom_set_atom_description(&m->atoms[i],
+                atom_description_lookup("CA", 2));
+        m->synthesised[i] = true;
+        vector_fill(&m->positions[i],
+                (double)rand() / RAND_MAX * 10,
+                (double)rand() / RAND_MAX * 10,
+                (double)rand() / RAND_MAX * 10);
+    }
+    for(size_t i=0; i < nsprings; i++)
+        linear_spring_init(&springs[i], 3.8, 0.1, rand() % natoms, i % natoms);
+    for(size_t i=0; i < natoms - 2; i++)
+        bond_angle_spring_init(&angles[i], i, i+1, i+2, 110, 0.1);
+    for(size_t i=0; i < natoms - 3; i++)
+        torsion_spring_init(&torsions[i], i, i+1, i+2, i+3, 60, 0.1);
+
+    m->num_linear_springs = nsprings;
+    m->linear_springs = springs;
+    m->num_bond_angles = natoms - 2;
+    m->bond_angles = angles;
+    m->num_torsion_springs = natoms - 3;
+    m->torsion_springs = torsions;
+
+    #ifdef HAVE_OPENMP
+    omp_set_num_threads(1);
+    #endif
+    model_accumulate_forces(m);
+    for(size_t i=0; i < natoms; i++)
+        vector_copy_to(&serial[i], &m->forces[i]);
+
+    #ifdef HAVE_OPENMP
+    omp_set_num_threads(4);
+    #endif
+    model_accumulate_forces(m);
+
+    double max_diff = 0;
+    for(size_t i=0; i < natoms; i++){
+        struct vector diff;
+        vsub(&diff, &serial[i], &m->forces[i]);
+        if(vmag(&diff) > max_diff)
+            max_diff = vmag(&diff);
+    }
+    ok(max_diff < 1e-10, "Parallel forces match serial forces");
+    m->linear_springs = NULL;
+    m->bond_angles = NULL;
+    m->torsion_springs = NULL;
+    model_free(m);
+}
+
+void test_scratch(){
+    //Enough atoms that the integrator temporaries would not fit in an 8 MB
+    //stack.
+    const size_t natoms = 200000;
+    struct model *m = model_alloc();
+    ok(!model_alloc_atoms(m, natoms), "Allocated large model");
+    m->timestep = 0.1;
+    m->drag_coefficient = 0;
+    for(size_t i=0; i < natoms; i++){
+        m->synthesised[i] = true;
+        vector_fill(&m->velocities[i], 1, 0, 0);
+    }
+
+    rk4_push(m);
+    cmp_ok(m->scratch.used, "==", 0, "Scratch space given back");
+    fis(m->positions[natoms - 1].c[0], 0.1, 1e-10, "Atoms moved");
+
+    void *a = model_scratch(m, 3);
+    void *b = model_scratch(m, 1);
+    ok(((uintptr_t)b - (uintptr_t)a) % SCRATCH_ALIGN == 0,
+            "Scratch allocations aligned");
+    model_free(m);
+}
+
+void test_replicate(){
+    struct model *m = model_alloc();
+    model_alloc_atoms(m, 3);
+    vector_fill(&m->positions[0], 1, 2, 3);
+    m->fixed[1] = true;
+    m->num_rama_constraints = 1;
+    m->rama_constraints = calloc(1, sizeof(*m->rama_constraints));
+    m->rama_constraints[0].type = ALPHA;
+
+    struct model *r = model_replicate(m, 5);
+    if(!r)
+        BAIL_OUT("Couldn't allocate replica");
+    ok(r->atoms == m->atoms, "Replica shares topology");
+    ok(r->positions != m->positions, "Replica has its own positions");
+    fis(r->positions[0].c[1], 2, 1e-10, "Positions copied");
+    ok(r->fixed[1] && !r->fixed[0], "Fixed flags copied");
+    ok(r->rama_constraints != m->rama_constraints
+            && r->rama_constraints[0].type == ALPHA,
+            "Ramachandran constraints copied");
+
+    r->positions[0].c[1] = 5;
+    fis(m->positions[0].c[1], 2, 1e-10, "Model positions untouched");
+
+    struct rng *rng = rng_alloc(5);
+    ok(rng_rand(r->rng) == rng_rand(rng), "Replica RNG seeded");
+    ok(r->rng != m->rng, "Replica has its own RNG");
+    rng_free(rng);
+    model_free_replica(r);
+    model_free(m);
+}
+
+void test_lanes(){
+    const size_t natoms = 30;
+    const size_t nsprings = 150;
+    const size_t nreplicas = 3;
+    struct linear_spring springs[nsprings];
+    struct bond_angle_spring angles[natoms - 2];
+    struct torsion_spring torsions[natoms - 3];
+    struct vector serial[nreplicas][natoms];
+
+    struct model *m = model_alloc();
+    model_alloc_atoms(m, natoms);
+    srand(2);
+    for(size_t i=0; i < natoms; i++){
+        atom_init(&m->atoms[i], i+1, "CA");
+        atom_set_atom_description(&m->atoms[i],
+                atom_description_lookup("CA", 2));
+        m->synthesised[i] = true;
+        vector_fill(&m->positions[i], i * 2.0, (i % 2) * 3.0, (i % 3) * 1.0);
+    }
+    for(size_t i=0; i < nsprings; i++){
+        linear_spring_init(&springs[i], 3.8, 0.1, rand() % natoms, i % natoms);
+        if(i % 3 == 0)
+            springs[i].cutoff = 2;
+        if(i % 5 == 0){
+            springs[i].inner = (i + 1) % natoms;
+            springs[i].outer = (i + 2) % natoms;
+        }
+    }
+    for(size_t i=0; i < natoms - 2; i++)
+        bond_angle_spring_init(&angles[i], i, i+1, i+2, 110, 0.1);
+    for(size_t i=0; i < natoms - 3; i++)
+        torsion_spring_init(&torsions[i], i, i+1, i+2, i+3, 60, 0.1);
+    m->num_linear_springs = nsprings;
+    m->linear_springs = springs;
+    m->num_bond_angles = natoms - 2;
+    m->bond_angles = angles;
+    m->num_torsion_springs = natoms - 3;
+    m->torsion_springs = torsions;
+
+    //Give each replica different positions and fixed atoms
+    struct model *replicas[nreplicas];
+    for(size_t k=0; k < nreplicas; k++){
+        replicas[k] = model_replicate(m, k);
+        for(size_t i=0; i < natoms; i++)
+            for(size_t j=0; j < N; j++)
+                replicas[k]->positions[i].c[j] += (double)rand() / RAND_MAX;
+    }
+    replicas[1]->fixed[4] = replicas[1]->fixed[5] = true;
+
+    #ifdef HAVE_OPENMP
+    omp_set_num_threads(1);
+    #endif
+    for(size_t k=0; k < nreplicas; k++){
+        model_accumulate_forces(replicas[k]);
+        for(size_t i=0; i < natoms; i++)
+            vector_copy_to(&serial[k][i], &replicas[k]->forces[i]);
+    }
+
+    struct lanes lanes;
+    if(lanes_init(&lanes, replicas, nreplicas, natoms))
+        BAIL_OUT("Couldn't allocate lanes");
+    model_accumulate_forces_lanes(&lanes);
+    for(size_t k=0; k < nreplicas; k++){
+        double max_diff = 0;
+        for(size_t i=0; i < natoms; i++){
+            struct vector diff;
+            vsub(&diff, &serial[k][i], &replicas[k]->forces[i]);
+            if(vmag(&diff) > max_diff)
+                max_diff = vmag(&diff);
+        }
+        ok(max_diff < 1e-10, "Lane %d forces match serial forces", k);
+    }
+    ok(vmag(&replicas[1]->forces[4]) == 0, "No force on fixed atom");
+
+    lanes_free(&lanes);
+    for(size_t k=0; k < nreplicas; k++)
+        model_free_replica(replicas[k]);
+    m->linear_springs = NULL;
+    m->bond_angles = NULL;
+    m->torsion_springs = NULL;
+    model_free(m);
+}
 
 int main(){
-    plan(8);
+    plan(36);
 
     size_t natoms = 20;
     struct residue residues[1];
-    struct atom atoms[natoms + 1];
 
     struct model *m = model_alloc();
     m->timestep = 1;
     m->synth_time = 1;
+    model_alloc_atoms(m, natoms + 1);
     m->num_atoms = natoms;
-    m->atoms = atoms;
     m->num_residues = 1;
     m->residues = residues;
 
@@ -55,7 +342,14 @@ int main(){
     for(size_t i=0; i < natoms; i++)
         model_synth_atom(m, i, 20);
     model_pdb(stdout, m, false, &npdb);
-    return 0;
+
+    test_active_set();
+    test_parallel_forces();
+    test_bonds();
+    test_scratch();
+    test_replicate();
+    test_lanes();
+    done_testing();
 }
 
 /**
@@ -0,0 +1,88 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <math.h>
+#include "../src/pdb.h"
+#include "../src/vector.h"
+#include "tap.h"
+
+//Format the records with pdb_buffer and printf, and return whether they match
+static bool atoms_match(const double *values, size_t n){
+    char *fast, *slow;
+    size_t fast_len, slow_len;
+    FILE *fast_out = open_memstream(&fast, &fast_len);
+    FILE *slow_out = open_memstream(&slow, &slow_len);
+
+    struct pdb_buffer *b = malloc(sizeof(*b));
+    pdb_buffer_init(b, fast_out);
+    for(size_t i=0; i < n; i++){
+        struct vector v;
+        vector_fill(&v, values[i], -values[i], values[i] * 0.1);
+        int id = (i * 7919) % 200000 - 1000;
+        pdb_atom(b, id, "CA", "GLY", id / 3, &v);
+        fprintf(slow_out, atom_fmt, id, "CA", "GLY", id / 3, " ",
+                v.c[0], v.c[1], v.c[2]);
+    }
+    pdb_flush(b);
+    free(b);
+    fclose(fast_out);
+    fclose(slow_out);
+
+    bool match = fast_len == slow_len && !strcmp(fast, slow);
+    free(fast);
+    free(slow);
+    return match;
+}
+
+void test_atoms(){
+    const double edges[] = {
+        0, -0.0, 1, -1, 0.0004, -0.0004, 0.0005, -0.0005, 0.0015, 2.0005,
+        1.2345, -1.2345, 1.0625, 999.9995, 9999.999, -9999.9995, 12345.678,
+        -123456.789, 1e7, -1e12, INFINITY, -INFINITY
+    };
+    ok(atoms_match(edges, sizeof(edges) / sizeof(*edges)),
+            "Edge cases match printf");
+
+    //Enough to fill the buffer several times
+    size_t n = 20000;
+    double *values = malloc(sizeof(*values) * n);
+    srand(1);
+    for(size_t i=0; i < n; i++)
+        values[i] = (rand() / (double)RAND_MAX - 0.5) * 200;
+    ok(atoms_match(values, n), "Random coordinates match printf");
+    for(size_t i=0; i < n; i++)
+        values[i] = (rand() % 2000001 - 1000000) / 1000.0 + 0.0005;
+    ok(atoms_match(values, n), "Halfway coordinates match printf");
+    free(values);
+}
+
+void test_records(){
+    char *str;
+    size_t len;
+    FILE *out = open_memstream(&str, &len);
+    struct pdb_buffer *b = malloc(sizeof(*b));
+    pdb_buffer_init(b, out);
+    pdb_model(b, 12);
+    pdb_conect(b, 1, 2);
+    pdb_conect(b, 12345, 123456);
+    pdb_puts(b, "ENDMDL\n");
+    ok(!pdb_flush(b), "Flushed buffer");
+    cmp_ok(b->written, "==", 57, "Counted bytes written");
+    free(b);
+    fclose(out);
+
+    char expected[256];
+    int n = sprintf(expected, "MODEL     %lu\n", 12ul);
+    n += sprintf(expected + n, conect_fmt, 1, 2);
+    n += sprintf(expected + n, conect_fmt, 12345, 123456);
+    sprintf(expected + n, "ENDMDL\n");
+    is(str, expected, "MODEL and CONECT records match printf");
+    free(str);
+}
+
+int main(){
+    plan(6);
+    test_atoms();
+    test_records();
+    done_testing();
+}
@@ -1,6 +1,7 @@
 #include <stdio.h>
 #include <stdlib.h>
-//#include "../src/rama.h"
+#include <unistd.h>
+#include "../src/rama.h"
 #include "../src/vector.h"
 #include "tap.h"
 
@@ -11,8 +12,48 @@ void is_vector(struct vector *v1, struct vector *v2,
         fis(v1->c[i], v2->c[i], epsilon, "%s: element %d", text, i);
 }
 
+void test_binary_table(){
+    ok(!rama_read_closest("data/boundary-general-nosec.data", GENERAL),
+            "Read text table");
+    ok(rama_is_inited(GENERAL), "General data loaded");
+    ok(!rama_is_inited(ALPHA), "Alpha data not loaded");
+
+    int phi = 0, psi = 0;
+    ok(rama_lookup(GENERAL, 0, 0, &phi, &psi) && phi == 1 && psi == 357,
+            "Closest point to (0, 0)");
+
+    char file[] = "ramaXXXXXX";
+    int fd = mkstemp(file);
+    close(fd);
+    ok(!rama_write_table(file, GENERAL), "Wrote binary table");
+    ok(!rama_read_closest(file, ALPHA), "Read binary table");
+
+    size_t mismatched = 0;
+    for(int i=0; i < 360; i++){
+        for(int j=0; j < 360; j++){
+            int p1 = -1, s1 = -1, p2 = -1, s2 = -1;
+            bool found1 = rama_lookup(GENERAL, i, j, &p1, &s1);
+            bool found2 = rama_lookup(ALPHA, i, j, &p2, &s2);
+            if(found1 != found2 || p1 != p2 || s1 != s2)
+                mismatched++;
+        }
+    }
+    cmp_ok(mismatched, "==", 0, "Binary table matches text table");
+
+    //A truncated table is rejected
+    FILE *f = fopen(file, "w");
+    fputs("POINGRAM", f);
+    fclose(f);
+    ok(rama_read_closest(file, BETA), "Truncated table rejected");
+    ok(!rama_is_inited(BETA), "Nothing loaded from truncated table");
+
+    remove(file);
+    rama_free_data();
+    ok(!rama_is_inited(GENERAL) && !rama_is_inited(ALPHA), "Data freed");
+}
+
 int main(){
-    plan(30);
+    plan(10);
 
     const char *springs =
         "[PDB]\n"
@@ -30,5 +71,6 @@ int main(){
 //    struct model *m = springreader_parse_str(springs);
 //    struct rama *r  = rama_init(&m->residues[0], &m->residues[1]);
 
+    test_binary_table();
     done_testing();
 }
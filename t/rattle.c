@@ -0,0 +1,216 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdbool.h>
+#include <math.h>
+#include "../src/model.h"
+#include "../src/vector.h"
+#include "../src/rattle.h"
+#include "../src/linear_spring.h"
+#include "tap.h"
+
+#ifdef HAVE_CONFIG_H
+#include <config.h>
+#endif
+
+//Chain 0-1-2-3-4 with unit bonds, plus atom 5 branching from atom 1
+static const uint32_t pairs[][2] = {{0, 1}, {1, 2}, {2, 3}, {3, 4}, {1, 5}};
+static const size_t natoms = 6;
+
+static struct model * chain(){
+    struct model *m = model_alloc();
+    model_alloc_atoms(m, natoms);
+    m->timestep = 0.1;
+    for(size_t i=0; i < natoms; i++){
+        m->synthesised[i] = true;
+        vector_fill(&m->positions[i], i, 0, 0);
+    }
+    vector_fill(&m->positions[5], 1, 1, 0);
+
+    m->num_constraints = sizeof(pairs) / sizeof(*pairs);
+    m->constraints = malloc(sizeof(*m->constraints) * m->num_constraints);
+    for(size_t i=0; i < m->num_constraints; i++){
+        m->constraints[i].a = pairs[i][0];
+        m->constraints[i].b = pairs[i][1];
+        m->constraints[i].distance = 1;
+    }
+    return m;
+}
+
+void test_colouring(){
+    struct model *m = chain();
+    ok(!rattle_colour_constraints(m), "Coloured constraints");
+    cmp_ok(m->num_colours, "==", 3, "Three colours");
+    cmp_ok(m->colour_start[m->num_colours], "==", m->num_constraints,
+            "All constraints coloured");
+
+    bool shared = false;
+    for(size_t k=0; k < m->num_colours; k++){
+        bool used[natoms];
+        for(size_t i=0; i < natoms; i++)
+            used[i] = false;
+        for(size_t i=m->colour_start[k]; i < m->colour_start[k+1]; i++){
+            struct constraint *c = &m->constraints[i];
+            if(used[c->a] || used[c->b])
+                shared = true;
+            used[c->a] = used[c->b] = true;
+        }
+    }
+    ok(!shared, "No atoms shared within a colour");
+    ok(m->constraints[0].a == 0 && m->constraints[0].b == 1,
+            "Order kept within colour");
+    model_free(m);
+}
+
+//Take a step from random velocities and check the constraints are satisfied
+static void check_solver(struct model *m, const char *name){
+
+    srand(1);
+    for(size_t i=0; i < natoms; i++)
+        vector_fill(&m->velocities[i],
+                (double)rand() / RAND_MAX - 0.5,
+                (double)rand() / RAND_MAX - 0.5,
+                (double)rand() / RAND_MAX - 0.5);
+
+    rattle_unconstrained_push(m);
+    double max_err = 0;
+    for(size_t i=0; i < m->num_constraints; i++){
+        struct constraint *c = &m->constraints[i];
+        struct vector r;
+        vsub(&r, &m->positions[c->a], &m->positions[c->b]);
+        double d = vmag(&r);
+        max_err = fmax(max_err, fabs(d - c->distance));
+    }
+    ok(max_err < 1e-3, "%s: positions satisfy constraints (error %g)",
+            name, max_err);
+
+    rattle_move(m);
+    double max_rv = 0;
+    for(size_t i=0; i < m->num_constraints; i++){
+        struct constraint *c = &m->constraints[i];
+        struct vector r, v;
+        vsub(&r, &m->positions[c->a], &m->positions[c->b]);
+        vsub(&v, &m->velocities[c->a], &m->velocities[c->b]);
+        max_rv = fmax(max_rv, fabs(vdot(&r, &v)));
+    }
+    ok(max_rv < 1e-3, "%s: no velocity along constraints (%g)",
+            name, max_rv);
+}
+
+void test_coloured_solver(){
+    struct model *m = chain();
+    m->constraint_solver = COLOURED_SOLVER;
+    rattle_init_solver(m);
+    check_solver(m, "Coloured");
+    model_free(m);
+}
+
+void test_chain_solver(){
+    struct model *m = chain();
+    m->constraint_solver = CHAIN_SOLVER;
+    ok(!rattle_init_solver(m), "Set up chain solver");
+    cmp_ok(m->chain->bandwidth, "==", 2, "Bandwidth of branched chain");
+    ok(m->constraints[2].a == 1 && m->constraints[2].b == 5,
+            "Constraints sorted by lowest atom");
+    check_solver(m, "Chain");
+
+    bool warm = false;
+    for(size_t i=0; i < m->num_constraints; i++)
+        warm = warm || m->chain->lambda[i] != 0;
+    ok(warm, "Multipliers kept for the next step");
+    check_solver(m, "Chain, warm started");
+    model_free(m);
+}
+
+//Add a weak spring across the chain, and give the atoms random velocities
+static struct model *sprung_chain(){
+    struct model *m = chain();
+    m->num_linear_springs = 1;
+    m->linear_springs = malloc(sizeof(*m->linear_springs));
+    linear_spring_init(&m->linear_springs[0], 2, 0.01, 0, 4);
+    srand(2);
+    for(size_t i=0; i < natoms; i++)
+        vector_fill(&m->velocities[i],
+                (double)rand() / RAND_MAX - 0.5,
+                (double)rand() / RAND_MAX - 0.5,
+                (double)rand() / RAND_MAX - 0.5);
+    return m;
+}
+
+void test_respa(){
+    struct model *plain = sprung_chain();
+    struct model *single = sprung_chain();
+    single->respa_steps = 1;
+    for(int i=0; i < 4; i++){
+        rattle_push(plain);
+        rattle_respa_push(single);
+    }
+    bool same = true;
+    for(size_t i=0; i < natoms; i++)
+        for(size_t j=0; j < N; j++)
+            same = same
+                && plain->positions[i].c[j] == single->positions[i].c[j]
+                && plain->velocities[i].c[j] == single->velocities[i].c[j];
+    ok(same, "RESPA with one inner step and no slow terms matches RATTLE");
+
+    struct model *m = sprung_chain();
+    m->respa_steps = 4;
+    m->slow_spring_constant = 0.01;
+    m->constraint_solver = CHAIN_SOLVER;
+    rattle_init_solver(m);
+    rattle_respa_push(m);
+    fis(m->time, 0.4, 1e-10, "RESPA step covers the inner steps");
+    ok(vmag(&m->slow_forces[0]) > 0 && vmag(&m->slow_forces[2]) == 0,
+            "Weak spring evaluated as a slow force");
+
+    double max_err = 0;
+    for(size_t i=0; i < m->num_constraints; i++){
+        struct constraint *c = &m->constraints[i];
+        struct vector r;
+        vsub(&r, &m->positions[c->a], &m->positions[c->b]);
+        max_err = fmax(max_err, fabs(vmag(&r) - c->distance));
+    }
+    ok(max_err < 1e-3, "RESPA step satisfies constraints (error %g)", max_err);
+
+    model_free(plain);
+    model_free(single);
+    model_free(m);
+}
+
+void test_adaptive(){
+    struct model *m = sprung_chain();
+    m->adaptive_timestep = true;
+    m->max_displacement = 0.001;
+    rattle_adaptive_push(m);
+    fis(m->time, 0.1, 1e-10, "Adaptive step taken with the initial timestep");
+    fis(m->timestep, 0.05, 1e-10, "Timestep halved when atoms move too far");
+    for(int i=0; i < 10; i++)
+        rattle_adaptive_push(m);
+    fis(m->timestep, m->min_timestep, 1e-10, "Timestep limited to minimum");
+    model_free(m);
+
+    m = chain();
+    m->adaptive_timestep = true;
+    for(int i=1; i < ADAPTIVE_GROW_STEPS; i++)
+        rattle_adaptive_push(m);
+    fis(m->timestep, 0.1, 1e-10, "Timestep kept until it has been stable");
+    rattle_adaptive_push(m);
+    fis(m->timestep, 0.1 * ADAPTIVE_GROW_FACTOR, 1e-10,
+            "Timestep of a quiet model grown");
+    for(int i=0; i < 50 * ADAPTIVE_GROW_STEPS; i++)
+        rattle_adaptive_push(m);
+    fis(m->timestep, m->max_timestep, 1e-10, "Timestep limited to maximum");
+    model_free(m);
+}
+
+int main(int argc, char **argv){
+    plan(28);
+    ok(rattle_parse_solver("serial") == SERIAL_SOLVER, "Parsed serial");
+    ok(rattle_parse_solver("Coloured") == COLOURED_SOLVER, "Parsed coloured");
+    ok(rattle_parse_solver("chain") == CHAIN_SOLVER, "Parsed chain");
+    test_colouring();
+    test_coloured_solver();
+    test_chain_solver();
+    test_respa();
+    test_adaptive();
+    done_testing();
+}
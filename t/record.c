@@ -18,11 +18,18 @@ int main(){
 
     const int natoms = 3;
     struct atom atoms[natoms];
-    struct model m = {.num_atoms = 3, .atoms = atoms};
+    struct vector positions[natoms];
+    bool fixed[natoms];
+    struct model m = {
+        .num_atoms = 3,
+        .atoms = atoms,
+        .positions = positions,
+        .fixed = fixed
+    };
 
     for(size_t i=0; i < natoms; i++){
-        vector_zero(&atoms[i].position);
-        atoms[i].fixed = false;
+        vector_zero(&positions[i]);
+        fixed[i] = false;
     }
 
     struct record pos;
@@ -30,7 +37,7 @@ int main(){
 
     for(size_t i=0; i < 10; i++){
         for(size_t j=0; j < natoms; j++)
-            atoms[j].position.c[0] += 0.1;
+            positions[j].c[0] += 0.1;
         record_add(&pos, &m);
     }
 
@@ -40,7 +47,7 @@ int main(){
 
     for(size_t i=0; i < 5; i++){
         for(size_t j=0; j < natoms; j++)
-            atoms[j].position.c[0] += 0.2;
+            positions[j].c[0] += 0.2;
         record_add(&pos, &m);
     }
 
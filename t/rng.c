@@ -0,0 +1,49 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include "../src/rng.h"
+#include "tap.h"
+
+/*
+ * Known answers for Philox4x32-10, from the Random123 distribution: counter,
+ * key and output.
+ */
+static const uint32_t known[][10] = {
+    {0x00000000, 0x00000000, 0x00000000, 0x00000000, 0x00000000, 0x00000000,
+     0x6627e8d5, 0xe169c58d, 0xbc57ac4c, 0x9b00dbd8},
+    {0xffffffff, 0xffffffff, 0xffffffff, 0xffffffff, 0xffffffff, 0xffffffff,
+     0x408f276d, 0x41c83b0e, 0xa20bc7c6, 0x6d5451fd},
+    {0x243f6a88, 0x85a308d3, 0x13198a2e, 0x03707344, 0xa4093822, 0x299f31d0,
+     0xd16cfe09, 0x94fdcceb, 0x5001e420, 0x24126ea1},
+};
+
+int main(){
+    plan(7);
+
+    for(size_t i=0; i < sizeof(known) / sizeof(*known); i++){
+        uint32_t out[4];
+        philox4x32(&known[i][0], &known[i][4], out);
+        ok(out[0] == known[i][6] && out[1] == known[i][7]
+                && out[2] == known[i][8] && out[3] == known[i][9],
+                "Philox known answer %zu", i + 1);
+    }
+
+    struct rng *a = rng_alloc(7), *b = rng_alloc(7), *c = rng_alloc(8);
+    uint32_t x[4], y[4], z[4];
+    rng_counter(a, 12, 3, x);
+    rng_rand(b);
+    rng_counter(b, 12, 3, y);
+    ok(x[0] == y[0] && x[3] == y[3],
+            "Counter-based numbers don't depend on the sequential generator");
+    rng_counter(c, 12, 3, z);
+    ok(x[0] != z[0], "Seed changes the counter-based numbers");
+    rng_counter(a, 12, 4, y);
+    rng_counter(a, 13, 3, z);
+    ok(x[0] != y[0] && x[0] != z[0], "Atom and step change the numbers");
+    fis(rng_uniform(UINT32_MAX), 1, 1e-9, "Uniform numbers below one");
+
+    rng_free(a);
+    rng_free(b);
+    rng_free(c);
+    done_testing();
+}
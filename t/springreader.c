@@ -1,20 +1,34 @@
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <unistd.h>
 #include "../src/springreader.h"
 #include "../src/model.h"
 #include "../src/residue.h"
 #include "../src/linear_spring.h"
 #include "../src/torsion_spring.h"
 #include "../src/bond_angle.h"
+#include "../src/rama.h"
+#include "../src/rattle.h"
 #include "tap.h"
 
+#ifdef HAVE_CONFIG_H
+#include <config.h>
+#endif
+
+#ifdef HAVE_ZLIB
+#include <zlib.h>
+#endif
+
 const char *json =
 "{\n"
 "    \"sequence\": \"EVYL\",\n"
 "    \"timestep\": 0.01,\n"
 "    \"synth_time\": 100,\n"
 "    \"drag_coefficient\": 0.1,\n"
+"    \"respa_steps\": 4,\n"
+"    \"slow_forces\": [\"steric\", \"water\"],\n"
+"    \"slow_spring_constant\": 0.01,\n"
 "    \"atom_descriptions\": {\n"
 "        \"GLU\" : {\"steric_radius\" : 0.5}\n"
 "    },\n"
@@ -85,6 +99,9 @@ void check_model(struct model *m){
     fis(m->timestep, 0.01, 1e-10, "Timestep");
     fis(m->synth_time, 100, 1e-10, "Synth time");
     fis(m->drag_coefficient, 0.1, 1e-10, "Drag coefficient");
+    cmp_ok(m->respa_steps, "==", 4, "RESPA steps");
+    ok(m->slow_terms == (FORCE_STERIC | FORCE_WATER), "Slow force terms");
+    fis(m->slow_spring_constant, 0.01, 1e-10, "Slow spring constant");
 
     struct atom_description *desc = atom_description_lookup("GLU", 3);
     fis(desc->steric_radius, 0.5, 1e-10, "Set atom description");
@@ -94,6 +111,9 @@ void check_model(struct model *m){
     cmp_ok(m->num_torsion_springs, "==", 1, "Read one torsion spring");
     cmp_ok(m->num_residues, "==", 4, "Read four residues");
     cmp_ok(m->num_rama_constraints, "==", 2, "Read two rama constraints");
+    ok(rama_is_inited(GENERAL) && rama_is_inited(ALANINE),
+            "Loaded rama data used by constraints");
+    ok(!rama_is_inited(BETA), "Skipped unused rama data");
     if(m->num_residues != 4)
         BAIL_OUT("Didn't read any residues: can't complete tests");
 
@@ -102,43 +122,125 @@ void check_model(struct model *m){
     is(m->residues[2].name, "TYR", "Residue 2 is TYR");
     is(m->residues[3].name, "LEU", "Residue 3 is LEU");
 
-    ok(m->linear_springs[0].a->id == m->atoms[0].id, "Spring 1 attached to residue 1");
-    ok(m->linear_springs[0].b->id == m->atoms[2].id, "Spring 1 attached to residue 2");
+    ok(m->linear_springs[0].a == 0, "Spring 1 attached to residue 1");
+    ok(m->linear_springs[0].b == 2, "Spring 1 attached to residue 2");
     ok(abs(m->linear_springs[0].distance - 4.0) < 1e9, "Spring 1 distance is 4.0A");
     ok(abs(m->linear_springs[0].constant - DEFAULT_SPRING_CONSTANT) < 1e9, "Spring 1 constant is %fA", DEFAULT_SPRING_CONSTANT);
     ok(m->linear_springs[0].cutoff < 0, "Spring 1 cutoff disabled");
 
-    ok(m->linear_springs[1].a->id == m->atoms[0].id, "Spring 2 attached to residue 1");
-    ok(m->linear_springs[1].b->id == m->atoms[4].id, "Spring 2 attached to residue 3");
+    ok(m->linear_springs[1].a == 0, "Spring 2 attached to residue 1");
+    ok(m->linear_springs[1].b == 4, "Spring 2 attached to residue 3");
     ok(abs(m->linear_springs[1].distance - 3.0) < 1e9, "Spring 2 distance is 3.0A");
     ok(abs(m->linear_springs[1].constant - 0.2) < 1e9, "Spring 2 constant is 0.2A");
     ok(m->linear_springs[1].cutoff < 0, "Spring 2 cutoff disabled");
-    ok(m->linear_springs[1].inner == &m->atoms[1], "inner set");
-    ok(m->linear_springs[1].outer == &m->atoms[3], "outer set");
+    ok(m->linear_springs[1].inner == 1, "inner set");
+    ok(m->linear_springs[1].outer == 3, "outer set");
     ok(m->linear_springs[1].right_handed, "handedness set");
 
-    ok(m->linear_springs[2].a->id == m->atoms[4].id, "Spring 3 attached to residue 3");
-    ok(m->linear_springs[2].b->id == m->atoms[6].id, "Spring 3 attached to residue 3");
+    ok(m->linear_springs[2].a == 4, "Spring 3 attached to residue 3");
+    ok(m->linear_springs[2].b == 6, "Spring 3 attached to residue 3");
     ok(abs(m->linear_springs[2].distance - 4.0) < 1e9, "Spring 3 distance is 4.0A");
     ok(abs(m->linear_springs[2].constant - 0.3) < 1e9, "Spring 3 constant is 0.3A");
     ok(abs(m->linear_springs[2].cutoff - 0.1) < 1e9, "Spring 3 cutoff is 0.1A");
 
-    ok(m->torsion_springs[0].a1->id == m->atoms[0].id, "Torsion a1 = a1");
-    ok(m->torsion_springs[0].a2->id == m->atoms[2].id, "Torsion a2 = a2");
-    ok(m->torsion_springs[0].a3->id == m->atoms[4].id, "Torsion a3 = a3");
-    ok(m->torsion_springs[0].a4->id == m->atoms[7].id, "Torsion a4 = a4");
+    ok(m->torsion_springs[0].a1 == 0, "Torsion a1 = a1");
+    ok(m->torsion_springs[0].a2 == 2, "Torsion a2 = a2");
+    ok(m->torsion_springs[0].a3 == 4, "Torsion a3 = a3");
+    ok(m->torsion_springs[0].a4 == 7, "Torsion a4 = a4");
     ok(abs(m->torsion_springs[0].angle - 40) < 1e9, "Angle correct");
     ok(abs(m->torsion_springs[0].constant - 0.1) < 1e9, "Constant correct");
 
-    ok(m->bond_angles[0].a1->id == m->atoms[0].id, "Angle a1 = a1");
-    ok(m->bond_angles[0].a2->id == m->atoms[2].id, "Angle a2 = a2");
-    ok(m->bond_angles[0].a3->id == m->atoms[4].id, "Angle a3 = a3");
+    ok(m->bond_angles[0].a1 == 0, "Angle a1 = a1");
+    ok(m->bond_angles[0].a2 == 2, "Angle a2 = a2");
+    ok(m->bond_angles[0].a3 == 4, "Angle a3 = a3");
     ok(abs(m->bond_angles[0].angle - 45) < 1e9, "Angle correct");
     ok(abs(m->bond_angles[0].constant - 0.1) < 1e9, "Constant correct");
 }
 
+//Write a large specification, with the springs before the atoms, so that it
+//is read in several blocks.
+void test_large_file(){
+    const size_t nsprings = 5000;
+    char tmpfile_name[] = "springXXXXXX";
+    FILE *f = fdopen(mkstemp(tmpfile_name), "w");
+    fprintf(f, "{\"linear\": [\n");
+    for(size_t i=0; i < nsprings; i++)
+        fprintf(f, "    {\"atoms\": [%lu, %lu], \"distance\": %lu.5}%s\n",
+                i % 4 + 1, (i + 1) % 4 + 1, i, i + 1 < nsprings ? "," : "");
+    fprintf(f, "],\n\"sequence\": \"GG\",\n\"atoms\": [\n"
+            "    {\"id\": 1, \"name\": \"N\", \"residue\": 1},\n"
+            "    {\"id\": 2, \"name\": \"CA\", \"residue\": 1},\n"
+            "    {\"id\": 3, \"name\": \"N\", \"residue\": 2},\n"
+            "    {\"id\": 4, \"name\": \"CA\", \"residue\": 2}\n"
+            "]}\n");
+    fclose(f);
+
+    struct model *m = springreader_parse_file(tmpfile_name);
+    ok(m != NULL, "Read large file");
+    if(m){
+        cmp_ok(m->num_linear_springs, "==", nsprings, "Read all springs");
+        struct linear_spring *last = &m->linear_springs[nsprings - 1];
+        ok(last->a == 3 && last->b == 0, "Last spring atoms");
+        fis(last->distance, nsprings - 0.5, 1e-6, "Last spring distance");
+        model_free(m);
+    }
+    unlink(tmpfile_name);
+}
+
+void test_bad_atom(){
+    const char *bad =
+        "{\"sequence\": \"G\", "
+        "\"atoms\": [{\"id\": 1, \"name\": \"CA\", \"residue\": 1}], "
+        "\"linear\": [{\"atoms\": [1, 2], \"distance\": 1}]}";
+    ok(springreader_parse_str(bad) == NULL, "Spring with missing atom");
+}
+
+void test_adaptive(){
+    const char *adaptive =
+        "{\"sequence\": \"G\", \"adaptive_timestep\": true, "
+        "\"max_timestep\": 0.3, \"max_displacement\": 0.05, "
+        "\"max_constraint_iterations\": 8, "
+        "\"atoms\": [{\"id\": 1, \"name\": \"CA\", \"residue\": 1}]}";
+    struct model *m = springreader_parse_str(adaptive);
+    ok(m && m->adaptive_timestep, "Adaptive timestep enabled");
+    ok(m && m->max_timestep == 0.3 && m->max_displacement == 0.05
+            && m->max_constraint_iterations == 8
+            && m->min_timestep == DEFAULT_MIN_TIMESTEP,
+            "Adaptive timestep bounds");
+    if(m)
+        model_free(m);
+
+    const char *bad =
+        "{\"sequence\": \"G\", \"adaptive_timestep\": true, "
+        "\"max_timestep\": 0.05, "
+        "\"atoms\": [{\"id\": 1, \"name\": \"CA\", \"residue\": 1}]}";
+    ok(springreader_parse_str(bad) == NULL,
+            "Timestep above adaptive maximum");
+}
+
+void test_gzip(){
+#ifdef HAVE_ZLIB
+    char tmpfile_name[] = "springXXXXXX";
+    gzFile f = gzdopen(mkstemp(tmpfile_name), "wb");
+    gzwrite(f, json, strlen(json));
+    gzclose(f);
+
+    struct model *m = springreader_parse_file(tmpfile_name);
+    ok(m != NULL, "Read compressed file");
+    if(m){
+        cmp_ok(m->num_linear_springs, "==", 3, "Read springs from compressed file");
+        model_free(m);
+    }else{
+        fail("Read springs from compressed file");
+    }
+    unlink(tmpfile_name);
+#else
+    tap_skip(2, "Not built with zlib");
+#endif
+}
+
 int main(){
-    plan(82);
+    plan(102);
 
     struct model *ms = springreader_parse_str(json);
     if(!ms)
@@ -161,5 +263,10 @@ int main(){
     model_free(mf);
     unlink(tmpfile_name);
 
+    test_large_file();
+    test_bad_atom();
+    test_adaptive();
+    test_gzip();
+
     done_testing();
 }
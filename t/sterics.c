@@ -22,45 +22,105 @@ bool increment(struct atom *a, struct atom *b, void *data){
 }
 
 int main(){
-    plan(9);
+    plan(20);
 
-    struct atom atoms[4];
-    for(int i=0; i < 4; i++){
-        vector_zero(&atoms[i].force);
-        atoms[i].radius = 1;
-    }
     struct model *m = model_alloc();
-    m->atoms = atoms;
-    m->num_atoms = 4;
+    model_alloc_atoms(m, 4);
+    struct atom *atoms = m->atoms;
+    struct vector *pos = m->positions;
+    for(int i=0; i < 4; i++)
+        atoms[i].radius = 1;
 
-    vector_fill(&atoms[0].position, -1, 0, 0);
-    vector_fill(&atoms[1].position, 1, -1, 0);
-    vector_fill(&atoms[2].position, 0, 0, 1);
-    vector_fill(&atoms[3].position, 1, 1, -1);
+    vector_fill(&pos[0], -1, 0, 0);
+    vector_fill(&pos[1], 1, -1, 0);
+    vector_fill(&pos[2], 0, 0, 1);
+    vector_fill(&pos[3], 1, 1, -1);
 
-    //Check that the origin makes sense with these atoms
     struct steric_grid grid;
-    steric_grid_init(&grid, 10, 5, m->num_atoms);
-    steric_grid_find_origin(&grid, m);
-    ok(grid.origin.c[0] < -1.0, "Grid origin x");
-    ok(grid.origin.c[1] < -1.0, "Grid origin y");
-    ok(grid.origin.c[2] < -1.0, "Grid origin z");
+    ok(!steric_grid_init(&grid, m), "Initialised grid");
+    ok(grid.cell_size >= 1, "Cells at least as large as largest radius");
+    ok(grid.num_buckets >= 2 * m->num_atoms, "At least two buckets per atom");
+    ok(!(grid.num_buckets & (grid.num_buckets - 1)), "Power of two buckets");
 
     //Now try some basic force tests
     m->num_atoms = 2;
-    vector_fill(&atoms[0].position, 0, 0, 0);
-    vector_fill(&atoms[1].position, 1, 0, 0);
+    vector_fill(&pos[0], 0, 0, 0);
+    vector_fill(&pos[1], 1, 0, 0);
+
+    steric_grid_update(&grid, m);
+    steric_grid_forces(&grid, m);
+
+    ok(m->forces[0].c[0] < 0, "Forced into the -x direction");
+    ok(m->forces[1].c[0] > 0, "Forced into the +x direction");
+    fis(m->forces[0].c[1], 0, 1e-6, "Y component = 0");
+    fis(m->forces[0].c[2], 0, 1e-6, "Z component = 0");
+    fis(m->forces[1].c[1], 0, 1e-6, "Y component = 0");
+    fis(m->forces[1].c[2], 0, 1e-6, "Z component = 0");
+
+    //Small movements shouldn't rebuild the neighbour lists
+    size_t builds = grid.neighbours.builds;
+    double skin = grid.neighbours.skin;
+    for(size_t i=0; i < 2; i++)
+        vector_zero(&m->forces[i]);
+    pos[1].c[0] += skin / 4;
+    steric_grid_update(&grid, m);
+    steric_grid_forces(&grid, m);
+    ok(grid.neighbours.builds == builds, "Small move keeps neighbour lists");
+    ok(m->forces[1].c[0] > 0, "Old lists still find clash");
+
+    pos[1].c[0] += skin;
+    steric_grid_update(&grid, m);
+    ok(grid.neighbours.builds == builds + 1, "Large move rebuilds lists");
+
+    //Pairs of fixed atoms are left out of the lists, until one is released
+    m->fixed[0] = m->fixed[1] = true;
+    vector_fill(&pos[1], 1, 0, 0);
+    steric_grid_update(&grid, m);
+    ok(grid.neighbours.start[2] == 0, "Pair of fixed atoms not listed");
+    m->fixed[1] = false;
+    builds = grid.neighbours.builds;
+    steric_grid_update(&grid, m);
+    ok(grid.neighbours.builds == builds + 1, "Releasing an atom rebuilds lists");
+    ok(grid.neighbours.start[2] == 2, "Released atom listed");
+    m->fixed[0] = false;
+
+    //Atoms that clash across a cell boundary must still interact. Cells are
+    //aligned to the origin, so there is always a boundary at zero.
+    for(size_t i=0; i < 2; i++)
+        vector_zero(&m->forces[i]);
+    vector_fill(&pos[0], -0.5, 0, 0);
+    vector_fill(&pos[1], 0.5, 0, 0);
+    grid.neighbours.num_atoms = 0; //Force the lists to be rebuilt
+    steric_grid_update(&grid, m);
+    steric_grid_forces(&grid, m);
+    ok(m->forces[0].c[0] < 0 && m->forces[1].c[0] > 0,
+            "Atoms in neighbouring cells repelled");
+
+    //There is no limit on how far atoms can be from the origin.
+    for(size_t i=0; i < 2; i++)
+        vector_zero(&m->forces[i]);
+    vector_fill(&pos[0], 1e5, -1e5, 1e5);
+    vector_fill(&pos[1], 1e5 + 1, -1e5, 1e5);
+    steric_grid_update(&grid, m);
+    steric_grid_forces(&grid, m);
+    ok(m->forces[0].c[0] < 0 && m->forces[1].c[0] > 0,
+            "Atoms far from the origin repelled");
 
+    //Bonded atoms are listed, but don't interact sterically
+    m->constraints = malloc(sizeof(*m->constraints));
+    m->constraints[0].a = 0;
+    m->constraints[0].b = 1;
+    m->num_constraints = 1;
+    model_build_bonds(m);
+    for(size_t i=0; i < 2; i++)
+        vector_zero(&m->forces[i]);
+    grid.neighbours.num_atoms = 0; //Force the lists to be rebuilt
     steric_grid_update(&grid, m);
-    steric_grid_build_ilists(&grid, m);
     steric_grid_forces(&grid, m);
+    ok(grid.neighbours.first_nonbonded[0] == 1, "Bonded atom listed first");
+    fis(m->forces[0].c[0], 0, 1e-6, "No steric force between bonded atoms");
 
-    ok(atoms[0].force.c[0] < 0, "Forced into the -x direction");
-    ok(atoms[1].force.c[0] > 0, "Forced into the +x direction");
-    fis(atoms[0].force.c[1], 0, 1e-6, "Y component = 0");
-    fis(atoms[0].force.c[2], 0, 1e-6, "Z component = 0");
-    fis(atoms[1].force.c[1], 0, 1e-6, "Y component = 0");
-    fis(atoms[1].force.c[2], 0, 1e-6, "Z component = 0");
+    steric_grid_free(&grid);
 
     done_testing();
 }
@@ -0,0 +1,118 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include "../src/springreader.h"
+#include "../src/trajectory.h"
+#include "../src/model.h"
+#include "../src/vector.h"
+#include "tap.h"
+
+const char *json =
+"{\n"
+"    \"sequence\": \"AG\",\n"
+"    \"do_synthesis\": false,\n"
+"    \"atoms\": [\n"
+"        {\"id\": 1, \"name\": \"CA\",  \"residue\": 1,"
+"         \"position\": [1, 2, 3]},\n"
+"        {\"id\": 2, \"name\": \"ALA\", \"residue\": 1},\n"
+"        {\"id\": 3, \"name\": \"CA\",  \"residue\": 2,"
+"         \"position\": [4, 5, 6]}\n"
+"    ]\n"
+"}\n";
+
+#define NFRAMES 3
+
+//Move the atoms of m for frame i, including a large jump in frame 1
+static void move_atoms(struct model *m, int i){
+    m->time = i * 10;
+    m->positions[0].c[0] = 1 + i * 0.125;
+    m->positions[2].c[1] = -5 - i * 1000.25;
+    m->positions[2].c[2] = 0.0004 * i;
+}
+
+void test_round_trip(const char *file, struct model *m){
+    m->synthesised[1] = false;
+    FILE *out = fopen(file, "w");
+    struct trajectory t;
+    unsigned int seed = 42;
+    ok(!trajectory_open(&t, out, m, &seed), "Opened trajectory");
+    int nwritten = 0;
+    for(int i=0; i < NFRAMES; i++){
+        move_atoms(m, i);
+        nwritten += !trajectory_write(&t, m);
+    }
+    cmp_ok(nwritten, "==", NFRAMES, "Wrote frames");
+    ok(!trajectory_close(&t), "Closed trajectory");
+    fclose(out);
+
+    struct trajectory_reader r;
+    ok(!trajectory_read_open(&r, file), "Read trajectory");
+    cmp_ok(r.natoms, "==", 3, "Three atoms");
+    cmp_ok(r.nframes, "==", NFRAMES, "Read index");
+    ok(r.has_seed && r.seed == 42, "Seed recorded");
+    is(r.atoms[1].name, "ALA", "Atom name");
+    is(r.atoms[2].residue, "GLY", "Residue name");
+
+    struct vector positions[3];
+    bool synthesised[3];
+    double time;
+    ok(!trajectory_read_frame(&r, 1, positions, synthesised, &time),
+            "Read frame 2");
+    fis(time, 10, 1e-10, "Time of frame");
+    ok(synthesised[0] && !synthesised[1] && synthesised[2],
+            "Unsynthesised atom left out");
+    fis(positions[0].c[0], 1.125, 1e-10, "Position of first atom");
+    fis(positions[2].c[1], -1005.25, 1e-10, "Position after large jump");
+    fis(positions[2].c[2], 0, 1e-10, "Position rounded to precision");
+
+    //The extracted PDB should match the snapshot written by poing2
+    char *pdb, *expected;
+    size_t pdb_len, expected_len;
+    FILE *pdb_out = open_memstream(&pdb, &pdb_len);
+    FILE *expected_out = open_memstream(&expected, &expected_len);
+    int n = NFRAMES - 1;
+    trajectory_frame_pdb(pdb_out, &r, NFRAMES - 1);
+    model_pdb(expected_out, m, false, &n);
+    fclose(pdb_out);
+    fclose(expected_out);
+    is(pdb, expected, "Final frame matches PDB snapshot");
+    free(pdb);
+    free(expected);
+
+    ok(trajectory_read_frame(&r, NFRAMES, positions, synthesised, NULL),
+            "Refused missing frame");
+    trajectory_read_close(&r);
+}
+
+void test_unclosed(const char *file){
+    //Remove the index and half of the final frame
+    FILE *f = fopen(file, "r");
+    fseek(f, 0, SEEK_END);
+    long len = ftell(f);
+    fclose(f);
+    truncate(file, len - sizeof(uint64_t) * NFRAMES - 24 - 4);
+
+    struct trajectory_reader r;
+    ok(!trajectory_read_open(&r, file), "Read trajectory without index");
+    cmp_ok(r.nframes, "==", NFRAMES - 1, "Found complete frames");
+    trajectory_read_close(&r);
+    ok(trajectory_read_open(&r, "data/boundary-alpha.data"),
+            "Refused text file");
+}
+
+int main(){
+    plan(20);
+    struct model *m = springreader_parse_str(json);
+    if(!m)
+        BAIL_OUT("Couldn't parse model");
+
+    char file[] = "trajXXXXXX";
+    int fd = mkstemp(file);
+    close(fd);
+    test_round_trip(file, m);
+    test_unclosed(file);
+    unlink(file);
+    model_free(m);
+    done_testing();
+}
@@ -0,0 +1,70 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "../src/springreader.h"
+#include "../src/writer.h"
+#include "../src/model.h"
+#include "../src/vector.h"
+#include "tap.h"
+
+const char *json =
+"{\n"
+"    \"sequence\": \"AG\",\n"
+"    \"do_synthesis\": false,\n"
+"    \"atoms\": [\n"
+"        {\"id\": 1, \"name\": \"CA\",  \"residue\": 1,"
+"         \"position\": [1, 2, 3]},\n"
+"        {\"id\": 2, \"name\": \"ALA\", \"residue\": 1,"
+"         \"position\": [2, 2, 3]},\n"
+"        {\"id\": 3, \"name\": \"CA\",  \"residue\": 2,"
+"         \"position\": [4, 5, 6]}\n"
+"    ],\n"
+"    \"linear\": [\n"
+"        {\"atoms\": [1, 3], \"distance\": 3.8, \"constant\": 0.2}\n"
+"    ]\n"
+"}\n";
+
+#define NSNAPSHOTS 50
+
+/*
+ * Write snapshots of m through a writer with nframes frames, moving the atoms
+ * after each snapshot is pushed. Returns the output, which must be freed.
+ */
+char *write_snapshots(struct model *m, size_t nframes){
+    char *str;
+    size_t len;
+    FILE *out = open_memstream(&str, &len);
+    struct writer w;
+    if(writer_init(&w, m, nframes, out, NULL, true))
+        BAIL_OUT("Couldn't start writer");
+    for(int i=0; i < NSNAPSHOTS; i++){
+        vector_fill(&m->positions[1], 2 + i * 0.01, 2, 3);
+        m->synthesised[2] = i % 2;
+        writer_push(&w, m);
+    }
+    if(writer_finish(&w))
+        BAIL_OUT("Couldn't write snapshots");
+    fclose(out);
+    return str;
+}
+
+int main(){
+    plan(3);
+    struct model *m = springreader_parse_str(json);
+    if(!m)
+        BAIL_OUT("Couldn't parse model");
+
+    char *direct = write_snapshots(m, 0);
+    char *queued = write_snapshots(m, 1);
+    ok(strstr(direct, "MODEL     50\n") && strstr(direct, "CONECT"),
+            "Snapshots written directly");
+    is(queued, direct, "Queue of one frame matches direct output");
+    free(queued);
+    queued = write_snapshots(m, DEFAULT_WRITER_FRAMES);
+    is(queued, direct, "Default queue matches direct output");
+
+    free(queued);
+    free(direct);
+    model_free(m);
+    done_testing();
+}